@@ -1,6 +1,7 @@
 #include "felink.h"
 #include "micro-ecc/uECC.h"
 #include "tea.h"
+#include "rng.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,6 +10,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 #define FELINK_SIGN 0xFE
 
@@ -34,6 +36,79 @@ struct fl_msg_t
     uint8_t *buf;
     uint32_t count;
     uint8_t sign;
+
+    struct fl_base *base;
+    int pool_class; // -1为超出最大尺寸级别，直接使用堆
+    struct fl_msg_t *next_free;
+};
+
+// 消息池的尺寸级别，最大级别可容纳0xFFFF字节的数据包
+static const uint32_t fl_msg_pool_class_size[FELINK_MSG_POOL_CLASSES] = {
+    32,
+    128,
+    512,
+    4096,
+    12 + ((6 + 0xFFFF + 3) / 4) * 4,
+};
+
+struct fl_dev_chunk
+{
+    struct fl_dev_chunk *next;
+    uint8_t records[];
+};
+
+typedef enum
+{
+    TX_REQ_CONNECT = 0,
+    TX_REQ_DATA = 1,
+} fl_tx_req_type;
+
+struct fl_tx_req
+{
+    struct fl_tx_req *next;
+    fl_tx_req_type type;
+    uint8_t *data;
+    size_t count;
+    size_t padding_align;
+    char is_plaintext;
+
+    fl_tx_done_callback_t callback;
+    void *private_arg;
+};
+
+typedef enum
+{
+    SLOT_FREE = 0,
+    SLOT_PENDING = 1,
+    SLOT_ACKED = 2,
+    SLOT_FAILED = 3,
+} fl_slot_state;
+
+struct fl_tx_slot
+{
+    struct fl_tx_req *req;
+    struct fl_msg_t *msg;
+    fl_slot_state state;
+    int res;
+    uint32_t seq;
+    uint32_t salt;
+    uint8_t is_salt_update;
+
+    struct timespec deadline;
+    struct timeval send_time;
+    time_t tx_packet_delay;
+    size_t tx_packet_count;
+    size_t tx_packet_loss;
+};
+
+// 设备的密钥上下文，tea_key改变时重置，数据密钥随salt变化按需重新派生
+struct fl_dev_crypto
+{
+    uint32_t connect_key[4];
+    uint32_t unpair_key[4];
+    uint32_t data_key[4];
+    uint32_t data_salt;
+    uint8_t is_data_key_valid;
 };
 
 struct fl_dev
@@ -51,24 +126,83 @@ struct fl_dev
     size_t tx_packet_count;
     size_t tx_packet_loss;
     uint32_t salt;
+    uint8_t tx_window;
 
     uint32_t connect_count;
+    uint32_t gen; // 创建时递增，记录由arena复用后与旧设备区分
     uint8_t *tea_key;
-
-    uint8_t ack_sign;
-    pthread_cond_t ack_cond;
-    pthread_mutex_t ack_mutex;
+    struct fl_dev_crypto crypto;
+    int salt_slot; // 在盐值表中的槽，-1为未分配
+    uint16_t salt_seq;
+
+    struct fl_tx_req *tx_queue;
+    struct fl_tx_req *tx_queue_tail;
+    int n_tx_queued;
+    struct fl_tx_slot tx_slots[FELINK_TX_WINDOW_MAX];
+    uint8_t n_tx_pending;
+    uint32_t tx_seq;
+    uint32_t tx_salt;
+    char is_tx_timeout;
 };
 
 struct fl_base
 {
     struct fl_dev **devs;
     int n_devs;
+    int devs_size;
 
     fl_tx_func_t tx_func;
     void *tx_func_private_arg;
+    pthread_mutex_t tx_func_mutex;
+
+    pthread_t tx_thread;
+    pthread_mutex_t tx_mutex;
+    pthread_cond_t tx_cond;
+    int is_tx_thread_stop;
+    int tx_rr_index;
+    struct fl_dev *tx_busy_dev;
+    uint32_t dev_gen;
+
+    // 消息池与设备记录arena，均由pool_mutex保护
+    pthread_mutex_t pool_mutex;
+    struct fl_msg_t *msg_free[FELINK_MSG_POOL_CLASSES];
+    size_t n_msg_free[FELINK_MSG_POOL_CLASSES];
+    size_t n_msg_in_use[FELINK_MSG_POOL_CLASSES];
+    size_t msg_high_water[FELINK_MSG_POOL_CLASSES];
+    size_t n_msg_oversize;
+    struct fl_dev_chunk *dev_chunks;
+    size_t n_dev_chunks;
+    size_t dev_record_size;
+    void *dev_free;
+    size_t n_dev_in_use;
+    size_t dev_high_water;
+
+    // 以id为键的开放寻址索引，与devs同在tx_mutex下修改
+    struct fl_dev **dev_index;
+    int dev_index_size;
+    int n_dev_index_used;
+    int n_dev_index_filled;
+
+    // 自上次fl_save/fl_save_journal后持久化内容有变化的设备id，由journal_mutex保护
+    pthread_mutex_t journal_mutex;
+    uint32_t *journal_ids;
+    int n_journal_ids;
+    int journal_ids_size;
+
+    // 调用者映射的盐值表，由tx_mutex保护
+    uint8_t *salt_table;
+    size_t n_salt_slots;
+    size_t salt_slot_hint;
+    int is_salt_table_dirty;
+
+    // fl_load_mapped映射的快照，设备名直接引用其中的字符串，fl_delete时解除映射
+    const uint8_t *sav_map;
+    size_t sav_map_size;
+
     fl_devs_change_callback_t devs_change_callback;
     void *devs_change_private_arg;
+    fl_stats_callback_t stats_callback;
+    void *stats_private_arg;
     uint8_t *pri_key;
     uint8_t *pub_key;
 };
@@ -117,34 +251,6 @@ static uint8_t fl_chksum8(const uint8_t *bytes, size_t len)
     return ~chksum8;
 }
 
-static int fl_random(uint8_t *dest, size_t size)
-{
-    int fd = open("/dev/urandom", O_RDONLY);
-    if (fd == -1)
-    {
-        fd = open("/dev/random", O_RDONLY);
-        if (fd == -1)
-            perror("no random generator");
-    }
-
-    char *ptr = (char *)dest;
-    size_t left = size;
-    while (left > 0)
-    {
-        ssize_t bytes_read = read(fd, ptr, left);
-        if (bytes_read <= 0)
-        {
-            close(fd);
-            return EIO;
-        }
-        left -= bytes_read;
-        ptr += bytes_read;
-    }
-
-    close(fd);
-    return 0;
-}
-
 static void fl_timespec_add_ns(struct timespec *t, uint64_t ns)
 {
     uint64_t temp = t->tv_nsec + ns;
@@ -152,29 +258,126 @@ static void fl_timespec_add_ns(struct timespec *t, uint64_t ns)
     t->tv_sec += temp / 1000000000;
 }
 
+static int fl_timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec)
+        return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    return 0;
+}
+
 static time_t fl_timeval_interval_us(struct timeval start, struct timeval end)
 {
     return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
 }
 
+static struct timeval fl_stats_start(struct fl_base *b)
+{
+    struct timeval start = {0, 0};
+    if (b->stats_callback != NULL)
+        gettimeofday(&start, NULL);
+    return start;
+}
+
+static void fl_stats_report(struct fl_base *b, struct fl_dev *d, fl_stats_type type, struct timeval start)
+{
+    if (b->stats_callback == NULL)
+        return;
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    b->stats_callback((struct fl_base_i *)b, (struct fl_dev_i *)d, type, (uint32_t)fl_timeval_interval_us(start, end), b->stats_private_arg);
+}
+
+static void fl_journal_mark(struct fl_base *b, uint32_t id)
+{
+    pthread_mutex_lock(&b->journal_mutex);
+    for (int i = 0; i < b->n_journal_ids; i++)
+        if (b->journal_ids[i] == id)
+        {
+            pthread_mutex_unlock(&b->journal_mutex);
+            return;
+        }
+    if (b->n_journal_ids == b->journal_ids_size)
+    {
+        int size = b->journal_ids_size ? b->journal_ids_size * 2 : 16;
+        uint32_t *ids = realloc(b->journal_ids, size * sizeof(uint32_t));
+        if (ids == NULL)
+        {
+            pthread_mutex_unlock(&b->journal_mutex);
+            return;
+        }
+        b->journal_ids = ids;
+        b->journal_ids_size = size;
+    }
+    b->journal_ids[b->n_journal_ids++] = id;
+    pthread_mutex_unlock(&b->journal_mutex);
+}
+
 static void fl_call_devs_change(struct fl_base *b, struct fl_dev *d, uint32_t id, fl_dev_change_type type)
 {
+    // 仅记录影响存档内容的变化，握手/配对开始与连接超时不改变存档
+    switch (type)
+    {
+    case DEV_CHANGE_ID_CHANGE:
+        fl_journal_mark(b, id);
+        fl_journal_mark(b, d->id);
+        break;
+    case DEV_CHANGE_REMOVE:
+    case DEV_CHANGE_PAIR:
+    case DEV_CHANGE_CONNECT:
+        fl_journal_mark(b, d->id);
+        break;
+    default:
+        break;
+    }
+
     if (b->devs_change_callback != NULL)
         b->devs_change_callback((struct fl_base_i *)b, (struct fl_dev_i *)d, id, type, b->devs_change_private_arg);
 }
 
-static struct fl_msg_t *fl_msg_create(size_t count)
+static struct fl_msg_t *fl_msg_create(
+    struct fl_base *b,
+    size_t count)
 {
-    struct fl_msg_t *msg = malloc(sizeof(struct fl_msg_t));
-    if (msg == NULL)
-        return NULL;
-    msg->buf = malloc(count);
-    if (msg->buf == NULL)
+    int pool_class = 0;
+    while (pool_class < FELINK_MSG_POOL_CLASSES && count > fl_msg_pool_class_size[pool_class])
+        pool_class++;
+
+    struct fl_msg_t *msg = NULL;
+    if (pool_class < FELINK_MSG_POOL_CLASSES)
     {
-        free(msg);
-        return NULL;
+        pthread_mutex_lock(&b->pool_mutex);
+        msg = b->msg_free[pool_class];
+        if (msg != NULL)
+        {
+            b->msg_free[pool_class] = msg->next_free;
+            b->n_msg_free[pool_class]--;
+        }
+        pthread_mutex_unlock(&b->pool_mutex);
+        if (msg == NULL)
+            msg = malloc(sizeof(struct fl_msg_t) + fl_msg_pool_class_size[pool_class]);
+    }
+    else
+    {
+        pool_class = -1;
+        msg = malloc(sizeof(struct fl_msg_t) + count);
     }
+    if (msg == NULL)
+        return NULL;
+
+    msg->buf = (uint8_t *)(msg + 1);
     msg->count = count;
+    msg->base = b;
+    msg->pool_class = pool_class;
+    msg->next_free = NULL;
+
+    pthread_mutex_lock(&b->pool_mutex);
+    if (pool_class < 0)
+        b->n_msg_oversize++;
+    else if (++b->n_msg_in_use[pool_class] > b->msg_high_water[pool_class])
+        b->msg_high_water[pool_class] = b->n_msg_in_use[pool_class];
+    pthread_mutex_unlock(&b->pool_mutex);
 
     return msg;
 }
@@ -182,100 +385,218 @@ static struct fl_msg_t *fl_msg_create(size_t count)
 static void fl_msg_delete(
     struct fl_msg_t *msg)
 {
-    free(msg->buf);
+    struct fl_base *b = msg->base;
+    int pool_class = msg->pool_class;
+
+    if (pool_class < 0)
+    {
+        free(msg);
+        return;
+    }
+
+    pthread_mutex_lock(&b->pool_mutex);
+    b->n_msg_in_use[pool_class]--;
+    if (b->n_msg_free[pool_class] < FELINK_MSG_POOL_MAX_FREE)
+    {
+        msg->next_free = b->msg_free[pool_class];
+        b->msg_free[pool_class] = msg;
+        b->n_msg_free[pool_class]++;
+        msg = NULL;
+    }
+    pthread_mutex_unlock(&b->pool_mutex);
     free(msg);
 }
 
-static struct fl_dev *fl_dev_add(
-    struct fl_base *b,
-    uint32_t id,
-    uint32_t type,
-    uint16_t version,
-    const char *name)
+/*  设备记录
+    struct fl_dev
+    u8[]    tea_key     FELINK_uECC_CURVE_SIZE
+    char[]  name        FELINK_DEV_NAME_INLINE，更长的名字单独分配
+*/
+static size_t fl_dev_record_tea_key_offset(void)
 {
-    struct fl_dev *d = malloc(sizeof(struct fl_dev));
+    return (sizeof(struct fl_dev) + 7) & ~(size_t)7;
+}
 
-    d->base = b;
-    d->id = id;
-    d->type = type;
-    d->version = version;
-    d->name = malloc(strlen(name) + 1);
-    strcpy(d->name, name);
-    d->state = STATE_HANDSHAKED;
-    d->timeout = FELINK_DEFAULT_TIMEOUT;
-    d->max_retrans = FELINK_DEFAULT_MAXRET;
-    d->tx_packet_delay = -1;
-    d->tx_packet_count = 0;
-    d->tx_packet_loss = 0;
-    d->tea_key = malloc(FELINK_uECC_CURVE_SIZE);
-    d->ack_sign = 0;
-    pthread_cond_init(&d->ack_cond, NULL);
-    pthread_mutex_init(&d->ack_mutex, NULL);
+static size_t fl_dev_record_name_offset(void)
+{
+    return fl_dev_record_tea_key_offset() + FELINK_uECC_CURVE_SIZE;
+}
 
-    b->devs = realloc(b->devs, (b->n_devs + 1) * sizeof(struct fl_dev *));
-    b->devs[b->n_devs] = d;
-    b->n_devs++;
+static struct fl_dev *fl_dev_record_alloc(struct fl_base *b)
+{
+    pthread_mutex_lock(&b->pool_mutex);
+    if (b->dev_free == NULL)
+    {
+        struct fl_dev_chunk *chunk = malloc(sizeof(struct fl_dev_chunk) + FELINK_DEV_ARENA_CHUNK * b->dev_record_size);
+        if (chunk == NULL)
+        {
+            pthread_mutex_unlock(&b->pool_mutex);
+            return NULL;
+        }
+        chunk->next = b->dev_chunks;
+        b->dev_chunks = chunk;
+        b->n_dev_chunks++;
+        for (int i = FELINK_DEV_ARENA_CHUNK - 1; i >= 0; i--)
+        {
+            void **record = (void **)&chunk->records[i * b->dev_record_size];
+            *record = b->dev_free;
+            b->dev_free = record;
+        }
+    }
+    struct fl_dev *d = b->dev_free;
+    b->dev_free = *(void **)d;
+    if (++b->n_dev_in_use > b->dev_high_water)
+        b->dev_high_water = b->n_dev_in_use;
+    pthread_mutex_unlock(&b->pool_mutex);
 
-    fl_call_devs_change(b, d, id, DEV_CHANGE_ADD);
     return d;
 }
 
-static void fl_dev_remove(
+static void fl_dev_record_free(
+    struct fl_base *b,
     struct fl_dev *d)
 {
-    int index;
-    struct fl_base *b = d->base;
-
-    for (index = 0; index < b->n_devs; index++)
-        if (b->devs[index] == d)
-            break;
-    if (index == b->n_devs)
-        return;
+    pthread_mutex_lock(&b->pool_mutex);
+    *(void **)d = b->dev_free;
+    b->dev_free = d;
+    b->n_dev_in_use--;
+    pthread_mutex_unlock(&b->pool_mutex);
+}
 
-    pthread_cond_destroy(&d->ack_cond);
-    pthread_mutex_destroy(&d->ack_mutex);
+static void fl_tx_req_delete(
+    struct fl_tx_req *req)
+{
+    free(req->data);
+    free(req);
+}
 
-    fl_call_devs_change(b, d, d->id, DEV_CHANGE_REMOVE);
+static void fl_tx_slot_release(
+    struct fl_dev *d,
+    struct fl_tx_slot *s)
+{
+    if (s->msg != NULL)
+        fl_msg_delete(s->msg);
+    s->msg = NULL;
+    s->req = NULL;
+    s->state = SLOT_FREE;
+    d->n_tx_pending--;
+}
 
-    free(d->name);
-    free(d->tea_key);
-    free(d);
+#define FL_DEV_INDEX_DELETED ((struct fl_dev *)-1)
 
-    for (int i = index; i < b->n_devs - 1; i++)
-        b->devs[i] = b->devs[i + 1];
-    b->n_devs--;
-    b->devs[b->n_devs] = NULL;
+static uint32_t fl_hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352DU;
+    x ^= x >> 15;
+    x *= 0x846CA68BU;
+    x ^= x >> 16;
+    return x;
 }
 
-static struct fl_dev *fl_base_get_dev_by_id(
+static struct fl_dev **fl_dev_index_find_slot(
     struct fl_base *b,
     uint32_t id)
 {
-    for (int i = 0; i < b->n_devs; i++)
-        if (b->devs[i]->id == id)
-            return b->devs[i];
-    return NULL;
+    if (b->dev_index_size == 0)
+        return NULL;
+
+    int mask = b->dev_index_size - 1;
+    for (int i = fl_hash32(id) & mask;; i = (i + 1) & mask)
+    {
+        struct fl_dev *d = b->dev_index[i];
+        if (d == NULL)
+            return NULL;
+        if (d != FL_DEV_INDEX_DELETED && d->id == id)
+            return &b->dev_index[i];
+    }
 }
 
-static int fl_base_is_dev_valid(
+static void fl_dev_index_place(
+    struct fl_dev **index,
+    int size,
+    struct fl_dev *d)
+{
+    int mask = size - 1;
+    int i = fl_hash32(d->id) & mask;
+    while (index[i] != NULL && index[i] != FL_DEV_INDEX_DELETED)
+        i = (i + 1) & mask;
+    index[i] = d;
+}
+
+// 重建为至少容纳n_used项且装载率不超过1/2的大小
+static int fl_dev_index_rebuild(
+    struct fl_base *b,
+    int n_used)
+{
+    int size = b->dev_index_size ? b->dev_index_size : FELINK_DEV_INDEX_MIN_SIZE;
+    while (n_used * 2 > size)
+        size *= 2;
+    struct fl_dev **index = calloc(size, sizeof(struct fl_dev *));
+    if (index == NULL)
+        return ENOMEM;
+    for (int i = 0; i < b->dev_index_size; i++)
+        if (b->dev_index[i] != NULL && b->dev_index[i] != FL_DEV_INDEX_DELETED)
+            fl_dev_index_place(index, size, b->dev_index[i]);
+    free(b->dev_index);
+    b->dev_index = index;
+    b->dev_index_size = size;
+    b->n_dev_index_filled = b->n_dev_index_used;
+    return 0;
+}
+
+// 不检查装载率，只用于放回刚删除的项
+static void fl_dev_index_put(
     struct fl_base *b,
     struct fl_dev *d)
 {
-    if (d == NULL || b->n_devs == 0 || d->version > FELINK_DEV_VERSION_MAX_COMPATIBILITY || d->version < FELINK_DEV_VERSION_MIN_COMPATIBILITY)
-        return 0;
-    for (int i = 0; i < b->n_devs; i++)
-        if (b->devs[i] == d)
-            return 1;
+    int mask = b->dev_index_size - 1;
+    int i = fl_hash32(d->id) & mask;
+    while (b->dev_index[i] != NULL && b->dev_index[i] != FL_DEV_INDEX_DELETED)
+        i = (i + 1) & mask;
+    if (b->dev_index[i] == NULL)
+        b->n_dev_index_filled++;
+    b->dev_index[i] = d;
+    b->n_dev_index_used++;
+}
+
+static int fl_dev_index_insert(
+    struct fl_base *b,
+    struct fl_dev *d)
+{
+    // 装载率(含删除标记)超过3/4时重建
+    if ((b->n_dev_index_filled + 1) * 4 > b->dev_index_size * 3 &&
+        fl_dev_index_rebuild(b, b->n_dev_index_used + 1))
+        return ENOMEM;
+
+    fl_dev_index_put(b, d);
     return 0;
 }
 
+static void fl_dev_index_erase(
+    struct fl_base *b,
+    struct fl_dev *d)
+{
+    if (b->dev_index_size == 0)
+        return;
+
+    int mask = b->dev_index_size - 1;
+    for (int i = fl_hash32(d->id) & mask; b->dev_index[i] != NULL; i = (i + 1) & mask)
+        if (b->dev_index[i] == d)
+        {
+            b->dev_index[i] = FL_DEV_INDEX_DELETED;
+            b->n_dev_index_used--;
+            return;
+        }
+}
+
 static void fl_get_key(
     struct fl_dev *d,
+    uint32_t salt,
     uint32_t key[4])
 {
     uint8_t *key_le = (uint8_t *)key;
     const uint8_t *keys = d->tea_key;
-    uint32_t salt = d->salt;
     uint32_t salt_rev = ~salt;
     uint32_t salt_m2 = salt + salt;
     uint32_t salt_rev_m2 = salt_rev + salt_rev;
@@ -293,171 +614,1058 @@ static void fl_get_key(
     }
 }
 
-static int fl_transmit_no_ack(
-    struct fl_base *b,
-    struct fl_msg_t *msg)
+static void fl_dev_crypto_reset(
+    struct fl_dev *d)
 {
-    if (b->tx_func == NULL)
-        return ENODEV;
-    int res = b->tx_func(NULL, msg->buf, msg->count, b->tx_func_private_arg);
-    fl_msg_delete(msg);
-    return res;
+    fl_get_key(d, 0x76543210, d->crypto.connect_key);
+    fl_get_key(d, 0x01234567, d->crypto.unpair_key);
+    d->crypto.is_data_key_valid = 0;
 }
 
-static int fl_transmit_with_ack(
+static uint32_t *fl_dev_crypto_data_key(
     struct fl_dev *d,
-    struct fl_msg_t *m)
+    uint32_t salt)
 {
-    struct fl_base *b = d->base;
-    int res = 0;
-
-    if (b->tx_func == NULL)
-        return ENODEV;
-    struct timeval send_time;
-    gettimeofday(&send_time, NULL);
-    int tries;
-    for (tries = 0; tries < d->max_retrans; tries++)
+    if (!d->crypto.is_data_key_valid || d->crypto.data_salt != salt)
     {
-        res = b->tx_func((struct fl_dev_i *)d, m->buf, m->count, b->tx_func_private_arg);
-        if (res)
-            break;
-        d->tx_packet_count++;
-
-        struct timespec t;
-        timespec_get(&t, TIME_UTC);
-        fl_timespec_add_ns(&t, d->timeout * 1000000);
-        int is_timeout;
-        do
-        {
-            is_timeout = pthread_cond_timedwait(&d->ack_cond, &d->ack_mutex, &t);
-        } while (!is_timeout && d->ack_sign != m->sign);
-
-        if (!is_timeout)
-            break;
-        else
-            d->tx_packet_loss++;
+        fl_get_key(d, salt, d->crypto.data_key);
+        d->crypto.data_salt = salt;
+        d->crypto.is_data_key_valid = 1;
     }
-    fl_msg_delete(m);
+    return d->crypto.data_key;
+}
 
-    if (res || tries == d->max_retrans)
-    {
-        d->state = STATE_PAIRED;
-        d->tx_packet_delay = -1;
-        fl_call_devs_change(d->base, d, d->id, DEV_CHANGE_CONNECT_TIMEOUT);
-        return res ? res : ETIMEDOUT;
-    }
-    else
+/*  盐值表
+    由调用者映射为共享内存，salt/connect_count提交时(持有tx_mutex)原地更新设备所在的槽
+    每槽两份副本交替写入，落盘时恰好写到一半的槽仍有一份有效
+    char[]  FLST
+    u16     version         FL_SALT_TABLE_VERSION
+    u16     slot_size       FELINK_SALT_SLOT_SIZE
+    u32     n_slots
+    u32     check           前12字节的散列
+    slots[]
     {
-        struct timeval ack_time;
-        gettimeofday(&ack_time, NULL);
-        d->tx_packet_delay = fl_timeval_interval_us(send_time, ack_time) / 1000;
-        return 0;
+        u32     id
+        u32     state       0为空闲，FL_SALT_SLOT_PAIRED或FL_SALT_SLOT_CONNECTED
+        copies[2]
+        {
+            u32     connect_count
+            u32     salt
+            u16     seq         两份均有效时取较新(按u16回绕比较)的一份
+            u16     check       id/connect_count/salt/seq的散列
+        }
     }
-}
-
-static int fl_pcmd_base_search(
-    struct fl_base *b)
-{
-    struct fl_msg_t *msg = fl_msg_create(4);
+*/
 
-    msg->buf[0] = FELINK_SIGN;
-    msg->buf[1] = 0;
-    msg->buf[2] = FELINK_PCMD;
-    msg->buf[3] = FELINK_PCMD_BASE_SEARCH;
-    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
+#define FL_SALT_TABLE_VERSION 1
+#define FL_SALT_SLOT_PAIRED 1
+// 重启后以槽中的salt恢复为已连接，设备未断开时可直接继续发送数据包
+#define FL_SALT_SLOT_CONNECTED 2
 
-    return fl_transmit_no_ack(b, msg);
+static uint32_t fl_salt_check(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    return fl_hash32(a ^ fl_hash32(b ^ fl_hash32(c ^ fl_hash32(d))));
 }
 
-static int fl_pcmd_base_id_invalid(
-    struct fl_base *b,
-    uint32_t id)
+static uint8_t *fl_salt_slot(struct fl_base *b, size_t i)
 {
-    struct fl_msg_t *msg = fl_msg_create(12);
+    return &b->salt_table[FELINK_SALT_TABLE_SIZE(i)];
+}
 
-    msg->buf[0] = FELINK_SIGN;
-    msg->buf[1] = 0;
-    msg->buf[2] = FELINK_PCMD;
-    msg->buf[3] = FELINK_PCMD_BASE_ID_INVALID;
-    fl_wr32(&msg->buf[4], id);
-    int res = fl_random(&msg->buf[8], 4);
-    if (res)
+// 返回槽中较新的有效副本，均无效返回NULL
+static const uint8_t *fl_salt_slot_latest(const uint8_t *slot)
+{
+    const uint8_t *latest = NULL;
+    uint32_t id = fl_rd32(slot);
+    for (int i = 0; i < 2; i++)
     {
-        fl_msg_delete(msg);
-        return res;
+        const uint8_t *copy = &slot[8 + i * 12];
+        uint16_t seq = fl_rd16(&copy[8]);
+        if (fl_rd16(&copy[10]) != (uint16_t)fl_salt_check(id, fl_rd32(&copy[0]), fl_rd32(&copy[4]), seq))
+            continue;
+        if (latest == NULL || (int16_t)(seq - fl_rd16(&latest[8])) > 0)
+            latest = copy;
     }
-    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
-
-    return fl_transmit_no_ack(b, msg);
+    return latest;
 }
 
-static int fl_pcmd_base_pair(
+// 需持有tx_mutex，已配对设备没有槽时先分配
+static void fl_salt_slot_sync(
     struct fl_base *b,
     struct fl_dev *d)
 {
-    size_t pub_key_size = FELINK_uECC_PUB_KEY_SIZE;
-    struct fl_msg_t *msg = fl_msg_create(9 + pub_key_size);
-
-    msg->buf[0] = FELINK_SIGN;
-    msg->buf[1] = 0;
-    msg->buf[2] = FELINK_PCMD;
-    msg->buf[3] = FELINK_PCMD_BASE_PAIR;
-    fl_wr32(&msg->buf[4], d->id);
-    msg->buf[8] = pub_key_size;
-    memcpy(&msg->buf[9], b->pub_key, pub_key_size);
-    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
-
-    int res = fl_transmit_no_ack(b, msg);
-    if (res)
-        return res;
+    if (b->salt_table == NULL || d->state < STATE_PAIRED)
+        return;
 
-    d->state = STATE_PAIRING;
-    fl_call_devs_change(b, d, d->id, DEV_CHANGE_PAIR_START);
+    if (d->salt_slot < 0)
+    {
+        for (size_t n = 0; n < b->n_salt_slots; n++)
+        {
+            size_t i = (b->salt_slot_hint + n) % b->n_salt_slots;
+            uint8_t *slot = fl_salt_slot(b, i);
+            if (fl_rd32(&slot[4]))
+                continue;
+            fl_wr32(&slot[4], FL_SALT_SLOT_PAIRED);
+            d->salt_slot = i;
+            b->salt_slot_hint = i + 1;
+            break;
+        }
+        // 表满时该设备只随快照保存
+        if (d->salt_slot < 0)
+            return;
+    }
 
-    return 0;
+    uint8_t *slot = fl_salt_slot(b, d->salt_slot);
+    fl_wr32(&slot[4], d->state == STATE_CONNECTED ? FL_SALT_SLOT_CONNECTED : FL_SALT_SLOT_PAIRED);
+    uint16_t seq = ++d->salt_seq;
+    uint8_t *copy = &slot[8 + (seq & 1) * 12];
+    fl_wr32(&slot[0], d->id);
+    fl_wr32(&copy[0], d->connect_count);
+    fl_wr32(&copy[4], d->salt);
+    fl_wr16(&copy[8], seq);
+    fl_wr16(&copy[10], fl_salt_check(d->id, d->connect_count, d->salt, seq));
+    b->is_salt_table_dirty = 1;
 }
 
-static int fl_ccmd_base_connect(
+// 需持有tx_mutex
+static void fl_salt_slot_free(
     struct fl_base *b,
     struct fl_dev *d)
 {
-    struct fl_msg_t *msg = fl_msg_create(16);
+    if (b->salt_table == NULL || d->salt_slot < 0)
+        return;
+    memset(fl_salt_slot(b, d->salt_slot), 0, FELINK_SALT_SLOT_SIZE);
+    d->salt_slot = -1;
+    b->is_salt_table_dirty = 1;
+}
+
+// is_name_ref时直接引用name(须位于sav_map中)，tea_key为NULL时置零
+static struct fl_dev *fl_dev_create(
+    struct fl_base *b,
+    uint32_t id,
+    uint32_t type,
+    uint16_t version,
+    const char *name,
+    int is_name_ref,
+    const uint8_t *tea_key)
+{
+    struct fl_dev *d = fl_dev_record_alloc(b);
+    if (d == NULL)
+        return NULL;
+
+    d->base = b;
+    d->gen = __atomic_add_fetch(&b->dev_gen, 1, __ATOMIC_RELAXED);
+    d->id = id;
+    d->type = type;
+    d->version = version;
+    if (is_name_ref)
+        d->name = (char *)name;
+    else
+    {
+        size_t name_size = strlen(name) + 1;
+        d->name = name_size > FELINK_DEV_NAME_INLINE ? malloc(name_size) : (char *)d + fl_dev_record_name_offset();
+        strcpy(d->name, name);
+    }
+    d->state = STATE_HANDSHAKED;
+    d->timeout = FELINK_DEFAULT_TIMEOUT;
+    d->max_retrans = FELINK_DEFAULT_MAXRET;
+    d->tx_packet_delay = -1;
+    d->tx_packet_count = 0;
+    d->tx_packet_loss = 0;
+    d->tx_window = FELINK_DEFAULT_WINDOW;
+    d->tea_key = (uint8_t *)d + fl_dev_record_tea_key_offset();
+    if (tea_key != NULL)
+        memcpy(d->tea_key, tea_key, FELINK_uECC_CURVE_SIZE);
+    else
+        memset(d->tea_key, 0, FELINK_uECC_CURVE_SIZE);
+    fl_dev_crypto_reset(d);
+    d->tx_queue = NULL;
+    d->tx_queue_tail = NULL;
+    d->n_tx_queued = 0;
+    memset(d->tx_slots, 0, sizeof(d->tx_slots));
+    d->n_tx_pending = 0;
+    d->tx_seq = 0;
+    d->tx_salt = 0;
+    d->is_tx_timeout = 0;
+    d->salt_slot = -1;
+    d->salt_seq = 0;
+    return d;
+}
+
+static void fl_dev_name_free(
+    struct fl_base *b,
+    struct fl_dev *d)
+{
+    if (d->name == (char *)d + fl_dev_record_name_offset())
+        return;
+    if (b->sav_map != NULL && (uint8_t *)d->name >= b->sav_map && (uint8_t *)d->name < b->sav_map + b->sav_map_size)
+        return;
+    free(d->name);
+}
+
+// 预留n_devs个设备的数组与索引空间，批量载入时避免逐个扩容
+static int fl_devs_reserve(
+    struct fl_base *b,
+    int n_devs)
+{
+    if (n_devs > b->devs_size)
+    {
+        struct fl_dev **devs = realloc(b->devs, n_devs * sizeof(struct fl_dev *));
+        if (devs == NULL)
+            return ENOMEM;
+        b->devs = devs;
+        b->devs_size = n_devs;
+    }
+    if (n_devs * 4 > b->dev_index_size * 3)
+        return fl_dev_index_rebuild(b, n_devs);
+    return 0;
+}
+
+// 需持有tx_mutex
+static int fl_dev_insert(
+    struct fl_base *b,
+    struct fl_dev *d)
+{
+    if (b->n_devs == b->devs_size && fl_devs_reserve(b, b->devs_size ? b->devs_size * 2 : 8))
+        return ENOMEM;
+    if (fl_dev_index_insert(b, d))
+        return ENOMEM;
+    b->devs[b->n_devs++] = d;
+    return 0;
+}
+
+static struct fl_dev *fl_dev_add(
+    struct fl_base *b,
+    uint32_t id,
+    uint32_t type,
+    uint16_t version,
+    const char *name)
+{
+    struct fl_dev *d = fl_dev_create(b, id, type, version, name, 0, NULL);
+    if (d == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&b->tx_mutex);
+    int res = fl_dev_insert(b, d);
+    pthread_mutex_unlock(&b->tx_mutex);
+    if (res)
+    {
+        fl_dev_name_free(b, d);
+        fl_dev_record_free(b, d);
+        return NULL;
+    }
+
+    fl_call_devs_change(b, d, id, DEV_CHANGE_ADD);
+    return d;
+}
+
+static void fl_dev_remove(
+    struct fl_dev *d)
+{
+    int index;
+    struct fl_base *b = d->base;
+
+    pthread_mutex_lock(&b->tx_mutex);
+    for (index = 0; index < b->n_devs; index++)
+        if (b->devs[index] == d)
+            break;
+    if (index == b->n_devs)
+    {
+        pthread_mutex_unlock(&b->tx_mutex);
+        return;
+    }
+
+    // 等待调度线程结束对该设备的发送/通知，调度线程自身的回调中移除时除外
+    if (!pthread_equal(pthread_self(), b->tx_thread))
+        while (b->tx_busy_dev == d)
+            pthread_cond_wait(&b->tx_cond, &b->tx_mutex);
+
+    for (int i = index; i < b->n_devs - 1; i++)
+        b->devs[i] = b->devs[i + 1];
+    b->n_devs--;
+    b->devs[b->n_devs] = NULL;
+    fl_dev_index_erase(b, d);
+    fl_salt_slot_free(b, d);
+
+    // 未完成的请求全部摘下，解锁后以ENODEV通知
+    struct fl_tx_req *reqs = d->tx_queue;
+    for (int i = 0; i < FELINK_TX_WINDOW_MAX; i++)
+    {
+        struct fl_tx_slot *s = &d->tx_slots[i];
+        if (s->state == SLOT_FREE)
+            continue;
+        s->req->next = reqs;
+        reqs = s->req;
+        fl_tx_slot_release(d, s);
+    }
+    d->tx_queue = NULL;
+    d->tx_queue_tail = NULL;
+    d->n_tx_queued = 0;
+    pthread_mutex_unlock(&b->tx_mutex);
+
+    while (reqs != NULL)
+    {
+        struct fl_tx_req *next = reqs->next;
+        if (reqs->callback != NULL)
+            reqs->callback((struct fl_base_i *)b, (struct fl_dev_i *)d, ENODEV, reqs->private_arg);
+        fl_tx_req_delete(reqs);
+        reqs = next;
+    }
+
+    fl_call_devs_change(b, d, d->id, DEV_CHANGE_REMOVE);
+
+    fl_dev_name_free(b, d);
+    fl_dev_record_free(b, d);
+}
+
+// 需持有tx_mutex，索引重建时会释放旧表
+static struct fl_dev *fl_dev_index_get(
+    struct fl_base *b,
+    uint32_t id)
+{
+    struct fl_dev **slot = fl_dev_index_find_slot(b, id);
+    return slot != NULL ? *slot : NULL;
+}
+
+static struct fl_dev *fl_base_get_dev_by_id(
+    struct fl_base *b,
+    uint32_t id)
+{
+    pthread_mutex_lock(&b->tx_mutex);
+    struct fl_dev *d = fl_dev_index_get(b, id);
+    pthread_mutex_unlock(&b->tx_mutex);
+    return d;
+}
+
+// 需持有tx_mutex
+static int fl_dev_is_valid(
+    struct fl_base *b,
+    struct fl_dev *d)
+{
+    if (d == NULL || b->n_devs == 0 || d->version > FELINK_DEV_VERSION_MAX_COMPATIBILITY || d->version < FELINK_DEV_VERSION_MIN_COMPATIBILITY)
+        return 0;
+    return fl_dev_index_get(b, d->id) == d;
+}
+
+static int fl_base_is_dev_valid(
+    struct fl_base *b,
+    struct fl_dev *d)
+{
+    pthread_mutex_lock(&b->tx_mutex);
+    int is_valid = fl_dev_is_valid(b, d);
+    pthread_mutex_unlock(&b->tx_mutex);
+    return is_valid;
+}
+
+static int fl_tx(
+    struct fl_base *b,
+    struct fl_dev *d,
+    struct fl_msg_t *msg)
+{
+    int res = ENODEV;
+
+    pthread_mutex_lock(&b->tx_func_mutex);
+    if (b->tx_func != NULL)
+        res = b->tx_func((struct fl_dev_i *)d, msg->buf, msg->count, b->tx_func_private_arg);
+    pthread_mutex_unlock(&b->tx_func_mutex);
+
+    return res;
+}
+
+static int fl_transmit_no_ack(
+    struct fl_base *b,
+    struct fl_msg_t *msg)
+{
+    int res = fl_tx(b, NULL, msg);
+    fl_msg_delete(msg);
+    return res;
+}
+
+/*  发送窗口
+    每个设备最多有tx_window个等待ACK的消息(槽)，各自以sign区分
+    数据包的salt在入窗时按序推进(tx_salt)，收到ACK后才提交到salt
+    从机只能在解密前一个数据包后才能解密下一个，所以某个加密包的ACK同时确认了比它早的加密包
+    以下函数均需持有tx_mutex
+*/
+static uint8_t fl_tx_window_size(
+    struct fl_dev *d)
+{
+    uint8_t window = d->tx_window;
+    if (window < 1)
+        window = 1;
+    else if (window > FELINK_TX_WINDOW_MAX)
+        window = FELINK_TX_WINDOW_MAX;
+    return window;
+}
+
+static struct fl_tx_slot *fl_tx_slot_acquire(
+    struct fl_dev *d)
+{
+    struct fl_tx_slot *s = NULL;
+    for (int i = 0; i < FELINK_TX_WINDOW_MAX; i++)
+    {
+        if (d->tx_slots[i].state == SLOT_FREE)
+        {
+            s = &d->tx_slots[i];
+            break;
+        }
+    }
+
+    s->req = NULL;
+    s->msg = NULL;
+    s->state = SLOT_PENDING;
+    s->res = 0;
+    s->seq = d->tx_seq++;
+    s->salt = 0;
+    s->is_salt_update = 0;
+    s->tx_packet_delay = -1;
+    s->tx_packet_count = 0;
+    s->tx_packet_loss = 0;
+    d->n_tx_pending++;
+
+    return s;
+}
+
+static int fl_tx_slot_is_sign_used(
+    struct fl_dev *d,
+    uint8_t sign)
+{
+    for (int i = 0; i < FELINK_TX_WINDOW_MAX; i++)
+    {
+        struct fl_tx_slot *s = &d->tx_slots[i];
+        if (s->state == SLOT_PENDING && s->msg != NULL && s->msg->sign == sign)
+            return 1;
+    }
+    return 0;
+}
+
+static int fl_tx_is_connecting(
+    struct fl_dev *d)
+{
+    for (int i = 0; i < FELINK_TX_WINDOW_MAX; i++)
+    {
+        struct fl_tx_slot *s = &d->tx_slots[i];
+        if (s->state == SLOT_PENDING && s->req != NULL && s->req->type == TX_REQ_CONNECT)
+            return 1;
+    }
+    return 0;
+}
+
+// 重传耗尽或发送出错，窗口内其余数据包的salt链已断，一并失败
+static void fl_tx_window_fail(
+    struct fl_dev *d,
+    int res)
+{
+    for (int i = 0; i < FELINK_TX_WINDOW_MAX; i++)
+    {
+        struct fl_tx_slot *s = &d->tx_slots[i];
+        if (s->state == SLOT_PENDING)
+        {
+            s->state = SLOT_FAILED;
+            s->res = res;
+        }
+    }
+    d->state = STATE_PAIRED;
+    d->tx_packet_delay = -1;
+    d->is_tx_timeout = 1;
+    fl_salt_slot_sync(d->base, d);
+}
+
+static struct fl_msg_t *fl_ccmd_base_connect_msg(
+    struct fl_dev *d,
+    uint32_t *salt,
+    int *res)
+{
+    struct fl_msg_t *msg = fl_msg_create(d->base, 16);
+    if (msg == NULL)
+    {
+        *res = ENOMEM;
+        return NULL;
+    }
+
+    msg->buf[0] = FELINK_SIGN;
+    msg->buf[1] = 0;
+    msg->buf[2] = FELINK_CCMD;
+    msg->buf[3] = FELINK_CCMD_BASE_CONNECT;
+    fl_wr32(&msg->buf[4], d->id);
+    msg->buf[8] = 0;
+    *res = fl_random(&msg->buf[9], 3);
+    if (*res)
+    {
+        fl_msg_delete(msg);
+        return NULL;
+    }
+    fl_wr32(&msg->buf[12], d->connect_count);
+    msg->buf[8] = fl_chksum8(&msg->buf[8], 8);
+    *salt = fl_rd32(&msg->buf[8]);
+    struct timeval start = fl_stats_start(d->base);
+    *res = fl_xxtea_byte_array_encrypt(&msg->buf[8], 8, d->crypto.connect_key);
+    fl_stats_report(d->base, d, FL_STATS_ENCRYPT, start);
+    if (*res)
+    {
+        fl_msg_delete(msg);
+        return NULL;
+    }
+    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
+    msg->sign = fl_chksum8(&msg->buf[8], 8);
+
+    return msg;
+}
+
+static void fl_dcmd_data_msg_seal(
+    struct fl_msg_t *msg)
+{
+    msg->buf[1] = 0;
+    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
+    msg->sign = fl_chksum8(&msg->buf[12], msg->count - 12);
+}
+
+// is_defer_encrypt时只生成明文，由调用者批量加密后再fl_dcmd_data_msg_seal
+static struct fl_msg_t *fl_dcmd_data_msg(
+    struct fl_dev *d,
+    const struct fl_tx_req *req,
+    uint32_t *salt,
+    int is_defer_encrypt,
+    int *res)
+{
+    const uint8_t *data = req->data;
+    size_t count = req->count;
+    size_t padding_align = req->padding_align;
+    char is_plaintext_transmit = req->is_plaintext;
+
+    if (d->state != STATE_CONNECTED)
+    {
+        *res = ENOTCONN;
+        return NULL;
+    }
+
+    uint32_t l = ((6 + (count > padding_align ? count : padding_align) + 3) / 4) * 4;
+    struct fl_msg_t *msg = fl_msg_create(d->base, 12 + l);
+    if (msg == NULL)
+    {
+        *res = ENOMEM;
+        return NULL;
+    }
+
+    msg->buf[0] = FELINK_SIGN;
+    msg->buf[1] = 0;
+    msg->buf[2] = FELINK_DCMD;
+    msg->buf[3] = FELINK_DCMD_DATA;
+    fl_wr32(&msg->buf[4], d->id);
+    fl_wr32(&msg->buf[8], (uint32_t)(is_plaintext_transmit ? -l : l));
+
+    // 与窗口内其它数据包sign冲突时更换随机数重新生成
+    int tries = 0;
+    do
+    {
+        memset(&msg->buf[12], 0, l);
+        fl_wr16(&msg->buf[12], count - 1);
+        *res = fl_random(&msg->buf[15], 4);
+        if (*res)
+            break;
+        memcpy(&msg->buf[18], data, count);
+        msg->buf[14] = fl_chksum8(&msg->buf[12], l);
+        *salt = fl_rd32(&msg->buf[14]);
+        if (!is_plaintext_transmit)
+        {
+            if (is_defer_encrypt)
+                return msg;
+            *res = fl_xxtea_byte_array_encrypt(&msg->buf[12], l, fl_dev_crypto_data_key(d, d->tx_salt));
+            if (*res)
+                break;
+        }
+        fl_dcmd_data_msg_seal(msg);
+    } while (fl_tx_slot_is_sign_used(d, msg->sign) && ++tries < FELINK_TX_WINDOW_MAX);
+    if (*res)
+    {
+        fl_msg_delete(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+// 需持有tx_mutex，发送期间解锁，tx_busy_dev保证设备不被移除
+static void fl_tx_slot_send(
+    struct fl_base *b,
+    struct fl_dev *d,
+    struct fl_tx_slot *s)
+{
+    b->tx_busy_dev = d;
+    pthread_mutex_unlock(&b->tx_mutex);
+    int res = fl_tx(b, d, s->msg);
+    pthread_mutex_lock(&b->tx_mutex);
+    b->tx_busy_dev = NULL;
+    pthread_cond_broadcast(&b->tx_cond);
+
+    if (res)
+    {
+        if (s->state == SLOT_PENDING)
+            fl_tx_window_fail(d, res);
+        return;
+    }
+    s->tx_packet_count++;
+    if (s->state != SLOT_PENDING)
+        return;
+    timespec_get(&s->deadline, TIME_UTC);
+    fl_timespec_add_ns(&s->deadline, (uint64_t)d->timeout * 1000000);
+}
+
+static void fl_tx_slots_sort(
+    struct fl_tx_slot **slots,
+    int n)
+{
+    for (int i = 1; i < n; i++)
+    {
+        struct fl_tx_slot *t = slots[i];
+        int j = i - 1;
+        for (; j >= 0 && (int32_t)(t->seq - slots[j]->seq) < 0; j--)
+            slots[j + 1] = slots[j];
+        slots[j + 1] = t;
+    }
+}
+
+/*  调度第一步：完成
+    收集某个设备已确认/已失败的槽，按入窗顺序在解锁后通知
+    回调结束前设备不会被其它线程移除
+    有完成返回1
+*/
+static int fl_tx_complete(
+    struct fl_base *b)
+{
+    for (int i = 0; i < b->n_devs; i++)
+    {
+        struct fl_dev *d = b->devs[i];
+        struct fl_tx_slot *slots[FELINK_TX_WINDOW_MAX];
+        int n = 0;
+
+        for (int j = 0; j < FELINK_TX_WINDOW_MAX; j++)
+            if (d->tx_slots[j].state == SLOT_ACKED || d->tx_slots[j].state == SLOT_FAILED)
+                slots[n++] = &d->tx_slots[j];
+        if (n == 0 && !d->is_tx_timeout)
+            continue;
+        fl_tx_slots_sort(slots, n);
+
+        struct fl_tx_req *reqs[FELINK_TX_WINDOW_MAX];
+        int res[FELINK_TX_WINDOW_MAX];
+        int is_connect = 0;
+        for (int j = 0; j < n; j++)
+        {
+            struct fl_tx_slot *s = slots[j];
+            d->tx_packet_count += s->tx_packet_count;
+            d->tx_packet_loss += s->tx_packet_loss;
+            if (s->state == SLOT_ACKED)
+            {
+                d->tx_packet_delay = s->tx_packet_delay;
+                if (s->req->type == TX_REQ_CONNECT)
+                {
+                    d->connect_count++;
+                    d->salt = s->salt;
+                    d->tx_salt = s->salt;
+                    d->state = STATE_CONNECTED;
+                    fl_salt_slot_sync(b, d);
+                    is_connect = 1;
+                }
+            }
+            reqs[j] = s->req;
+            res[j] = s->state == SLOT_ACKED ? 0 : s->res;
+            fl_tx_slot_release(d, s);
+        }
+        int is_timeout = d->is_tx_timeout;
+        d->is_tx_timeout = 0;
+
+        b->tx_busy_dev = d;
+        pthread_mutex_unlock(&b->tx_mutex);
+        if (is_timeout)
+            fl_call_devs_change(b, d, d->id, DEV_CHANGE_CONNECT_TIMEOUT);
+        if (is_connect)
+            fl_call_devs_change(b, d, d->id, DEV_CHANGE_CONNECT);
+        for (int j = 0; j < n; j++)
+        {
+            if (reqs[j]->callback != NULL)
+                reqs[j]->callback((struct fl_base_i *)b, (struct fl_dev_i *)d, res[j], reqs[j]->private_arg);
+            fl_tx_req_delete(reqs[j]);
+        }
+        pthread_mutex_lock(&b->tx_mutex);
+        b->tx_busy_dev = NULL;
+        pthread_cond_broadcast(&b->tx_cond);
+
+        return 1;
+    }
+    return 0;
+}
+
+/*  调度第二步：超时重传
+    同时求出最早的超时时刻作为下一次唤醒时间
+    有重传返回1
+*/
+static int fl_tx_retransmit(
+    struct fl_base *b,
+    struct timespec *wake,
+    int *is_wake_set)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    *is_wake_set = 0;
+
+    for (int i = 0; i < b->n_devs; i++)
+    {
+        struct fl_dev *d = b->devs[i];
+        for (int j = 0; j < FELINK_TX_WINDOW_MAX; j++)
+        {
+            struct fl_tx_slot *s = &d->tx_slots[j];
+            if (s->state != SLOT_PENDING || s->tx_packet_count == 0)
+                continue;
+            if (fl_timespec_cmp(&s->deadline, &now) > 0)
+            {
+                if (!*is_wake_set || fl_timespec_cmp(&s->deadline, wake) < 0)
+                    *wake = s->deadline;
+                *is_wake_set = 1;
+                continue;
+            }
+
+            s->tx_packet_loss++;
+            if (s->tx_packet_count >= d->max_retrans)
+                fl_tx_window_fail(d, ETIMEDOUT);
+            else
+                fl_tx_slot_send(b, d, s);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*  调度第三步：新发送
+    各设备轮转，每轮从窗口未满的设备队列头各取一个请求，最多FELINK_TX_BATCH_MAX个
+    连接请求需等窗口清空，且连接期间不再发送其它请求
+    一轮中等长的加密数据包先批量加密(NEON下多通道并行)，sign冲突的再单独重新生成
+    发送期间会解锁，之后的批内请求按id与seq重新查找，设备已移除或窗口已失败的跳过
+    有发送返回1
+*/
+struct fl_tx_batch_entry
+{
+    struct fl_dev *d;
+    struct fl_tx_slot *s;
+    uint32_t id;
+    uint32_t gen;
+    uint32_t seq;
+    uint32_t key_salt;
+    uint8_t is_encrypt_pending;
+};
+
+static void fl_tx_batch_encrypt(
+    struct fl_base *b,
+    struct fl_tx_batch_entry *batch,
+    int n)
+{
+    uint8_t *bufs[FELINK_TX_BATCH_MAX];
+    uint32_t *keys[FELINK_TX_BATCH_MAX];
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!batch[i].is_encrypt_pending)
+            continue;
+
+        size_t count = batch[i].s->msg->count;
+        int m = 0;
+        for (int j = i; j < n; j++)
+        {
+            struct fl_tx_batch_entry *e = &batch[j];
+            if (!e->is_encrypt_pending || e->s->msg->count != count)
+                continue;
+            bufs[m] = &e->s->msg->buf[12];
+            keys[m] = fl_dev_crypto_data_key(e->d, e->key_salt);
+            e->is_encrypt_pending = 0;
+            m++;
+        }
+        struct timeval start = fl_stats_start(b);
+        fl_xxtea_byte_array_encrypt_lanes(bufs, count - 12, keys, m);
+        fl_stats_report(b, m == 1 ? batch[i].d : NULL, FL_STATS_ENCRYPT, start);
+    }
+}
+
+static int fl_tx_send_new(
+    struct fl_base *b)
+{
+    struct fl_tx_batch_entry batch[FELINK_TX_BATCH_MAX];
+    int n = 0;
+    int is_picked = 0;
 
-    msg->buf[0] = FELINK_SIGN;
-    msg->buf[1] = 0;
-    msg->buf[2] = FELINK_CCMD;
-    msg->buf[3] = FELINK_CCMD_BASE_CONNECT;
-    fl_wr32(&msg->buf[4], d->id);
-    msg->buf[8] = 0;
-    int res = fl_random(&msg->buf[9], 3);
-    if (res)
+    for (int k = 0; k < b->n_devs && n < FELINK_TX_BATCH_MAX; k++)
+    {
+        int i = (b->tx_rr_index + k) % b->n_devs;
+        struct fl_dev *d = b->devs[i];
+        struct fl_tx_req *req = d->tx_queue;
+        if (req == NULL || d->n_tx_pending >= fl_tx_window_size(d) || fl_tx_is_connecting(d))
+            continue;
+        if (req->type == TX_REQ_CONNECT && d->n_tx_pending > 0)
+            continue;
+
+        d->tx_queue = req->next;
+        if (d->tx_queue == NULL)
+            d->tx_queue_tail = NULL;
+        d->n_tx_queued--;
+        b->tx_rr_index = (i + 1) % b->n_devs;
+        is_picked = 1;
+
+        struct fl_tx_slot *s = fl_tx_slot_acquire(d);
+        s->req = req;
+        uint32_t salt = 0;
+        int res = 0;
+        struct fl_tx_batch_entry *e = &batch[n];
+        e->is_encrypt_pending = 0;
+        if (req->type == TX_REQ_CONNECT)
+        {
+            d->tx_packet_count = 0;
+            d->tx_packet_loss = 0;
+            s->msg = fl_ccmd_base_connect_msg(d, &salt, &res);
+            s->salt = salt;
+        }
+        else
+        {
+            struct fl_msg_t *msg = fl_dcmd_data_msg(d, req, &salt, 1, &res);
+            if (msg != NULL && !req->is_plaintext)
+            {
+                e->key_salt = d->tx_salt;
+                e->is_encrypt_pending = 1;
+                s->salt = salt;
+                s->is_salt_update = 1;
+                d->tx_salt = salt;
+            }
+            s->msg = msg;
+        }
+        if (s->msg == NULL)
+        {
+            s->state = SLOT_FAILED;
+            s->res = res;
+            continue;
+        }
+
+        e->d = d;
+        e->s = s;
+        e->id = d->id;
+        e->gen = d->gen;
+        e->seq = s->seq;
+        n++;
+    }
+
+    fl_tx_batch_encrypt(b, batch, n);
+    for (int i = 0; i < n; i++)
     {
+        struct fl_tx_batch_entry *e = &batch[i];
+        if (!e->s->is_salt_update)
+            continue;
+
+        // sign须在加密后才能得到，检查冲突时先不计入自身
+        struct fl_msg_t *msg = e->s->msg;
+        e->s->msg = NULL;
+        fl_dcmd_data_msg_seal(msg);
+        if (!fl_tx_slot_is_sign_used(e->d, msg->sign))
+        {
+            e->s->msg = msg;
+            continue;
+        }
+
         fl_msg_delete(msg);
-        return res;
+        int res = 0;
+        uint32_t salt = 0;
+        e->d->tx_salt = e->key_salt;
+        e->s->msg = fl_dcmd_data_msg(e->d, e->s->req, &salt, 0, &res);
+        if (e->s->msg == NULL)
+        {
+            e->s->state = SLOT_FAILED;
+            e->s->res = res;
+            continue;
+        }
+        e->s->salt = salt;
+        e->d->tx_salt = salt;
     }
-    fl_wr32(&msg->buf[12], d->connect_count);
-    msg->buf[8] = fl_chksum8(&msg->buf[8], 8);
-    uint32_t salt = fl_rd32(&msg->buf[8]);
-    uint32_t key[4];
-    d->salt = 0x76543210;
-    fl_get_key(d, key);
-    res = fl_xxtea_byte_array_encrypt(&msg->buf[8], 8, key);
+
+    for (int i = 0; i < n; i++)
+    {
+        struct fl_dev *d = fl_dev_index_get(b, batch[i].id);
+        if (d != batch[i].d || d->gen != batch[i].gen)
+            continue;
+        struct fl_tx_slot *s = NULL;
+        for (int j = 0; j < FELINK_TX_WINDOW_MAX; j++)
+            if (d->tx_slots[j].state == SLOT_PENDING && d->tx_slots[j].seq == batch[i].seq)
+                s = &d->tx_slots[j];
+        if (s == NULL || s->msg == NULL || s->tx_packet_count != 0)
+            continue;
+
+        gettimeofday(&s->send_time, NULL);
+        fl_tx_slot_send(b, d, s);
+    }
+
+    return is_picked;
+}
+
+static void *fl_tx_thread(void *args)
+{
+    struct fl_base *b = args;
+
+    pthread_mutex_lock(&b->tx_mutex);
+    while (!b->is_tx_thread_stop)
+    {
+        struct timespec wake;
+        int is_wake_set;
+
+        if (fl_tx_complete(b))
+            continue;
+        if (fl_tx_retransmit(b, &wake, &is_wake_set))
+            continue;
+        if (fl_tx_send_new(b))
+            continue;
+
+        if (is_wake_set)
+            pthread_cond_timedwait(&b->tx_cond, &b->tx_mutex, &wake);
+        else
+            pthread_cond_wait(&b->tx_cond, &b->tx_mutex);
+    }
+    pthread_mutex_unlock(&b->tx_mutex);
+
+    return NULL;
+}
+
+static int fl_tx_enqueue(
+    struct fl_base *b,
+    struct fl_dev *d,
+    struct fl_tx_req *req)
+{
+    pthread_mutex_lock(&b->tx_mutex);
+    if (!fl_dev_is_valid(b, d) || d->state == STATE_HANDSHAKED || d->state == STATE_PAIRING)
+    {
+        pthread_mutex_unlock(&b->tx_mutex);
+        return ENOTCONN;
+    }
+    if (d->n_tx_queued >= FELINK_TX_QUEUE_MAX)
+    {
+        pthread_mutex_unlock(&b->tx_mutex);
+        return ENOBUFS;
+    }
+
+    req->next = NULL;
+    if (d->tx_queue_tail == NULL)
+        d->tx_queue = req;
+    else
+        d->tx_queue_tail->next = req;
+    d->tx_queue_tail = req;
+    d->n_tx_queued++;
+    pthread_cond_broadcast(&b->tx_cond);
+    pthread_mutex_unlock(&b->tx_mutex);
+
+    return 0;
+}
+
+// 同步接口等待异步请求完成
+struct fl_tx_wait
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int is_done;
+    int res;
+};
+
+static void fl_tx_wait_callback(
+    struct fl_base_i *base,
+    struct fl_dev_i *dev,
+    int res,
+    void *private_arg)
+{
+    struct fl_tx_wait *w = private_arg;
+
+    pthread_mutex_lock(&w->mutex);
+    w->res = res;
+    w->is_done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void fl_tx_wait_init(
+    struct fl_tx_wait *w)
+{
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->is_done = 0;
+    w->res = 0;
+}
+
+static int fl_tx_wait_for(
+    struct fl_tx_wait *w,
+    int res)
+{
+    if (!res)
+    {
+        pthread_mutex_lock(&w->mutex);
+        while (!w->is_done)
+            pthread_cond_wait(&w->cond, &w->mutex);
+        res = w->res;
+        pthread_mutex_unlock(&w->mutex);
+    }
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+
+    return res;
+}
+
+static int fl_pcmd_base_search(
+    struct fl_base *b)
+{
+    struct fl_msg_t *msg = fl_msg_create(b, 4);
+
+    msg->buf[0] = FELINK_SIGN;
+    msg->buf[1] = 0;
+    msg->buf[2] = FELINK_PCMD;
+    msg->buf[3] = FELINK_PCMD_BASE_SEARCH;
+    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
+
+    return fl_transmit_no_ack(b, msg);
+}
+
+static int fl_pcmd_base_id_invalid(
+    struct fl_base *b,
+    uint32_t id)
+{
+    struct fl_msg_t *msg = fl_msg_create(b, 12);
+
+    msg->buf[0] = FELINK_SIGN;
+    msg->buf[1] = 0;
+    msg->buf[2] = FELINK_PCMD;
+    msg->buf[3] = FELINK_PCMD_BASE_ID_INVALID;
+    fl_wr32(&msg->buf[4], id);
+    int res = fl_random(&msg->buf[8], 4);
     if (res)
     {
         fl_msg_delete(msg);
         return res;
     }
     msg->buf[1] = fl_chksum8(msg->buf, msg->count);
-    msg->sign = fl_chksum8(&msg->buf[8], 8);
 
-    res = fl_transmit_with_ack(d, msg);
+    return fl_transmit_no_ack(b, msg);
+}
+
+static int fl_pcmd_base_pair(
+    struct fl_base *b,
+    struct fl_dev *d)
+{
+    size_t pub_key_size = FELINK_uECC_PUB_KEY_SIZE;
+    struct fl_msg_t *msg = fl_msg_create(b, 9 + pub_key_size);
+
+    msg->buf[0] = FELINK_SIGN;
+    msg->buf[1] = 0;
+    msg->buf[2] = FELINK_PCMD;
+    msg->buf[3] = FELINK_PCMD_BASE_PAIR;
+    fl_wr32(&msg->buf[4], d->id);
+    msg->buf[8] = pub_key_size;
+    memcpy(&msg->buf[9], b->pub_key, pub_key_size);
+    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
+
+    int res = fl_transmit_no_ack(b, msg);
     if (res)
         return res;
 
-    d->connect_count++;
-    d->salt = salt;
-    d->state = STATE_CONNECTED;
-    fl_call_devs_change(b, d, d->id, DEV_CHANGE_CONNECT);
+    d->state = STATE_PAIRING;
+    fl_call_devs_change(b, d, d->id, DEV_CHANGE_PAIR_START);
 
     return 0;
 }
@@ -466,7 +1674,7 @@ static int fl_ccmd_base_unpair(
     struct fl_base *b,
     struct fl_dev *d)
 {
-    struct fl_msg_t *msg = fl_msg_create(16);
+    struct fl_msg_t *msg = fl_msg_create(b, 16);
 
     msg->buf[0] = FELINK_SIGN;
     msg->buf[1] = 0;
@@ -482,10 +1690,7 @@ static int fl_ccmd_base_unpair(
     }
     fl_wr32(&msg->buf[12], d->connect_count);
     msg->buf[8] = fl_chksum8(&msg->buf[8], 8);
-    uint32_t key[4];
-    d->salt = 0x01234567;
-    fl_get_key(d, key);
-    res = fl_xxtea_byte_array_encrypt(&msg->buf[8], 8, key);
+    res = fl_xxtea_byte_array_encrypt(&msg->buf[8], 8, d->crypto.unpair_key);
     if (res)
     {
         fl_msg_delete(msg);
@@ -500,60 +1705,6 @@ static int fl_ccmd_base_unpair(
     return res;
 }
 
-static int fl_dcmd_data(
-    struct fl_base *b,
-    struct fl_dev *d,
-    const uint8_t *data,
-    size_t count,
-    size_t padding_align,
-    char is_plaintext_transmit)
-{
-    if (count == 0)
-        return ENODATA;
-    if (count > 0xFFFF)
-        return EMSGSIZE;
-
-    uint32_t l = ((6 + (count > padding_align ? count : padding_align) + 3) / 4) * 4;
-    struct fl_msg_t *msg = fl_msg_create(12 + l);
-
-    msg->buf[0] = FELINK_SIGN;
-    msg->buf[1] = 0;
-    msg->buf[2] = FELINK_DCMD;
-    msg->buf[3] = FELINK_DCMD_DATA;
-    fl_wr32(&msg->buf[4], d->id);
-    fl_wr32(&msg->buf[8], (uint32_t)(is_plaintext_transmit ? -l : l));
-    fl_wr16(&msg->buf[12], count - 1);
-    msg->buf[14] = 0;
-    int res = fl_random(&msg->buf[15], 4);
-    if (res)
-    {
-        fl_msg_delete(msg);
-        return res;
-    }
-    memcpy(&msg->buf[18], data, count);
-    msg->buf[14] = fl_chksum8(&msg->buf[12], l);
-    uint32_t salt = fl_rd32(&msg->buf[14]);
-    if (!is_plaintext_transmit)
-    {
-        uint32_t key[4];
-        fl_get_key(d, key);
-        res = fl_xxtea_byte_array_encrypt(&msg->buf[12], l, key);
-        if (res)
-        {
-            fl_msg_delete(msg);
-            return res;
-        }
-    }
-    msg->buf[1] = fl_chksum8(msg->buf, msg->count);
-    msg->sign = fl_chksum8(&msg->buf[12], l);
-
-    res = fl_transmit_with_ack(d, msg);
-    if (!res && !is_plaintext_transmit)
-        d->salt = salt;
-
-    return res;
-}
-
 static int fl_pcmd_dev_handshake_handler(
     struct fl_base *b,
     const uint8_t *data,
@@ -587,8 +1738,12 @@ static int fl_pcmd_dev_pair_handler(
             return EPROTONOSUPPORT;
 
         uECC_shared_secret(&data[9], b->pri_key, d->tea_key, FELINK_uECC_CURVE);
+        fl_dev_crypto_reset(d);
         fl_random((uint8_t *)&d->connect_count, 3);
+        pthread_mutex_lock(&b->tx_mutex);
         d->state = STATE_PAIRED;
+        fl_salt_slot_sync(b, d);
+        pthread_mutex_unlock(&b->tx_mutex);
         fl_call_devs_change(b, d, d->id, DEV_CHANGE_PAIR);
     }
 
@@ -617,7 +1772,19 @@ static int fl_pcmd_dev_id_change_handler(
     else
     {
         uint32_t oid = d->id;
+        pthread_mutex_lock(&b->tx_mutex);
+        fl_dev_index_erase(b, d);
         d->id = nid;
+        if (fl_dev_index_insert(b, d))
+        {
+            // 索引扩容失败，保留原id放回刚删除的位置
+            d->id = oid;
+            fl_dev_index_put(b, d);
+            pthread_mutex_unlock(&b->tx_mutex);
+            return ENOMEM;
+        }
+        fl_salt_slot_sync(b, d);
+        pthread_mutex_unlock(&b->tx_mutex);
         fl_call_devs_change(b, d, oid, DEV_CHANGE_ID_CHANGE);
     }
 
@@ -654,14 +1821,47 @@ static int fl_ccmd_dev_ack_handler(
 {
     uint32_t id = fl_rd32(&data[4]);
 
-    struct fl_dev *d = fl_base_get_dev_by_id(b, id);
-    if (d != NULL)
+    pthread_mutex_lock(&b->tx_mutex);
+    struct fl_dev *d = fl_dev_index_get(b, id);
+    if (d == NULL)
+    {
+        pthread_mutex_unlock(&b->tx_mutex);
+        return 0;
+    }
+
+    struct fl_tx_slot *s = NULL;
+    for (int i = 0; i < FELINK_TX_WINDOW_MAX; i++)
+    {
+        struct fl_tx_slot *t = &d->tx_slots[i];
+        if (t->state == SLOT_PENDING && t->msg != NULL && t->msg->sign == data[8])
+            if (s == NULL || (int32_t)(t->seq - s->seq) < 0)
+                s = t;
+    }
+    if (s != NULL)
     {
-        pthread_mutex_lock(&d->ack_mutex);
-        d->ack_sign = data[8];
-        pthread_mutex_unlock(&d->ack_mutex);
-        pthread_cond_signal(&d->ack_cond);
+        struct timeval ack_time;
+        gettimeofday(&ack_time, NULL);
+        s->state = SLOT_ACKED;
+        s->tx_packet_delay = fl_timeval_interval_us(s->send_time, ack_time) / 1000;
+        if (b->stats_callback != NULL)
+            b->stats_callback((struct fl_base_i *)b, (struct fl_dev_i *)d, FL_STATS_ACK_RTT, (uint32_t)fl_timeval_interval_us(s->send_time, ack_time), b->stats_private_arg);
+        if (s->is_salt_update)
+        {
+            for (int i = 0; i < FELINK_TX_WINDOW_MAX; i++)
+            {
+                struct fl_tx_slot *t = &d->tx_slots[i];
+                if (t->state == SLOT_PENDING && t->is_salt_update && (int32_t)(t->seq - s->seq) < 0)
+                {
+                    t->state = SLOT_ACKED;
+                    t->tx_packet_delay = fl_timeval_interval_us(t->send_time, ack_time) / 1000;
+                }
+            }
+            d->salt = s->salt;
+            fl_salt_slot_sync(b, d);
+        }
+        pthread_cond_broadcast(&b->tx_cond);
     }
+    pthread_mutex_unlock(&b->tx_mutex);
 
     return 0;
 }
@@ -739,82 +1939,291 @@ int fl_scan(
 
 int fl_pair(
     struct fl_base_i *base,
-    const struct fl_dev_i *dev)
+    const struct fl_dev_i *dev)
+{
+    struct fl_base *b = (struct fl_base *)base;
+    struct fl_dev *d = (struct fl_dev *)dev;
+
+    if (!fl_base_is_dev_valid(b, d))
+        return ENOTCONN;
+    if (d->state == STATE_PAIRED || d->state == STATE_CONNECTED)
+        return EISCONN;
+
+    return fl_pcmd_base_pair(b, d);
+}
+
+int fl_connect_async(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    fl_tx_done_callback_t callback,
+    void *private_arg)
+{
+    struct fl_base *b = (struct fl_base *)base;
+    struct fl_dev *d = (struct fl_dev *)dev;
+
+    struct fl_tx_req *req = malloc(sizeof(struct fl_tx_req));
+    if (req == NULL)
+        return ENOMEM;
+    req->type = TX_REQ_CONNECT;
+    req->data = NULL;
+    req->count = 0;
+    req->padding_align = 0;
+    req->is_plaintext = 0;
+    req->callback = callback;
+    req->private_arg = private_arg;
+
+    int res = fl_tx_enqueue(b, d, req);
+    if (res)
+        fl_tx_req_delete(req);
+    return res;
+}
+
+int fl_connect(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev)
+{
+    struct fl_base *b = (struct fl_base *)base;
+
+    if (pthread_equal(pthread_self(), b->tx_thread))
+        return EDEADLK;
+
+    struct fl_tx_wait w;
+    fl_tx_wait_init(&w);
+    int res = fl_connect_async(base, dev, fl_tx_wait_callback, &w);
+    return fl_tx_wait_for(&w, res);
+}
+
+int fl_unpair(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev)
+{
+    struct fl_base *b = (struct fl_base *)base;
+    struct fl_dev *d = (struct fl_dev *)dev;
+
+    if (!fl_base_is_dev_valid(b, d) || d->state == STATE_HANDSHAKED)
+        return ENOTCONN;
+
+    return fl_ccmd_base_unpair(b, d);
+}
+
+int fl_data_async(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    const uint8_t *data,
+    size_t count,
+    size_t padding_align,
+    int is_plaintext,
+    fl_tx_done_callback_t callback,
+    void *private_arg)
+{
+    struct fl_base *b = (struct fl_base *)base;
+    struct fl_dev *d = (struct fl_dev *)dev;
+
+    if (count == 0)
+        return ENODATA;
+    if (count > 0xFFFF)
+        return EMSGSIZE;
+
+    struct fl_tx_req *req = malloc(sizeof(struct fl_tx_req));
+    if (req == NULL)
+        return ENOMEM;
+    req->data = malloc(count);
+    if (req->data == NULL)
+    {
+        free(req);
+        return ENOMEM;
+    }
+    memcpy(req->data, data, count);
+    req->type = TX_REQ_DATA;
+    req->count = count;
+    req->padding_align = padding_align;
+    req->is_plaintext = is_plaintext;
+    req->callback = callback;
+    req->private_arg = private_arg;
+
+    int res = fl_tx_enqueue(b, d, req);
+    if (res)
+        fl_tx_req_delete(req);
+    return res;
+}
+
+int fl_data(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    const uint8_t *data,
+    size_t count,
+    size_t padding_align,
+    int is_plaintext)
 {
     struct fl_base *b = (struct fl_base *)base;
     struct fl_dev *d = (struct fl_dev *)dev;
 
-    if (!fl_base_is_dev_valid(b, d))
+    if (pthread_equal(pthread_self(), b->tx_thread))
+        return EDEADLK;
+    if (!fl_base_is_dev_valid(b, d) || d->state != STATE_CONNECTED)
         return ENOTCONN;
-    if (d->state == STATE_PAIRED || d->state == STATE_CONNECTED)
-        return EISCONN;
 
-    return fl_pcmd_base_pair(b, d);
+    struct fl_tx_wait w;
+    fl_tx_wait_init(&w);
+    int res = fl_data_async(base, dev, data, count, padding_align, is_plaintext, fl_tx_wait_callback, &w);
+    return fl_tx_wait_for(&w, res);
 }
 
-int fl_connect(
+int fl_set_timeout(
     struct fl_base_i *base,
-    const struct fl_dev_i *dev)
+    const struct fl_dev_i *dev,
+    uint16_t timeout)
 {
     struct fl_base *b = (struct fl_base *)base;
     struct fl_dev *d = (struct fl_dev *)dev;
 
-    if (!fl_base_is_dev_valid(b, d) || d->state == STATE_HANDSHAKED || d->state == STATE_PAIRING)
-        return ENOTCONN;
+    if (timeout < FELINK_TIMEOUT_MIN || timeout > FELINK_TIMEOUT_MAX)
+        return ERANGE;
 
-    d->tx_packet_count = 0;
-    d->tx_packet_loss = 0;
+    pthread_mutex_lock(&b->tx_mutex);
+    int is_valid = fl_dev_is_valid(b, d);
+    if (is_valid)
+        d->timeout = timeout;
+    pthread_mutex_unlock(&b->tx_mutex);
 
-    return fl_ccmd_base_connect(b, d);
+    return is_valid ? 0 : ENOTCONN;
 }
 
-int fl_unpair(
+int fl_set_max_retrans(
     struct fl_base_i *base,
-    const struct fl_dev_i *dev)
+    const struct fl_dev_i *dev,
+    uint8_t max_retrans)
 {
     struct fl_base *b = (struct fl_base *)base;
     struct fl_dev *d = (struct fl_dev *)dev;
 
-    if (!fl_base_is_dev_valid(b, d) || d->state == STATE_HANDSHAKED)
-        return ENOTCONN;
+    if (max_retrans < 1 || max_retrans > FELINK_MAXRET_MAX)
+        return ERANGE;
 
-    return fl_ccmd_base_unpair(b, d);
+    pthread_mutex_lock(&b->tx_mutex);
+    int is_valid = fl_dev_is_valid(b, d);
+    if (is_valid)
+        d->max_retrans = max_retrans;
+    pthread_mutex_unlock(&b->tx_mutex);
+
+    return is_valid ? 0 : ENOTCONN;
 }
 
-int fl_data(
+int fl_set_tx_window(
     struct fl_base_i *base,
     const struct fl_dev_i *dev,
-    const uint8_t *data,
-    size_t count,
-    size_t padding_align,
-    int is_plaintext)
+    uint8_t tx_window)
 {
     struct fl_base *b = (struct fl_base *)base;
     struct fl_dev *d = (struct fl_dev *)dev;
 
-    if (!fl_base_is_dev_valid(b, d) || d->state != STATE_CONNECTED)
-        return ENOTCONN;
+    if (tx_window < 1 || tx_window > FELINK_TX_WINDOW_MAX)
+        return ERANGE;
 
-    int res = fl_dcmd_data(b, d, data, count, padding_align, is_plaintext);
-    return res;
+    pthread_mutex_lock(&b->tx_mutex);
+    int is_valid = fl_dev_is_valid(b, d);
+    if (is_valid)
+    {
+        d->tx_window = tx_window;
+        // 窗口变大时可立即发送排队的请求
+        pthread_cond_broadcast(&b->tx_cond);
+    }
+    pthread_mutex_unlock(&b->tx_mutex);
+
+    return is_valid ? 0 : ENOTCONN;
 }
 
-struct fl_base_i *fl_init(void)
+static pthread_once_t fl_global_init_once = PTHREAD_ONCE_INIT;
+
+// 进程内只做一次：XXTEA自检(NEON不一致时tea.c自行回退)，uECC改用熵池
+static void fl_global_init(void)
+{
+    fl_xxtea_self_check();
+    uECC_set_rng(fl_random_uecc);
+}
+
+static struct fl_base *fl_base_alloc(void)
 {
+    pthread_once(&fl_global_init_once, fl_global_init);
+
     struct fl_base *b = malloc(sizeof(struct fl_base));
+    if (b == NULL)
+        return NULL;
 
-    b->devs = malloc(8 * sizeof(struct fl_dev *));
+    b->devs = NULL;
     b->n_devs = 0;
+    b->devs_size = 0;
+    pthread_mutex_init(&b->pool_mutex, NULL);
+    for (int i = 0; i < FELINK_MSG_POOL_CLASSES; i++)
+    {
+        b->msg_free[i] = NULL;
+        b->n_msg_free[i] = 0;
+        b->n_msg_in_use[i] = 0;
+        b->msg_high_water[i] = 0;
+    }
+    b->n_msg_oversize = 0;
+    b->dev_chunks = NULL;
+    b->n_dev_chunks = 0;
+    b->dev_record_size = (fl_dev_record_name_offset() + FELINK_DEV_NAME_INLINE + 7) & ~(size_t)7;
+    b->dev_free = NULL;
+    b->n_dev_in_use = 0;
+    b->dev_high_water = 0;
+    b->dev_index = NULL;
+    b->dev_index_size = 0;
+    b->n_dev_index_used = 0;
+    b->n_dev_index_filled = 0;
+    pthread_mutex_init(&b->journal_mutex, NULL);
+    b->journal_ids = NULL;
+    b->n_journal_ids = 0;
+    b->journal_ids_size = 0;
+    b->salt_table = NULL;
+    b->n_salt_slots = 0;
+    b->salt_slot_hint = 0;
+    b->is_salt_table_dirty = 0;
+    b->sav_map = NULL;
+    b->sav_map_size = 0;
     b->tx_func = NULL;
     b->tx_func_private_arg = NULL;
+    pthread_mutex_init(&b->tx_func_mutex, NULL);
+    pthread_mutex_init(&b->tx_mutex, NULL);
+    pthread_cond_init(&b->tx_cond, NULL);
+    b->is_tx_thread_stop = 0;
+    b->tx_rr_index = 0;
+    b->dev_gen = 0;
+    b->tx_busy_dev = NULL;
     b->devs_change_callback = NULL;
     b->devs_change_private_arg = NULL;
+    b->stats_callback = NULL;
+    b->stats_private_arg = NULL;
+    b->pri_key = NULL;
+    b->pub_key = NULL;
+
+    if (pthread_create(&b->tx_thread, NULL, fl_tx_thread, b))
+    {
+        pthread_cond_destroy(&b->tx_cond);
+        pthread_mutex_destroy(&b->tx_mutex);
+        pthread_mutex_destroy(&b->tx_func_mutex);
+        pthread_mutex_destroy(&b->pool_mutex);
+        pthread_mutex_destroy(&b->journal_mutex);
+        free(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+struct fl_base_i *fl_init(void)
+{
+    struct fl_base *b = fl_base_alloc();
+    if (b == NULL)
+        return NULL;
+
     b->pri_key = malloc(FELINK_uECC_PRI_KEY_SIZE);
     b->pub_key = malloc(FELINK_uECC_PUB_KEY_SIZE);
     int res = uECC_make_key(b->pub_key, b->pri_key, FELINK_uECC_CURVE);
     if (res == 0)
     {
-        free(b);
+        fl_delete((struct fl_base_i *)b);
         return NULL;
     }
 
@@ -826,11 +2235,40 @@ void fl_delete(
 {
     struct fl_base *b = (struct fl_base *)base;
 
+    pthread_mutex_lock(&b->tx_mutex);
+    b->salt_table = NULL;
+    b->is_tx_thread_stop = 1;
+    pthread_cond_broadcast(&b->tx_cond);
+    pthread_mutex_unlock(&b->tx_mutex);
+    pthread_join(b->tx_thread, NULL);
+
     for (int i = b->n_devs - 1; i >= 0; i--)
         fl_dev_remove(b->devs[i]);
     free(b->devs);
+    free(b->dev_index);
+    if (b->sav_map != NULL)
+        munmap((void *)b->sav_map, b->sav_map_size);
+    for (int i = 0; i < FELINK_MSG_POOL_CLASSES; i++)
+        while (b->msg_free[i] != NULL)
+        {
+            struct fl_msg_t *msg = b->msg_free[i];
+            b->msg_free[i] = msg->next_free;
+            free(msg);
+        }
+    while (b->dev_chunks != NULL)
+    {
+        struct fl_dev_chunk *chunk = b->dev_chunks;
+        b->dev_chunks = chunk->next;
+        free(chunk);
+    }
+    pthread_mutex_destroy(&b->pool_mutex);
+    free(b->journal_ids);
+    pthread_mutex_destroy(&b->journal_mutex);
     free(b->pri_key);
     free(b->pub_key);
+    pthread_cond_destroy(&b->tx_cond);
+    pthread_mutex_destroy(&b->tx_mutex);
+    pthread_mutex_destroy(&b->tx_func_mutex);
     free(b);
 }
 
@@ -841,8 +2279,10 @@ void fl_set_tx_func(
 {
     struct fl_base *b = (struct fl_base *)base;
 
+    pthread_mutex_lock(&b->tx_func_mutex);
     b->tx_func = func;
     b->tx_func_private_arg = private_arg;
+    pthread_mutex_unlock(&b->tx_func_mutex);
 }
 
 void fl_set_devs_change_callback(
@@ -856,7 +2296,122 @@ void fl_set_devs_change_callback(
     b->devs_change_private_arg = private_arg;
 }
 
-/*  .sav
+void fl_set_stats_callback(
+    struct fl_base_i *base,
+    fl_stats_callback_t callback,
+    void *private_arg)
+{
+    struct fl_base *b = (struct fl_base *)base;
+
+    b->stats_callback = callback;
+    b->stats_private_arg = private_arg;
+}
+
+static int fl_salt_table_is_valid(
+    const uint8_t *table,
+    size_t n_slots)
+{
+    return strncmp((const char *)table, "FLST", 4) == 0 &&
+           fl_rd16(&table[4]) == FL_SALT_TABLE_VERSION &&
+           fl_rd16(&table[6]) == FELINK_SALT_SLOT_SIZE &&
+           fl_rd32(&table[8]) == n_slots &&
+           fl_rd32(&table[12]) == fl_salt_check(fl_rd32(&table[0]), fl_rd32(&table[4]), fl_rd32(&table[8]), 0);
+}
+
+int fl_set_salt_table(
+    struct fl_base_i *base,
+    void *table,
+    size_t size)
+{
+    struct fl_base *b = (struct fl_base *)base;
+    uint8_t *t = table;
+    size_t n_slots = size > FELINK_SALT_TABLE_SIZE(0) ? (size - FELINK_SALT_TABLE_SIZE(0)) / FELINK_SALT_SLOT_SIZE : 0;
+    if (t != NULL && n_slots == 0)
+        return EINVAL;
+
+    pthread_mutex_lock(&b->tx_mutex);
+    // 仅首次设置时以表恢复，之后更换的新表由当前状态重写
+    int is_restore = b->salt_table == NULL && t != NULL && fl_salt_table_is_valid(t, n_slots);
+    for (int i = 0; i < b->n_devs; i++)
+        b->devs[i]->salt_slot = -1;
+    b->salt_table = t;
+    b->n_salt_slots = n_slots;
+    b->salt_slot_hint = 0;
+    if (t == NULL)
+    {
+        pthread_mutex_unlock(&b->tx_mutex);
+        return 0;
+    }
+
+    if (is_restore)
+        for (size_t i = 0; i < n_slots; i++)
+        {
+            uint8_t *slot = fl_salt_slot(b, i);
+            if (!fl_rd32(&slot[4]))
+                continue;
+            const uint8_t *copy = fl_salt_slot_latest(slot);
+            struct fl_dev *d = fl_dev_index_get(b, fl_rd32(slot));
+            if (copy == NULL || d == NULL || d->salt_slot >= 0 || d->state < STATE_PAIRED)
+            {
+                memset(slot, 0, FELINK_SALT_SLOT_SIZE);
+                continue;
+            }
+            d->salt_slot = i;
+            d->salt_seq = fl_rd16(&copy[8]);
+            d->connect_count = fl_rd32(&copy[0]);
+            d->salt = fl_rd32(&copy[4]);
+            d->tx_salt = d->salt;
+            if (fl_rd32(&slot[4]) == FL_SALT_SLOT_CONNECTED)
+                d->state = STATE_CONNECTED;
+        }
+    else
+    {
+        memset(t, 0, size);
+        memcpy(t, "FLST", 4);
+        fl_wr16(&t[4], FL_SALT_TABLE_VERSION);
+        fl_wr16(&t[6], FELINK_SALT_SLOT_SIZE);
+        fl_wr32(&t[8], n_slots);
+        fl_wr32(&t[12], fl_salt_check(fl_rd32(&t[0]), fl_rd32(&t[4]), fl_rd32(&t[8]), 0));
+    }
+    for (int i = 0; i < b->n_devs; i++)
+        if (b->devs[i]->salt_slot < 0)
+            fl_salt_slot_sync(b, b->devs[i]);
+    b->is_salt_table_dirty = 1;
+    pthread_mutex_unlock(&b->tx_mutex);
+
+    return 0;
+}
+
+int fl_salt_table_take_dirty(
+    struct fl_base_i *base)
+{
+    struct fl_base *b = (struct fl_base *)base;
+    return __atomic_exchange_n(&b->is_salt_table_dirty, 0, __ATOMIC_ACQ_REL);
+}
+
+void fl_get_mem_stats(
+    struct fl_base_i *base,
+    struct fl_mem_stats *stats)
+{
+    struct fl_base *b = (struct fl_base *)base;
+
+    pthread_mutex_lock(&b->pool_mutex);
+    for (int i = 0; i < FELINK_MSG_POOL_CLASSES; i++)
+    {
+        stats->msg_class_size[i] = fl_msg_pool_class_size[i];
+        stats->msg_in_use[i] = b->n_msg_in_use[i];
+        stats->msg_high_water[i] = b->msg_high_water[i];
+        stats->msg_free[i] = b->n_msg_free[i];
+    }
+    stats->msg_oversize = b->n_msg_oversize;
+    stats->dev_in_use = b->n_dev_in_use;
+    stats->dev_high_water = b->dev_high_water;
+    stats->dev_chunks = b->n_dev_chunks;
+    stats->dev_record_size = b->dev_record_size;
+    pthread_mutex_unlock(&b->pool_mutex);
+}
+
+/*  .sav v1 (仅用于读取旧存档，其设备记录也是.jnl中PUT的格式)
     char[]  FELK
     u32     len
     u8      chksum8
@@ -875,7 +2430,148 @@ void fl_set_devs_change_callback(
         char[]  name
     }
 */
-struct fl_base_i *fl_load(
+
+/*  .sav v2
+    可直接mmap使用，各字段按自身大小对齐，设备记录定长，设备名原地引用
+    char[]  FLSV
+    u16     format_version  FL_SAV_VERSION
+    u16     ecc_curve_len
+    u32     len             4的倍数
+    u32     chksum32        全文按u32累加后为0xFFFFFFFF
+    u32     n_paired_devs
+    u32     devs_offset
+    u32     strs_offset
+    u8[]    pri_key
+    u8[]    pub_key
+    paired_devs[]           自devs_offset起，每项fl_sav_dev_stride()字节
+    {
+        u32     id
+        u32     type
+        u32     connect_count
+        u32     name_offset     相对文件头
+        u16     version
+        u16     name_len        不含'\0'
+        u8[]    tea_key         补齐到4字节
+    }
+    char[]  strs            自strs_offset起，以'\0'结尾的设备名
+*/
+
+/*  .jnl
+    由autosave追加写入，按顺序重放，记录均为设备的最终状态，重复重放结果不变
+    records[]
+    {
+        u32     len         含记录头
+        u8      chksum8
+        u8      op          FL_JOURNAL_PUT 或 FL_JOURNAL_DEL
+        u8[]    body        PUT为v1 .sav中paired_devs[]的一项，DEL为u32 id
+    }
+*/
+
+#define FL_SAV_VERSION 2
+#define FL_SAV_HEAD_SIZE 28
+
+enum
+{
+    FL_JOURNAL_PUT = 0,
+    FL_JOURNAL_DEL = 1,
+};
+
+#define FL_JOURNAL_HEAD_SIZE 6
+
+static size_t fl_sav_align4(size_t len)
+{
+    return (len + 3) & ~(size_t)3;
+}
+
+static size_t fl_sav_dev_stride(void)
+{
+    return 20 + fl_sav_align4(FELINK_uECC_CURVE_SIZE);
+}
+
+static uint32_t fl_chksum32(const uint8_t *bytes, size_t len)
+{
+    uint32_t chksum32 = 0;
+    for (size_t i = 0; i < len; i += 4)
+        chksum32 += fl_rd32(&bytes[i]);
+    return ~chksum32;
+}
+
+static size_t fl_sav_v1_dev_len(const struct fl_dev *d)
+{
+    return 15 + FELINK_uECC_CURVE_SIZE + strlen(d->name) + 1;
+}
+
+static uint8_t *fl_sav_v1_dev_write(uint8_t *ptr, const struct fl_dev *d)
+{
+    size_t ecc_curve_len = FELINK_uECC_CURVE_SIZE;
+
+    fl_wr32(ptr, d->id);
+    ptr += 4;
+    fl_wr32(ptr, d->type);
+    ptr += 4;
+    fl_wr16(ptr, d->version);
+    ptr += 2;
+    fl_wr32(ptr, d->connect_count);
+    ptr += 4;
+    *ptr++ = (uint8_t)ecc_curve_len;
+    memcpy(ptr, d->tea_key, ecc_curve_len);
+    ptr += ecc_curve_len;
+    strcpy((char *)ptr, d->name);
+    ptr += strlen(d->name) + 1;
+    return ptr;
+}
+
+// 解析一项设备记录并新建或覆盖同id设备，返回下一项的位置，记录不完整返回NULL
+static const uint8_t *fl_sav_v1_dev_read(
+    struct fl_base *b,
+    const uint8_t *ptr,
+    const uint8_t *end)
+{
+    size_t ecc_curve_len = FELINK_uECC_CURVE_SIZE;
+
+    if (end - ptr < 15)
+        return NULL;
+    uint32_t id = fl_rd32(ptr);
+    ptr += 4;
+    uint32_t type = fl_rd32(ptr);
+    ptr += 4;
+    uint16_t version = fl_rd16(ptr);
+    ptr += 2;
+    uint32_t connect_count = fl_rd32(ptr);
+    ptr += 4;
+    uint8_t tea_key_len = *ptr++;
+    if (end - ptr < tea_key_len)
+        return NULL;
+    const uint8_t *tea_key = ptr;
+    ptr += tea_key_len;
+    const char *name = (const char *)ptr;
+    ptr = memchr(ptr, '\0', end - ptr);
+    if (ptr == NULL)
+        return NULL;
+    ptr++;
+    if (tea_key_len != ecc_curve_len)
+        return ptr;
+
+    struct fl_dev *d = fl_base_get_dev_by_id(b, id);
+    if (d != NULL && strcmp(d->name, name) != 0)
+    {
+        fl_dev_remove(d);
+        d = NULL;
+    }
+    if (d == NULL)
+        d = fl_dev_add(b, id, type, version, name);
+    if (d == NULL)
+        return ptr;
+    d->type = type;
+    d->version = version;
+    memcpy(d->tea_key, tea_key, ecc_curve_len);
+    fl_dev_crypto_reset(d);
+    d->connect_count = connect_count;
+    d->state = STATE_PAIRED;
+    return ptr;
+}
+
+static struct fl_base *fl_load_v1(
     const uint8_t *sav,
     size_t count)
 {
@@ -883,12 +2579,12 @@ struct fl_base_i *fl_load(
 
     const uint8_t *ptr = sav;
 
-    if (strncmp((char *)ptr, "FELK", 4))
+    if (count < 14 + pri_key_len + pub_key_len)
         return NULL;
     ptr += 4;
 
     uint32_t len = fl_rd32(ptr);
-    if (len > count)
+    if (len > count || len < 14 + pri_key_len + pub_key_len)
         return NULL;
     ptr += 4;
 
@@ -899,11 +2595,9 @@ struct fl_base_i *fl_load(
     if (*ptr++ != ecc_curve_len)
         return NULL;
 
-    struct fl_base *b = malloc(sizeof(struct fl_base));
-    b->tx_func = NULL;
-    b->tx_func_private_arg = NULL;
-    b->devs_change_callback = NULL;
-    b->devs_change_private_arg = NULL;
+    struct fl_base *b = fl_base_alloc();
+    if (b == NULL)
+        return NULL;
     b->pri_key = malloc(pri_key_len);
     memcpy(b->pri_key, ptr, pri_key_len);
     ptr += pri_key_len;
@@ -913,36 +2607,95 @@ struct fl_base_i *fl_load(
 
     uint32_t n_paired_devs = fl_rd32(ptr);
     ptr += 4;
-    b->devs = malloc(n_paired_devs * sizeof(struct fl_dev *));
-    for (int i = 0; i < n_paired_devs; i++)
+    for (int i = 0; i < n_paired_devs && ptr != NULL; i++)
+        ptr = fl_sav_v1_dev_read(b, ptr, sav + len);
+
+    return b;
+}
+
+// is_mapped时sav交由base在fl_delete时解除映射，设备名直接引用其中的字符串
+static struct fl_base *fl_load_v2(
+    const uint8_t *sav,
+    size_t count,
+    int is_mapped)
+{
+    size_t ecc_curve_len = FELINK_uECC_CURVE_SIZE, pri_key_len = FELINK_uECC_PRI_KEY_SIZE, pub_key_len = FELINK_uECC_PUB_KEY_SIZE;
+    size_t dev_stride = fl_sav_dev_stride();
+
+    if (count < FL_SAV_HEAD_SIZE ||
+        fl_rd16(&sav[4]) != FL_SAV_VERSION ||
+        fl_rd16(&sav[6]) != ecc_curve_len)
+        return NULL;
+    uint32_t len = fl_rd32(&sav[8]);
+    uint32_t n_paired_devs = fl_rd32(&sav[16]);
+    uint32_t devs_offset = fl_rd32(&sav[20]);
+    uint32_t strs_offset = fl_rd32(&sav[24]);
+    if (len > count || len % 4 != 0 ||
+        devs_offset < FL_SAV_HEAD_SIZE + pri_key_len + pub_key_len || devs_offset % 4 != 0 ||
+        devs_offset > strs_offset || strs_offset > len || n_paired_devs > (strs_offset - devs_offset) / dev_stride)
+        return NULL;
+    if (fl_chksum32(sav, len) != 0)
+        return NULL;
+
+    struct fl_base *b = fl_base_alloc();
+    if (b == NULL)
+        return NULL;
+    b->pri_key = malloc(pri_key_len);
+    memcpy(b->pri_key, &sav[FL_SAV_HEAD_SIZE], pri_key_len);
+    b->pub_key = malloc(pub_key_len);
+    memcpy(b->pub_key, &sav[FL_SAV_HEAD_SIZE + pri_key_len], pub_key_len);
+    if (is_mapped)
     {
-        uint32_t id = fl_rd32(ptr);
-        ptr += 4;
-        uint32_t type = fl_rd32(ptr);
-        ptr += 4;
-        uint16_t version = fl_rd16(ptr);
-        ptr += 2;
-        uint32_t connect_count = fl_rd32(ptr);
-        ptr += 4;
-        if (ecc_curve_len != *ptr)
-        {
-            ptr += 1 + *ptr;
-            ptr += strlen((char *)ptr) + 1;
-            continue;
-        }
+        b->sav_map = sav;
+        b->sav_map_size = count;
+    }
 
-        const uint8_t *tea_key = (uint8_t *)(ptr + 1);
-        ptr += 1 + *ptr;
-        const char *name = (const char *)ptr;
-        ptr += strlen((char *)ptr) + 1;
+    pthread_mutex_lock(&b->tx_mutex);
+    fl_devs_reserve(b, n_paired_devs);
+    for (uint32_t i = 0; i < n_paired_devs; i++)
+    {
+        const uint8_t *rec = &sav[devs_offset + i * dev_stride];
+        uint32_t name_offset = fl_rd32(&rec[12]);
+        uint16_t name_len = fl_rd16(&rec[18]);
+        if (name_offset < strs_offset || (size_t)name_offset + name_len >= len || sav[name_offset + name_len] != '\0')
+            continue;
 
-        struct fl_dev *d = fl_dev_add(b, id, type, version, name);
-        memcpy(d->tea_key, tea_key, ecc_curve_len);
-        d->connect_count = connect_count;
+        struct fl_dev *d = fl_dev_create(b, fl_rd32(&rec[0]), fl_rd32(&rec[4]), fl_rd16(&rec[16]), (const char *)&sav[name_offset], is_mapped, &rec[20]);
+        if (d == NULL)
+            break;
+        d->connect_count = fl_rd32(&rec[8]);
         d->state = STATE_PAIRED;
+        if (fl_dev_index_get(b, d->id) != NULL || fl_dev_insert(b, d))
+        {
+            fl_dev_name_free(b, d);
+            fl_dev_record_free(b, d);
+        }
     }
+    pthread_mutex_unlock(&b->tx_mutex);
 
-    return (struct fl_base_i *)b;
+    return b;
+}
+
+struct fl_base_i *fl_load(
+    const uint8_t *sav,
+    size_t count)
+{
+    if (count < 4)
+        return NULL;
+    if (strncmp((char *)sav, "FELK", 4) == 0)
+        return (struct fl_base_i *)fl_load_v1(sav, count);
+    if (strncmp((char *)sav, "FLSV", 4) == 0)
+        return (struct fl_base_i *)fl_load_v2(sav, count, 0);
+    return NULL;
+}
+
+struct fl_base_i *fl_load_mapped(
+    const void *map,
+    size_t count)
+{
+    if (count < 4 || strncmp((char *)map, "FLSV", 4) != 0)
+        return NULL;
+    return (struct fl_base_i *)fl_load_v2(map, count, 1);
 }
 
 size_t fl_save(
@@ -952,9 +2705,13 @@ size_t fl_save(
     struct fl_base *b = (struct fl_base *)base;
 
     size_t ecc_curve_len = FELINK_uECC_CURVE_SIZE, pri_key_len = FELINK_uECC_PRI_KEY_SIZE, pub_key_len = FELINK_uECC_PUB_KEY_SIZE;
-    uint32_t len = 14 + pri_key_len + pub_key_len;
+    size_t dev_stride = fl_sav_dev_stride();
 
+    // 持锁期间的变化要么已写入存档，要么在清空后重新记入日志
+    pthread_mutex_lock(&b->tx_mutex);
+    pthread_mutex_lock(&b->journal_mutex);
     uint32_t n_paired_devs = 0;
+    size_t strs_len = 0;
     struct fl_dev *paired_devs[b->n_devs];
     for (int i = 0; i < b->n_devs; i++)
     {
@@ -962,43 +2719,145 @@ size_t fl_save(
         if (d->state == STATE_PAIRED || d->state == STATE_CONNECTED)
         {
             paired_devs[n_paired_devs++] = d;
-            len += 17 + ecc_curve_len + strlen(d->name) + 1;
+            strs_len += strlen(d->name) + 1;
         }
     }
+    uint32_t devs_offset = fl_sav_align4(FL_SAV_HEAD_SIZE + pri_key_len + pub_key_len);
+    uint32_t strs_offset = devs_offset + n_paired_devs * dev_stride;
+    uint32_t len = fl_sav_align4(strs_offset + strs_len);
 
-    *sav = malloc(len);
+    *sav = calloc(1, len);
+    if (*sav == NULL)
+    {
+        pthread_mutex_unlock(&b->journal_mutex);
+        pthread_mutex_unlock(&b->tx_mutex);
+        return 0;
+    }
     uint8_t *ptr = *sav;
 
-    strncpy((char *)ptr, "FELK", 4);
-    ptr += 4;
-    fl_wr32(ptr, len);
-    ptr += 4;
-    *ptr++ = 0;
-    *ptr++ = (uint8_t)ecc_curve_len;
-    memcpy(ptr, b->pri_key, pri_key_len);
-    ptr += pri_key_len;
-    memcpy(ptr, b->pub_key, pub_key_len);
-    ptr += pub_key_len;
-    fl_wr32(ptr, n_paired_devs);
-    ptr += 4;
+    memcpy(ptr, "FLSV", 4);
+    fl_wr16(&ptr[4], FL_SAV_VERSION);
+    fl_wr16(&ptr[6], ecc_curve_len);
+    fl_wr32(&ptr[8], len);
+    fl_wr32(&ptr[16], n_paired_devs);
+    fl_wr32(&ptr[20], devs_offset);
+    fl_wr32(&ptr[24], strs_offset);
+    memcpy(&ptr[FL_SAV_HEAD_SIZE], b->pri_key, pri_key_len);
+    memcpy(&ptr[FL_SAV_HEAD_SIZE + pri_key_len], b->pub_key, pub_key_len);
+    uint32_t name_offset = strs_offset;
     for (int i = 0; i < n_paired_devs; i++)
     {
         struct fl_dev *d = paired_devs[i];
-        fl_wr32(ptr, d->id);
-        ptr += 4;
-        fl_wr32(ptr, d->type);
-        ptr += 4;
-        fl_wr16(ptr, d->version);
-        ptr += 2;
-        fl_wr32(ptr, d->connect_count);
-        ptr += 4;
-        *ptr++ = (uint8_t)ecc_curve_len;
-        memcpy(ptr, d->tea_key, ecc_curve_len);
-        ptr += ecc_curve_len;
-        strcpy((char *)ptr, d->name);
-        ptr += strlen(d->name) + 1;
-    }
-    (*sav)[8] = fl_chksum8(*sav, len);
+        uint8_t *rec = &ptr[devs_offset + i * dev_stride];
+        size_t name_len = strlen(d->name);
+        fl_wr32(&rec[0], d->id);
+        fl_wr32(&rec[4], d->type);
+        fl_wr32(&rec[8], d->connect_count);
+        fl_wr32(&rec[12], name_offset);
+        fl_wr16(&rec[16], d->version);
+        fl_wr16(&rec[18], name_len);
+        memcpy(&rec[20], d->tea_key, ecc_curve_len);
+        memcpy(&ptr[name_offset], d->name, name_len + 1);
+        name_offset += name_len + 1;
+    }
+    fl_wr32(&ptr[12], fl_chksum32(ptr, len));
+    b->n_journal_ids = 0;
+    pthread_mutex_unlock(&b->journal_mutex);
+    pthread_mutex_unlock(&b->tx_mutex);
+
+    return len;
+}
+
+size_t fl_save_journal(
+    struct fl_base_i *base,
+    uint8_t **jnl)
+{
+    struct fl_base *b = (struct fl_base *)base;
+
+    *jnl = NULL;
+    pthread_mutex_lock(&b->tx_mutex);
+    pthread_mutex_lock(&b->journal_mutex);
+    if (b->n_journal_ids == 0)
+        goto fl_save_journal_unlock;
+
+    size_t len = 0;
+    for (int i = 0; i < b->n_journal_ids; i++)
+    {
+        struct fl_dev *d = fl_dev_index_get(b, b->journal_ids[i]);
+        if (d != NULL && (d->state == STATE_PAIRED || d->state == STATE_CONNECTED))
+            len += FL_JOURNAL_HEAD_SIZE + fl_sav_v1_dev_len(d);
+        else
+            len += FL_JOURNAL_HEAD_SIZE + 4;
+    }
 
+    *jnl = malloc(len);
+    if (*jnl == NULL)
+        goto fl_save_journal_unlock;
+    uint8_t *ptr = *jnl;
+    for (int i = 0; i < b->n_journal_ids; i++)
+    {
+        uint8_t *rec = ptr;
+        struct fl_dev *d = fl_dev_index_get(b, b->journal_ids[i]);
+        ptr += FL_JOURNAL_HEAD_SIZE;
+        if (d != NULL && (d->state == STATE_PAIRED || d->state == STATE_CONNECTED))
+        {
+            rec[5] = FL_JOURNAL_PUT;
+            ptr = fl_sav_v1_dev_write(ptr, d);
+        }
+        else
+        {
+            rec[5] = FL_JOURNAL_DEL;
+            fl_wr32(ptr, b->journal_ids[i]);
+            ptr += 4;
+        }
+        fl_wr32(rec, ptr - rec);
+        rec[4] = 0;
+        rec[4] = fl_chksum8(rec, ptr - rec);
+    }
+    b->n_journal_ids = 0;
+    pthread_mutex_unlock(&b->journal_mutex);
+    pthread_mutex_unlock(&b->tx_mutex);
     return len;
+
+fl_save_journal_unlock:
+    pthread_mutex_unlock(&b->journal_mutex);
+    pthread_mutex_unlock(&b->tx_mutex);
+    return 0;
+}
+
+size_t fl_load_journal(
+    struct fl_base_i *base,
+    const uint8_t *jnl,
+    size_t count)
+{
+    struct fl_base *b = (struct fl_base *)base;
+    const uint8_t *ptr = jnl, *jnl_end = jnl + count;
+
+    // 末尾可能是写入一半的记录，遇到第一条不完整或校验失败的记录即停止
+    while (jnl_end - ptr >= FL_JOURNAL_HEAD_SIZE)
+    {
+        uint32_t len = fl_rd32(ptr);
+        if (len < FL_JOURNAL_HEAD_SIZE || len > jnl_end - ptr || fl_chksum8(ptr, len) != 0)
+            break;
+        const uint8_t *end = ptr + len;
+        if (ptr[5] == FL_JOURNAL_PUT)
+        {
+            if (fl_sav_v1_dev_read(b, ptr + FL_JOURNAL_HEAD_SIZE, end) == NULL)
+                break;
+        }
+        else if (ptr[5] == FL_JOURNAL_DEL)
+        {
+            if (len < FL_JOURNAL_HEAD_SIZE + 4)
+                break;
+            struct fl_dev *d = fl_base_get_dev_by_id(b, fl_rd32(ptr + FL_JOURNAL_HEAD_SIZE));
+            if (d != NULL)
+                fl_dev_remove(d);
+        }
+        ptr = end;
+    }
+
+    pthread_mutex_lock(&b->journal_mutex);
+    b->n_journal_ids = 0;
+    pthread_mutex_unlock(&b->journal_mutex);
+    return ptr - jnl;
 }
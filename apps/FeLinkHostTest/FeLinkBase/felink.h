@@ -30,6 +30,12 @@ typedef enum
     DEV_CHANGE_CONNECT_TIMEOUT = 6,
 } fl_dev_change_type;
 
+typedef enum
+{
+    FL_STATS_ENCRYPT = 0,
+    FL_STATS_ACK_RTT = 1,
+} fl_stats_type;
+
 struct fl_dev_i
 {
     const struct flbase *const base;
@@ -39,12 +45,13 @@ struct fl_dev_i
     const uint16_t version;
     const char *name;
     const fl_state state;
-    uint16_t timeout;
-    uint8_t max_retrans;
+    const uint16_t timeout;    // 由fl_set_timeout修改
+    const uint8_t max_retrans; // 由fl_set_max_retrans修改
     const time_t tx_packet_delay;
     const size_t tx_packet_count;
     const size_t tx_packet_loss;
     const uint32_t salt;
+    const uint8_t tx_window; // 由fl_set_tx_window修改
 };
 
 struct fl_base_i
@@ -53,8 +60,28 @@ struct fl_base_i
     const int n_devs;
 };
 
+struct fl_mem_stats
+{
+    size_t msg_class_size[FELINK_MSG_POOL_CLASSES];
+    size_t msg_in_use[FELINK_MSG_POOL_CLASSES];
+    size_t msg_high_water[FELINK_MSG_POOL_CLASSES];
+    size_t msg_free[FELINK_MSG_POOL_CLASSES];
+    size_t msg_oversize; // 超出最大尺寸级别直接分配的次数
+    size_t dev_in_use;
+    size_t dev_high_water;
+    size_t dev_chunks;
+    size_t dev_record_size;
+};
+
+#define FELINK_SALT_SLOT_SIZE 32
+#define FELINK_SALT_TABLE_SIZE(n_slots) (16 + (n_slots) * FELINK_SALT_SLOT_SIZE)
+
 typedef int (*fl_tx_func_t)(struct fl_dev_i *dev, uint8_t *buf, size_t count, void *private_arg);
 typedef void (*fl_devs_change_callback_t)(struct fl_base_i *base, struct fl_dev_i *dev, uint32_t old_id, fl_dev_change_type type, void *private_arg);
+// 在发送调度线程中调用，其中不可调用同步的fl_connect/fl_data(返回EDEADLK)
+typedef void (*fl_tx_done_callback_t)(struct fl_base_i *base, struct fl_dev_i *dev, int res, void *private_arg);
+// 持有发送锁时调用，不可阻塞；批量加密多个设备时dev为NULL，us为耗时(微秒)
+typedef void (*fl_stats_callback_t)(struct fl_base_i *base, struct fl_dev_i *dev, fl_stats_type type, uint32_t us, void *private_arg);
 
 int fl_receive_handler(
     struct fl_base_i *base,
@@ -71,6 +98,11 @@ int fl_pair(
 int fl_connect(
     struct fl_base_i *base,
     const struct fl_dev_i *dev);
+int fl_connect_async(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    fl_tx_done_callback_t callback,
+    void *private_arg);
 int fl_unpair(
     struct fl_base_i *base,
     const struct fl_dev_i *dev);
@@ -81,6 +113,30 @@ int fl_data(
     size_t count,
     size_t padding_align,
     int is_plaintext);
+int fl_data_async(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    const uint8_t *buf,
+    size_t count,
+    size_t padding_align,
+    int is_plaintext,
+    fl_tx_done_callback_t callback,
+    void *private_arg);
+// 持发送锁修改，超出FELINK_TIMEOUT_MIN~FELINK_TIMEOUT_MAX(ms)返回ERANGE，对已在窗口中的数据包从下次重传起生效
+int fl_set_timeout(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    uint16_t timeout);
+// 持发送锁修改，超出1~FELINK_MAXRET_MAX返回ERANGE
+int fl_set_max_retrans(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    uint8_t max_retrans);
+// 持发送锁修改，超出1~FELINK_TX_WINDOW_MAX返回ERANGE，已在窗口中的数据包不受影响
+int fl_set_tx_window(
+    struct fl_base_i *base,
+    const struct fl_dev_i *dev,
+    uint8_t tx_window);
 struct fl_base_i *fl_init(void);
 void fl_delete(
     struct fl_base_i *base);
@@ -92,11 +148,41 @@ void fl_set_devs_change_callback(
     struct fl_base_i *base,
     fl_devs_change_callback_t callback,
     void *private_arg);
+// 未设置时不计时
+void fl_set_stats_callback(
+    struct fl_base_i *base,
+    fl_stats_callback_t callback,
+    void *private_arg);
+// table为调用者映射的共享内存，salt/connect_count提交时原地更新，首次设置时以表中有效的槽恢复设备
+// 断开前已连接的设备恢复为已连接并沿用槽中的salt，设备已重启时第一个数据包超时后回到已配对
+int fl_set_salt_table(
+    struct fl_base_i *base,
+    void *table,
+    size_t size);
+// 返回并清除自上次调用后盐值表是否被修改
+int fl_salt_table_take_dirty(
+    struct fl_base_i *base);
+void fl_get_mem_stats(
+    struct fl_base_i *base,
+    struct fl_mem_stats *stats);
 struct fl_base_i *fl_load(
     const uint8_t *sav,
     size_t count);
+// 仅支持v2存档，map为mmap得到的只读映射，成功时交由base管理(设备名原地引用)，失败时由调用者解除映射
+struct fl_base_i *fl_load_mapped(
+    const void *map,
+    size_t count);
 size_t fl_save(
     struct fl_base_i *base,
     uint8_t **sav);
+// 导出自上次fl_save/fl_save_journal后变化的设备记录，无变化返回0
+size_t fl_save_journal(
+    struct fl_base_i *base,
+    uint8_t **jnl);
+// 在fl_load之后、设置回调与连接设备之前重放，返回完整记录的长度
+size_t fl_load_journal(
+    struct fl_base_i *base,
+    const uint8_t *jnl,
+    size_t count);
 
 #endif // !_FELINK_BASE_FELINK_
@@ -0,0 +1,224 @@
+#include "rng.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+/*  熵池
+    以ChaCha20密钥流作为缓冲池，池耗尽时生成新的一批密钥流，
+    并立即用其开头的密钥与nonce替换当前状态(快速密钥擦除)，已输出的数据无法回推
+    每输出FELINK_RNG_RESEED_BYTES字节或进程fork后从内核重新播种
+    内核熵源优先使用getrandom，不可用时使用常驻打开的/dev/urandom
+*/
+#define FL_RNG_KEY_SIZE 32
+#define FL_RNG_NONCE_SIZE 8
+#define FL_RNG_SEED_SIZE (FL_RNG_KEY_SIZE + FL_RNG_NONCE_SIZE)
+#define FL_RNG_BLOCK_SIZE 64
+
+#define FL_RNG_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define FL_RNG_QR(a, b, c, d)                                        \
+    do                                                               \
+    {                                                                \
+        a += b, d ^= a, d = FL_RNG_ROTL(d, 16);                      \
+        c += d, b ^= c, b = FL_RNG_ROTL(b, 12);                      \
+        a += b, d ^= a, d = FL_RNG_ROTL(d, 8);                       \
+        c += d, b ^= c, b = FL_RNG_ROTL(b, 7);                       \
+    } while (0)
+
+struct fl_rng
+{
+    pthread_mutex_t mutex;
+    uint32_t state[16];
+    uint8_t pool[FELINK_RNG_POOL_SIZE];
+    size_t pool_left;
+    size_t n_since_reseed;
+    int fd;
+    char is_seeded;
+    char is_forked; // 由pthread_atfork的子进程回调置位，下次取数时重新播种
+};
+
+static struct fl_rng fl_rng = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+static pthread_once_t fl_rng_atfork_once = PTHREAD_ONCE_INIT;
+
+// fork时持有mutex，子进程中不会留下其它线程持有的锁
+static void fl_rng_atfork_prepare(void)
+{
+    pthread_mutex_lock(&fl_rng.mutex);
+}
+
+static void fl_rng_atfork_parent(void)
+{
+    pthread_mutex_unlock(&fl_rng.mutex);
+}
+
+static void fl_rng_atfork_child(void)
+{
+    fl_rng.is_forked = 1;
+    pthread_mutex_unlock(&fl_rng.mutex);
+}
+
+static void fl_rng_atfork_register(void)
+{
+    pthread_atfork(fl_rng_atfork_prepare, fl_rng_atfork_parent, fl_rng_atfork_child);
+}
+
+static uint32_t fl_rng_rd32(const uint8_t *buf)
+{
+    return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static void fl_rng_wr32(uint8_t *buf, uint32_t v)
+{
+    buf[0] = v;
+    buf[1] = v >> 8;
+    buf[2] = v >> 16;
+    buf[3] = v >> 24;
+}
+
+static void fl_rng_block(const uint32_t state[16], uint8_t out[FL_RNG_BLOCK_SIZE])
+{
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        FL_RNG_QR(x[0], x[4], x[8], x[12]);
+        FL_RNG_QR(x[1], x[5], x[9], x[13]);
+        FL_RNG_QR(x[2], x[6], x[10], x[14]);
+        FL_RNG_QR(x[3], x[7], x[11], x[15]);
+        FL_RNG_QR(x[0], x[5], x[10], x[15]);
+        FL_RNG_QR(x[1], x[6], x[11], x[12]);
+        FL_RNG_QR(x[2], x[7], x[8], x[13]);
+        FL_RNG_QR(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++)
+        fl_rng_wr32(&out[i * 4], x[i] + state[i]);
+}
+
+static void fl_rng_set_key(struct fl_rng *r, const uint8_t seed[FL_RNG_SEED_SIZE])
+{
+    // "expand 32-byte k"
+    r->state[0] = 0x61707865;
+    r->state[1] = 0x3320646e;
+    r->state[2] = 0x79622d32;
+    r->state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        r->state[4 + i] = fl_rng_rd32(&seed[i * 4]);
+    r->state[12] = 0;
+    r->state[13] = 0;
+    r->state[14] = fl_rng_rd32(&seed[FL_RNG_KEY_SIZE]);
+    r->state[15] = fl_rng_rd32(&seed[FL_RNG_KEY_SIZE + 4]);
+}
+
+static int fl_rng_kernel_read(struct fl_rng *r, uint8_t *dest, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = -1;
+        if (r->fd < 0)
+        {
+            n = getrandom(dest, size, 0);
+            if (n < 0 && errno == ENOSYS)
+            {
+                r->fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+                if (r->fd < 0)
+                {
+                    perror("no random generator");
+                    return EIO;
+                }
+            }
+        }
+        if (r->fd >= 0)
+            n = read(r->fd, dest, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return EIO;
+        dest += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int fl_rng_reseed(struct fl_rng *r)
+{
+    uint8_t seed[FL_RNG_SEED_SIZE];
+    int res = fl_rng_kernel_read(r, seed, sizeof(seed));
+    if (res)
+        return res;
+
+    // 已播种时与当前密钥流混合，内核熵源本身有问题时也不会更差
+    if (r->is_seeded)
+    {
+        uint8_t block[FL_RNG_BLOCK_SIZE];
+        fl_rng_block(r->state, block);
+        for (int i = 0; i < FL_RNG_SEED_SIZE; i++)
+            seed[i] ^= block[i];
+        memset(block, 0, sizeof(block));
+    }
+    fl_rng_set_key(r, seed);
+    memset(seed, 0, sizeof(seed));
+
+    memset(r->pool, 0, sizeof(r->pool));
+    r->pool_left = 0;
+    r->n_since_reseed = 0;
+    r->is_seeded = 1;
+    r->is_forked = 0;
+    return 0;
+}
+
+static void fl_rng_refill(struct fl_rng *r)
+{
+    for (size_t i = 0; i < FELINK_RNG_POOL_SIZE; i += FL_RNG_BLOCK_SIZE)
+    {
+        fl_rng_block(r->state, &r->pool[i]);
+        if (++r->state[12] == 0)
+            r->state[13]++;
+    }
+
+    fl_rng_set_key(r, r->pool);
+    memset(r->pool, 0, FL_RNG_SEED_SIZE);
+    r->pool_left = FELINK_RNG_POOL_SIZE - FL_RNG_SEED_SIZE;
+}
+
+int fl_random(uint8_t *dest, size_t size)
+{
+    struct fl_rng *r = &fl_rng;
+    int res = 0;
+
+    pthread_once(&fl_rng_atfork_once, fl_rng_atfork_register);
+    pthread_mutex_lock(&r->mutex);
+    if (!r->is_seeded || r->is_forked || r->n_since_reseed >= FELINK_RNG_RESEED_BYTES)
+        res = fl_rng_reseed(r);
+
+    while (res == 0 && size > 0)
+    {
+        if (r->pool_left == 0)
+            fl_rng_refill(r);
+
+        size_t n = size < r->pool_left ? size : r->pool_left;
+        uint8_t *src = &r->pool[FELINK_RNG_POOL_SIZE - r->pool_left];
+        memcpy(dest, src, n);
+        memset(src, 0, n);
+        r->pool_left -= n;
+        r->n_since_reseed += n;
+        dest += n;
+        size -= n;
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    return res;
+}
+
+int fl_random_uecc(uint8_t *dest, unsigned size)
+{
+    return fl_random(dest, size) == 0;
+}
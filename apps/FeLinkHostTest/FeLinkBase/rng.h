@@ -0,0 +1,11 @@
+#ifndef _FELINK_BASE_RNG_
+#define _FELINK_BASE_RNG_
+
+#include "felink.h"
+
+// 线程安全，由内核熵源播种的ChaCha20缓冲池提供
+int fl_random(uint8_t *dest, size_t size);
+// 供uECC_set_rng使用，成功返回1
+int fl_random_uecc(uint8_t *dest, unsigned size);
+
+#endif // !_FELINK_BASE_RNG_
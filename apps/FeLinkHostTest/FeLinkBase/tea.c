@@ -1,9 +1,20 @@
 #include "tea.h"
 #include <string.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define MX (((z >> 5) ^ (y << 2)) + ((y >> 3) ^ (z << 4))) ^ ((sum ^ y) + (key[(p & 3) ^ e] ^ z))
 #define DELTA 0x9e3779b9
 
+#define FL_XXTEA_LANES 4
+// 多通道的缓冲区大小固定在栈上，更长的数据包用标量实现
+#define FL_XXTEA_LANES_DWORD_MAX 64
+
+// 启动自检未通过时回退到标量实现
+static int fl_xxtea_is_neon_ok = 1;
+
 int fl_xxtea_encrypt(uint32_t *plaintext, size_t dword_len, uint32_t *key)
 {
     uint32_t *buf = (uint32_t *)plaintext;
@@ -60,6 +71,189 @@ int fl_xxtea_decrypt(uint32_t *ciphetext, size_t dword_len, uint32_t *key)
     return 0;
 }
 
+#if defined(__ARM_NEON)
+#define MX_NEON                                                             \
+    veorq_u32(                                                              \
+        vaddq_u32(                                                          \
+            veorq_u32(vshrq_n_u32(z, 5), vshlq_n_u32(y, 2)),                \
+            veorq_u32(vshrq_n_u32(y, 3), vshlq_n_u32(z, 4))),               \
+        vaddq_u32(veorq_u32(sumv, y), veorq_u32(keyv[(p & 3) ^ e], z)))
+
+/*  4个等长的独立数据包各占一个通道同时加解密
+    XXTEA同一数据包内各字前后依赖，只能在数据包之间并行
+*/
+static void fl_xxtea_neon_load(
+    uint32x4_t *v,
+    uint32_t *const *bufs,
+    size_t dword_len)
+{
+    uint32_t lane[FL_XXTEA_LANES];
+    for (size_t p = 0; p < dword_len; p++)
+    {
+        for (int i = 0; i < FL_XXTEA_LANES; i++)
+            lane[i] = bufs[i][p];
+        v[p] = vld1q_u32(lane);
+    }
+}
+
+static void fl_xxtea_neon_store(
+    uint32_t *const *bufs,
+    const uint32x4_t *v,
+    size_t dword_len)
+{
+    uint32_t lane[FL_XXTEA_LANES];
+    for (size_t p = 0; p < dword_len; p++)
+    {
+        vst1q_u32(lane, v[p]);
+        for (int i = 0; i < FL_XXTEA_LANES; i++)
+            bufs[i][p] = lane[i];
+    }
+}
+
+static void fl_xxtea_neon_encrypt_x4(uint32_t *const *bufs, size_t dword_len, uint32_t *const *keys)
+{
+    size_t n = dword_len - 1, p;
+    uint32_t q = 6 + 52 / (n + 1), sum = 0, e;
+    uint32x4_t v[FL_XXTEA_LANES_DWORD_MAX], keyv[4], y, z, sumv;
+
+    fl_xxtea_neon_load(keyv, keys, 4);
+    fl_xxtea_neon_load(v, bufs, dword_len);
+
+    z = v[n];
+    while (0 < q--)
+    {
+        sum += DELTA;
+        e = sum >> 2 & 3;
+        sumv = vdupq_n_u32(sum);
+
+        for (p = 0; p < n; p++)
+        {
+            y = v[p + 1];
+            z = v[p] = vaddq_u32(v[p], MX_NEON);
+        }
+
+        y = v[0];
+        z = v[n] = vaddq_u32(v[n], MX_NEON);
+    }
+
+    fl_xxtea_neon_store(bufs, v, dword_len);
+}
+
+static void fl_xxtea_neon_decrypt_x4(uint32_t *const *bufs, size_t dword_len, uint32_t *const *keys)
+{
+    size_t n = dword_len - 1, p;
+    uint32_t q = 6 + 52 / (n + 1), sum = q * DELTA, e;
+    uint32x4_t v[FL_XXTEA_LANES_DWORD_MAX], keyv[4], y, z, sumv;
+
+    fl_xxtea_neon_load(keyv, keys, 4);
+    fl_xxtea_neon_load(v, bufs, dword_len);
+
+    y = v[0];
+    while (sum != 0)
+    {
+        e = sum >> 2 & 3;
+        sumv = vdupq_n_u32(sum);
+
+        for (p = n; p > 0; p--)
+        {
+            z = v[p - 1];
+            y = v[p] = vsubq_u32(v[p], MX_NEON);
+        }
+
+        z = v[n];
+        y = v[0] = vsubq_u32(v[0], MX_NEON);
+        sum -= DELTA;
+    }
+
+    fl_xxtea_neon_store(bufs, v, dword_len);
+}
+#endif
+
+int fl_xxtea_encrypt_lanes(uint32_t *const *bufs, size_t dword_len, uint32_t *const *keys, size_t n)
+{
+    if (dword_len < 2)
+        return ENODATA;
+
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    if (fl_xxtea_is_neon_ok && dword_len <= FL_XXTEA_LANES_DWORD_MAX)
+        for (; i + FL_XXTEA_LANES <= n; i += FL_XXTEA_LANES)
+            fl_xxtea_neon_encrypt_x4(&bufs[i], dword_len, &keys[i]);
+#endif
+    for (; i < n; i++)
+        fl_xxtea_encrypt(bufs[i], dword_len, keys[i]);
+
+    return 0;
+}
+
+int fl_xxtea_decrypt_lanes(uint32_t *const *bufs, size_t dword_len, uint32_t *const *keys, size_t n)
+{
+    if (dword_len < 2)
+        return ENODATA;
+
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    if (fl_xxtea_is_neon_ok && dword_len <= FL_XXTEA_LANES_DWORD_MAX)
+        for (; i + FL_XXTEA_LANES <= n; i += FL_XXTEA_LANES)
+            fl_xxtea_neon_decrypt_x4(&bufs[i], dword_len, &keys[i]);
+#endif
+    for (; i < n; i++)
+        fl_xxtea_decrypt(bufs[i], dword_len, keys[i]);
+
+    return 0;
+}
+
+int fl_xxtea_self_check(void)
+{
+    uint32_t bufs[FL_XXTEA_LANES + 1][13];
+    uint32_t ref[FL_XXTEA_LANES + 1][13];
+    uint32_t keys[FL_XXTEA_LANES + 1][4];
+    uint32_t *buf_ptrs[FL_XXTEA_LANES + 1];
+    uint32_t *key_ptrs[FL_XXTEA_LANES + 1];
+
+    // 固定的伪随机测试向量，长度覆盖最短的2字与奇数字长
+    uint32_t x = 0x2545F491;
+    for (int i = 0; i <= FL_XXTEA_LANES; i++)
+    {
+        for (int j = 0; j < 13; j++)
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            bufs[i][j] = ref[i][j] = x;
+        }
+        for (int j = 0; j < 4; j++)
+            keys[i][j] = x * (j + 3) + i;
+        buf_ptrs[i] = bufs[i];
+        key_ptrs[i] = keys[i];
+    }
+
+    const size_t lens[] = {2, 13};
+    for (size_t k = 0; k < sizeof(lens) / sizeof(lens[0]); k++)
+    {
+        fl_xxtea_encrypt_lanes(buf_ptrs, lens[k], key_ptrs, FL_XXTEA_LANES + 1);
+        for (int i = 0; i <= FL_XXTEA_LANES; i++)
+        {
+            uint32_t expect[13];
+            memcpy(expect, ref[i], sizeof(expect));
+            fl_xxtea_encrypt(expect, lens[k], keys[i]);
+            if (memcmp(expect, bufs[i], lens[k] * 4) != 0)
+            {
+                fl_xxtea_is_neon_ok = 0;
+                return EIO;
+            }
+        }
+        fl_xxtea_decrypt_lanes(buf_ptrs, lens[k], key_ptrs, FL_XXTEA_LANES + 1);
+        if (memcmp(bufs, ref, sizeof(bufs)) != 0)
+        {
+            fl_xxtea_is_neon_ok = 0;
+            return EIO;
+        }
+    }
+
+    return 0;
+}
+
 int fl_xxtea_byte_array_encrypt(uint8_t *plaintext, size_t byte_len, uint32_t *key)
 {
     if (byte_len % 4 != 0)
@@ -89,3 +283,35 @@ int fl_xxtea_byte_array_decrypt(uint8_t *ciphetext, size_t byte_len, uint32_t *k
 
     return res;
 }
+
+int fl_xxtea_byte_array_encrypt_lanes(uint8_t *const *plaintexts, size_t byte_len, uint32_t *const *keys, size_t n)
+{
+    if (byte_len % 4 != 0 || byte_len < 8)
+        return ENODATA;
+
+    size_t dword_len = byte_len / 4;
+    if (dword_len > FL_XXTEA_LANES_DWORD_MAX)
+    {
+        for (size_t i = 0; i < n; i++)
+            fl_xxtea_byte_array_encrypt(plaintexts[i], byte_len, keys[i]);
+        return 0;
+    }
+
+    //字节对齐
+    uint32_t buf[FL_XXTEA_LANES][FL_XXTEA_LANES_DWORD_MAX];
+    uint32_t *buf_ptrs[FL_XXTEA_LANES];
+    for (int i = 0; i < FL_XXTEA_LANES; i++)
+        buf_ptrs[i] = buf[i];
+
+    for (size_t i = 0; i < n; i += FL_XXTEA_LANES)
+    {
+        size_t m = n - i < FL_XXTEA_LANES ? n - i : FL_XXTEA_LANES;
+        for (size_t j = 0; j < m; j++)
+            memcpy(buf[j], plaintexts[i + j], byte_len);
+        fl_xxtea_encrypt_lanes(buf_ptrs, dword_len, &keys[i], m);
+        for (size_t j = 0; j < m; j++)
+            memcpy(plaintexts[i + j], buf[j], byte_len);
+    }
+
+    return 0;
+}
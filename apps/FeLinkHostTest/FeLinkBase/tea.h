@@ -5,7 +5,13 @@
 
 int fl_xxtea_encrypt(uint32_t *buf, size_t len, uint32_t *key);
 int fl_xxtea_decrypt(uint32_t *buf, size_t len, uint32_t *key);
+// 多个等长的独立数据包各用各的密钥，ARM NEON下每4个一组并行
+int fl_xxtea_encrypt_lanes(uint32_t *const *bufs, size_t dword_len, uint32_t *const *keys, size_t n);
+int fl_xxtea_decrypt_lanes(uint32_t *const *bufs, size_t dword_len, uint32_t *const *keys, size_t n);
+// 与标量实现比对，不一致时返回EIO并回退到标量实现
+int fl_xxtea_self_check(void);
 int fl_xxtea_byte_array_encrypt(uint8_t *plaintext, size_t byte_len, uint32_t *key);
 int fl_xxtea_byte_array_decrypt(uint8_t *ciphetext, size_t byte_len, uint32_t *key);
+int fl_xxtea_byte_array_encrypt_lanes(uint8_t *const *plaintexts, size_t byte_len, uint32_t *const *keys, size_t n);
 
 #endif // !_FELINK_DEV_TEA_
@@ -3,6 +3,25 @@
 
 #define FELINK_DEFAULT_TIMEOUT  100
 #define FELINK_DEFAULT_MAXRET   4
+#define FELINK_DEFAULT_WINDOW   4
+
+#define FELINK_TIMEOUT_MIN      10 // ms
+#define FELINK_TIMEOUT_MAX      10000
+#define FELINK_MAXRET_MAX       32
+
+#define FELINK_TX_WINDOW_MAX    8
+#define FELINK_TX_QUEUE_MAX     64
+#define FELINK_TX_BATCH_MAX     4  // 调度线程每轮最多取出的新请求数
+
+#define FELINK_DEV_INDEX_MIN_SIZE   16 // 必须为2的幂
+
+#define FELINK_MSG_POOL_CLASSES     5
+#define FELINK_MSG_POOL_MAX_FREE    16 // 每个尺寸级别最多缓存的空闲消息数
+#define FELINK_DEV_ARENA_CHUNK      16 // 每次向堆申请的设备记录数
+#define FELINK_DEV_NAME_INLINE      32
+
+#define FELINK_RNG_POOL_SIZE        512 // 必须为64的倍数
+#define FELINK_RNG_RESEED_BYTES     (1024 * 1024)
 
 #define FELINK_uECC_CURVE   uECC_secp160r1()
 
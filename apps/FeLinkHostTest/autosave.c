@@ -1,14 +1,30 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 
 #include "autosave.h"
+#include "metrics.h"
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include <sys/timerfd.h>
+#include <poll.h>
 #include <time.h>
 
+/*  .jnl
+    u32     sav_len     所属快照的长度
+    u32     sav_hash    所属快照的FNV-1a，与当前快照不符的日志(合并中途断电)整体丢弃
+    u8[]    records     见fl_load_journal/host_load_journal
+*/
+#define AUTOSAVE_JOURNAL_HEAD_SIZE 8
+
+/*  .slt
+    见fl_set_salt_table，MAP_SHARED映射后由base原地更新，保存线程按AUTOSAVE_SALT_SYNC_MS定期msync
+    设备数超过槽数时按2倍设备数新建并rename替换
+*/
+
 struct fl_autosave
 {
     struct fl_base_i *base;
@@ -18,8 +34,330 @@ struct fl_autosave
     int timer_fd;
     pthread_t save_thread;
     int changes;
+    int snapshot_pending; // 日志写入或合并失败，下次直接重写快照
+
+    int salt_timer_fd;
+    int salt_fd;
+    uint8_t *salt_table;
+    size_t salt_table_size;
 };
 
+static uint32_t autosave_hash(const uint8_t *buf, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    while (len--)
+    {
+        hash ^= *buf++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void autosave_wr32(uint8_t *p, uint32_t val)
+{
+    p[0] = val & 0xff;
+    p[1] = (val >> 8) & 0xff;
+    p[2] = (val >> 16) & 0xff;
+    p[3] = (val >> 24) & 0xff;
+}
+
+static uint32_t autosave_rd32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static const char *autosave_sav_file(int change)
+{
+    return change == AUTOSAVE_BASE_CHANGE ? AUTOSAVE_BASE_FILE : AUTOSAVE_HOST_FILE;
+}
+
+static const char *autosave_journal_file(int change)
+{
+    return change == AUTOSAVE_BASE_CHANGE ? AUTOSAVE_BASE_JOURNAL : AUTOSAVE_HOST_JOURNAL;
+}
+
+static int autosave_write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static int autosave_read_file(const char *path, uint8_t **buf, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        close(fd);
+        return errno;
+    }
+    *buf = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (*buf == NULL)
+    {
+        close(fd);
+        return ENOMEM;
+    }
+
+    *len = 0;
+    while ((off_t)*len < st.st_size)
+    {
+        ssize_t res = read(fd, *buf + *len, st.st_size - *len);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        *len += res;
+    }
+    close(fd);
+    return 0;
+}
+
+// 快照只会被rename整体替换，不会原地截断，映射在进程内始终有效
+static int autosave_map_file(const char *path, const uint8_t **map, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0)
+    {
+        close(fd);
+        return EINVAL;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return errno;
+    posix_madvise(addr, st.st_size, POSIX_MADV_SEQUENTIAL);
+    *map = addr;
+    *len = st.st_size;
+    return 0;
+}
+
+static void autosave_sync_dir(void)
+{
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// 先写临时文件再rename，磁盘上始终是某个完整版本
+static int autosave_write_file_atomic(const char *path, const uint8_t *buf, size_t len)
+{
+    char tmp_path[strlen(path) + 5];
+    sprintf(tmp_path, "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    if (fd < 0)
+        return errno;
+    int res = autosave_write_all(fd, buf, len);
+    if (res == 0 && fsync(fd))
+        res = errno;
+    close(fd);
+    if (res == 0 && rename(tmp_path, path))
+        res = errno;
+    if (res)
+    {
+        unlink(tmp_path);
+        return res;
+    }
+
+    autosave_sync_dir();
+    return 0;
+}
+
+// 返回追加后日志的长度，失败时回退到追加前
+static int autosave_journal_append(const char *path, const uint8_t *buf, size_t len, off_t *size)
+{
+    int fd = open(path, O_WRONLY | O_APPEND);
+    if (fd < 0)
+        return errno;
+
+    off_t old_size = lseek(fd, 0, SEEK_END);
+    int res = autosave_write_all(fd, buf, len);
+    if (res == 0 && fdatasync(fd))
+        res = errno;
+    if (res)
+        ftruncate(fd, old_size);
+    *size = old_size + len;
+    close(fd);
+    return res;
+}
+
+static void autosave_salt_table_close(struct fl_autosave *as)
+{
+    if (as->salt_table == NULL)
+        return;
+    munmap(as->salt_table, as->salt_table_size);
+    close(as->salt_fd);
+    as->salt_table = NULL;
+    as->salt_table_size = 0;
+}
+
+static size_t autosave_salt_table_slots(struct fl_base_i *base)
+{
+    size_t n_slots = 2 * base->n_devs;
+    return n_slots > AUTOSAVE_SALT_TABLE_MIN_SLOTS ? n_slots : AUTOSAVE_SALT_TABLE_MIN_SLOTS;
+}
+
+// 新表写入当前全部设备并落盘后才替换旧表，失败时继续使用旧表
+static int autosave_salt_table_create(struct fl_autosave *as, size_t n_slots)
+{
+    const char *tmp_path = AUTOSAVE_BASE_SALT_TABLE ".tmp";
+    size_t size = FELINK_SALT_TABLE_SIZE(n_slots);
+    uint8_t *table = MAP_FAILED;
+    int res = 0;
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    if (fd < 0)
+        return errno;
+    if (ftruncate(fd, size))
+        res = errno;
+    else if ((table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        res = errno;
+    else if ((res = fl_set_salt_table(as->base, table, size)) == 0 && msync(table, size, MS_SYNC))
+        res = errno;
+    if (res == 0 && rename(tmp_path, AUTOSAVE_BASE_SALT_TABLE))
+        res = errno;
+    if (res)
+    {
+        fl_set_salt_table(as->base, as->salt_table, as->salt_table_size);
+        if (table != MAP_FAILED)
+            munmap(table, size);
+        close(fd);
+        unlink(tmp_path);
+        return res;
+    }
+
+    autosave_sync_dir();
+    autosave_salt_table_close(as);
+    as->salt_fd = fd;
+    as->salt_table = table;
+    as->salt_table_size = size;
+    return 0;
+}
+
+// 已有的表先挂载以恢复其中的盐值，槽数不足时再换新表
+static void autosave_salt_table_open(struct fl_autosave *as)
+{
+    int fd = open(AUTOSAVE_BASE_SALT_TABLE, O_RDWR);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > FELINK_SALT_TABLE_SIZE(0))
+    {
+        void *table = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (table != MAP_FAILED && fl_set_salt_table(as->base, table, st.st_size) == 0)
+        {
+            as->salt_fd = fd;
+            as->salt_table = table;
+            as->salt_table_size = st.st_size;
+        }
+        else
+        {
+            if (table != MAP_FAILED)
+                munmap(table, st.st_size);
+            close(fd);
+        }
+    }
+    else if (fd >= 0)
+        close(fd);
+}
+
+static void autosave_salt_table_check(struct fl_autosave *as)
+{
+    if (as->salt_table != NULL &&
+        as->salt_table_size >= FELINK_SALT_TABLE_SIZE((size_t)as->base->n_devs))
+        return;
+
+    int res = autosave_salt_table_create(as, autosave_salt_table_slots(as->base));
+    if (res)
+        printf("Autosave: create %s ERROR: %s\n", AUTOSAVE_BASE_SALT_TABLE, strerror(res));
+}
+
+static void autosave_salt_table_sync(struct fl_autosave *as)
+{
+    if (as->salt_table == NULL || !fl_salt_table_take_dirty(as->base))
+        return;
+    if (msync(as->salt_table, as->salt_table_size, MS_SYNC))
+        printf("Autosave: sync %s ERROR: %s\n", AUTOSAVE_BASE_SALT_TABLE, strerror(errno));
+}
+
+static int autosave_snapshot_part(struct fl_base_i *base, struct fl_host_i *host, int change)
+{
+    uint8_t *sav_buf;
+    size_t sav_size;
+    if (change == AUTOSAVE_BASE_CHANGE)
+        sav_size = fl_save(base, &sav_buf);
+    else
+        sav_size = host_save(host, &sav_buf);
+    if (sav_buf == NULL)
+        return ENOMEM;
+
+    uint8_t jnl_head[AUTOSAVE_JOURNAL_HEAD_SIZE];
+    autosave_wr32(&jnl_head[0], sav_size);
+    autosave_wr32(&jnl_head[4], autosave_hash(sav_buf, sav_size));
+
+    // 快照落盘后旧日志的头部即与之不符，换新日志前断电也不会被重放
+    int res = autosave_write_file_atomic(autosave_sav_file(change), sav_buf, sav_size);
+    free(sav_buf);
+    if (res == 0)
+        res = autosave_write_file_atomic(autosave_journal_file(change), jnl_head, AUTOSAVE_JOURNAL_HEAD_SIZE);
+    return res;
+}
+
+static int autosave_save_part(struct fl_autosave *as, int change)
+{
+    int res;
+
+    if (!(as->snapshot_pending & change))
+    {
+        uint8_t *jnl_buf;
+        size_t jnl_size;
+        if (change == AUTOSAVE_BASE_CHANGE)
+            jnl_size = fl_save_journal(as->base, &jnl_buf);
+        else
+            jnl_size = host_save_journal(as->host, &jnl_buf);
+        if (jnl_size == 0)
+            return 0;
+
+        off_t size = 0;
+        res = autosave_journal_append(autosave_journal_file(change), jnl_buf, jnl_size, &size);
+        free(jnl_buf);
+        if (res == 0 && size < AUTOSAVE_JOURNAL_MAX)
+            return 0;
+        if (res)
+            printf("Autosave: append %s ERROR: %s\n", autosave_journal_file(change), strerror(res));
+    }
+
+    printf("Autosave: compact %s\n", autosave_sav_file(change));
+    res = autosave_snapshot_part(as->base, as->host, change);
+    if (res)
+    {
+        printf("Autosave: save %s ERROR: %s\n", autosave_sav_file(change), strerror(res));
+        as->snapshot_pending |= change;
+    }
+    else
+        as->snapshot_pending &= ~change;
+    return res;
+}
+
 static void *autosave_save_thread(void *args)
 {
     struct fl_autosave *as = args;
@@ -27,54 +365,129 @@ static void *autosave_save_thread(void *args)
 
     while (1)
     {
+        struct pollfd fds[2] = {
+            {.fd = as->timer_fd, .events = POLLIN},
+            {.fd = as->salt_timer_fd, .events = POLLIN},
+        };
         uint64_t count;
-        res = read(as->timer_fd, &count, sizeof(uint64_t));
+        int old_state;
+        res = poll(fds, 2, -1);
         pthread_testcancel();
-        if (res <= 0)
+        if (res < 0)
         {
-            perror("autosave read timer");
+            if (errno == EINTR)
+                continue;
+            perror("autosave poll timer");
             return NULL;
         }
 
-        printf("Autosave: save\n");
-        if (as->changes & AUTOSAVE_BASE_CHANGE)
+        if (fds[1].revents & POLLIN && read(as->salt_timer_fd, &count, sizeof(uint64_t)) > 0)
         {
-            int felink_sav_fd = open(AUTOSAVE_BASE_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-            if (felink_sav_fd < 0)
-            {
-                perror("Autosave: open " AUTOSAVE_BASE_FILE);
-                goto save_thread_base_save_skip;
-            }
-            uint8_t *sav_buf;
-            size_t sav_size;
-            sav_size = fl_save(as->base, &sav_buf);
-            write(felink_sav_fd, sav_buf, sav_size);
-            close(felink_sav_fd);
-            free(sav_buf);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+            autosave_salt_table_sync(as);
+            pthread_setcancelstate(old_state, NULL);
         }
-    save_thread_base_save_skip:
-        if (as->changes & AUTOSAVE_HOST_CHANGE)
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        res = read(as->timer_fd, &count, sizeof(uint64_t));
+        if (res <= 0)
         {
-            int host_sav_fd = open(AUTOSAVE_HOST_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-            if (host_sav_fd < 0)
-            {
-                perror("Autosave: open " AUTOSAVE_HOST_FILE);
-                goto save_thread_host_save_skip;
-            }
-            uint8_t *sav_buf;
-            size_t sav_size;
-            sav_size = host_save(as->host, &sav_buf);
-            write(host_sav_fd, sav_buf, sav_size);
-            close(host_sav_fd);
-            free(sav_buf);
+            perror("autosave read timer");
+            return NULL;
         }
-    save_thread_host_save_skip:
-        as->changes = 0;
+
+        int changes = __atomic_exchange_n(&as->changes, 0, __ATOMIC_ACQ_REL) | as->snapshot_pending;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+        uint64_t start = metrics_time_us();
+        if (changes & AUTOSAVE_BASE_CHANGE)
+        {
+            autosave_save_part(as, AUTOSAVE_BASE_CHANGE);
+            autosave_salt_table_check(as);
+        }
+        if (changes & AUTOSAVE_HOST_CHANGE)
+            autosave_save_part(as, AUTOSAVE_HOST_CHANGE);
+        metrics_observe(METRICS_AUTOSAVE, metrics_time_us() - start);
+        pthread_setcancelstate(old_state, NULL);
+        if (as->snapshot_pending)
+            autosave_add_change((struct fl_autosave_i *)as, as->snapshot_pending);
     }
 
     return NULL;
 }
 
+// 日志头部与快照不符或日志不存在时只使用快照
+static void autosave_journal_replay(int change, const uint8_t *sav_buf, size_t sav_size, void *obj)
+{
+    uint8_t *jnl_buf = NULL;
+    size_t jnl_size = 0;
+    if (autosave_read_file(autosave_journal_file(change), &jnl_buf, &jnl_size))
+        return;
+
+    if (jnl_size >= AUTOSAVE_JOURNAL_HEAD_SIZE &&
+        autosave_rd32(&jnl_buf[0]) == sav_size &&
+        autosave_rd32(&jnl_buf[4]) == autosave_hash(sav_buf, sav_size))
+    {
+        size_t n;
+        if (change == AUTOSAVE_BASE_CHANGE)
+            n = fl_load_journal(obj, &jnl_buf[AUTOSAVE_JOURNAL_HEAD_SIZE], jnl_size - AUTOSAVE_JOURNAL_HEAD_SIZE);
+        else
+            n = host_load_journal(obj, &jnl_buf[AUTOSAVE_JOURNAL_HEAD_SIZE], jnl_size - AUTOSAVE_JOURNAL_HEAD_SIZE);
+        if (n < jnl_size - AUTOSAVE_JOURNAL_HEAD_SIZE)
+            printf("Autosave: %s truncated at %zu\n", autosave_journal_file(change), n + AUTOSAVE_JOURNAL_HEAD_SIZE);
+    }
+    free(jnl_buf);
+}
+
+struct fl_base_i *autosave_load_base(void)
+{
+    const uint8_t *sav_map;
+    size_t sav_size;
+    if (autosave_map_file(AUTOSAVE_BASE_FILE, &sav_map, &sav_size))
+        return NULL;
+
+    // 旧格式存档需复制载入，新格式成功时映射归base所有，其生存期内可以继续读取
+    int is_copy = sav_size < 4 || memcmp(sav_map, "FLSV", 4) != 0;
+    struct fl_base_i *base = is_copy ? fl_load(sav_map, sav_size) : fl_load_mapped(sav_map, sav_size);
+    if (base != NULL)
+        autosave_journal_replay(AUTOSAVE_BASE_CHANGE, sav_map, sav_size, base);
+    if (base == NULL || is_copy)
+        munmap((void *)sav_map, sav_size);
+    return base;
+}
+
+struct fl_host_i *autosave_load_host(
+    struct fl_base_i *base)
+{
+    const uint8_t *sav_map;
+    size_t sav_size;
+    if (autosave_map_file(AUTOSAVE_HOST_FILE, &sav_map, &sav_size))
+        return NULL;
+
+    struct fl_host_i *host = host_load(base, sav_map, sav_size);
+    if (host != NULL)
+        autosave_journal_replay(AUTOSAVE_HOST_CHANGE, sav_map, sav_size, host);
+    munmap((void *)sav_map, sav_size);
+    return host;
+}
+
+int autosave_snapshot(
+    struct fl_base_i *base,
+    struct fl_host_i *host,
+    int changes)
+{
+    int res = 0;
+
+    if (changes & AUTOSAVE_BASE_CHANGE)
+        res = autosave_snapshot_part(base, host, AUTOSAVE_BASE_CHANGE);
+    if (changes & AUTOSAVE_HOST_CHANGE)
+    {
+        int host_res = autosave_snapshot_part(base, host, AUTOSAVE_HOST_CHANGE);
+        if (res == 0)
+            res = host_res;
+    }
+    return res;
+}
+
 int autosave_add_change(
     struct fl_autosave_i *autosave,
     int changes)
@@ -82,7 +495,7 @@ int autosave_add_change(
     struct fl_autosave *as = (struct fl_autosave *)autosave;
     struct itimerspec timeval;
 
-    as->changes |= changes;
+    __atomic_fetch_or(&as->changes, changes, __ATOMIC_ACQ_REL);
     timeval.it_value.tv_nsec = 0;
     timeval.it_value.tv_sec = as->idle_secs;
     timeval.it_interval.tv_nsec = 0;
@@ -100,12 +513,39 @@ struct fl_autosave_i *autosave_start(
     as->base = base;
     as->host = host;
     as->idle_secs = save_idle_secs;
+    as->changes = 0;
+    as->snapshot_pending = 0;
+    as->salt_table = NULL;
+    as->salt_table_size = 0;
     as->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
     if (as->timer_fd <= 0)
         goto autosave_start_error;
+    as->salt_timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (as->salt_timer_fd <= 0)
+        goto autosave_start_salt_timer_error;
+
+    struct itimerspec timeval;
+    timeval.it_value.tv_sec = AUTOSAVE_SALT_SYNC_MS / 1000;
+    timeval.it_value.tv_nsec = AUTOSAVE_SALT_SYNC_MS % 1000 * 1000000;
+    timeval.it_interval = timeval.it_value;
+    timerfd_settime(as->salt_timer_fd, 0, &timeval, NULL);
+
+    // 盐值表比快照新，须在合并前恢复，使其中的connect_count/salt进入新快照
+    autosave_salt_table_open(as);
+    autosave_salt_table_check(as);
+
+    // 启动时合并一次，使日志与当前快照对应且不带残缺的尾部
+    if (autosave_snapshot_part(base, host, AUTOSAVE_BASE_CHANGE))
+        as->snapshot_pending |= AUTOSAVE_BASE_CHANGE;
+    if (autosave_snapshot_part(base, host, AUTOSAVE_HOST_CHANGE))
+        as->snapshot_pending |= AUTOSAVE_HOST_CHANGE;
     pthread_create(&as->save_thread, NULL, autosave_save_thread, as);
+    if (as->snapshot_pending)
+        autosave_add_change((struct fl_autosave_i *)as, as->snapshot_pending);
 
     return (struct fl_autosave_i *)as;
+autosave_start_salt_timer_error:
+    close(as->timer_fd);
 autosave_start_error:
     free(as);
     return NULL;
@@ -126,5 +566,11 @@ void autosave_stop(struct fl_autosave_i *autosave)
 
     pthread_join(as->save_thread, NULL);
     close(as->timer_fd);
+    close(as->salt_timer_fd);
+
+    fl_set_salt_table(as->base, NULL, 0);
+    if (as->salt_table != NULL)
+        msync(as->salt_table, as->salt_table_size, MS_SYNC);
+    autosave_salt_table_close(as);
     free(as);
 }
@@ -10,6 +10,13 @@
 
 #define AUTOSAVE_BASE_FILE "felink.sav"
 #define AUTOSAVE_HOST_FILE "host.sav"
+#define AUTOSAVE_BASE_JOURNAL "felink.jnl"
+#define AUTOSAVE_HOST_JOURNAL "host.jnl"
+#define AUTOSAVE_BASE_SALT_TABLE "felink.slt"
+
+#define AUTOSAVE_JOURNAL_MAX (64 * 1024) // 日志超过该长度时合并进快照
+#define AUTOSAVE_SALT_SYNC_MS 500         // 盐值表落盘间隔，期间的多次ACK合并为一次msync
+#define AUTOSAVE_SALT_TABLE_MIN_SLOTS 256
 
 #define AUTOSAVE_BASE_CHANGE (1 << 0)
 #define AUTOSAVE_HOST_CHANGE (1 << 1)
@@ -21,6 +28,15 @@ struct fl_autosave_i
     time_t idle_secs;
 };
 
+// 读取快照并重放日志，无可用快照时返回NULL
+struct fl_base_i *autosave_load_base(void);
+struct fl_host_i *autosave_load_host(
+    struct fl_base_i *base);
+// 原子地重写changes对应的快照并清空日志
+int autosave_snapshot(
+    struct fl_base_i *base,
+    struct fl_host_i *host,
+    int changes);
 int autosave_add_change(
     struct fl_autosave_i *autosave,
     int changes);
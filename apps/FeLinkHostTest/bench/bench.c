@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+
+#include "../FeLinkBase/felink.h"
+#include "../host.h"
+#include "../metrics.h"
+#include "sim_radio.h"
+#include "loadgen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#define BENCH_SETUP_TIMEOUT_MS 5000
+#define BENCH_ACK_RTT_SAMPLES (1 << 20)
+
+/*  主机基准测试
+    父进程运行FeLink base、模拟射频与主机，子进程为TLS负载生成器，CPU与RSS只统计父进程
+    射频按-l/-j/-p模拟延迟、抖动与丢包，-p只在设备连接后生效(配对命令没有重传)
+*/
+struct bench_conf
+{
+    struct sim_radio_conf radio;
+    struct loadgen_conf load;
+};
+
+// base侧ACK RTT的样本，统计回调在发送锁内调用，只做一次原子自增
+static uint32_t bench_ack_rtts[BENCH_ACK_RTT_SAMPLES];
+static size_t bench_n_ack_rtts;
+
+static void bench_stats_callback(
+    struct fl_base_i *base,
+    struct fl_dev_i *dev,
+    fl_stats_type type,
+    uint32_t us,
+    void *private_arg)
+{
+    if (type == FL_STATS_ACK_RTT)
+    {
+        size_t i = __atomic_fetch_add(&bench_n_ack_rtts, 1, __ATOMIC_RELAXED);
+        if (i < BENCH_ACK_RTT_SAMPLES)
+            bench_ack_rtts[i] = us;
+    }
+    metrics_fl_stats_callback(base, dev, type, us, private_arg);
+}
+
+static uint64_t bench_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t bench_timeval_us(struct timeval t)
+{
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static int bench_u32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile_ms(const uint32_t *sorted, size_t n, double p)
+{
+    if (n == 0)
+        return 0;
+    return sorted[(size_t)(p * (n - 1) + 0.5)] / 1000.0;
+}
+
+static long bench_proc_status_kb(const char *key)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL)
+        return -1;
+
+    char line[256];
+    long kb = -1;
+    size_t key_len = strlen(key);
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':')
+        {
+            kb = strtol(&line[key_len + 1], NULL, 10);
+            break;
+        }
+    fclose(f);
+    return kb;
+}
+
+// 生成临时的自签名P-256证书，host_start读取后即可删除
+static int bench_write_cert(char *cert_path, char *key_path)
+{
+    int res = EIO;
+    EVP_PKEY *pkey = NULL;
+    X509 *x509 = NULL;
+    FILE *f = NULL;
+
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (pctx == NULL || EVP_PKEY_keygen_init(pctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(pctx, &pkey) <= 0)
+        goto bench_write_cert_out;
+
+    x509 = X509_new();
+    if (x509 == NULL)
+        goto bench_write_cert_out;
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 24 * 3600);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"felink-bench", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    if (X509_sign(x509, pkey, EVP_sha256()) <= 0)
+        goto bench_write_cert_out;
+
+    int fd = mkstemp(key_path);
+    if (fd < 0 || (f = fdopen(fd, "w")) == NULL || !PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL))
+        goto bench_write_cert_out;
+    fclose(f);
+    fd = mkstemp(cert_path);
+    if (fd < 0 || (f = fdopen(fd, "w")) == NULL || !PEM_write_X509(f, x509))
+        goto bench_write_cert_out;
+    res = 0;
+
+bench_write_cert_out:
+    if (f != NULL)
+        fclose(f);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_CTX_free(pctx);
+    return res;
+}
+
+static int bench_wait_devs(struct fl_base_i *base, const uint32_t *ids, int n, int is_paired)
+{
+    uint64_t deadline = bench_time_us() + BENCH_SETUP_TIMEOUT_MS * 1000ULL;
+    while (bench_time_us() < deadline)
+    {
+        int i;
+        for (i = 0; i < n; i++)
+        {
+            struct fl_dev_i *d = fl_get_dev_by_id(base, ids[i]);
+            if (d == NULL || (is_paired && d->state != STATE_PAIRED))
+                break;
+        }
+        if (i == n)
+            return 0;
+        usleep(1000);
+    }
+    return ETIMEDOUT;
+}
+
+// 搜索、配对并连接全部模拟设备
+static int bench_setup_devs(struct fl_base_i *base, const uint32_t *ids, int n)
+{
+    int res = fl_scan(base);
+    if (res == 0)
+        res = bench_wait_devs(base, ids, n, 0);
+    for (int i = 0; i < n && res == 0; i++)
+        res = fl_pair(base, fl_get_dev_by_id(base, ids[i]));
+    if (res == 0)
+        res = bench_wait_devs(base, ids, n, 1);
+    for (int i = 0; i < n && res == 0; i++)
+        res = fl_connect(base, fl_get_dev_by_id(base, ids[i]));
+    return res;
+}
+
+static void bench_usage(const char *prog)
+{
+    printf("Usage: %s [options]\n"
+           "\t-d N\tvirtual devices (8)\n"
+           "\t-c N\tTLS clients (16)\n"
+           "\t-w N\toutstanding requests per client (1)\n"
+           "\t-t S\tload duration in seconds (10)\n"
+           "\t-s N\tCCMD_DATA payload bytes (16)\n"
+           "\t-i N\tsend CCMD_INFO as every Nth request, 0 to disable (0)\n"
+           "\t-l US\tone-way radio latency in microseconds (2000)\n"
+           "\t-j US\tradio jitter in microseconds (500)\n"
+           "\t-p PCT\tradio loss per direction in percent (0)\n"
+           "\t-x\tsend plaintext data\n"
+           "\t-P PORT\thost port (11301)\n",
+           prog);
+}
+
+static int bench_parse_args(int argc, char *argv[], struct bench_conf *conf)
+{
+    int opt;
+    double loss = 0;
+
+    conf->radio.n_devs = 8;
+    conf->radio.latency_us = 2000;
+    conf->radio.jitter_us = 500;
+    conf->load.port = 11301;
+    conf->load.n_clients = 16;
+    conf->load.window = 1;
+    conf->load.info_every = 0;
+    conf->load.data_size = 16;
+    conf->load.is_plaintext = 0;
+    conf->load.seconds = 10;
+    conf->load.username = "admin";
+    conf->load.password = "123456";
+
+    while ((opt = getopt(argc, argv, "d:c:w:t:s:i:l:j:p:xP:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            conf->radio.n_devs = atoi(optarg);
+            break;
+        case 'c':
+            conf->load.n_clients = atoi(optarg);
+            break;
+        case 'w':
+            conf->load.window = atoi(optarg);
+            break;
+        case 't':
+            conf->load.seconds = atoi(optarg);
+            break;
+        case 's':
+            conf->load.data_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            conf->load.info_every = atoi(optarg);
+            break;
+        case 'l':
+            conf->radio.latency_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            conf->radio.jitter_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            loss = atof(optarg) / 100;
+            break;
+        case 'x':
+            conf->load.is_plaintext = 1;
+            break;
+        case 'P':
+            conf->load.port = atoi(optarg);
+            break;
+        default:
+            bench_usage(argv[0]);
+            return EINVAL;
+        }
+    }
+    conf->radio.loss = loss;
+
+    if (conf->radio.n_devs < 1 || conf->load.n_clients < 1 || conf->load.window < 1 || conf->load.seconds < 1 ||
+        conf->load.data_size < 1 || loss < 0 || loss >= 1)
+    {
+        bench_usage(argv[0]);
+        return EINVAL;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_conf conf;
+    if (bench_parse_args(argc, argv, &conf))
+        return 1;
+
+    uint32_t *ids = malloc(conf.radio.n_devs * sizeof(uint32_t));
+    if (ids == NULL)
+        return 1;
+    for (int i = 0; i < conf.radio.n_devs; i++)
+        ids[i] = SIM_RADIO_DEV_ID_BASE + i;
+    conf.load.dev_ids = ids;
+    conf.load.n_devs = conf.radio.n_devs;
+
+    // 在创建任何线程之前fork
+    int ready_pipe[2];
+    if (pipe(ready_pipe))
+        return 1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        return 1;
+    if (pid == 0)
+    {
+        close(ready_pipe[1]);
+        _exit(loadgen_run(&conf.load, ready_pipe[0]) ? 1 : 0);
+    }
+    close(ready_pipe[0]);
+
+    // 先以无丢包完成配对，开始负载前再设置
+    double loss = conf.radio.loss;
+    conf.radio.loss = 0;
+    struct fl_base_i *base = fl_init();
+    struct sim_radio *sim = base != NULL ? sim_radio_create(base, &conf.radio) : NULL;
+    struct fl_host_i *host = base != NULL ? host_init(base) : NULL;
+    if (sim == NULL || host == NULL)
+    {
+        printf("Bench: init ERROR\n");
+        kill(pid, SIGKILL);
+        return 1;
+    }
+    fl_set_tx_func(base, sim_radio_tx_func, sim);
+    fl_set_stats_callback(base, bench_stats_callback, NULL);
+
+    char cert_path[] = "/tmp/felink-bench-cert-XXXXXX";
+    char key_path[] = "/tmp/felink-bench-key-XXXXXX";
+    int res = bench_write_cert(cert_path, key_path);
+    if (res == 0)
+        res = host_start(host, conf.load.port, cert_path, key_path);
+    unlink(cert_path);
+    unlink(key_path);
+    if (res)
+    {
+        printf("Bench: host start ERROR\n");
+        kill(pid, SIGKILL);
+        return 1;
+    }
+
+    res = bench_setup_devs(base, ids, conf.radio.n_devs);
+    if (res)
+    {
+        printf("Bench: device setup ERROR: %s\n", strerror(res));
+        kill(pid, SIGKILL);
+        return 1;
+    }
+    sim_radio_set_loss(sim, loss);
+    __atomic_store_n(&bench_n_ack_rtts, 0, __ATOMIC_RELAXED);
+    printf("Bench: %d devices connected, latency %u us, jitter %u us, loss %.1f%%\n",
+           conf.radio.n_devs, conf.radio.latency_us, conf.radio.jitter_us, loss * 100);
+    fflush(stdout);
+
+    struct sim_radio_stats radio_start, radio_end;
+    struct rusage usage_start, usage_end;
+    sim_radio_get_stats(sim, &radio_start);
+    getrusage(RUSAGE_SELF, &usage_start);
+    uint64_t start = bench_time_us();
+
+    // 计时包含客户端登录，登录的口令运算同样是主机负载
+    write(ready_pipe[1], "R", 1);
+    int status;
+    waitpid(pid, &status, 0);
+
+    double secs = (bench_time_us() - start) / 1e6;
+    getrusage(RUSAGE_SELF, &usage_end);
+    sim_radio_get_stats(sim, &radio_end);
+
+    size_t n = __atomic_load_n(&bench_n_ack_rtts, __ATOMIC_RELAXED);
+    if (n > BENCH_ACK_RTT_SAMPLES)
+        n = BENCH_ACK_RTT_SAMPLES;
+    qsort(bench_ack_rtts, n, sizeof(uint32_t), bench_u32_cmp);
+
+    double user = (bench_timeval_us(usage_end.ru_utime) - bench_timeval_us(usage_start.ru_utime)) / 1e6;
+    double sys = (bench_timeval_us(usage_end.ru_stime) - bench_timeval_us(usage_start.ru_stime)) / 1e6;
+    printf("Radio: tx %zu, rx %zu, dropped %zu frames (%.1f tx frames/s)\n",
+           radio_end.tx_frames - radio_start.tx_frames,
+           radio_end.rx_frames - radio_start.rx_frames,
+           radio_end.dropped - radio_start.dropped,
+           (radio_end.tx_frames - radio_start.tx_frames) / secs);
+    printf("Base ACK RTT (ms, %zu samples): p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n", n,
+           bench_percentile_ms(bench_ack_rtts, n, 0.5),
+           bench_percentile_ms(bench_ack_rtts, n, 0.9),
+           bench_percentile_ms(bench_ack_rtts, n, 0.99),
+           bench_percentile_ms(bench_ack_rtts, n, 1));
+    printf("Host CPU: user %.2f s, sys %.2f s, %.1f%% of one core over %.2f s\n", user, sys, (user + sys) / secs * 100, secs);
+    printf("Host RSS: %ld kB, peak %ld kB\n", bench_proc_status_kb("VmRSS"), bench_proc_status_kb("VmHWM"));
+
+    host_stop(host);
+    host_delete(host);
+    fl_set_tx_func(base, NULL, NULL);
+    sim_radio_delete(sim);
+    fl_delete(base);
+    free(ids);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,460 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "loadgen.h"
+#include "../cJSON/cJSON.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define LOADGEN_CCMD_INFO 0
+#define LOADGEN_CCMD_DATA 6
+#define LOADGEN_CCMD_LOGIN -1
+#define LOADGEN_HCMD_ACK 0
+#define LOADGEN_HCMD_INFO 1
+#define LOADGEN_HCMD_CONFIRM -1
+
+#define LOADGEN_RX_BUF_INIT_SIZE 4096
+#define LOADGEN_READ_TIMEOUT_MS 100
+#define LOADGEN_LOGIN_TIMEOUT_MS 10000
+
+// 未确认请求的发送时间，主机按序回复，收到回复时取最早的一项
+struct loadgen_fifo
+{
+    uint64_t *time;
+    int head;
+    int n;
+};
+
+struct loadgen_client
+{
+    const struct loadgen_conf *conf;
+    int index;
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    SSL_CTX *ctx;
+
+    int fd;
+    SSL *ssl;
+    uint8_t *rx_buf;
+    size_t rx_len;
+    size_t rx_size;
+    struct loadgen_fifo data_fifo;
+    struct loadgen_fifo info_fifo;
+    uint8_t *tx_buf;
+    size_t tx_len;
+
+    int is_logged_in;
+    int is_confirmed;
+    size_t n_sent;
+    size_t n_acks;
+    size_t n_infos;
+    size_t n_timeouts;
+    uint32_t *rtts; // 微秒
+    size_t n_rtts;
+    size_t rtts_size;
+};
+
+static uint64_t loadgen_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint8_t loadgen_chksum8(const uint8_t *bytes, size_t len)
+{
+    uint8_t chksum8 = 0;
+    while (len--)
+        chksum8 += *(bytes++);
+    return ~chksum8;
+}
+
+static uint32_t loadgen_rd32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void loadgen_wr32(uint8_t *p, uint32_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+static void loadgen_fifo_push(struct loadgen_fifo *f, int size, uint64_t t)
+{
+    f->time[(f->head + f->n) % size] = t;
+    f->n++;
+}
+
+static uint64_t loadgen_fifo_pop(struct loadgen_fifo *f, int size)
+{
+    uint64_t t = f->time[f->head];
+    f->head = (f->head + 1) % size;
+    f->n--;
+    return t;
+}
+
+static int loadgen_send_frame(struct loadgen_client *c, const char *tag, const void *body, size_t len)
+{
+    uint8_t head[8];
+    head[0] = 0;
+    memcpy(&head[1], tag, 3);
+    loadgen_wr32(&head[4], len);
+    head[0] = loadgen_chksum8(head, 8);
+
+    if (8 + len > c->tx_len)
+    {
+        uint8_t *buf = realloc(c->tx_buf, 8 + len);
+        if (buf == NULL)
+            return ENOMEM;
+        c->tx_buf = buf;
+        c->tx_len = 8 + len;
+    }
+    memcpy(c->tx_buf, head, 8);
+    memcpy(&c->tx_buf[8], body, len);
+
+    return SSL_write(c->ssl, c->tx_buf, 8 + len) == (int)(8 + len) ? 0 : EIO;
+}
+
+static int loadgen_login(struct loadgen_client *c)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "ccmd", cJSON_CreateNumber(LOADGEN_CCMD_LOGIN));
+    cJSON_AddItemToObject(json, "username", cJSON_CreateString(c->conf->username));
+    cJSON_AddItemToObject(json, "password", cJSON_CreateString(c->conf->password));
+    char *json_str = cJSON_PrintUnformatted(json);
+
+    int res = loadgen_send_frame(c, "CMD", json_str, strlen(json_str));
+
+    cJSON_free(json_str);
+    cJSON_Delete(json);
+    return res;
+}
+
+static int loadgen_send_request(struct loadgen_client *c)
+{
+    const struct loadgen_conf *conf = c->conf;
+    int is_info = conf->info_every > 0 && c->n_sent % conf->info_every == conf->info_every - 1;
+    uint64_t now = loadgen_time_us();
+    int res;
+
+    if (is_info)
+    {
+        uint8_t body[1] = {(uint8_t)LOADGEN_CCMD_INFO};
+        res = loadgen_send_frame(c, "BIN", body, sizeof(body));
+        if (res == 0)
+            loadgen_fifo_push(&c->info_fifo, conf->window, now);
+    }
+    else
+    {
+        uint8_t body[7 + conf->data_size];
+        body[0] = (uint8_t)LOADGEN_CCMD_DATA;
+        loadgen_wr32(&body[1], conf->dev_ids[c->index % conf->n_devs]);
+        body[5] = conf->is_plaintext;
+        body[6] = 0;
+        for (size_t i = 0; i < conf->data_size; i++)
+            body[7 + i] = (uint8_t)(c->n_sent + i);
+        res = loadgen_send_frame(c, "BIN", body, sizeof(body));
+        if (res == 0)
+            loadgen_fifo_push(&c->data_fifo, conf->window, now);
+    }
+    if (res == 0)
+        c->n_sent++;
+
+    return res;
+}
+
+static void loadgen_rtt_add(struct loadgen_client *c, uint64_t start)
+{
+    if (c->n_rtts == c->rtts_size)
+    {
+        size_t size = c->rtts_size ? c->rtts_size * 2 : 1024;
+        uint32_t *rtts = realloc(c->rtts, size * sizeof(uint32_t));
+        if (rtts == NULL)
+            return;
+        c->rtts = rtts;
+        c->rtts_size = size;
+    }
+    c->rtts[c->n_rtts++] = loadgen_time_us() - start;
+}
+
+static void loadgen_handle_frame(struct loadgen_client *c, const uint8_t *head, const uint8_t *body, size_t len)
+{
+    if (strncmp((const char *)&head[1], "CMD", 3) == 0)
+    {
+        // 登录前后只关心HCMD_CONFIRM
+        cJSON *json = cJSON_ParseWithLength((const char *)body, len);
+        if (json == NULL)
+            return;
+        cJSON *json_hcmd = cJSON_GetObjectItemCaseSensitive(json, "hcmd");
+        if (cJSON_IsNumber(json_hcmd) && cJSON_GetNumberValue(json_hcmd) == LOADGEN_HCMD_CONFIRM)
+        {
+            c->is_confirmed = 1;
+            c->is_logged_in = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "is_success"));
+        }
+        cJSON_Delete(json);
+        return;
+    }
+
+    if (len < 1)
+        return;
+    int window = c->conf->window;
+    switch ((int8_t)body[0])
+    {
+    case LOADGEN_HCMD_ACK:
+        if (c->data_fifo.n > 0)
+        {
+            loadgen_rtt_add(c, loadgen_fifo_pop(&c->data_fifo, window));
+            c->n_acks++;
+        }
+        break;
+    case LOADGEN_HCMD_INFO:
+        if (c->info_fifo.n > 0)
+        {
+            loadgen_fifo_pop(&c->info_fifo, window);
+            c->n_infos++;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// 读取一次并处理其中完整的帧，超时返回0
+static int loadgen_receive(struct loadgen_client *c)
+{
+    if (c->rx_size - c->rx_len < LOADGEN_RX_BUF_INIT_SIZE)
+    {
+        uint8_t *buf = realloc(c->rx_buf, c->rx_size * 2);
+        if (buf == NULL)
+            return ENOMEM;
+        c->rx_buf = buf;
+        c->rx_size *= 2;
+    }
+
+    int n = SSL_read(c->ssl, &c->rx_buf[c->rx_len], c->rx_size - c->rx_len);
+    if (n <= 0)
+    {
+        int err = SSL_get_error(c->ssl, n);
+        if (err == SSL_ERROR_WANT_READ || (err == SSL_ERROR_SYSCALL && (errno == EAGAIN || errno == EWOULDBLOCK)))
+            return 0;
+        return EIO;
+    }
+    c->rx_len += n;
+
+    size_t off = 0;
+    while (c->rx_len - off >= 8)
+    {
+        const uint8_t *head = &c->rx_buf[off];
+        uint32_t len = loadgen_rd32(&head[4]);
+        if (c->rx_len - off < 8 + (size_t)len)
+            break;
+        loadgen_handle_frame(c, head, &head[8], len);
+        off += 8 + len;
+    }
+    memmove(c->rx_buf, &c->rx_buf[off], c->rx_len - off);
+    c->rx_len -= off;
+
+    return 0;
+}
+
+static void loadgen_expire(struct loadgen_client *c, struct loadgen_fifo *f)
+{
+    uint64_t limit = loadgen_time_us() - LOADGEN_REQ_TIMEOUT_MS * 1000ULL;
+    while (f->n > 0 && f->time[f->head] < limit)
+    {
+        loadgen_fifo_pop(f, c->conf->window);
+        c->n_timeouts++;
+    }
+}
+
+static int loadgen_connect(struct loadgen_client *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0)
+        return errno;
+
+    // 分散到不同的回环地址，避免同一IP的口令运算被限速
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + c->index / LOADGEN_CLIENTS_PER_ADDR);
+    if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)))
+        return errno;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(c->conf->port);
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)))
+        return errno;
+
+    struct timeval tv = {0, LOADGEN_READ_TIMEOUT_MS * 1000};
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    c->ssl = SSL_new(c->ctx);
+    if (c->ssl == NULL)
+        return ENOMEM;
+    SSL_set_fd(c->ssl, c->fd);
+    while (SSL_connect(c->ssl) != 1)
+        if (SSL_get_error(c->ssl, -1) != SSL_ERROR_WANT_READ)
+            return EPROTO;
+
+    return 0;
+}
+
+static void *loadgen_client_thread(void *args)
+{
+    struct loadgen_client *c = args;
+    const struct loadgen_conf *conf = c->conf;
+
+    if (loadgen_connect(c) == 0 && loadgen_login(c) == 0)
+    {
+        uint64_t deadline = loadgen_time_us() + LOADGEN_LOGIN_TIMEOUT_MS * 1000ULL;
+        while (!c->is_confirmed && loadgen_time_us() < deadline)
+            if (loadgen_receive(c))
+                break;
+    }
+    if (!c->is_logged_in)
+        fprintf(stderr, "Loadgen: client %d login failed\n", c->index);
+
+    pthread_barrier_wait(c->barrier);
+    if (!c->is_logged_in)
+        return NULL;
+
+    uint64_t deadline = loadgen_time_us() + conf->seconds * 1000000ULL;
+    while (loadgen_time_us() < deadline)
+    {
+        loadgen_expire(c, &c->data_fifo);
+        loadgen_expire(c, &c->info_fifo);
+        while (c->data_fifo.n + c->info_fifo.n < conf->window)
+            if (loadgen_send_request(c))
+                return NULL;
+        if (loadgen_receive(c))
+            return NULL;
+    }
+
+    return NULL;
+}
+
+static void loadgen_client_free(struct loadgen_client *c)
+{
+    if (c->ssl != NULL)
+    {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+    }
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c->rx_buf);
+    free(c->tx_buf);
+    free(c->data_fifo.time);
+    free(c->info_fifo.time);
+    free(c->rtts);
+}
+
+static int loadgen_rtt_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double loadgen_percentile_ms(const uint32_t *sorted, size_t n, double p)
+{
+    if (n == 0)
+        return 0;
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+int loadgen_run(const struct loadgen_conf *conf, int ready_fd)
+{
+    char ready;
+    if (read(ready_fd, &ready, 1) != 1)
+        return EPIPE;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL)
+        return ENOMEM;
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    struct loadgen_client *clients = calloc(conf->n_clients, sizeof(struct loadgen_client));
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, conf->n_clients + 1);
+    for (int i = 0; i < conf->n_clients; i++)
+    {
+        struct loadgen_client *c = &clients[i];
+        c->conf = conf;
+        c->index = i;
+        c->barrier = &barrier;
+        c->ctx = ctx;
+        c->fd = -1;
+        c->rx_size = LOADGEN_RX_BUF_INIT_SIZE;
+        c->rx_buf = malloc(c->rx_size);
+        c->data_fifo.time = malloc(conf->window * sizeof(uint64_t));
+        c->info_fifo.time = malloc(conf->window * sizeof(uint64_t));
+        if (c->rx_buf == NULL || c->data_fifo.time == NULL || c->info_fifo.time == NULL)
+            return ENOMEM;
+        if (pthread_create(&c->thread, NULL, loadgen_client_thread, c))
+            return EAGAIN;
+    }
+
+    // 全部登录后同时开始，登录期间的口令运算不计入吞吐
+    pthread_barrier_wait(&barrier);
+    uint64_t start = loadgen_time_us();
+    for (int i = 0; i < conf->n_clients; i++)
+        pthread_join(clients[i].thread, NULL);
+    double secs = (loadgen_time_us() - start) / 1e6;
+
+    int n_logged_in = 0;
+    size_t n_sent = 0, n_acks = 0, n_infos = 0, n_timeouts = 0, n_rtts = 0;
+    for (int i = 0; i < conf->n_clients; i++)
+    {
+        n_logged_in += clients[i].is_logged_in;
+        n_sent += clients[i].n_sent;
+        n_acks += clients[i].n_acks;
+        n_infos += clients[i].n_infos;
+        n_timeouts += clients[i].n_timeouts;
+        n_rtts += clients[i].n_rtts;
+    }
+    uint32_t *rtts = malloc((n_rtts + 1) * sizeof(uint32_t));
+    n_rtts = 0;
+    for (int i = 0; i < conf->n_clients; i++)
+    {
+        if (rtts != NULL)
+            memcpy(&rtts[n_rtts], clients[i].rtts, clients[i].n_rtts * sizeof(uint32_t));
+        n_rtts += clients[i].n_rtts;
+        loadgen_client_free(&clients[i]);
+    }
+    if (rtts == NULL)
+        n_rtts = 0;
+    qsort(rtts, n_rtts, sizeof(uint32_t), loadgen_rtt_cmp);
+
+    printf("Clients: %d logged in of %d, window %d\n", n_logged_in, conf->n_clients, conf->window);
+    printf("Requests: sent %zu, data acked %zu, info %zu, timeouts %zu in %.2f s\n", n_sent, n_acks, n_infos, n_timeouts, secs);
+    printf("Throughput: %.1f msgs/s (data %.1f/s)\n", (n_acks + n_infos) / secs, n_acks / secs);
+    printf("Client RTT CCMD_DATA -> HCMD_ACK (ms): p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+           loadgen_percentile_ms(rtts, n_rtts, 0.5),
+           loadgen_percentile_ms(rtts, n_rtts, 0.9),
+           loadgen_percentile_ms(rtts, n_rtts, 0.99),
+           loadgen_percentile_ms(rtts, n_rtts, 1));
+    fflush(stdout);
+
+    free(rtts);
+    free(clients);
+    pthread_barrier_destroy(&barrier);
+    SSL_CTX_free(ctx);
+
+    return n_logged_in == conf->n_clients ? 0 : ECONNREFUSED;
+}
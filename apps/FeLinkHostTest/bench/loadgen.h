@@ -0,0 +1,28 @@
+#ifndef _FELINK_BENCH_LOADGEN_
+#define _FELINK_BENCH_LOADGEN_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOADGEN_CLIENTS_PER_ADDR 4 // 每个源地址的客户端数，不超过主机的口令运算突发数
+#define LOADGEN_REQ_TIMEOUT_MS 3000 // 发送失败时主机不回复，超时后丢弃该请求
+
+struct loadgen_conf
+{
+    uint16_t port;
+    int n_clients;
+    const uint32_t *dev_ids; // 客户端i向dev_ids[i % n_devs]发送
+    int n_devs;
+    int window;      // 每个客户端未确认的请求数
+    int info_every;  // 每info_every个请求中有一个CCMD_INFO，0为不发送
+    size_t data_size;
+    int is_plaintext;
+    int seconds;
+    const char *username;
+    const char *password;
+};
+
+// 阻塞直到ready_fd可读(主机就绪)，运行结束后向stdout输出客户端侧的结果
+int loadgen_run(const struct loadgen_conf *conf, int ready_fd);
+
+#endif
@@ -0,0 +1,318 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sim_radio.h"
+#include "../FeLinkBase/micro-ecc/uECC.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SIM_FRAME_MAX 64
+#define SIM_DEV_TYPE 0x00000001
+#define SIM_DEV_VERSION 0x0002
+
+/*  模拟设备
+    只实现主机测量所需的最少从机行为：
+    搜索 -> 每个设备回复握手；配对 -> 回复同一个预先生成的公钥(设备侧不需要共享密钥)
+    连接/数据包 -> 回复ACK，ack-chksum8直接对密文计算，无需解密
+    应答按到达时间放入最小堆，由模拟线程送到fl_receive_handler，与真实接收线程的调用方式相同
+*/
+struct sim_event
+{
+    uint64_t due_us;
+    size_t len;
+    uint8_t buf[SIM_FRAME_MAX];
+};
+
+struct sim_radio
+{
+    struct fl_base_i *base;
+    struct sim_radio_conf conf;
+    uint8_t pub_key[SIM_FRAME_MAX];
+    size_t pub_key_size;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int is_stop;
+    struct sim_event *heap;
+    size_t n_events;
+    size_t heap_size;
+    uint64_t rng;
+    struct sim_radio_stats stats;
+};
+
+static uint64_t sim_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint8_t sim_chksum8(const uint8_t *bytes, size_t len)
+{
+    uint8_t chksum8 = 0;
+    while (len--)
+        chksum8 += *(bytes++);
+    return ~chksum8;
+}
+
+static uint32_t sim_rd32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void sim_wr32(uint8_t *p, uint32_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+// 需持有mutex
+static uint32_t sim_random(struct sim_radio *sim)
+{
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 7;
+    sim->rng ^= sim->rng << 17;
+    return sim->rng >> 32;
+}
+
+static int sim_is_lost(struct sim_radio *sim)
+{
+    return sim->conf.loss > 0 && sim_random(sim) < sim->conf.loss * 4294967296.0;
+}
+
+static int sim_dev_index(struct sim_radio *sim, uint32_t id)
+{
+    uint32_t i = id - SIM_RADIO_DEV_ID_BASE;
+    return i < (uint32_t)sim->conf.n_devs ? (int)i : -1;
+}
+
+static void sim_heap_swap(struct sim_event *a, struct sim_event *b)
+{
+    struct sim_event t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// 需持有mutex，buf[1]在此填入chksum8
+static int sim_queue(struct sim_radio *sim, uint8_t *buf, size_t len)
+{
+    if (sim->n_events == sim->heap_size)
+    {
+        size_t size = sim->heap_size ? sim->heap_size * 2 : 64;
+        struct sim_event *heap = realloc(sim->heap, size * sizeof(struct sim_event));
+        if (heap == NULL)
+            return ENOMEM;
+        sim->heap = heap;
+        sim->heap_size = size;
+    }
+
+    uint64_t delay = 2 * (uint64_t)sim->conf.latency_us;
+    if (sim->conf.jitter_us)
+        delay += sim_random(sim) % (2 * sim->conf.jitter_us + 1);
+    delay = delay > sim->conf.jitter_us ? delay - sim->conf.jitter_us : 0;
+
+    size_t i = sim->n_events++;
+    struct sim_event *e = &sim->heap[i];
+    e->due_us = sim_time_us() + delay;
+    e->len = len;
+    buf[1] = 0;
+    buf[1] = sim_chksum8(buf, len);
+    memcpy(e->buf, buf, len);
+    while (i > 0 && sim->heap[(i - 1) / 2].due_us > sim->heap[i].due_us)
+    {
+        sim_heap_swap(&sim->heap[(i - 1) / 2], &sim->heap[i]);
+        i = (i - 1) / 2;
+    }
+
+    pthread_cond_signal(&sim->cond);
+    return 0;
+}
+
+// 需持有mutex
+static void sim_pop(struct sim_radio *sim, struct sim_event *e)
+{
+    *e = sim->heap[0];
+    sim->heap[0] = sim->heap[--sim->n_events];
+    size_t i = 0;
+    for (;;)
+    {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < sim->n_events && sim->heap[l].due_us < sim->heap[min].due_us)
+            min = l;
+        if (r < sim->n_events && sim->heap[r].due_us < sim->heap[min].due_us)
+            min = r;
+        if (min == i)
+            break;
+        sim_heap_swap(&sim->heap[i], &sim->heap[min]);
+        i = min;
+    }
+}
+
+static void *sim_thread(void *args)
+{
+    struct sim_radio *sim = args;
+    struct sim_event e;
+
+    pthread_mutex_lock(&sim->mutex);
+    while (!sim->is_stop)
+    {
+        if (sim->n_events == 0)
+        {
+            pthread_cond_wait(&sim->cond, &sim->mutex);
+            continue;
+        }
+        uint64_t now = sim_time_us();
+        if (sim->heap[0].due_us > now)
+        {
+            struct timespec t;
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            uint64_t ns = t.tv_nsec + (sim->heap[0].due_us - now) * 1000;
+            t.tv_sec += ns / 1000000000;
+            t.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&sim->cond, &sim->mutex, &t);
+            continue;
+        }
+
+        sim_pop(sim, &e);
+        sim->stats.rx_frames++;
+        pthread_mutex_unlock(&sim->mutex);
+        fl_receive_handler(sim->base, e.buf, e.len);
+        pthread_mutex_lock(&sim->mutex);
+    }
+    pthread_mutex_unlock(&sim->mutex);
+
+    return NULL;
+}
+
+static void sim_handshake(struct sim_radio *sim)
+{
+    for (int i = 0; i < sim->conf.n_devs; i++)
+    {
+        uint8_t buf[SIM_FRAME_MAX] = {0xFE, 0, 0xAA, 0xBA};
+        sim_wr32(&buf[4], SIM_RADIO_DEV_ID_BASE + i);
+        sim_wr32(&buf[8], SIM_DEV_TYPE);
+        buf[12] = SIM_DEV_VERSION & 0xFF;
+        buf[13] = SIM_DEV_VERSION >> 8;
+        int n = snprintf((char *)&buf[14], SIM_FRAME_MAX - 14, "sim%d", i);
+        sim_queue(sim, buf, 14 + n + 1);
+    }
+}
+
+static void sim_pair(struct sim_radio *sim, uint32_t id)
+{
+    uint8_t buf[SIM_FRAME_MAX] = {0xFE, 0, 0xAA, 0xBB};
+    sim_wr32(&buf[4], id);
+    buf[8] = sim->pub_key_size;
+    memcpy(&buf[9], sim->pub_key, sim->pub_key_size);
+    sim_queue(sim, buf, 9 + sim->pub_key_size);
+}
+
+static void sim_ack(struct sim_radio *sim, uint32_t id, uint8_t sign)
+{
+    if (sim_is_lost(sim) || sim_is_lost(sim))
+    {
+        sim->stats.dropped++;
+        return;
+    }
+
+    uint8_t buf[SIM_FRAME_MAX] = {0xFE, 0, 0xCC, 0xBA};
+    sim_wr32(&buf[4], id);
+    buf[8] = sign;
+    sim_queue(sim, buf, 9);
+}
+
+int sim_radio_tx_func(struct fl_dev_i *dev, uint8_t *buf, size_t count, void *private_arg)
+{
+    struct sim_radio *sim = private_arg;
+
+    if (count < 4 || buf[0] != 0xFE)
+        return EINVAL;
+
+    pthread_mutex_lock(&sim->mutex);
+    sim->stats.tx_frames++;
+    uint32_t id = count >= 8 ? sim_rd32(&buf[4]) : 0;
+    if (buf[2] == 0xAA && buf[3] == 0xAA)
+        sim_handshake(sim);
+    else if (count >= 8 && sim_dev_index(sim, id) >= 0)
+    {
+        if (buf[2] == 0xAA && buf[3] == 0xAB)
+            sim_pair(sim, id);
+        else if (buf[2] == 0xCC && buf[3] == 0xAC && count >= 16)
+            sim_ack(sim, id, sim_chksum8(&buf[8], 8));
+        else if (buf[2] == 0xDD && buf[3] == 0xAD && count > 12)
+            sim_ack(sim, id, sim_chksum8(&buf[12], count - 12));
+    }
+    pthread_mutex_unlock(&sim->mutex);
+
+    return 0;
+}
+
+struct sim_radio *sim_radio_create(struct fl_base_i *base, const struct sim_radio_conf *conf)
+{
+    struct sim_radio *sim = calloc(1, sizeof(struct sim_radio));
+    if (sim == NULL)
+        return NULL;
+    sim->base = base;
+    sim->conf = *conf;
+    sim->rng = 0x9E3779B97F4A7C15ULL ^ sim_time_us();
+
+    // 使用fl_init设置的随机数源
+    uint8_t pri_key[SIM_FRAME_MAX];
+    sim->pub_key_size = FELINK_uECC_PUB_KEY_SIZE;
+    if (sim->pub_key_size > SIM_FRAME_MAX - 9 || !uECC_make_key(sim->pub_key, pri_key, FELINK_uECC_CURVE))
+    {
+        free(sim);
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sim->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&sim->mutex, NULL);
+    if (pthread_create(&sim->thread, NULL, sim_thread, sim))
+    {
+        pthread_cond_destroy(&sim->cond);
+        pthread_mutex_destroy(&sim->mutex);
+        free(sim);
+        return NULL;
+    }
+
+    return sim;
+}
+
+void sim_radio_delete(struct sim_radio *sim)
+{
+    pthread_mutex_lock(&sim->mutex);
+    sim->is_stop = 1;
+    pthread_cond_signal(&sim->cond);
+    pthread_mutex_unlock(&sim->mutex);
+    pthread_join(sim->thread, NULL);
+
+    pthread_cond_destroy(&sim->cond);
+    pthread_mutex_destroy(&sim->mutex);
+    free(sim->heap);
+    free(sim);
+}
+
+void sim_radio_set_loss(struct sim_radio *sim, double loss)
+{
+    pthread_mutex_lock(&sim->mutex);
+    sim->conf.loss = loss;
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+void sim_radio_get_stats(struct sim_radio *sim, struct sim_radio_stats *stats)
+{
+    pthread_mutex_lock(&sim->mutex);
+    *stats = sim->stats;
+    pthread_mutex_unlock(&sim->mutex);
+}
@@ -0,0 +1,35 @@
+#ifndef _FELINK_BENCH_SIM_RADIO_
+#define _FELINK_BENCH_SIM_RADIO_
+
+#include "../FeLinkBase/felink.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIM_RADIO_DEV_ID_BASE 0x5E000001
+
+struct sim_radio_conf
+{
+    int n_devs;
+    uint32_t latency_us; // 单向延迟，应答在latency_us±jitter_us的往返后送达
+    uint32_t jitter_us;
+    double loss; // 每个方向的丢包率，只作用于带ACK的连接与数据包
+};
+
+struct sim_radio_stats
+{
+    size_t tx_frames; // 主机发出的帧
+    size_t rx_frames; // 交给fl_receive_handler的帧
+    size_t dropped;
+};
+
+struct sim_radio;
+
+struct sim_radio *sim_radio_create(struct fl_base_i *base, const struct sim_radio_conf *conf);
+void sim_radio_delete(struct sim_radio *sim);
+// 交给fl_set_tx_func，只入队应答，由模拟线程按到达时间调用fl_receive_handler
+int sim_radio_tx_func(struct fl_dev_i *dev, uint8_t *buf, size_t count, void *sim);
+void sim_radio_set_loss(struct sim_radio *sim, double loss);
+void sim_radio_get_stats(struct sim_radio *sim, struct sim_radio_stats *stats);
+
+#endif
@@ -1,18 +1,29 @@
 #include "connection.h"
 #include "FeLinkBase/felink.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#include "nrf24_ioctl.h"
 
 #define NRF24_FELINK_CMD_ADDR "0x666C636D64"
+#define NRF24_FELINK_DATA_ADDR(salt) (0x666C000000ULL | ((salt) & 0x00FFFFFF))
 
 #define NRF24_PAYLOAD_WIDTH 32
 #if NRF24_PAYLOAD_WIDTH < 2
 #error NRF24_PAYLOAD_WIDTH should be bigger than 2
 #endif
+#define CON_NRF24_FELINK_BLOCK_SIZE (NRF24_PAYLOAD_WIDTH - 1)
+#define CON_NRF24_FELINK_BLOCK_MAX 256
 #define _MARCO_TO_STR(marco) #marco
 #define MARCO_TO_STR(marco) _MARCO_TO_STR(marco)
 
@@ -29,7 +40,28 @@
 struct fl_dev_con
 {
     struct fl_dev_i *dev;
-    char addr[13];
+    uint64_t addr;
+};
+
+#define CON_NRF24_RX_SLOTS 4
+#define CON_NRF24_RX_TIMEOUT_MS 500
+// 设备在硬件ACK负载中回复FeLink ACK时置1，命令/数据管道改为动态负载长度，需设备固件同时支持
+// 仅接收方向：FeLink协议中基站不回复设备ACK，主机不调用NRF24_IOC_SET_ACK_PLOAD，
+// 时延收益取决于设备固件是否把ACK放入硬件ACK负载，固件支持前保持为0
+#define CON_NRF24_ACK_PLOAD 0
+// 动态负载长度下ACK负载可短于NRF24_PAYLOAD_WIDTH，至少含块序号与1字节数据
+#define CON_NRF24_RX_MIN_WIDTH (CON_NRF24_ACK_PLOAD ? 2 : NRF24_PAYLOAD_WIDTH)
+
+struct nrf24_rx_slot
+{
+    int is_used;
+    int pipe;
+    uint8_t *buf;
+    uint8_t max_block_index;
+    uint16_t min_block_index; // 尚未收到任何块时为max_block_index + 1，可达256
+    uint32_t bitmap[CON_NRF24_FELINK_BLOCK_MAX / 32];
+    struct timespec time;
+    struct timespec open_time; // 收到第一块的时间，用于统计重组耗时
 };
 
 struct fl_con
@@ -39,6 +71,12 @@ struct fl_con
 
     int cmd_fd;
     int data_fd;
+    uint64_t data_addr;
+    int is_data_addr_set;
+    uint8_t block_index[CON_NRF24_FELINK_BLOCK_MAX];
+    struct iovec tx_iov[2 * CON_NRF24_FELINK_BLOCK_MAX + 1];
+    struct nrf24_rx_slot rx_slots[CON_NRF24_RX_SLOTS];
+    void *ring_map; // 命令管道的包模式环形缓冲，映射失败时为NULL，退回read
     struct fl_base_i *base;
     pthread_t receive_thread;
 };
@@ -52,7 +90,7 @@ static int sysfs_puts(const char *f, const char *s)
     close(fd);
     return res != len;
 }
-static int nrf24_config(void)
+static int nrf24_config_sysfs(void)
 {
     int res = 0;
     res += sysfs_puts("/sys/class/nrf24/nrf0/address_width", "5");
@@ -77,83 +115,349 @@ static int nrf24_config(void)
     return 0;
 }
 
-#define NRF24_MIN(a, b) ((a) < (b) ? (a) : (b))
-#define CON_NRF24_BUF_SIZE 128
-#define CON_NRF24_FELINK_BLOCK_SIZE (NRF24_PAYLOAD_WIDTH - 1)
-static void *nrf24_rx_thread(void *args)
+// 一次ioctl整体写入，驱动只发送值有变化的寄存器；旧驱动不支持时退回sysfs
+static int nrf24_config(int fd)
 {
-    struct fl_con *con = args;
-    struct fl_base_i *b = con->base;
+    struct nrf24_ioc_cfg cfg;
+    if (ioctl(fd, NRF24_IOC_GET_CFG, &cfg) < 0)
+        return errno == ENOTTY ? nrf24_config_sysfs() : errno;
+
+    cfg.address_width = 5;
+    cfg.channel = 113;
+    cfg.crc = 16;
+    cfg.data_rate = 2048;
+    cfg.retr_count = 15;
+    cfg.retr_delay = 1000;
+    cfg.rf_power = 0;
+    cfg.pipes[0].address = strtoull(NRF24_FELINK_CMD_ADDR, NULL, 16);
+    cfg.pipes[1].address = 0;
+    // ACK负载经0号管道收到，与普通命令帧一样进入分块重组
+    cfg.pipes[0].plw = CON_NRF24_ACK_PLOAD ? 0 : NRF24_PAYLOAD_WIDTH;
+    cfg.pipes[1].plw = CON_NRF24_ACK_PLOAD ? 0 : NRF24_PAYLOAD_WIDTH;
+    for (int i = 0; i < 6; i++)
+    {
+        cfg.pipes[i].ack = i < 2;
+        cfg.pipes[i].ack_pload = CON_NRF24_ACK_PLOAD && i < 2;
+    }
+    if (ioctl(fd, NRF24_IOC_SET_CFG, &cfg) < 0)
+        return errno;
+    return 0;
+}
 
-    uint8_t buf[CON_NRF24_BUF_SIZE];
-    uint8_t buf_max_block_index = CON_NRF24_BUF_SIZE / CON_NRF24_FELINK_BLOCK_SIZE;
-    uint8_t max_block_index = 0;
-    uint8_t rx_buf[NRF24_PAYLOAD_WIDTH];
-    while (1)
+/*  分块重组
+    发送方从最后一块倒序发送，0号块最后到达；射频层不提供发送方地址，只能按接收管道区分
+    同一管道上多个设备交错发送时，按块序号连续性把块归入不同的重组槽，位图记录已收到的块
+    收到0号块时，依次尝试完整的重组槽(最近优先)及0号块单独成帧，取校验通过者交给FeLink
+    超时或槽满时淘汰最旧的槽
+*/
+static int nrf24_rx_is_frame_valid(const uint8_t *buf, size_t len)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += buf[i];
+    return len >= 4 && buf[0] == 0xFE && sum == 0xFF;
+}
+
+static long nrf24_rx_interval_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static uint64_t nrf24_rx_interval_us(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+// 整行格式化后一次输出，运行时关闭时不再逐字节调用printf
+static void con_hexdump(const char *tag, const uint8_t *buf, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char line[3 * 64 + 1];
+
+    if (!(C_PRINT_DISPLAY & C_PRINT_MSG) || !metrics_log_is_on(METRICS_LOG_RADIO))
+        return;
+
+    fputs(tag, stdout);
+    for (size_t i = 0; i < len;)
     {
-        ssize_t count = read(con->cmd_fd, rx_buf, NRF24_PAYLOAD_WIDTH);
-        if (count < 0)
-            continue;
+        char *p = line;
+        for (size_t n = 0; n < 64 && i < len; n++, i++)
+        {
+            *p++ = hex[buf[i] >> 4];
+            *p++ = hex[buf[i] & 0x0F];
+            *p++ = ' ';
+        }
+        fwrite(line, 1, p - line, stdout);
+    }
+    fputc('\n', stdout);
+}
 
-        uint8_t block_index = rx_buf[0];
-        if (block_index > buf_max_block_index)
+static int nrf24_rx_slot_has(const struct nrf24_rx_slot *s, uint8_t block_index)
+{
+    return (s->bitmap[block_index / 32] >> (block_index % 32)) & 1;
+}
+
+static void nrf24_rx_slot_set(struct nrf24_rx_slot *s, uint8_t block_index)
+{
+    s->bitmap[block_index / 32] |= 1u << (block_index % 32);
+    if (block_index < s->min_block_index)
+        s->min_block_index = block_index;
+}
+
+static int nrf24_rx_slot_is_complete(const struct nrf24_rx_slot *s)
+{
+    for (int i = 1; i <= s->max_block_index; i++)
+        if (!nrf24_rx_slot_has(s, i))
+            return 0;
+    return 1;
+}
+
+static void nrf24_rx_slot_free(struct nrf24_rx_slot *s)
+{
+    free(s->buf);
+    s->buf = NULL;
+    s->is_used = 0;
+}
+
+static struct nrf24_rx_slot *nrf24_rx_slot_find(struct fl_con *con, int pipe, uint8_t block_index)
+{
+    struct nrf24_rx_slot *fill = NULL;
+
+    for (int i = 0; i < CON_NRF24_RX_SLOTS; i++)
+    {
+        struct nrf24_rx_slot *s = &con->rx_slots[i];
+        if (!s->is_used || s->pipe != pipe || block_index >= s->max_block_index || nrf24_rx_slot_has(s, block_index))
             continue;
-        else
-            memcpy(
-                &buf[block_index * CON_NRF24_FELINK_BLOCK_SIZE],
-                &rx_buf[1],
-                block_index == buf_max_block_index ? CON_NRF24_BUF_SIZE - block_index * CON_NRF24_FELINK_BLOCK_SIZE : CON_NRF24_FELINK_BLOCK_SIZE);
+        if (s->min_block_index == block_index + 1)
+            return s;
+        if (fill == NULL)
+            fill = s;
+    }
+    return fill;
+}
+
+static struct nrf24_rx_slot *nrf24_rx_slot_open(struct fl_con *con, int pipe, uint8_t max_block_index, const struct timespec *now)
+{
+    struct nrf24_rx_slot *s = NULL;
+
+    for (int i = 0; i < CON_NRF24_RX_SLOTS; i++)
+    {
+        struct nrf24_rx_slot *t = &con->rx_slots[i];
+        if (!t->is_used)
+        {
+            s = t;
+            break;
+        }
+        if (s == NULL || nrf24_rx_interval_ms(&t->time, &s->time) > 0)
+            s = t;
+    }
+    if (s->is_used)
+    {
+        metrics_count(METRICS_RX_DROPS, 1);
+        nrf24_rx_slot_free(s);
+    }
+
+    s->buf = malloc((max_block_index + 1) * CON_NRF24_FELINK_BLOCK_SIZE);
+    if (s->buf == NULL)
+        return NULL;
+    s->is_used = 1;
+    s->pipe = pipe;
+    s->max_block_index = max_block_index;
+    s->min_block_index = max_block_index + 1;
+    memset(s->bitmap, 0, sizeof(s->bitmap));
+    s->time = *now;
+    s->open_time = *now;
+
+    return s;
+}
+
+static void nrf24_rx_deliver(struct fl_con *con, const uint8_t *buf, size_t len)
+{
+    con_hexdump("R: ", buf, len);
 
-        if (block_index > max_block_index)
-            max_block_index = block_index;
+    uint64_t start = metrics_time_us();
+    int res = fl_receive_handler(con->base, buf, len);
+    metrics_observe(METRICS_RX_HANDLER, metrics_time_us() - start);
+    metrics_count(METRICS_RX_FRAMES, 1);
+    if (res)
+    {
+        metrics_count(METRICS_RX_ERRORS, 1);
+        con_printf(C_PRINT_MSG, "FeLink ERROR: %s\n", strerror(res));
+    }
+}
 
-        if (block_index == 0)
+static void nrf24_rx_block(struct fl_con *con, int pipe, const uint8_t *rx_buf)
+{
+    uint8_t block_index = rx_buf[0];
+    const uint8_t *data = &rx_buf[1];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < CON_NRF24_RX_SLOTS; i++)
+    {
+        struct nrf24_rx_slot *s = &con->rx_slots[i];
+        if (s->is_used && nrf24_rx_interval_ms(&s->time, &now) > CON_NRF24_RX_TIMEOUT_MS)
         {
-            size_t len = NRF24_MIN((max_block_index + 1) * CON_NRF24_FELINK_BLOCK_SIZE, CON_NRF24_BUF_SIZE);
-            con_printf(C_PRINT_MSG, "R: ");
-            for (int i = 0; i < len; i++)
-                con_printf(C_PRINT_MSG, "%02hhX ", buf[i]);
-            con_printf(C_PRINT_MSG, "\n");
+            metrics_count(METRICS_RX_DROPS, 1);
+            nrf24_rx_slot_free(s);
+        }
+    }
 
-            int res = fl_receive_handler(b, buf, len);
-            if (res)
-                con_printf(C_PRINT_MSG, "FeLink ERROR: %s\n", strerror(res));
+    if (block_index != 0)
+    {
+        struct nrf24_rx_slot *s = nrf24_rx_slot_find(con, pipe, block_index);
+        if (s == NULL)
+            s = nrf24_rx_slot_open(con, pipe, block_index, &now);
+        if (s == NULL)
+            return;
+        memcpy(&s->buf[block_index * CON_NRF24_FELINK_BLOCK_SIZE], data, CON_NRF24_FELINK_BLOCK_SIZE);
+        nrf24_rx_slot_set(s, block_index);
+        s->time = now;
+        return;
+    }
+
+    for (;;)
+    {
+        struct nrf24_rx_slot *s = NULL;
+        for (int i = 0; i < CON_NRF24_RX_SLOTS; i++)
+        {
+            struct nrf24_rx_slot *t = &con->rx_slots[i];
+            if (!t->is_used || t->pipe != pipe || t->min_block_index != 1 || !nrf24_rx_slot_is_complete(t))
+                continue;
+            if (s == NULL || nrf24_rx_interval_ms(&s->time, &t->time) > 0)
+                s = t;
+        }
+        if (s == NULL)
+            break;
 
-            max_block_index = 0;
+        size_t len = (s->max_block_index + 1) * CON_NRF24_FELINK_BLOCK_SIZE;
+        memcpy(s->buf, data, CON_NRF24_FELINK_BLOCK_SIZE);
+        if (nrf24_rx_is_frame_valid(s->buf, len))
+        {
+            metrics_observe(METRICS_REASSEMBLY, nrf24_rx_interval_us(&s->open_time, &now));
+            nrf24_rx_deliver(con, s->buf, len);
+            nrf24_rx_slot_free(s);
+            return;
         }
+        // 不属于该槽，标记后继续尝试其它槽
+        s->min_block_index = 0;
+    }
+
+    // 恢复未匹配槽的状态，等待它们自己的0号块
+    for (int i = 0; i < CON_NRF24_RX_SLOTS; i++)
+    {
+        struct nrf24_rx_slot *s = &con->rx_slots[i];
+        if (s->is_used && s->pipe == pipe && s->min_block_index == 0)
+            s->min_block_index = 1;
+    }
+    nrf24_rx_deliver(con, data, CON_NRF24_FELINK_BLOCK_SIZE);
+}
+
+// 短负载补零到整块后再交给nrf24_rx_block
+static void nrf24_rx_payload(struct fl_con *con, int pipe, const uint8_t *rx_buf, size_t len)
+{
+    if (len < CON_NRF24_RX_MIN_WIDTH || len > NRF24_PAYLOAD_WIDTH)
+        return;
+    if (len == NRF24_PAYLOAD_WIDTH)
+    {
+        nrf24_rx_block(con, pipe, rx_buf);
+        return;
+    }
+
+    uint8_t buf[NRF24_PAYLOAD_WIDTH] = {0};
+    memcpy(buf, rx_buf, len);
+    nrf24_rx_block(con, pipe, buf);
+}
+
+// 每次唤醒取完环中所有负载，不再每块一次系统调用
+static void nrf24_rx_ring_drain(struct fl_con *con)
+{
+    struct nrf24_ring *ring = (struct nrf24_ring *)((uint8_t *)con->ring_map + NRF24_RING_RX_OFFSET);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+
+    for (; tail != head; tail++)
+    {
+        const struct nrf24_ring_slot *slot = &ring->slots[tail % NRF24_RING_SLOTS];
+        nrf24_rx_payload(con, slot->pipe, slot->data, slot->len);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void *nrf24_rx_thread(void *args)
+{
+    struct fl_con *con = args;
+
+    if (con->ring_map != NULL)
+    {
+        struct pollfd pfd = {.fd = con->cmd_fd, .events = POLLIN};
+        while (1)
+        {
+            if (poll(&pfd, 1, -1) > 0)
+                nrf24_rx_ring_drain(con);
+        }
+    }
+
+    uint8_t rx_buf[NRF24_PAYLOAD_WIDTH];
+    while (1)
+    {
+        ssize_t count = read(con->cmd_fd, rx_buf, NRF24_PAYLOAD_WIDTH);
+        if (count > 0)
+            nrf24_rx_payload(con, 0, rx_buf, count);
     }
     pthread_exit(NULL);
 }
 
+/*  分块发送
+    每块为 块序号(1字节) + 数据(31字节)，从最后一块开始倒序发送，0号块最后发出
+    块序号取自con->block_index，数据直接指向buf，通过writev交给驱动拼成负载，不再复制
+*/
 static int nrf24_tx_func(struct fl_con *con, uint8_t *buf, size_t count, int pipe)
 {
-    uint8_t tx_buf[32 + (count / (NRF24_PAYLOAD_WIDTH - 1) * NRF24_PAYLOAD_WIDTH)]; // 确保缓存空间足够
-    uint8_t block_index = count / CON_NRF24_FELINK_BLOCK_SIZE;
-    const uint8_t *ptr = buf + count - count % CON_NRF24_FELINK_BLOCK_SIZE;
-
-    uint8_t *tbptr = tx_buf;
-    memset(tbptr, 0, NRF24_PAYLOAD_WIDTH);
-    tbptr[0] = block_index;
-    memcpy(&tbptr[1], ptr, count % CON_NRF24_FELINK_BLOCK_SIZE);
-    tbptr += NRF24_PAYLOAD_WIDTH;
-    ptr -= CON_NRF24_FELINK_BLOCK_SIZE;
+    static uint8_t zero_pad[CON_NRF24_FELINK_BLOCK_SIZE];
+
+    size_t block_index = count / CON_NRF24_FELINK_BLOCK_SIZE;
+    if (block_index >= CON_NRF24_FELINK_BLOCK_MAX)
+        return EMSGSIZE;
+
+    struct iovec *iov = con->tx_iov;
+    size_t rem = count % CON_NRF24_FELINK_BLOCK_SIZE;
+    uint8_t *ptr = buf + count - rem;
+    size_t len = NRF24_PAYLOAD_WIDTH * (block_index + 1);
+
+    iov->iov_base = &con->block_index[block_index];
+    iov->iov_len = 1;
+    iov++;
+    if (rem)
+    {
+        iov->iov_base = ptr;
+        iov->iov_len = rem;
+        iov++;
+    }
+    iov->iov_base = zero_pad;
+    iov->iov_len = CON_NRF24_FELINK_BLOCK_SIZE - rem;
+    iov++;
     while (block_index--)
     {
-        tbptr[0] = block_index;
-        memcpy(&tbptr[1], ptr, CON_NRF24_FELINK_BLOCK_SIZE);
-        tbptr += NRF24_PAYLOAD_WIDTH;
         ptr -= CON_NRF24_FELINK_BLOCK_SIZE;
+        iov->iov_base = &con->block_index[block_index];
+        iov->iov_len = 1;
+        iov++;
+        iov->iov_base = ptr;
+        iov->iov_len = CON_NRF24_FELINK_BLOCK_SIZE;
+        iov++;
     }
 
     int fd = pipe == 0 ? con->cmd_fd : con->data_fd;
-    ssize_t n = write(fd, tx_buf, (size_t)(tbptr - tx_buf));
-    if (n < (size_t)(tbptr - tx_buf))
-        return errno;
+    ssize_t n = writev(fd, con->tx_iov, iov - con->tx_iov);
+    if (n < 0 || (size_t)n < len)
+    {
+        metrics_count(METRICS_TX_ERRORS, 1);
+        return n < 0 ? errno : EIO;
+    }
+    metrics_count(METRICS_TX_FRAMES, 1);
 
-    con_printf(C_PRINT_MSG, "T: ");
-    for (int i = 0; i < count; i++)
-        con_printf(C_PRINT_MSG, "%02hhX ", buf[i]);
-    con_printf(C_PRINT_MSG, "\n");
+    con_hexdump("T: ", buf, count);
 
     return 0;
 }
@@ -166,17 +470,14 @@ void connection_dev_con_add(struct fl_con_i *con, struct fl_dev_i *dev)
     {
         if (c->dev_cons[i].dev == dev)
         {
-            char *addr = c->dev_cons[i].addr;
-            sprintf(addr, "0x666C%06X", dev->salt & 0x00FFFFFF);
+            c->dev_cons[i].addr = NRF24_FELINK_DATA_ADDR(dev->salt);
             return;
         }
     }
 
     c->dev_cons = realloc(c->dev_cons, (c->n_dev_cons + 1) * sizeof(struct fl_dev_con));
     c->dev_cons[c->n_dev_cons].dev = dev;
-
-    char *addr = c->dev_cons[c->n_dev_cons].addr;
-    sprintf(addr, "0x666C%06X", dev->salt & 0x00FFFFFF);
+    c->dev_cons[c->n_dev_cons].addr = NRF24_FELINK_DATA_ADDR(dev->salt);
     c->n_dev_cons++;
 }
 
@@ -196,29 +497,31 @@ void connection_dev_con_remove(struct fl_con_i *con, struct fl_dev_i *dev)
     c->n_dev_cons--;
 }
 
-static const char *connection_get_dev_con_addr(struct fl_con *c, struct fl_dev_i *dev)
+static const struct fl_dev_con *connection_get_dev_con(struct fl_con *c, struct fl_dev_i *dev)
 {
     if (dev != NULL)
         for (int i = 0; i < c->n_dev_cons; i++)
             if (c->dev_cons[i].dev == dev)
-                return c->dev_cons[i].addr;
+                return &c->dev_cons[i];
     return NULL;
 }
 
 int connection_tx_func(struct fl_dev_i *dev, uint8_t *buf, size_t count, void *con)
 {
     struct fl_con *c = con;
-    static char old_addr[16];
 
-    const char *addr = connection_get_dev_con_addr(c, dev);
-    if (addr != NULL && strcmp(addr, old_addr) != 0)
+    // 目的地址随数据交给驱动，地址不变时不再设置
+    const struct fl_dev_con *dc = connection_get_dev_con(c, dev);
+    if (dc != NULL && (!c->is_data_addr_set || c->data_addr != dc->addr))
     {
-        if (sysfs_puts("/sys/class/nrf24/nrf0.1/address", addr))
-            return EIO;
-        strcpy(old_addr, addr);
+        c->is_data_addr_set = 0;
+        if (ioctl(c->data_fd, NRF24_IOC_SET_TX_ADDR, &dc->addr) < 0)
+            return errno;
+        c->data_addr = dc->addr;
+        c->is_data_addr_set = 1;
     }
 
-    return nrf24_tx_func(c, buf, count, addr != NULL);
+    return nrf24_tx_func(c, buf, count, dc != NULL);
 }
 
 struct fl_con_i *connection_init(struct fl_base_i *base)
@@ -226,8 +529,6 @@ struct fl_con_i *connection_init(struct fl_base_i *base)
     struct fl_con *c = malloc(sizeof(struct fl_con));
 
     c->base = base;
-    if (nrf24_config())
-        return NULL;
     c->cmd_fd = open("/dev/nrf0.0", O_RDWR);
     if (c->cmd_fd < 0)
     {
@@ -235,6 +536,12 @@ struct fl_con_i *connection_init(struct fl_base_i *base)
         free(c);
         return NULL;
     }
+    if (nrf24_config(c->cmd_fd))
+    {
+        close(c->cmd_fd);
+        free(c);
+        return NULL;
+    }
     c->data_fd = open("/dev/nrf0.1", O_WRONLY);
     if (c->data_fd < 0)
     {
@@ -242,8 +549,16 @@ struct fl_con_i *connection_init(struct fl_base_i *base)
         free(c);
         return NULL;
     }
+    c->ring_map = mmap(NULL, NRF24_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, c->cmd_fd, 0);
+    if (c->ring_map == MAP_FAILED)
+        c->ring_map = NULL;
     c->dev_cons = malloc(8 * sizeof(struct fl_dev_con));
     c->n_dev_cons = 0;
+    c->data_addr = 0;
+    c->is_data_addr_set = 0;
+    for (int i = 0; i < CON_NRF24_FELINK_BLOCK_MAX; i++)
+        c->block_index[i] = i;
+    memset(c->rx_slots, 0, sizeof(c->rx_slots));
 
     fl_set_tx_func(base, connection_tx_func, c);
 
@@ -265,6 +580,11 @@ void connection_stop(struct fl_con_i *con)
 
     pthread_cancel(c->receive_thread);
     pthread_join(c->receive_thread, NULL);
+    for (int i = 0; i < CON_NRF24_RX_SLOTS; i++)
+        if (c->rx_slots[i].is_used)
+            nrf24_rx_slot_free(&c->rx_slots[i]);
+    if (c->ring_map != NULL)
+        munmap(c->ring_map, NRF24_RING_MAP_SIZE);
     close(c->cmd_fd);
     free(c);
 }
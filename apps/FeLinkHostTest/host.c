@@ -1,5 +1,9 @@
+#define _GNU_SOURCE
+
 #include "host.h"
+#include "metrics.h"
 #include "cJSON/cJSON.h"
+#include "FeLinkBase/rng.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -9,18 +13,26 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <pthread.h>
-#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <openssl/ssl.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #define H_PRINT_ERR (1 << 0)
 #define H_PRINT_CMD (1 << 1)
 #define H_PRINT_INFO (1 << 2)
 #define H_PRINT_DISPLAY (H_PRINT_ERR | H_PRINT_INFO)
-#define host_printf(type, format, ...) \
-    if (H_PRINT_DISPLAY & (type))      \
+// H_PRINT_CMD另受运行时开关METRICS_LOG_CMD控制
+#define host_printf(type, format, ...)                                                                 \
+    if ((H_PRINT_DISPLAY & (type)) && (!((type) & H_PRINT_CMD) || metrics_log_is_on(METRICS_LOG_CMD))) \
         printf(format, ##__VA_ARGS__)
 
 typedef enum
@@ -34,33 +46,213 @@ typedef enum
     CCMD_DATA = 6,
     CCMD_SET_TIMEOUT = 7,
     CCMD_SET_MAXRET = 8,
+    CCMD_SET_WINDOW = 9,
+    CCMD_STATS = 10,
     CCMD_LOGIN = -1,
     CCMD_REGISTER = -2,
     CCMD_CHANGE_PASSWORD = -3,
 
 } client_cmd;
 
+#define HOST_EPOLL_EVENTS 32
+#define HOST_CONFIRM_DELAY_MS 1000
+#define HOST_RX_BUF_INIT_SIZE 1024
+#define HOST_INDEX_MIN_SIZE 16
+#define HOST_PASSWORD_PBKDF2_ITER 2048
+#define HOST_PW_RATE_SLOTS 32
+#define HOST_PW_RATE_BURST 5          // 每个IP最多连续的口令运算次数
+#define HOST_PW_RATE_INTERVAL_MS 2000 // 每个IP恢复一次口令运算的间隔
+#define HOST_TLS_SESSION_ID_CONTEXT "FeLinkHost"
+#define HOST_TLS_SESSION_CACHE_SIZE 128
+#define HOST_TLS_SESSION_TIMEOUT (24 * 3600)
+#define HOST_TLS_TICKET_KEYS 2 // 当前密钥与上一个密钥
+#define HOST_TLS_TICKET_KEY_LIFETIME (12 * 3600)
+#define HOST_TLS_TICKET_NAME_SIZE 16
+#define HOST_TLS_TICKET_KEY_SIZE 32
+
 typedef enum
 {
     HCMD_ACK = 0,
     HCMD_INFO = 1,
+    HCMD_DEV_DELTA = 2,
+    HCMD_STATS = 3,
     HCMD_CONFIRM = -1,
 } host_cmd;
 
+/*  BIN帧
+    u8      chksum8
+    char[3] "BIN"
+    u32     len
+    s8      ccmd/hcmd
+    ...
+
+    客户端发送BIN帧后，主机对该客户端的回复和广播也改用BIN帧，发送CMD帧则切换回JSON
+
+    广播给用户的HCMD_INFO和HCMD_DEV_DELTA带有该用户递增的seq，单独回复的HCMD_INFO带当前seq，
+    HCMD_DEV_DELTA只含相对上次广播变化的字段，客户端发现seq不连续时应发送CCMD_INFO重新同步
+    所有多字节字段均为小端，登录、注册和修改密码仅支持JSON
+
+    CCMD_INFO / CCMD_INIT / CCMD_SCAN / CCMD_STATS: 无
+    CCMD_PAIR / CCMD_CONNECT / CCMD_UNPAIR:
+        u32     id
+    CCMD_DATA:
+        u32     id
+        u8      is_plaintext
+        u8      padding_align
+        u8[]    data
+    CCMD_SET_TIMEOUT:   u32 id, u16 timeout
+    CCMD_SET_MAXRET:    u32 id, u8 max_retrans
+    CCMD_SET_WINDOW:    u32 id, u8 tx_window
+
+    HCMD_ACK:
+        u32     id
+        u32     delay
+        u32     count
+        u32     loss
+    HCMD_INFO:
+        u32     seq
+        u8      is_use_only
+        u8      username_len
+        char[]  username
+        u16     n_devs
+        devs[]
+        {
+            u32     id
+            u32     type
+            u16     version
+            u8      state
+            u16     timeout
+            u8      max_retrans
+            u8      tx_window
+            u32     tx_packet_delay
+            u32     tx_packet_count
+            u32     tx_packet_loss
+            u8      name_len
+            char[]  name
+        }
+    HCMD_DEV_DELTA:
+        u32     seq
+        u32     id
+        u16     mask
+        u32     old_id              HOST_DELTA_ID
+        u8      state               HOST_DELTA_STATE
+        u16     timeout             HOST_DELTA_TIMEOUT
+        u8      max_retrans         HOST_DELTA_MAX_RETRANS
+        u8      tx_window           HOST_DELTA_TX_WINDOW
+        u32     tx_packet_delay     HOST_DELTA_TX_PACKET_DELAY
+        u32     tx_packet_count     HOST_DELTA_TX_PACKET_COUNT
+        u32     tx_packet_loss      HOST_DELTA_TX_PACKET_LOSS
+    HCMD_STATS:
+        char[]  text                Prometheus文本格式，见metrics_dump，JSON中为"text"字段
+    HCMD_CONFIRM:
+        u8      is_success
+*/
+#define HOST_DELTA_ID (1 << 0)
+#define HOST_DELTA_STATE (1 << 1)
+#define HOST_DELTA_TIMEOUT (1 << 2)
+#define HOST_DELTA_MAX_RETRANS (1 << 3)
+#define HOST_DELTA_TX_WINDOW (1 << 4)
+#define HOST_DELTA_TX_PACKET_DELAY (1 << 5)
+#define HOST_DELTA_TX_PACKET_COUNT (1 << 6)
+#define HOST_DELTA_TX_PACKET_LOSS (1 << 7)
+#define HOST_DELTA_ALL 0xFF
+#define HOST_BIN_DEV_RECORD_SIZE 28
+
+typedef enum
+{
+    CLIENT_PROTO_JSON = 0,
+    CLIENT_PROTO_BIN = 1,
+} client_proto;
+
+// 引用计数的完整帧(含帧头)，可同时挂在多个客户端的发送队列中
+struct host_buf
+{
+    int refs;
+    struct fl_host *host;
+    int pool_class; // -1为超出最大尺寸级别，直接使用堆
+    struct host_buf *next_free;
+    size_t len;
+    uint8_t data[];
+};
+
+// 帧(含帧头)缓冲池的尺寸级别
+static const size_t host_buf_pool_class_size[HOST_BUF_POOL_CLASSES] = {
+    64,
+    256,
+    1024,
+    4096,
+    16384,
+};
+
+struct host_dev_stats
+{
+    const struct fl_dev_i *dev;
+    uint32_t id;
+    fl_state state;
+    uint16_t timeout;
+    uint8_t max_retrans;
+    uint8_t tx_window;
+    time_t tx_packet_delay;
+    size_t tx_packet_count;
+    size_t tx_packet_loss;
+};
+
+// 用户设备列表的序列化缓存，version由变化事件递增，stats用于发现ACK统计等无事件的变化
+struct host_info_cache
+{
+    uint32_t version;
+    uint32_t cached_version;
+    struct host_dev_stats *stats;
+    int n_stats;
+    struct host_buf *frame[2]; // CLIENT_PROTO_JSON, CLIENT_PROTO_BIN
+
+    // 最近一次广播给该用户所有客户端的设备状态，作为增量的基准
+    uint32_t seq;
+    struct host_dev_stats *sent;
+    int n_sent;
+};
+
+struct host_dev_delta
+{
+    uint32_t seq;
+    uint32_t old_id;
+    uint16_t mask;
+    struct host_dev_stats now;
+};
+
+// 开放寻址(线性探测)的指针索引，删除时整体重建，装载率不超过1/2
+struct host_index
+{
+    void **slots;
+    int size;
+    int n;
+};
+
+typedef uint32_t (*host_index_hash_t)(const void *item);
+
 struct fl_user
 {
     struct fl_host *host;
     char *username;
     struct fl_dev_i **available_devs;
     int n_available_devs;
+    struct host_index available_dev_index;
     struct fl_client **clients;
     int n_clients;
     int is_use_only;
 
     uint8_t password_hash[HOST_PASSWORD_HASH_SIZE];
     uint8_t password_salt[HOST_PASSWORD_SALT_SIZE];
+
+    struct host_info_cache info;
 };
 
+typedef enum
+{
+    CLIENT_STATE_HANDSHAKE = 0,
+    CLIENT_STATE_ESTABLISHED = 1,
+} client_state;
+
 struct fl_client
 {
     struct fl_host *host;
@@ -69,8 +261,79 @@ struct fl_client
 
     int fd;
     SSL *ssl;
-    pthread_t receive_thread;
     pthread_mutex_t ssl_mutex;
+    client_state state;
+    client_proto proto;
+    uint32_t serial;
+    uint32_t events;
+    int is_want_write;
+    struct host_buf **tx_queue; // 环形队列
+    int tx_head;
+    int n_tx_queued;
+    int tx_queue_size;
+    size_t tx_off;
+    uint8_t *rx_buf;
+    size_t rx_off;
+    size_t rx_len;
+    size_t rx_size;
+    int is_confirm_delayed;
+    struct timespec confirm_time;
+    int is_pw_pending;
+    int is_closed;
+    struct fl_client *next_closed;
+};
+
+// FeLink异步发送完成后由调度线程入队，reactor线程回复HCMD_ACK
+struct host_tx_done
+{
+    struct host_tx_done *next;
+    struct fl_host *host;
+    struct fl_client *client;
+    uint32_t serial;
+    uint32_t dev_id;
+    const char *what;
+    int res;
+};
+
+/*  口令运算任务
+    PBKDF2在工作线程中计算，期间暂停读取该客户端，完成后由reactor线程核对并回复HCMD_CONFIRM
+    提交时复制用户当前的salt与hash，完成时用户若已被修改则按失败处理
+*/
+struct host_pw_job
+{
+    struct host_pw_job *next;
+    struct fl_client *client;
+    uint32_t serial;
+    client_cmd cmd;
+    char *username;
+    char *password;
+    char *new_password;
+    int is_use_only;
+    int is_match;
+    uint8_t salt[HOST_PASSWORD_SALT_SIZE];
+    uint8_t expect_hash[HOST_PASSWORD_HASH_SIZE];
+    uint8_t new_salt[HOST_PASSWORD_SALT_SIZE];
+    uint8_t new_hash[HOST_PASSWORD_HASH_SIZE];
+};
+
+// 按IP的令牌桶，只在reactor线程中访问
+struct host_pw_rate
+{
+    in_addr_t addr;
+    int tokens;
+    struct timespec last;
+};
+
+/*  会话票据密钥
+    每HOST_TLS_TICKET_KEY_LIFETIME秒轮换一次，上一个密钥仍可解密(并要求客户端换发新票据)
+    随host.sav保存，重启后已发出的票据依然有效
+*/
+struct host_ticket_key
+{
+    uint8_t name[HOST_TLS_TICKET_NAME_SIZE];
+    uint8_t aes_key[HOST_TLS_TICKET_KEY_SIZE];
+    uint8_t hmac_key[HOST_TLS_TICKET_KEY_SIZE];
+    time_t created;
 };
 
 struct fl_host
@@ -78,14 +341,59 @@ struct fl_host
     struct fl_base_i *base;
     struct fl_user **users;
     int n_users;
+    struct host_index user_index;
     struct fl_client **clients;
     int n_clients;
     struct sockaddr_in addr;
 
     int fd;
+    int backlog;
+    uint32_t max_frame_size;
     SSL_CTX *ctx;
-    pthread_t accept_thread;
+    char *ecdsa_cert;
+    char *ecdsa_key;
+    pthread_mutex_t ticket_mutex;
+    struct host_ticket_key ticket_keys[HOST_TLS_TICKET_KEYS];
+    int n_ticket_keys;
+    int epoll_fd;
+    int event_fd;
+    pthread_t reactor_thread;
+    int is_reactor_stop;
+    uint32_t client_serial;
+    pthread_mutex_t clients_mutex;
+    pthread_mutex_t tx_done_mutex;
+    pthread_mutex_t info_mutex;
+    pthread_mutex_t buf_pool_mutex;
+    struct host_buf *buf_free[HOST_BUF_POOL_CLASSES];
+    size_t n_buf_free[HOST_BUF_POOL_CLASSES];
+    size_t n_buf_in_use[HOST_BUF_POOL_CLASSES];
+    size_t buf_high_water[HOST_BUF_POOL_CLASSES];
+    size_t n_buf_oversize;
+    pthread_cond_t tx_done_cond;
+    struct host_tx_done *tx_done;
+    int n_tx_pending;
     struct fl_client *client_pairing_dev;
+    // 已关闭但可能仍在本轮epoll事件中的客户端，reactor每轮结束后释放
+    struct fl_client *closed_clients;
+
+    pthread_t *pw_threads;
+    int n_pw_workers;
+    int n_pw_threads;
+    int pw_queue_max;
+    pthread_mutex_t pw_mutex;
+    pthread_cond_t pw_cond;
+    int is_pw_stop;
+    struct host_pw_job *pw_queue;
+    struct host_pw_job *pw_queue_tail;
+    int n_pw_queued;
+    struct host_pw_job *pw_done;
+    struct host_pw_rate pw_rates[HOST_PW_RATE_SLOTS];
+
+    // 自上次host_save/host_save_journal后变化的用户名及票据密钥，由journal_mutex保护
+    pthread_mutex_t journal_mutex;
+    char **journal_users;
+    int n_journal_users;
+    int is_journal_ticket_keys;
 
     host_change_callback_t host_change_callback;
     void *host_change_private_arg;
@@ -112,6 +420,18 @@ static void host_wr32(uint8_t *p, uint32_t val)
     *p++ = (uint8_t)val;
 }
 
+static void host_wr16(uint8_t *p, uint16_t val)
+{
+    *p++ = (uint8_t)val;
+    val >>= 8;
+    *p++ = (uint8_t)val;
+}
+
+static uint16_t host_rd16(const uint8_t *p)
+{
+    return (uint16_t)(p[1] << 8 | p[0]);
+}
+
 static uint8_t host_chksum8(const uint8_t *bytes, size_t len)
 {
     uint8_t chksum8 = 0;
@@ -120,66 +440,278 @@ static uint8_t host_chksum8(const uint8_t *bytes, size_t len)
     return ~chksum8;
 }
 
-static int host_random(uint8_t *dest, size_t size)
+static void host_call_host_change(struct fl_host *h, struct fl_dev_i *dev, host_change_type type)
+{
+    if (h->host_change_callback != NULL)
+        h->host_change_callback((struct fl_host_i *)h, dev, type, h->host_change_private_arg);
+}
+
+// username为NULL时记录票据密钥的变化
+static void host_journal_mark(struct fl_host *h, const char *username)
 {
-    int fd = open("/dev/urandom", O_RDONLY);
-    if (fd == -1)
+    pthread_mutex_lock(&h->journal_mutex);
+    if (username == NULL)
     {
-        fd = open("/dev/random", O_RDONLY);
-        if (fd == -1)
-            perror("no random generator");
+        h->is_journal_ticket_keys = 1;
+        goto host_journal_mark_unlock;
     }
+    for (int i = 0; i < h->n_journal_users; i++)
+        if (strcmp(h->journal_users[i], username) == 0)
+            goto host_journal_mark_unlock;
+    char **users = realloc(h->journal_users, (h->n_journal_users + 1) * sizeof(char *));
+    if (users == NULL)
+        goto host_journal_mark_unlock;
+    h->journal_users = users;
+    h->journal_users[h->n_journal_users] = strdup(username);
+    if (h->journal_users[h->n_journal_users] != NULL)
+        h->n_journal_users++;
+host_journal_mark_unlock:
+    pthread_mutex_unlock(&h->journal_mutex);
+}
+
+// 需持有journal_mutex
+static void host_journal_clear(struct fl_host *h)
+{
+    for (int i = 0; i < h->n_journal_users; i++)
+        free(h->journal_users[i]);
+    h->n_journal_users = 0;
+    h->is_journal_ticket_keys = 0;
+}
+
+static struct host_buf *host_buf_alloc(struct fl_host *h, const char *tag, size_t len)
+{
+    int pool_class = 0;
+    while (pool_class < HOST_BUF_POOL_CLASSES && 8 + len > host_buf_pool_class_size[pool_class])
+        pool_class++;
 
-    char *ptr = (char *)dest;
-    size_t left = size;
-    while (left > 0)
+    struct host_buf *buf = NULL;
+    pthread_mutex_lock(&h->buf_pool_mutex);
+    if (pool_class < HOST_BUF_POOL_CLASSES)
+    {
+        buf = h->buf_free[pool_class];
+        if (buf != NULL)
+        {
+            h->buf_free[pool_class] = buf->next_free;
+            h->n_buf_free[pool_class]--;
+        }
+        if (++h->n_buf_in_use[pool_class] > h->buf_high_water[pool_class])
+            h->buf_high_water[pool_class] = h->n_buf_in_use[pool_class];
+    }
+    else
+    {
+        pool_class = -1;
+        h->n_buf_oversize++;
+    }
+    pthread_mutex_unlock(&h->buf_pool_mutex);
+    if (buf == NULL)
+        buf = malloc(sizeof(struct host_buf) + (pool_class < 0 ? 8 + len : host_buf_pool_class_size[pool_class]));
+    if (buf == NULL)
     {
-        ssize_t bytes_read = read(fd, ptr, left);
-        if (bytes_read <= 0)
+        if (pool_class >= 0)
         {
-            close(fd);
-            return EIO;
+            pthread_mutex_lock(&h->buf_pool_mutex);
+            h->n_buf_in_use[pool_class]--;
+            pthread_mutex_unlock(&h->buf_pool_mutex);
         }
-        left -= bytes_read;
-        ptr += bytes_read;
+        return NULL;
     }
+    buf->refs = 1;
+    buf->host = h;
+    buf->pool_class = pool_class;
+    buf->next_free = NULL;
+    buf->len = 8 + len;
+    buf->data[0] = 0;
+    memcpy(&buf->data[1], tag, 3);
+    host_wr32(&buf->data[4], (uint32_t)len);
+    buf->data[0] = host_chksum8(buf->data, 8);
+    return buf;
+}
 
-    close(fd);
-    return 0;
+static void host_buf_pool_free(struct fl_host *h)
+{
+    for (int i = 0; i < HOST_BUF_POOL_CLASSES; i++)
+        while (h->buf_free[i] != NULL)
+        {
+            struct host_buf *buf = h->buf_free[i];
+            h->buf_free[i] = buf->next_free;
+            free(buf);
+        }
+    pthread_mutex_destroy(&h->buf_pool_mutex);
 }
 
-static void host_call_host_change(struct fl_host *h, struct fl_dev_i *dev, host_change_type type)
+static struct host_buf *host_buf_get(struct host_buf *buf)
 {
-    if (h->host_change_callback != NULL)
-        h->host_change_callback((struct fl_host_i *)h, dev, type, h->host_change_private_arg);
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
 }
 
-static int host_transmit(
-    struct fl_client *c,
-    char *json_str)
+static void host_buf_put(struct host_buf *buf)
 {
-    size_t len = strlen(json_str);
-    uint8_t head[8];
-    head[0] = 0;
-    strncpy((char *)&head[1], "CMD", 3);
-    host_wr32(&head[4], (uint32_t)len);
-    head[0] = host_chksum8(head, 8);
-    uint8_t *msg = malloc(8 + len);
-    memcpy(msg, head, 8);
-    memcpy(&msg[8], json_str, len);
+    if (buf == NULL || __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    struct fl_host *h = buf->host;
+    int pool_class = buf->pool_class;
+    if (pool_class < 0)
+    {
+        free(buf);
+        return;
+    }
+
+    pthread_mutex_lock(&h->buf_pool_mutex);
+    h->n_buf_in_use[pool_class]--;
+    if (h->n_buf_free[pool_class] < HOST_BUF_POOL_MAX_FREE)
+    {
+        buf->next_free = h->buf_free[pool_class];
+        h->buf_free[pool_class] = buf;
+        h->n_buf_free[pool_class]++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&h->buf_pool_mutex);
+    free(buf);
+}
+
+// 延迟确认或口令运算期间不读取该客户端
+static int host_client_is_paused(const struct fl_client *c)
+{
+    return c->is_confirm_delayed || c->is_pw_pending;
+}
+
+// 需持有ssl_mutex
+static void host_client_update_events(struct fl_client *c)
+{
+    uint32_t events = 0;
+    if (!host_client_is_paused(c))
+        events |= EPOLLIN;
+    if (c->n_tx_queued > 0 || c->is_want_write)
+        events |= EPOLLOUT;
+    if (events == c->events)
+        return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->host->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->events = events;
+}
+
+// 需持有ssl_mutex，写不完的部分留在发送队列中等待EPOLLOUT
+static int host_client_flush(struct fl_client *c)
+{
+    int res = 0;
+    c->is_want_write = 0;
+    while (c->n_tx_queued > 0)
+    {
+        struct host_buf *buf = c->tx_queue[c->tx_head];
+        size_t bytes_write;
+        uint64_t start = metrics_time_us();
+        int ret = SSL_write_ex(c->ssl, &buf->data[c->tx_off], buf->len - c->tx_off, &bytes_write);
+        metrics_observe(METRICS_TLS_WRITE, metrics_time_us() - start);
+        if (ret <= 0)
+        {
+            int err = SSL_get_error(c->ssl, ret);
+            if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ)
+                res = EIO;
+            break;
+        }
+        metrics_count(METRICS_TLS_WRITE_BYTES, bytes_write);
+        c->tx_off += bytes_write;
+        if (c->tx_off < buf->len)
+            continue;
+        host_buf_put(buf);
+        c->tx_head = (c->tx_head + 1) % c->tx_queue_size;
+        c->n_tx_queued--;
+        c->tx_off = 0;
+    }
+    host_client_update_events(c);
+
+    return res;
+}
 
+// 入队时增加引用，不复制数据
+static int host_transmit_buf(
+    struct fl_client *c,
+    struct host_buf *buf)
+{
     pthread_mutex_lock(&c->ssl_mutex);
-    int bytes_write = SSL_write(c->ssl, msg, 8 + len);
+    if (c->n_tx_queued == c->tx_queue_size)
+    {
+        int size = c->tx_queue_size ? c->tx_queue_size * 2 : 8;
+        struct host_buf **queue = malloc(size * sizeof(struct host_buf *));
+        if (queue == NULL)
+        {
+            pthread_mutex_unlock(&c->ssl_mutex);
+            return ENOMEM;
+        }
+        for (int i = 0; i < c->n_tx_queued; i++)
+            queue[i] = c->tx_queue[(c->tx_head + i) % c->tx_queue_size];
+        free(c->tx_queue);
+        c->tx_queue = queue;
+        c->tx_queue_size = size;
+        c->tx_head = 0;
+    }
+    c->tx_queue[(c->tx_head + c->n_tx_queued) % c->tx_queue_size] = host_buf_get(buf);
+    c->n_tx_queued++;
+    int res = host_client_flush(c);
     pthread_mutex_unlock(&c->ssl_mutex);
 
-    host_printf(H_PRINT_CMD, "H: %s:%hu: %s\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), json_str);
+    if (buf->data[1] == 'C')
+    {
+        host_printf(H_PRINT_CMD, "H: %s:%hu: %.*s\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), (int)(buf->len - 8), (char *)&buf->data[8]);
+    }
+    else
+    {
+        host_printf(H_PRINT_CMD, "H: %s:%hu: BIN hcmd %d, %zu bytes\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), (int8_t)buf->data[8], buf->len - 8);
+    }
+
+    return res;
+}
+
+static int host_transmit_frame(
+    struct fl_client *c,
+    const char *tag,
+    const void *body,
+    size_t len)
+{
+    struct host_buf *buf = host_buf_alloc(c->host, tag, len);
+    if (buf == NULL)
+        return ENOMEM;
+    memcpy(&buf->data[8], body, len);
+
+    int res = host_transmit_buf(c, buf);
+    host_buf_put(buf);
+
+    return res;
+}
+
+static int host_transmit(
+    struct fl_client *c,
+    char *json_str)
+{
+    return host_transmit_frame(c, "CMD", json_str, strlen(json_str));
+}
 
-    free(msg);
-    return bytes_write != 8 + len;
+static int host_transmit_bin(
+    struct fl_client *c,
+    const uint8_t *body,
+    size_t len)
+{
+    return host_transmit_frame(c, "BIN", body, len);
 }
 
 static int host_hcmd_ack(struct fl_client *c, struct fl_dev_i *dev)
 {
+    if (c->proto == CLIENT_PROTO_BIN)
+    {
+        uint8_t body[17];
+        body[0] = (uint8_t)HCMD_ACK;
+        host_wr32(&body[1], dev->id);
+        host_wr32(&body[5], (uint32_t)dev->tx_packet_delay);
+        host_wr32(&body[9], (uint32_t)dev->tx_packet_count);
+        host_wr32(&body[13], (uint32_t)dev->tx_packet_loss);
+        return host_transmit_bin(c, body, sizeof(body));
+    }
+
     cJSON *json = cJSON_CreateObject();
     cJSON_AddItemToObject(json, "hcmd", cJSON_CreateNumber(HCMD_ACK));
     cJSON_AddItemToObject(json, "id", cJSON_CreateNumber(dev->id));
@@ -191,20 +723,22 @@ static int host_hcmd_ack(struct fl_client *c, struct fl_dev_i *dev)
 
     int res = host_transmit(c, json_str);
 
+    cJSON_free(json_str);
     cJSON_Delete(json);
     return res;
 }
 
-static int host_hcmd_info(struct fl_client *c)
+static struct host_buf *host_json_info(struct fl_user *u)
 {
     cJSON *json = cJSON_CreateObject();
     cJSON_AddItemToObject(json, "hcmd", cJSON_CreateNumber(HCMD_INFO));
-    cJSON_AddItemToObject(json, "username", cJSON_CreateString(c->user->username));
-    cJSON_AddItemToObject(json, "is_use_only", cJSON_CreateBool(c->user->is_use_only));
+    cJSON_AddItemToObject(json, "seq", cJSON_CreateNumber(u->info.seq));
+    cJSON_AddItemToObject(json, "username", cJSON_CreateString(u->username));
+    cJSON_AddItemToObject(json, "is_use_only", cJSON_CreateBool(u->is_use_only));
     cJSON *json_devs = cJSON_CreateArray();
-    for (int i = 0; i < c->user->n_available_devs; i++)
+    for (int i = 0; i < u->n_available_devs; i++)
     {
-        struct fl_dev_i *d = c->user->available_devs[i];
+        struct fl_dev_i *d = u->available_devs[i];
         cJSON *json_dev = cJSON_CreateObject();
         cJSON_AddItemToObject(json_dev, "id", cJSON_CreateNumber(d->id));
         cJSON_AddItemToObject(json_dev, "type", cJSON_CreateNumber(d->type));
@@ -213,124 +747,694 @@ static int host_hcmd_info(struct fl_client *c)
         cJSON_AddItemToObject(json_dev, "state", cJSON_CreateNumber(d->state));
         cJSON_AddItemToObject(json_dev, "timeout", cJSON_CreateNumber(d->timeout));
         cJSON_AddItemToObject(json_dev, "max_retrans", cJSON_CreateNumber(d->max_retrans));
+        cJSON_AddItemToObject(json_dev, "tx_window", cJSON_CreateNumber(d->tx_window));
         cJSON_AddItemToObject(json_dev, "tx_packet_delay", cJSON_CreateNumber(d->tx_packet_delay));
         cJSON_AddItemToObject(json_dev, "tx_packet_count", cJSON_CreateNumber(d->tx_packet_count));
         cJSON_AddItemToObject(json_dev, "tx_packet_loss", cJSON_CreateNumber(d->tx_packet_loss));
         cJSON_AddItemToArray(json_devs, json_dev);
     }
     cJSON_AddItemToObject(json, "devs", json_devs);
-    char *json_str = cJSON_PrintUnformatted(json);
-
-    int res = host_transmit(c, json_str);
 
+    char *json_str = cJSON_PrintUnformatted(json);
     cJSON_Delete(json);
-    return res;
+    if (json_str == NULL)
+        return NULL;
+
+    size_t len = strlen(json_str);
+    struct host_buf *buf = host_buf_alloc(u->host, "CMD", len);
+    if (buf != NULL)
+        memcpy(&buf->data[8], json_str, len);
+    cJSON_free(json_str);
+    return buf;
 }
 
-static int host_hcmd_info_broadcast(struct fl_user *u)
+static struct host_buf *host_bin_info(struct fl_user *u)
 {
-    cJSON *json = cJSON_CreateObject();
-    cJSON_AddItemToObject(json, "hcmd", cJSON_CreateNumber(HCMD_INFO));
-    cJSON_AddItemToObject(json, "username", cJSON_CreateString(u->username));
-    cJSON_AddItemToObject(json, "is_use_only", cJSON_CreateBool(u->is_use_only));
-    cJSON *json_devs = cJSON_CreateArray();
+    size_t username_len = strlen(u->username);
+    if (username_len > UINT8_MAX)
+        username_len = UINT8_MAX;
+    size_t size = 1 + 4 + 1 + 1 + username_len + 2;
     for (int i = 0; i < u->n_available_devs; i++)
     {
-        struct fl_dev_i *d = u->available_devs[i];
-        cJSON *json_dev = cJSON_CreateObject();
-        cJSON_AddItemToObject(json_dev, "id", cJSON_CreateNumber(d->id));
-        cJSON_AddItemToObject(json_dev, "type", cJSON_CreateNumber(d->type));
-        cJSON_AddItemToObject(json_dev, "version", cJSON_CreateNumber(d->version));
-        cJSON_AddItemToObject(json_dev, "name", cJSON_CreateString(d->name));
-        cJSON_AddItemToObject(json_dev, "state", cJSON_CreateNumber(d->state));
-        cJSON_AddItemToObject(json_dev, "timeout", cJSON_CreateNumber(d->timeout));
-        cJSON_AddItemToObject(json_dev, "max_retrans", cJSON_CreateNumber(d->max_retrans));
-        cJSON_AddItemToObject(json_dev, "tx_packet_delay", cJSON_CreateNumber(d->tx_packet_delay));
-        cJSON_AddItemToObject(json_dev, "tx_packet_count", cJSON_CreateNumber(d->tx_packet_count));
-        cJSON_AddItemToObject(json_dev, "tx_packet_loss", cJSON_CreateNumber(d->tx_packet_loss));
-        cJSON_AddItemToArray(json_devs, json_dev);
+        size_t name_len = strlen(u->available_devs[i]->name);
+        size += HOST_BIN_DEV_RECORD_SIZE + (name_len > UINT8_MAX ? UINT8_MAX : name_len);
     }
-    cJSON_AddItemToObject(json, "devs", json_devs);
 
-    char *json_str = cJSON_PrintUnformatted(json);
-    int res;
-    for (int i = 0; i < u->n_clients; i++)
+    struct host_buf *buf = host_buf_alloc(u->host, "BIN", size);
+    if (buf == NULL)
+        return NULL;
+    uint8_t *ptr = &buf->data[8];
+    *ptr++ = (uint8_t)HCMD_INFO;
+    host_wr32(ptr, u->info.seq);
+    ptr += 4;
+    *ptr++ = u->is_use_only ? 1 : 0;
+    *ptr++ = (uint8_t)username_len;
+    memcpy(ptr, u->username, username_len);
+    ptr += username_len;
+    host_wr16(ptr, (uint16_t)u->n_available_devs);
+    ptr += 2;
+    for (int i = 0; i < u->n_available_devs; i++)
     {
-        res = host_transmit(u->clients[i], json_str);
-        if (res)
-            break;
+        struct fl_dev_i *d = u->available_devs[i];
+        size_t name_len = strlen(d->name);
+        if (name_len > UINT8_MAX)
+            name_len = UINT8_MAX;
+        host_wr32(&ptr[0], d->id);
+        host_wr32(&ptr[4], d->type);
+        host_wr16(&ptr[8], d->version);
+        ptr[10] = (uint8_t)d->state;
+        host_wr16(&ptr[11], d->timeout);
+        ptr[13] = d->max_retrans;
+        ptr[14] = d->tx_window;
+        host_wr32(&ptr[15], (uint32_t)d->tx_packet_delay);
+        host_wr32(&ptr[19], (uint32_t)d->tx_packet_count);
+        host_wr32(&ptr[23], (uint32_t)d->tx_packet_loss);
+        ptr[27] = (uint8_t)name_len;
+        memcpy(&ptr[28], d->name, name_len);
+        ptr += HOST_BIN_DEV_RECORD_SIZE + name_len;
     }
 
-    cJSON_Delete(json);
-    return res;
+    return buf;
 }
 
-static int host_hcmd_confirm(struct fl_client *c, int is_success)
+static void host_dev_stats_fill(struct host_dev_stats *st, const struct fl_dev_i *d)
 {
-    cJSON *json = cJSON_CreateObject();
-    cJSON_AddItemToObject(json, "hcmd", cJSON_CreateNumber(HCMD_CONFIRM));
-    cJSON_AddItemToObject(json, "is_success", cJSON_CreateBool(is_success));
+    st->dev = d;
+    st->id = d->id;
+    st->state = d->state;
+    st->timeout = d->timeout;
+    st->max_retrans = d->max_retrans;
+    st->tx_window = d->tx_window;
+    st->tx_packet_delay = d->tx_packet_delay;
+    st->tx_packet_count = d->tx_packet_count;
+    st->tx_packet_loss = d->tx_packet_loss;
+}
 
-    char *json_str = cJSON_PrintUnformatted(json);
+static uint16_t host_dev_stats_diff(const struct host_dev_stats *old, const struct host_dev_stats *now)
+{
+    uint16_t mask = 0;
+    if (old->id != now->id)
+        mask |= HOST_DELTA_ID;
+    if (old->state != now->state)
+        mask |= HOST_DELTA_STATE;
+    if (old->timeout != now->timeout)
+        mask |= HOST_DELTA_TIMEOUT;
+    if (old->max_retrans != now->max_retrans)
+        mask |= HOST_DELTA_MAX_RETRANS;
+    if (old->tx_window != now->tx_window)
+        mask |= HOST_DELTA_TX_WINDOW;
+    if (old->tx_packet_delay != now->tx_packet_delay)
+        mask |= HOST_DELTA_TX_PACKET_DELAY;
+    if (old->tx_packet_count != now->tx_packet_count)
+        mask |= HOST_DELTA_TX_PACKET_COUNT;
+    if (old->tx_packet_loss != now->tx_packet_loss)
+        mask |= HOST_DELTA_TX_PACKET_LOSS;
+    return mask;
+}
 
-    int res = host_transmit(c, json_str);
+// 需持有info_mutex
+static int host_info_cache_is_valid(struct fl_user *u)
+{
+    struct host_info_cache *cache = &u->info;
 
-    cJSON_Delete(json);
-    return res;
+    if (cache->stats == NULL || cache->cached_version != cache->version)
+        return 0;
+    if (cache->n_stats != u->n_available_devs)
+        return 0;
+    for (int i = 0; i < cache->n_stats; i++)
+    {
+        struct host_dev_stats now;
+        host_dev_stats_fill(&now, u->available_devs[i]);
+        if (cache->stats[i].dev != now.dev || host_dev_stats_diff(&cache->stats[i], &now))
+            return 0;
+    }
+    return 1;
 }
 
-static struct fl_user *host_user_get_by_name(
-    struct fl_host *h,
-    const char *username)
+// 需持有info_mutex
+static void host_info_cache_clear(struct host_info_cache *cache)
 {
-    for (int i = 0; i < h->n_users; i++)
-        if (strcmp(h->users[i]->username, username) == 0)
-            return h->users[i];
-    return NULL;
+    for (int i = 0; i < 2; i++)
+    {
+        host_buf_put(cache->frame[i]);
+        cache->frame[i] = NULL;
+    }
+    free(cache->stats);
+    cache->stats = NULL;
+    cache->n_stats = 0;
 }
 
-static int host_user_dev_is_accessable(
-    struct fl_user *u,
-    struct fl_dev_i *d)
+// 需持有info_mutex
+static void host_info_cache_free(struct host_info_cache *cache)
+{
+    host_info_cache_clear(cache);
+    free(cache->sent);
+    cache->sent = NULL;
+    cache->n_sent = 0;
+}
+
+// 需持有info_mutex
+static int host_info_cache_refresh(struct fl_user *u)
 {
+    struct host_info_cache *cache = &u->info;
+
+    host_info_cache_clear(cache);
+    cache->stats = malloc((u->n_available_devs + 1) * sizeof(struct host_dev_stats));
+    if (cache->stats == NULL)
+        return ENOMEM;
     for (int i = 0; i < u->n_available_devs; i++)
-        if (u->available_devs[i] == d)
-            return 1;
+        host_dev_stats_fill(&cache->stats[i], u->available_devs[i]);
+    cache->n_stats = u->n_available_devs;
+    cache->cached_version = cache->version;
     return 0;
 }
 
-static void host_user_client_add(
-    struct fl_user *u,
-    struct fl_client *c)
+static void host_user_info_invalidate(struct fl_user *u)
 {
-    for (int i = 0; i < u->n_clients; i++)
-        if (u->clients[i] == c)
-            return;
-    u->clients = realloc(u->clients, (u->n_clients + 1) * sizeof(struct fl_dev_i *));
-    u->clients[u->n_clients] = c;
-    u->n_clients++;
-    c->user = u;
-    host_hcmd_info(c);
+    pthread_mutex_lock(&u->host->info_mutex);
+    u->info.version++;
+    pthread_mutex_unlock(&u->host->info_mutex);
 }
 
-static void host_user_client_remove(struct fl_client *c)
+// 返回带引用的HCMD_INFO帧，用完需host_buf_put
+static struct host_buf *host_user_info_get(struct fl_user *u, client_proto proto)
 {
-    struct fl_user *u = c->user;
+    struct host_info_cache *cache = &u->info;
+    struct host_buf *buf = NULL;
+
+    pthread_mutex_lock(&u->host->info_mutex);
+    if (!host_info_cache_is_valid(u) && host_info_cache_refresh(u))
+        goto host_user_info_get_unlock;
+    if (cache->frame[proto] == NULL)
+        cache->frame[proto] = proto == CLIENT_PROTO_BIN ? host_bin_info(u) : host_json_info(u);
+    if (cache->frame[proto] != NULL)
+        buf = host_buf_get(cache->frame[proto]);
+host_user_info_get_unlock:
+    pthread_mutex_unlock(&u->host->info_mutex);
+
+    return buf;
+}
 
-    if (u == NULL)
-        return;
+static int host_hcmd_info(struct fl_client *c)
+{
+    struct host_buf *buf = host_user_info_get(c->user, c->proto);
+    if (buf == NULL)
+        return ENOMEM;
 
-    int index;
-    for (index = 0; index < u->n_clients; index++)
-        if (u->clients[index] == c)
-            break;
-    if (index >= u->n_clients)
+    int res = host_transmit_buf(c, buf);
+    host_buf_put(buf);
+    return res;
+}
+
+// 需持有info_mutex，以当前状态作为之后增量的基准
+static void host_user_sent_reset(struct fl_user *u)
+{
+    struct host_info_cache *cache = &u->info;
+    struct host_dev_stats *sent = realloc(cache->sent, (u->n_available_devs + 1) * sizeof(struct host_dev_stats));
+    if (sent == NULL)
         return;
-    for (int i = index; i < u->n_clients - 1; i++)
-        u->clients[i] = u->clients[i + 1];
-    u->n_clients--;
-    u->clients[u->n_clients] = NULL;
-    c->user = NULL;
+    for (int i = 0; i < u->n_available_devs; i++)
+        host_dev_stats_fill(&sent[i], u->available_devs[i]);
+    cache->sent = sent;
+    cache->n_sent = u->n_available_devs;
+}
+
+// 同一用户的所有客户端共享同一份序列化结果
+static int host_hcmd_info_broadcast(struct fl_user *u)
+{
+    struct host_buf *buf[2] = {NULL, NULL};
+    int res = 0;
+
+    pthread_mutex_lock(&u->host->info_mutex);
+    u->info.seq++;
+    u->info.version++;
+    host_user_sent_reset(u);
+    pthread_mutex_unlock(&u->host->info_mutex);
+
+    pthread_mutex_lock(&u->host->clients_mutex);
+    for (int i = 0; i < u->n_clients; i++)
+    {
+        struct fl_client *c = u->clients[i];
+        if (buf[c->proto] == NULL)
+            buf[c->proto] = host_user_info_get(u, c->proto);
+        res = buf[c->proto] == NULL ? ENOMEM : host_transmit_buf(c, buf[c->proto]);
+        if (res)
+            break;
+    }
+    pthread_mutex_unlock(&u->host->clients_mutex);
+
+    host_buf_put(buf[CLIENT_PROTO_JSON]);
+    host_buf_put(buf[CLIENT_PROTO_BIN]);
+    return res;
+}
+
+static struct host_buf *host_json_dev_delta(struct fl_host *h, const struct host_dev_delta *delta)
+{
+    const struct host_dev_stats *st = &delta->now;
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "hcmd", cJSON_CreateNumber(HCMD_DEV_DELTA));
+    cJSON_AddItemToObject(json, "seq", cJSON_CreateNumber(delta->seq));
+    cJSON_AddItemToObject(json, "id", cJSON_CreateNumber(st->id));
+    if (delta->mask & HOST_DELTA_ID)
+        cJSON_AddItemToObject(json, "old_id", cJSON_CreateNumber(delta->old_id));
+    if (delta->mask & HOST_DELTA_STATE)
+        cJSON_AddItemToObject(json, "state", cJSON_CreateNumber(st->state));
+    if (delta->mask & HOST_DELTA_TIMEOUT)
+        cJSON_AddItemToObject(json, "timeout", cJSON_CreateNumber(st->timeout));
+    if (delta->mask & HOST_DELTA_MAX_RETRANS)
+        cJSON_AddItemToObject(json, "max_retrans", cJSON_CreateNumber(st->max_retrans));
+    if (delta->mask & HOST_DELTA_TX_WINDOW)
+        cJSON_AddItemToObject(json, "tx_window", cJSON_CreateNumber(st->tx_window));
+    if (delta->mask & HOST_DELTA_TX_PACKET_DELAY)
+        cJSON_AddItemToObject(json, "tx_packet_delay", cJSON_CreateNumber(st->tx_packet_delay));
+    if (delta->mask & HOST_DELTA_TX_PACKET_COUNT)
+        cJSON_AddItemToObject(json, "tx_packet_count", cJSON_CreateNumber(st->tx_packet_count));
+    if (delta->mask & HOST_DELTA_TX_PACKET_LOSS)
+        cJSON_AddItemToObject(json, "tx_packet_loss", cJSON_CreateNumber(st->tx_packet_loss));
+
+    char *json_str = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (json_str == NULL)
+        return NULL;
+
+    size_t len = strlen(json_str);
+    struct host_buf *buf = host_buf_alloc(h, "CMD", len);
+    if (buf != NULL)
+        memcpy(&buf->data[8], json_str, len);
+    cJSON_free(json_str);
+    return buf;
+}
+
+static struct host_buf *host_bin_dev_delta(struct fl_host *h, const struct host_dev_delta *delta)
+{
+    const struct host_dev_stats *st = &delta->now;
+    uint8_t body[11 + 4 + 1 + 2 + 1 + 1 + 4 + 4 + 4];
+    uint8_t *ptr = body;
+
+    *ptr++ = (uint8_t)HCMD_DEV_DELTA;
+    host_wr32(ptr, delta->seq);
+    host_wr32(ptr + 4, st->id);
+    host_wr16(ptr + 8, delta->mask);
+    ptr += 10;
+    if (delta->mask & HOST_DELTA_ID)
+    {
+        host_wr32(ptr, delta->old_id);
+        ptr += 4;
+    }
+    if (delta->mask & HOST_DELTA_STATE)
+        *ptr++ = (uint8_t)st->state;
+    if (delta->mask & HOST_DELTA_TIMEOUT)
+    {
+        host_wr16(ptr, st->timeout);
+        ptr += 2;
+    }
+    if (delta->mask & HOST_DELTA_MAX_RETRANS)
+        *ptr++ = st->max_retrans;
+    if (delta->mask & HOST_DELTA_TX_WINDOW)
+        *ptr++ = st->tx_window;
+    if (delta->mask & HOST_DELTA_TX_PACKET_DELAY)
+    {
+        host_wr32(ptr, (uint32_t)st->tx_packet_delay);
+        ptr += 4;
+    }
+    if (delta->mask & HOST_DELTA_TX_PACKET_COUNT)
+    {
+        host_wr32(ptr, (uint32_t)st->tx_packet_count);
+        ptr += 4;
+    }
+    if (delta->mask & HOST_DELTA_TX_PACKET_LOSS)
+    {
+        host_wr32(ptr, (uint32_t)st->tx_packet_loss);
+        ptr += 4;
+    }
+
+    struct host_buf *buf = host_buf_alloc(h, "BIN", ptr - body);
+    if (buf != NULL)
+        memcpy(&buf->data[8], body, ptr - body);
+    return buf;
+}
+
+// 只广播设备相对上次广播变化的字段，没有变化时不发送
+static int host_hcmd_dev_delta_broadcast(struct fl_user *u, struct fl_dev_i *d)
+{
+    struct host_info_cache *cache = &u->info;
+    struct host_dev_delta delta;
+    struct host_buf *buf[2] = {NULL, NULL};
+    int res = 0;
+
+    host_dev_stats_fill(&delta.now, d);
+
+    pthread_mutex_lock(&u->host->info_mutex);
+    struct host_dev_stats *sent = NULL;
+    for (int i = 0; i < cache->n_sent; i++)
+        if (cache->sent[i].dev == d)
+        {
+            sent = &cache->sent[i];
+            break;
+        }
+    if (sent == NULL)
+    {
+        struct host_dev_stats *temp = realloc(cache->sent, (cache->n_sent + 1) * sizeof(struct host_dev_stats));
+        if (temp == NULL)
+        {
+            pthread_mutex_unlock(&u->host->info_mutex);
+            return ENOMEM;
+        }
+        cache->sent = temp;
+        sent = &cache->sent[cache->n_sent++];
+        memset(sent, 0, sizeof(struct host_dev_stats));
+        delta.mask = HOST_DELTA_ALL & ~HOST_DELTA_ID;
+    }
+    else
+        delta.mask = host_dev_stats_diff(sent, &delta.now);
+    delta.old_id = sent->id;
+    *sent = delta.now;
+    if (delta.mask)
+    {
+        delta.seq = ++cache->seq;
+        cache->version++;
+    }
+    pthread_mutex_unlock(&u->host->info_mutex);
+
+    if (!delta.mask)
+        return 0;
+
+    pthread_mutex_lock(&u->host->clients_mutex);
+    for (int i = 0; i < u->n_clients; i++)
+    {
+        struct fl_client *c = u->clients[i];
+        if (buf[c->proto] == NULL)
+            buf[c->proto] = c->proto == CLIENT_PROTO_BIN ? host_bin_dev_delta(u->host, &delta) : host_json_dev_delta(u->host, &delta);
+        res = buf[c->proto] == NULL ? ENOMEM : host_transmit_buf(c, buf[c->proto]);
+        if (res)
+            break;
+    }
+    pthread_mutex_unlock(&u->host->clients_mutex);
+
+    host_buf_put(buf[CLIENT_PROTO_JSON]);
+    host_buf_put(buf[CLIENT_PROTO_BIN]);
+    return res;
+}
+
+static int host_hcmd_confirm(struct fl_client *c, int is_success)
+{
+    if (c->proto == CLIENT_PROTO_BIN)
+    {
+        uint8_t body[2] = {(uint8_t)HCMD_CONFIRM, is_success ? 1 : 0};
+        return host_transmit_bin(c, body, sizeof(body));
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "hcmd", cJSON_CreateNumber(HCMD_CONFIRM));
+    cJSON_AddItemToObject(json, "is_success", cJSON_CreateBool(is_success));
+
+    char *json_str = cJSON_PrintUnformatted(json);
+
+    int res = host_transmit(c, json_str);
+
+    cJSON_free(json_str);
+    cJSON_Delete(json);
+    return res;
+}
+
+static int host_hcmd_stats(struct fl_client *c)
+{
+    char *text;
+    size_t len = metrics_dump(&text);
+    if (text == NULL)
+        return ENOMEM;
+
+    int res;
+    if (c->proto == CLIENT_PROTO_BIN)
+    {
+        struct host_buf *buf = host_buf_alloc(c->host, "BIN", len + 1);
+        if (buf == NULL)
+        {
+            free(text);
+            return ENOMEM;
+        }
+        buf->data[8] = (uint8_t)HCMD_STATS;
+        memcpy(&buf->data[9], text, len);
+        res = host_transmit_buf(c, buf);
+        host_buf_put(buf);
+        free(text);
+        return res;
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "hcmd", cJSON_CreateNumber(HCMD_STATS));
+    cJSON_AddItemToObject(json, "text", cJSON_CreateString(text));
+    free(text);
+
+    char *json_str = cJSON_PrintUnformatted(json);
+
+    res = host_transmit(c, json_str);
+
+    cJSON_free(json_str);
+    cJSON_Delete(json);
+    return res;
+}
+
+static long host_timespec_interval_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// 失败的确认延迟发送，期间不读取该客户端，代替原来阻塞线程的sleep(1)
+static int host_hcmd_confirm_delayed(struct fl_client *c)
+{
+    clock_gettime(CLOCK_MONOTONIC, &c->confirm_time);
+    c->confirm_time.tv_sec += HOST_CONFIRM_DELAY_MS / 1000;
+    c->confirm_time.tv_nsec += (HOST_CONFIRM_DELAY_MS % 1000) * 1000000;
+    if (c->confirm_time.tv_nsec >= 1000000000)
+    {
+        c->confirm_time.tv_sec++;
+        c->confirm_time.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&c->ssl_mutex);
+    c->is_confirm_delayed = 1;
+    host_client_update_events(c);
+    pthread_mutex_unlock(&c->ssl_mutex);
+
+    return 0;
+}
+
+static void host_tx_done_callback(
+    struct fl_base_i *base,
+    struct fl_dev_i *dev,
+    int res,
+    void *private_arg)
+{
+    struct host_tx_done *done = private_arg;
+    struct fl_host *h = done->host;
+
+    done->res = res;
+    pthread_mutex_lock(&h->tx_done_mutex);
+    done->next = h->tx_done;
+    h->tx_done = done;
+    uint64_t one = 1;
+    write(h->event_fd, &one, sizeof(one));
+    h->n_tx_pending--;
+    pthread_cond_broadcast(&h->tx_done_cond);
+    pthread_mutex_unlock(&h->tx_done_mutex);
+}
+
+static struct host_tx_done *host_tx_done_create(
+    struct fl_client *c,
+    struct fl_dev_i *d,
+    const char *what)
+{
+    struct host_tx_done *done = malloc(sizeof(struct host_tx_done));
+    if (done == NULL)
+        return NULL;
+    done->host = c->host;
+    done->client = c;
+    done->serial = c->serial;
+    done->dev_id = d->id;
+    done->what = what;
+    done->res = 0;
+
+    pthread_mutex_lock(&c->host->tx_done_mutex);
+    c->host->n_tx_pending++;
+    pthread_mutex_unlock(&c->host->tx_done_mutex);
+
+    return done;
+}
+
+// 异步请求未能提交时释放
+static void host_tx_done_cancel(struct host_tx_done *done)
+{
+    struct fl_host *h = done->host;
+
+    pthread_mutex_lock(&h->tx_done_mutex);
+    h->n_tx_pending--;
+    pthread_cond_broadcast(&h->tx_done_cond);
+    pthread_mutex_unlock(&h->tx_done_mutex);
+    free(done);
+}
+
+static uint32_t host_hash_str(const char *str)
+{
+    uint32_t hash = 2166136261U; // FNV-1a
+    while (*str)
+    {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static uint32_t host_hash_ptr(const void *ptr)
+{
+    uint64_t x = (uintptr_t)ptr;
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+static uint32_t host_user_index_hash(const void *item)
+{
+    return host_hash_str(((const struct fl_user *)item)->username);
+}
+
+static uint32_t host_dev_index_hash(const void *item)
+{
+    return host_hash_ptr(item);
+}
+
+static void host_index_place(void **slots, int size, void *item, host_index_hash_t hash)
+{
+    int mask = size - 1;
+    int i = hash(item) & mask;
+    while (slots[i] != NULL)
+        i = (i + 1) & mask;
+    slots[i] = item;
+}
+
+static int host_index_rebuild(
+    struct host_index *index,
+    void *const *items,
+    int n,
+    host_index_hash_t hash)
+{
+    int size = HOST_INDEX_MIN_SIZE;
+    while (n * 2 > size)
+        size *= 2;
+    void **slots = calloc(size, sizeof(void *));
+    if (slots == NULL)
+        return ENOMEM;
+    for (int i = 0; i < n; i++)
+        host_index_place(slots, size, items[i], hash);
+    free(index->slots);
+    index->slots = slots;
+    index->size = size;
+    index->n = n;
+    return 0;
+}
+
+static int host_index_insert(
+    struct host_index *index,
+    void *item,
+    host_index_hash_t hash)
+{
+    if ((index->n + 1) * 2 > index->size)
+    {
+        int size = index->size ? index->size * 2 : HOST_INDEX_MIN_SIZE;
+        void **slots = calloc(size, sizeof(void *));
+        if (slots == NULL)
+            return ENOMEM;
+        for (int i = 0; i < index->size; i++)
+            if (index->slots[i] != NULL)
+                host_index_place(slots, size, index->slots[i], hash);
+        free(index->slots);
+        index->slots = slots;
+        index->size = size;
+    }
+    host_index_place(index->slots, index->size, item, hash);
+    index->n++;
+    return 0;
+}
+
+static struct fl_user *host_user_get_by_name(
+    struct fl_host *h,
+    const char *username)
+{
+    struct host_index *index = &h->user_index;
+    if (index->size == 0)
+        return NULL;
+
+    int mask = index->size - 1;
+    for (int i = host_hash_str(username) & mask; index->slots[i] != NULL; i = (i + 1) & mask)
+    {
+        struct fl_user *u = index->slots[i];
+        if (strcmp(u->username, username) == 0)
+            return u;
+    }
+    return NULL;
+}
+
+static int host_user_dev_is_accessable(
+    struct fl_user *u,
+    struct fl_dev_i *d)
+{
+    struct host_index *index = &u->available_dev_index;
+    if (index->size == 0)
+        return 0;
+
+    int mask = index->size - 1;
+    for (int i = host_hash_ptr(d) & mask; index->slots[i] != NULL; i = (i + 1) & mask)
+        if (index->slots[i] == d)
+            return 1;
+    return 0;
+}
+
+static void host_user_client_add(
+    struct fl_user *u,
+    struct fl_client *c)
+{
+    struct fl_host *h = c->host;
+
+    pthread_mutex_lock(&h->clients_mutex);
+    for (int i = 0; i < u->n_clients; i++)
+        if (u->clients[i] == c)
+        {
+            pthread_mutex_unlock(&h->clients_mutex);
+            return;
+        }
+    u->clients = realloc(u->clients, (u->n_clients + 1) * sizeof(struct fl_dev_i *));
+    u->clients[u->n_clients] = c;
+    u->n_clients++;
+    c->user = u;
+    pthread_mutex_unlock(&h->clients_mutex);
+    host_hcmd_info(c);
+}
+
+static void host_user_client_remove(struct fl_client *c)
+{
+    struct fl_user *u = c->user;
+
+    if (u == NULL)
+        return;
+
+    pthread_mutex_lock(&c->host->clients_mutex);
+    int index;
+    for (index = 0; index < u->n_clients; index++)
+        if (u->clients[index] == c)
+            break;
+    if (index >= u->n_clients)
+    {
+        pthread_mutex_unlock(&c->host->clients_mutex);
+        return;
+    }
+    for (int i = index; i < u->n_clients - 1; i++)
+        u->clients[i] = u->clients[i + 1];
+    u->n_clients--;
+    u->clients[u->n_clients] = NULL;
+    c->user = NULL;
+    pthread_mutex_unlock(&c->host->clients_mutex);
 }
 
 static struct fl_user *host_user_add(
@@ -340,9 +1444,8 @@ static struct fl_user *host_user_add(
     uint8_t password_salt[HOST_PASSWORD_SALT_SIZE],
     int is_use_only)
 {
-    for (int i = 0; i < h->n_users; i++)
-        if (strcmp(username, h->users[i]->username) == 0)
-            return NULL;
+    if (host_user_get_by_name(h, username) != NULL)
+        return NULL;
 
     struct fl_user *u = malloc(sizeof(struct fl_user));
     u->host = h;
@@ -350,16 +1453,20 @@ static struct fl_user *host_user_add(
     strcpy(u->username, username);
     u->available_devs = malloc(8 * sizeof(struct fl_dev_i *));
     u->n_available_devs = 0;
+    memset(&u->available_dev_index, 0, sizeof(struct host_index));
     u->clients = malloc(8 * sizeof(struct fl_client *));
     u->n_clients = 0;
     memcpy(u->password_hash, password_hash, HOST_PASSWORD_HASH_SIZE);
     memcpy(u->password_salt, password_salt, HOST_PASSWORD_SALT_SIZE);
     u->is_use_only = is_use_only;
+    memset(&u->info, 0, sizeof(struct host_info_cache));
 
     h->users = realloc(h->users, (h->n_users + 1) * sizeof(struct fl_user *));
     h->users[h->n_users] = u;
     h->n_users++;
+    host_index_insert(&h->user_index, u, host_user_index_hash);
 
+    host_journal_mark(h, u->username);
     host_call_host_change(h, NULL, HOST_CHANGE_USER_ADD);
     return u;
 }
@@ -379,10 +1486,16 @@ static void host_user_remove(struct fl_user *u)
         h->users[i] = h->users[i + 1];
     h->n_users--;
     h->users[h->n_users] = NULL;
+    host_index_rebuild(&h->user_index, (void *const *)h->users, h->n_users, host_user_index_hash);
 
+    host_journal_mark(h, u->username);
     host_call_host_change(u->host, NULL, HOST_CHANGE_USER_REMOVE);
+    pthread_mutex_lock(&h->info_mutex);
+    host_info_cache_free(&u->info);
+    pthread_mutex_unlock(&h->info_mutex);
     free(u->username);
     free(u->available_devs);
+    free(u->available_dev_index.slots);
     free(u->clients);
     free(u);
 }
@@ -398,6 +1511,15 @@ static int host_ccmd_init_handler(struct fl_client *c)
     return 0;
 }
 
+// 统计包含全部设备，仅对可管理设备的用户开放
+static int host_ccmd_stats_handler(struct fl_client *c)
+{
+    if (c->user->is_use_only)
+        return 0;
+
+    return host_hcmd_stats(c);
+}
+
 static int host_ccmd_scan_handler(struct fl_client *c)
 {
     if (c->user->is_use_only)
@@ -410,15 +1532,11 @@ static int host_ccmd_scan_handler(struct fl_client *c)
     return 0;
 }
 
-static int host_ccmd_pair_handler(struct fl_client *c, cJSON *json)
+static int host_ccmd_pair(struct fl_client *c, uint32_t id)
 {
     if (c->user->is_use_only)
         return 0;
 
-    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
-    if (!cJSON_IsNumber(json_id))
-        return ENOMSG;
-    uint32_t id = cJSON_GetNumberValue(json_id);
     struct fl_dev_i *d = fl_get_dev_by_id(c->host->base, id);
     if (d == NULL)
         return ENOMSG;
@@ -435,38 +1553,33 @@ static int host_ccmd_pair_handler(struct fl_client *c, cJSON *json)
     return 0;
 }
 
-static int host_ccmd_connect_handler(struct fl_client *c, cJSON *json)
+static int host_ccmd_connect(struct fl_client *c, uint32_t id)
 {
     if (c->user->is_use_only)
         return 0;
 
-    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
-    if (!cJSON_IsNumber(json_id))
-        return ENOMSG;
-    uint32_t id = cJSON_GetNumberValue(json_id);
     struct fl_dev_i *d = fl_get_dev_by_id(c->host->base, id);
     if (d == NULL)
         return ENOMSG;
 
-    int res = fl_connect(c->host->base, d);
+    struct host_tx_done *done = host_tx_done_create(c, d, "connect");
+    if (done == NULL)
+        return ENOMEM;
+    int res = fl_connect_async(c->host->base, d, host_tx_done_callback, done);
     if (res)
     {
+        host_tx_done_cancel(done);
         host_printf(H_PRINT_ERR, "FeLink: connect ERROR, <%08X> : %s\n", id, strerror(res));
-        return 0;
     }
 
-    return host_hcmd_ack(c, d);
+    return 0;
 }
 
-static int host_ccmd_unpair_handler(struct fl_client *c, cJSON *json)
+static int host_ccmd_unpair(struct fl_client *c, uint32_t id)
 {
     if (c->user->is_use_only)
         return 0;
 
-    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
-    if (!cJSON_IsNumber(json_id))
-        return ENOMSG;
-    uint32_t id = cJSON_GetNumberValue(json_id);
     struct fl_dev_i *d = fl_get_dev_by_id(c->host->base, id);
     if (d == NULL)
         return ENOMSG;
@@ -478,27 +1591,119 @@ static int host_ccmd_unpair_handler(struct fl_client *c, cJSON *json)
     return 0;
 }
 
-static int host_ccmd_data_handler(struct fl_client *c, cJSON *json)
+static int host_ccmd_data(
+    struct fl_client *c,
+    uint32_t id,
+    const uint8_t *data,
+    size_t count,
+    size_t padding_align,
+    int is_plaintext)
 {
-    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
-    if (!cJSON_IsNumber(json_id))
-        return ENOMSG;
-    uint32_t id = cJSON_GetNumberValue(json_id);
     struct fl_dev_i *d = fl_get_dev_by_id(c->host->base, id);
     if (d == NULL)
         return 0;
     if (!host_user_dev_is_accessable(c->user, d))
         return 0;
 
-    cJSON *json_count = cJSON_GetObjectItemCaseSensitive(json, "count");
-    if (!cJSON_IsNumber(json_count))
-        return ENOMSG;
-    uint32_t count = cJSON_GetNumberValue(json_count);
+    struct host_tx_done *done = host_tx_done_create(c, d, "send data");
+    if (done == NULL)
+        return ENOMEM;
+    int res = fl_data_async(c->host->base, d, data, count, padding_align, is_plaintext, host_tx_done_callback, done);
+    if (res)
+    {
+        host_tx_done_cancel(done);
+        host_printf(H_PRINT_ERR, "FeLink: send data ERROR, <%08X> : %s\n", id, strerror(res));
+    }
 
-    cJSON *json_padding_align = cJSON_GetObjectItemCaseSensitive(json, "padding_align");
-    if (!cJSON_IsNumber(json_padding_align))
-        return ENOMSG;
-    uint32_t padding_align = cJSON_GetNumberValue(json_padding_align);
+    return 0;
+}
+
+static struct fl_dev_i *host_ccmd_accessable_dev(struct fl_client *c, uint32_t id)
+{
+    struct fl_dev_i *d = fl_get_dev_by_id(c->host->base, id);
+    if (d == NULL)
+        return NULL;
+    if (!host_user_dev_is_accessable(c->user, d))
+        return NULL;
+    return d;
+}
+
+static int host_ccmd_set_timeout(struct fl_client *c, uint32_t id, double timeout)
+{
+    struct fl_dev_i *d = host_ccmd_accessable_dev(c, id);
+    if (d == NULL)
+        return 0;
+
+    if (timeout < FELINK_TIMEOUT_MIN || timeout > FELINK_TIMEOUT_MAX)
+        return ERANGE;
+    return fl_set_timeout(c->host->base, d, timeout);
+}
+
+static int host_ccmd_set_maxret(struct fl_client *c, uint32_t id, double max_retrans)
+{
+    struct fl_dev_i *d = host_ccmd_accessable_dev(c, id);
+    if (d == NULL)
+        return 0;
+
+    if (max_retrans < 1 || max_retrans > FELINK_MAXRET_MAX)
+        return ERANGE;
+    return fl_set_max_retrans(c->host->base, d, max_retrans);
+}
+
+static int host_ccmd_set_window(struct fl_client *c, uint32_t id, double tx_window)
+{
+    struct fl_dev_i *d = host_ccmd_accessable_dev(c, id);
+    if (d == NULL)
+        return 0;
+
+    if (tx_window < 1 || tx_window > FELINK_TX_WINDOW_MAX)
+        return ERANGE;
+    return fl_set_tx_window(c->host->base, d, tx_window);
+}
+
+static int host_ccmd_pair_handler(struct fl_client *c, cJSON *json)
+{
+    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
+    if (!cJSON_IsNumber(json_id))
+        return ENOMSG;
+
+    return host_ccmd_pair(c, cJSON_GetNumberValue(json_id));
+}
+
+static int host_ccmd_connect_handler(struct fl_client *c, cJSON *json)
+{
+    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
+    if (!cJSON_IsNumber(json_id))
+        return ENOMSG;
+
+    return host_ccmd_connect(c, cJSON_GetNumberValue(json_id));
+}
+
+static int host_ccmd_unpair_handler(struct fl_client *c, cJSON *json)
+{
+    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
+    if (!cJSON_IsNumber(json_id))
+        return ENOMSG;
+
+    return host_ccmd_unpair(c, cJSON_GetNumberValue(json_id));
+}
+
+static int host_ccmd_data_handler(struct fl_client *c, cJSON *json)
+{
+    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
+    if (!cJSON_IsNumber(json_id))
+        return ENOMSG;
+    uint32_t id = cJSON_GetNumberValue(json_id);
+
+    cJSON *json_count = cJSON_GetObjectItemCaseSensitive(json, "count");
+    if (!cJSON_IsNumber(json_count))
+        return ENOMSG;
+    uint32_t count = cJSON_GetNumberValue(json_count);
+
+    cJSON *json_padding_align = cJSON_GetObjectItemCaseSensitive(json, "padding_align");
+    if (!cJSON_IsNumber(json_padding_align))
+        return ENOMSG;
+    uint32_t padding_align = cJSON_GetNumberValue(json_padding_align);
 
     cJSON *json_is_plaintext = cJSON_GetObjectItemCaseSensitive(json, "is_plaintext");
     if (!cJSON_IsBool(json_is_plaintext))
@@ -510,16 +1715,11 @@ static int host_ccmd_data_handler(struct fl_client *c, cJSON *json)
     char *data_base64 = cJSON_GetStringValue(json_data);
     int base64_len = strlen(data_base64);
     uint8_t data[base64_len];
-    EVP_DecodeBlock(data, (uint8_t *)data_base64, base64_len);
-
-    int res = fl_data(c->host->base, d, data, count, padding_align, cJSON_IsTrue(json_is_plaintext));
-    if (res)
-    {
-        host_printf(H_PRINT_ERR, "FeLink: send data ERROR, <%08X> : %s\n", id, strerror(res));
-        return 0;
-    }
+    int data_len = EVP_DecodeBlock(data, (uint8_t *)data_base64, base64_len);
+    if (data_len < 0 || count > (uint32_t)data_len)
+        return ENOMSG;
 
-    return host_hcmd_ack(c, d);
+    return host_ccmd_data(c, id, data, count, padding_align, cJSON_IsTrue(json_is_plaintext));
 }
 
 static int host_ccmd_set_timeout_handler(struct fl_client *c, cJSON *json)
@@ -527,19 +1727,12 @@ static int host_ccmd_set_timeout_handler(struct fl_client *c, cJSON *json)
     cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
     if (!cJSON_IsNumber(json_id))
         return ENOMSG;
-    uint32_t id = cJSON_GetNumberValue(json_id);
-    struct fl_dev_i *d = fl_get_dev_by_id(c->host->base, id);
-    if (d == NULL)
-        return 0;
-    if (!host_user_dev_is_accessable(c->user, d))
-        return 0;
 
     cJSON *json_timeout = cJSON_GetObjectItemCaseSensitive(json, "timeout");
     if (!cJSON_IsNumber(json_timeout))
         return ENOMSG;
-    d->timeout = cJSON_GetNumberValue(json_timeout);
 
-    return 0;
+    return host_ccmd_set_timeout(c, cJSON_GetNumberValue(json_id), cJSON_GetNumberValue(json_timeout));
 }
 
 static int host_ccmd_set_maxret_handler(struct fl_client *c, cJSON *json)
@@ -547,21 +1740,231 @@ static int host_ccmd_set_maxret_handler(struct fl_client *c, cJSON *json)
     cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
     if (!cJSON_IsNumber(json_id))
         return ENOMSG;
-    uint32_t id = cJSON_GetNumberValue(json_id);
-    struct fl_dev_i *d = fl_get_dev_by_id(c->host->base, id);
-    if (d == NULL)
-        return 0;
-    if (!host_user_dev_is_accessable(c->user, d))
-        return 0;
 
     cJSON *json_max_retrans = cJSON_GetObjectItemCaseSensitive(json, "max_retrans");
     if (!cJSON_IsNumber(json_max_retrans))
         return ENOMSG;
-    d->max_retrans = cJSON_GetNumberValue(json_max_retrans);
+
+    return host_ccmd_set_maxret(c, cJSON_GetNumberValue(json_id), cJSON_GetNumberValue(json_max_retrans));
+}
+
+static int host_ccmd_set_window_handler(struct fl_client *c, cJSON *json)
+{
+    cJSON *json_id = cJSON_GetObjectItemCaseSensitive(json, "id");
+    if (!cJSON_IsNumber(json_id))
+        return ENOMSG;
+
+    cJSON *json_tx_window = cJSON_GetObjectItemCaseSensitive(json, "tx_window");
+    if (!cJSON_IsNumber(json_tx_window))
+        return ENOMSG;
+
+    return host_ccmd_set_window(c, cJSON_GetNumberValue(json_id), cJSON_GetNumberValue(json_tx_window));
+}
+
+static void host_pw_job_delete(struct host_pw_job *job)
+{
+    if (job->password != NULL)
+        OPENSSL_cleanse(job->password, strlen(job->password));
+    if (job->new_password != NULL)
+        OPENSSL_cleanse(job->new_password, strlen(job->new_password));
+    free(job->username);
+    free(job->password);
+    free(job->new_password);
+    OPENSSL_cleanse(job, sizeof(struct host_pw_job));
+    free(job);
+}
+
+static struct host_pw_job *host_pw_job_create(
+    struct fl_client *c,
+    client_cmd cmd,
+    const char *username,
+    const char *password,
+    const char *new_password)
+{
+    struct host_pw_job *job = calloc(1, sizeof(struct host_pw_job));
+    if (job == NULL)
+        return NULL;
+    job->client = c;
+    job->serial = c->serial;
+    job->cmd = cmd;
+    job->username = strdup(username);
+    job->password = strdup(password);
+    job->new_password = new_password != NULL ? strdup(new_password) : NULL;
+    if (job->username == NULL || job->password == NULL || (new_password != NULL && job->new_password == NULL))
+    {
+        host_pw_job_delete(job);
+        return NULL;
+    }
+    return job;
+}
+
+// 取一个令牌，超出频率返回0
+static int host_pw_rate_take(struct fl_host *h, in_addr_t addr)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct host_pw_rate *r = NULL, *oldest = &h->pw_rates[0];
+    for (int i = 0; i < HOST_PW_RATE_SLOTS; i++)
+    {
+        struct host_pw_rate *t = &h->pw_rates[i];
+        if (t->addr == addr)
+        {
+            r = t;
+            break;
+        }
+        if (host_timespec_interval_ms(&t->last, &oldest->last) > 0)
+            oldest = t;
+    }
+    if (r == NULL)
+    {
+        // 表满时淘汰最久未出现的IP
+        r = oldest;
+        r->addr = addr;
+        r->tokens = HOST_PW_RATE_BURST;
+        r->last = now;
+    }
+
+    long elapsed = host_timespec_interval_ms(&r->last, &now);
+    if (elapsed >= HOST_PW_RATE_INTERVAL_MS)
+    {
+        long n = elapsed / HOST_PW_RATE_INTERVAL_MS;
+        if (r->tokens + n >= HOST_PW_RATE_BURST)
+        {
+            r->tokens = HOST_PW_RATE_BURST;
+            r->last = now;
+        }
+        else
+        {
+            r->tokens += n;
+            r->last.tv_sec += n * HOST_PW_RATE_INTERVAL_MS / 1000;
+            r->last.tv_nsec += (n * HOST_PW_RATE_INTERVAL_MS % 1000) * 1000000;
+            if (r->last.tv_nsec >= 1000000000)
+            {
+                r->last.tv_sec++;
+                r->last.tv_nsec -= 1000000000;
+            }
+        }
+    }
+
+    if (r->tokens <= 0)
+        return 0;
+    if (r->tokens == HOST_PW_RATE_BURST)
+        r->last = now;
+    r->tokens--;
+    return 1;
+}
+
+// 超出频率或队列已满时按失败延迟确认
+static int host_pw_job_submit(struct host_pw_job *job)
+{
+    struct fl_client *c = job->client;
+    struct fl_host *h = c->host;
+
+    if (!host_pw_rate_take(h, c->addr.sin_addr.s_addr))
+    {
+        host_printf(H_PRINT_ERR, "Host: client %s:%hu password attempts rate limited\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+        host_pw_job_delete(job);
+        return host_hcmd_confirm_delayed(c);
+    }
+
+    pthread_mutex_lock(&h->pw_mutex);
+    if (h->n_pw_threads == 0 || h->n_pw_queued >= h->pw_queue_max)
+    {
+        pthread_mutex_unlock(&h->pw_mutex);
+        host_printf(H_PRINT_ERR, "Host: client %s:%hu password queue full\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+        host_pw_job_delete(job);
+        return host_hcmd_confirm_delayed(c);
+    }
+    if (h->pw_queue_tail != NULL)
+        h->pw_queue_tail->next = job;
+    else
+        h->pw_queue = job;
+    h->pw_queue_tail = job;
+    h->n_pw_queued++;
+    pthread_cond_signal(&h->pw_cond);
+    pthread_mutex_unlock(&h->pw_mutex);
+
+    pthread_mutex_lock(&c->ssl_mutex);
+    c->is_pw_pending = 1;
+    host_client_update_events(c);
+    pthread_mutex_unlock(&c->ssl_mutex);
 
     return 0;
 }
 
+static void host_pw_job_compute(struct host_pw_job *job)
+{
+    uint8_t hash[HOST_PASSWORD_HASH_SIZE];
+
+    switch (job->cmd)
+    {
+    case CCMD_LOGIN:
+    case CCMD_CHANGE_PASSWORD:
+        PKCS5_PBKDF2_HMAC_SHA1(job->password, -1, job->salt, HOST_PASSWORD_SALT_SIZE, HOST_PASSWORD_PBKDF2_ITER, HOST_PASSWORD_HASH_SIZE, hash);
+        job->is_match = CRYPTO_memcmp(hash, job->expect_hash, HOST_PASSWORD_HASH_SIZE) == 0;
+        OPENSSL_cleanse(hash, HOST_PASSWORD_HASH_SIZE);
+        if (job->cmd == CCMD_CHANGE_PASSWORD && job->is_match)
+            PKCS5_PBKDF2_HMAC_SHA1(job->new_password, -1, job->new_salt, HOST_PASSWORD_SALT_SIZE, HOST_PASSWORD_PBKDF2_ITER, HOST_PASSWORD_HASH_SIZE, job->new_hash);
+        break;
+    case CCMD_REGISTER:
+        PKCS5_PBKDF2_HMAC_SHA1(job->password, -1, job->new_salt, HOST_PASSWORD_SALT_SIZE, HOST_PASSWORD_PBKDF2_ITER, HOST_PASSWORD_HASH_SIZE, job->new_hash);
+        job->is_match = 1;
+        break;
+    default:
+        break;
+    }
+}
+
+static void *host_pw_worker_thread(void *args)
+{
+    struct fl_host *h = args;
+
+    pthread_mutex_lock(&h->pw_mutex);
+    while (!h->is_pw_stop)
+    {
+        struct host_pw_job *job = h->pw_queue;
+        if (job == NULL)
+        {
+            pthread_cond_wait(&h->pw_cond, &h->pw_mutex);
+            continue;
+        }
+        h->pw_queue = job->next;
+        if (h->pw_queue == NULL)
+            h->pw_queue_tail = NULL;
+        pthread_mutex_unlock(&h->pw_mutex);
+
+        host_pw_job_compute(job);
+
+        pthread_mutex_lock(&h->pw_mutex);
+        h->n_pw_queued--;
+        job->next = h->pw_done;
+        h->pw_done = job;
+        uint64_t one = 1;
+        write(h->event_fd, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&h->pw_mutex);
+
+    return NULL;
+}
+
+// 用户的salt与hash在运算期间未被修改
+static int host_pw_job_is_user_unchanged(const struct host_pw_job *job, const struct fl_user *u)
+{
+    return memcmp(job->salt, u->password_salt, HOST_PASSWORD_SALT_SIZE) == 0 &&
+           memcmp(job->expect_hash, u->password_hash, HOST_PASSWORD_HASH_SIZE) == 0;
+}
+
+static int host_client_login(struct fl_client *c, struct fl_user *u)
+{
+    host_user_client_remove(c);
+    host_user_client_add(u, c);
+
+    host_printf(H_PRINT_INFO, "Host: client %s:%hu login <%s>\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), u->username);
+
+    return host_hcmd_confirm(c, 1);
+}
+
 static int host_ccmd_login_handler(struct fl_client *c, cJSON *json)
 {
     cJSON *json_username = cJSON_GetObjectItemCaseSensitive(json, "username");
@@ -570,317 +1973,791 @@ static int host_ccmd_login_handler(struct fl_client *c, cJSON *json)
     char *username = cJSON_GetStringValue(json_username);
     struct fl_user *u = host_user_get_by_name(c->host, username);
     if (u == NULL)
-        goto host_ccmd_login_error;
+        return host_hcmd_confirm_delayed(c);
     if (strcmp(c->host->users[HOST_USER_GUEST]->username, username) == 0)
-        goto host_ccmd_login_success;
+        return host_client_login(c, u);
 
     cJSON *json_password = cJSON_GetObjectItemCaseSensitive(json, "password");
     if (!cJSON_IsString(json_password))
         return ENOMSG;
     char *password = cJSON_GetStringValue(json_password);
 
-    uint8_t password_hash[HOST_PASSWORD_HASH_SIZE];
-    PKCS5_PBKDF2_HMAC_SHA1(password, -1, u->password_salt, HOST_PASSWORD_SALT_SIZE, 2048, HOST_PASSWORD_HASH_SIZE, password_hash);
-    if (memcmp(password_hash, u->password_hash, HOST_PASSWORD_HASH_SIZE))
-        goto host_ccmd_login_error;
+    struct host_pw_job *job = host_pw_job_create(c, CCMD_LOGIN, username, password, NULL);
+    if (job == NULL)
+        return ENOMEM;
+    memcpy(job->salt, u->password_salt, HOST_PASSWORD_SALT_SIZE);
+    memcpy(job->expect_hash, u->password_hash, HOST_PASSWORD_HASH_SIZE);
+    return host_pw_job_submit(job);
+}
+
+static int host_ccmd_login_done(struct fl_client *c, struct host_pw_job *job)
+{
+    struct fl_user *u = host_user_get_by_name(c->host, job->username);
+    if (u == NULL || !job->is_match || !host_pw_job_is_user_unchanged(job, u))
+        return host_hcmd_confirm_delayed(c);
+
+    return host_client_login(c, u);
+}
+
+static int host_ccmd_register_handler(struct fl_client *c, cJSON *json)
+{
+    if (strcmp(c->user->username, c->host->users[HOST_USER_ADMIN]->username) != 0)
+        return host_hcmd_confirm_delayed(c);
+
+    cJSON *json_username = cJSON_GetObjectItemCaseSensitive(json, "username");
+    if (!cJSON_IsString(json_username))
+        return ENOMSG;
+    char *username = cJSON_GetStringValue(json_username);
+
+    cJSON *json_password = cJSON_GetObjectItemCaseSensitive(json, "password");
+    if (!cJSON_IsString(json_password))
+        return ENOMSG;
+    char *password = cJSON_GetStringValue(json_password);
+
+    cJSON *json_is_use_only = cJSON_GetObjectItemCaseSensitive(json, "is_use_only");
+    if (!cJSON_IsBool(json_is_use_only))
+        return ENOMSG;
+
+    struct host_pw_job *job = host_pw_job_create(c, CCMD_REGISTER, username, password, NULL);
+    if (job == NULL)
+        return ENOMEM;
+    job->is_use_only = cJSON_IsTrue(json_is_use_only);
+    fl_random(job->new_salt, HOST_PASSWORD_SALT_SIZE);
+    return host_pw_job_submit(job);
+}
+
+static int host_ccmd_register_done(struct fl_client *c, struct host_pw_job *job)
+{
+    if (strcmp(c->user->username, c->host->users[HOST_USER_ADMIN]->username) != 0)
+        return host_hcmd_confirm_delayed(c);
+
+    struct fl_user *u = host_user_get_by_name(c->host, job->username);
+    if (u != NULL)
+    {
+        if (!u->is_use_only)
+            return host_hcmd_confirm_delayed(c);
+        memcpy(u->password_hash, job->new_hash, HOST_PASSWORD_HASH_SIZE);
+        memcpy(u->password_salt, job->new_salt, HOST_PASSWORD_SALT_SIZE);
+        u->is_use_only = job->is_use_only;
+        host_user_info_invalidate(u);
+        host_journal_mark(c->host, u->username);
+        host_call_host_change(c->host, NULL, HOST_CHANGE_USER_CHANGE);
+    }
+    else
+    {
+        struct fl_user *u = host_user_add(c->host, job->username, job->new_hash, job->new_salt, job->is_use_only);
+        if (u == NULL)
+            return host_hcmd_confirm_delayed(c);
+    }
+
+    host_printf(H_PRINT_INFO, "Host: client %s:%hu registers <%s>\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), job->username);
+
+    return host_hcmd_confirm(c, 1);
+}
+
+static int host_ccmd_change_password_handler(struct fl_client *c, cJSON *json)
+{
+    if (c->user == NULL || c->user->is_use_only)
+        return host_hcmd_confirm_delayed(c);
+
+    cJSON *json_username = cJSON_GetObjectItemCaseSensitive(json, "username");
+    if (!cJSON_IsString(json_username))
+        return ENOMSG;
+    char *username = cJSON_GetStringValue(json_username);
+    struct fl_user *u = host_user_get_by_name(c->host, username);
+    if (u == NULL)
+        return host_hcmd_confirm_delayed(c);
+    if (strcmp(u->username, c->host->users[HOST_USER_GUEST]->username) == 0)
+        return host_hcmd_confirm_delayed(c);
+
+    cJSON *json_old_password = cJSON_GetObjectItemCaseSensitive(json, "old_password");
+    if (!cJSON_IsString(json_old_password))
+        return ENOMSG;
+    char *old_password = cJSON_GetStringValue(json_old_password);
+
+    cJSON *json_new_password = cJSON_GetObjectItemCaseSensitive(json, "new_password");
+    if (!cJSON_IsString(json_new_password))
+        return ENOMSG;
+    char *new_password = cJSON_GetStringValue(json_new_password);
+
+    struct host_pw_job *job = host_pw_job_create(c, CCMD_CHANGE_PASSWORD, username, old_password, new_password);
+    if (job == NULL)
+        return ENOMEM;
+    memcpy(job->salt, u->password_salt, HOST_PASSWORD_SALT_SIZE);
+    memcpy(job->expect_hash, u->password_hash, HOST_PASSWORD_HASH_SIZE);
+    fl_random(job->new_salt, HOST_PASSWORD_SALT_SIZE);
+    return host_pw_job_submit(job);
+}
+
+static int host_ccmd_change_password_done(struct fl_client *c, struct host_pw_job *job)
+{
+    struct fl_user *u = host_user_get_by_name(c->host, job->username);
+    if (u == NULL || !job->is_match || !host_pw_job_is_user_unchanged(job, u))
+        return host_hcmd_confirm_delayed(c);
+
+    memcpy(u->password_hash, job->new_hash, HOST_PASSWORD_HASH_SIZE);
+    memcpy(u->password_salt, job->new_salt, HOST_PASSWORD_SALT_SIZE);
+    host_journal_mark(c->host, u->username);
+    host_call_host_change(c->host, NULL, HOST_CHANGE_USER_CHANGE);
+
+    host_printf(H_PRINT_INFO, "Host: client %s:%hu changes <%s>'s password\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), job->username);
+
+    return host_hcmd_confirm(c, 1);
+}
+
+static struct fl_client *host_client_create(
+    struct fl_host *h,
+    int fd,
+    struct sockaddr_in addr)
+{
+    struct fl_client *c = malloc(sizeof(struct fl_client));
+    if (c == NULL)
+        return NULL;
+    c->host = h;
+    c->user = NULL;
+    c->addr = addr;
+    c->fd = fd;
+    c->ssl = SSL_new(h->ctx);
+    if (c->ssl == NULL)
+    {
+        free(c);
+        return NULL;
+    }
+    SSL_set_fd(c->ssl, fd);
+    SSL_set_accept_state(c->ssl);
+    pthread_mutex_init(&c->ssl_mutex, NULL);
+    c->state = CLIENT_STATE_HANDSHAKE;
+    c->proto = CLIENT_PROTO_JSON;
+    c->serial = h->client_serial++;
+    c->events = 0;
+    c->is_want_write = 0;
+    c->tx_queue = NULL;
+    c->tx_head = 0;
+    c->n_tx_queued = 0;
+    c->tx_queue_size = 0;
+    c->tx_off = 0;
+    c->rx_buf = NULL;
+    c->rx_off = 0;
+    c->rx_len = 0;
+    c->rx_size = 0;
+    c->is_confirm_delayed = 0;
+    c->is_pw_pending = 0;
+    c->is_closed = 0;
+    c->next_closed = NULL;
+
+    return c;
+}
+
+// 移出客户端列表与epoll，释放推迟到host_clients_free_closed
+static void host_client_disconnected(struct fl_client *c)
+{
+    struct fl_host *h = c->host;
+
+    if (c->is_closed)
+        return;
+    c->is_closed = 1;
+    host_user_client_remove(c);
+
+    pthread_mutex_lock(&h->clients_mutex);
+    int index;
+    for (index = 0; index < h->n_clients; index++)
+        if (h->clients[index] == c)
+            break;
+    if (index < h->n_clients)
+    {
+        for (int i = index; i < h->n_clients - 1; i++)
+            h->clients[i] = h->clients[i + 1];
+        h->n_clients--;
+        h->clients[h->n_clients] = NULL;
+    }
+    if (h->client_pairing_dev == c)
+        h->client_pairing_dev = NULL;
+    pthread_mutex_unlock(&h->clients_mutex);
+
+    epoll_ctl(h->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->state == CLIENT_STATE_ESTABLISHED)
+    {
+        host_printf(H_PRINT_INFO, "Host: client %s:%hu disconnected\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+        host_call_host_change(c->host, NULL, HOST_CHANGE_CLIENT_DISCON);
+    }
+    c->next_closed = h->closed_clients;
+    h->closed_clients = c;
+}
+
+static void host_clients_free_closed(struct fl_host *h)
+{
+    while (h->closed_clients != NULL)
+    {
+        struct fl_client *c = h->closed_clients;
+        h->closed_clients = c->next_closed;
+        pthread_mutex_destroy(&c->ssl_mutex);
+        SSL_free(c->ssl);
+        close(c->fd);
+        for (int i = 0; i < c->n_tx_queued; i++)
+            host_buf_put(c->tx_queue[(c->tx_head + i) % c->tx_queue_size]);
+        free(c->tx_queue);
+        free(c->rx_buf);
+        free(c);
+    }
+}
+
+static int host_client_dispatch(struct fl_client *c, cJSON *json)
+{
+    cJSON *json_cmd = cJSON_GetObjectItemCaseSensitive(json, "ccmd");
+    if (!cJSON_IsNumber(json_cmd))
+        return 0;
+    client_cmd cmd = (client_cmd)cJSON_GetNumberValue(json_cmd);
+    switch (cmd)
+    {
+    case CCMD_INFO:
+        return host_ccmd_info_handler(c);
+    case CCMD_INIT:
+        return host_ccmd_init_handler(c);
+    case CCMD_SCAN:
+        return host_ccmd_scan_handler(c);
+    case CCMD_PAIR:
+        return host_ccmd_pair_handler(c, json);
+    case CCMD_CONNECT:
+        return host_ccmd_connect_handler(c, json);
+    case CCMD_UNPAIR:
+        return host_ccmd_unpair_handler(c, json);
+    case CCMD_DATA:
+        return host_ccmd_data_handler(c, json);
+    case CCMD_SET_TIMEOUT:
+        return host_ccmd_set_timeout_handler(c, json);
+    case CCMD_SET_MAXRET:
+        return host_ccmd_set_maxret_handler(c, json);
+    case CCMD_SET_WINDOW:
+        return host_ccmd_set_window_handler(c, json);
+    case CCMD_STATS:
+        return host_ccmd_stats_handler(c);
+    case CCMD_LOGIN:
+        return host_ccmd_login_handler(c, json);
+    case CCMD_REGISTER:
+        return host_ccmd_register_handler(c, json);
+    case CCMD_CHANGE_PASSWORD:
+        return host_ccmd_change_password_handler(c, json);
+    default:
+        return 0;
+    }
+}
+
+static int host_client_dispatch_bin(struct fl_client *c, const uint8_t *body, size_t len)
+{
+    if (len < 1)
+        return ENOMSG;
+    client_cmd cmd = (client_cmd)(int8_t)body[0];
+    body++;
+    len--;
+
+    switch (cmd)
+    {
+    case CCMD_INFO:
+        return host_ccmd_info_handler(c);
+    case CCMD_INIT:
+        return host_ccmd_init_handler(c);
+    case CCMD_SCAN:
+        return host_ccmd_scan_handler(c);
+    case CCMD_STATS:
+        return host_ccmd_stats_handler(c);
+    default:
+        break;
+    }
+
+    if (len < 4)
+        return ENOMSG;
+    uint32_t id = host_rd32(body);
+    body += 4;
+    len -= 4;
+
+    switch (cmd)
+    {
+    case CCMD_PAIR:
+        return host_ccmd_pair(c, id);
+    case CCMD_CONNECT:
+        return host_ccmd_connect(c, id);
+    case CCMD_UNPAIR:
+        return host_ccmd_unpair(c, id);
+    case CCMD_DATA:
+        if (len < 2)
+            return ENOMSG;
+        return host_ccmd_data(c, id, &body[2], len - 2, body[1], body[0]);
+    case CCMD_SET_TIMEOUT:
+        if (len < 2)
+            return ENOMSG;
+        return host_ccmd_set_timeout(c, id, host_rd16(body));
+    case CCMD_SET_MAXRET:
+        if (len < 1)
+            return ENOMSG;
+        return host_ccmd_set_maxret(c, id, body[0]);
+    case CCMD_SET_WINDOW:
+        if (len < 1)
+            return ENOMSG;
+        return host_ccmd_set_window(c, id, body[0]);
+    default:
+        return ENOMSG;
+    }
+}
+
+// 从接收缓冲区中解析完整的帧并处理，不完整的帧留待下次读取
+static int host_client_parse(struct fl_client *c)
+{
+    int res;
+
+    while (!host_client_is_paused(c) && c->rx_len >= 8)
+    {
+        uint8_t *head = &c->rx_buf[c->rx_off]; // chksum8 "CMD" len[4]
+        int is_bin = strncmp((char *)&head[1], "BIN", 3) == 0;
+        if ((!is_bin && strncmp((char *)&head[1], "CMD", 3) != 0) || host_chksum8(head, 8) != 0)
+        {
+            // 逐字节丢弃直到重新对齐到帧头
+            c->rx_off++;
+            c->rx_len--;
+            continue;
+        }
+        uint32_t len = host_rd32(&head[4]);
+        if (len > c->host->max_frame_size)
+        {
+            host_printf(H_PRINT_ERR, "Host: client %s:%hu frame too large (%u)\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), len);
+            return EMSGSIZE;
+        }
+        if (c->rx_len < 8 + (size_t)len)
+            break;
+
+        char *json_str = (char *)&head[8];
+        c->rx_off += 8 + len;
+        c->rx_len -= 8 + len;
+
+        if (is_bin)
+        {
+            c->proto = CLIENT_PROTO_BIN;
+            host_printf(H_PRINT_CMD, "C (%s:%hu, %s): BIN ccmd %d, %u bytes\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), c->user->username, len ? (int8_t)head[8] : 0, len);
+            res = host_client_dispatch_bin(c, &head[8], len);
+            if (res)
+                host_printf(H_PRINT_ERR, "Host: client cmd ERROR : %s\n", strerror(res));
+            continue;
+        }
+        c->proto = CLIENT_PROTO_JSON;
+
+        cJSON *json = cJSON_ParseWithLength(json_str, len);
+        if (json == NULL)
+            continue;
+
+        host_printf(H_PRINT_CMD, "C (%s:%hu, %s): %.*s\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), c->user->username, (int)len, json_str);
+
+        res = host_client_dispatch(c, json);
+        if (res)
+            host_printf(H_PRINT_ERR, "Host: client cmd ERROR : %s\n", strerror(res));
+
+        cJSON_Delete(json);
+    }
+
+    if (c->rx_len == 0)
+        c->rx_off = 0;
+
+    return 0;
+}
 
-host_ccmd_login_success:
-    host_user_client_remove(c);
-    host_user_client_add(u, c);
+// 保证接收缓冲区尾部至少有一个完整帧(不超过最大帧长)的空间
+static int host_client_rx_reserve(struct fl_client *c)
+{
+    size_t need = HOST_RX_BUF_INIT_SIZE;
+    if (c->rx_len >= 8)
+        need = 8 + (size_t)host_rd32(&c->rx_buf[c->rx_off + 4]);
+    if (need > 8 + (size_t)c->host->max_frame_size)
+        need = 8 + (size_t)c->host->max_frame_size;
+    if (need <= c->rx_len)
+        need = c->rx_len + HOST_RX_BUF_INIT_SIZE;
+
+    if (c->rx_off + need <= c->rx_size)
+        return 0;
+    if (c->rx_off > 0)
+    {
+        memmove(c->rx_buf, &c->rx_buf[c->rx_off], c->rx_len);
+        c->rx_off = 0;
+    }
+    if (need <= c->rx_size)
+        return 0;
 
-    host_printf(H_PRINT_INFO, "Host: client %s:%hu login <%s>\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), username);
+    size_t size = c->rx_size ? c->rx_size : HOST_RX_BUF_INIT_SIZE;
+    while (size < need)
+        size *= 2;
+    uint8_t *buf = realloc(c->rx_buf, size);
+    if (buf == NULL)
+        return ENOMEM;
+    c->rx_buf = buf;
+    c->rx_size = size;
 
-    return host_hcmd_confirm(c, 1);
-host_ccmd_login_error:
-    sleep(1);
-    return host_hcmd_confirm(c, 0);
+    return 0;
 }
 
-static int host_ccmd_register_handler(struct fl_client *c, cJSON *json)
+// 读到WANT_READ为止，返回非0时断开
+static int host_client_receive(struct fl_client *c)
 {
-    if (strcmp(c->user->username, c->host->users[HOST_USER_ADMIN]->username) != 0)
-        goto host_ccmd_register_error;
+    int res, err;
 
-    cJSON *json_username = cJSON_GetObjectItemCaseSensitive(json, "username");
-    if (!cJSON_IsString(json_username))
-        return ENOMSG;
-    char *username = cJSON_GetStringValue(json_username);
+    // 延迟确认期间积压的帧
+    res = host_client_parse(c);
+    if (res)
+        return res;
 
-    cJSON *json_password = cJSON_GetObjectItemCaseSensitive(json, "password");
-    if (!cJSON_IsString(json_password))
-        return ENOMSG;
-    char *password = cJSON_GetStringValue(json_password);
+    while (!host_client_is_paused(c))
+    {
+        res = host_client_rx_reserve(c);
+        if (res)
+            return res;
 
-    cJSON *json_is_use_only = cJSON_GetObjectItemCaseSensitive(json, "is_use_only");
-    if (!cJSON_IsBool(json_is_use_only))
-        return ENOMSG;
+        size_t bytes_read;
+        size_t tail = c->rx_off + c->rx_len;
+        pthread_mutex_lock(&c->ssl_mutex);
+        res = SSL_read_ex(c->ssl, &c->rx_buf[tail], c->rx_size - tail, &bytes_read);
+        err = res <= 0 ? SSL_get_error(c->ssl, res) : SSL_ERROR_NONE;
+        if (err == SSL_ERROR_WANT_WRITE)
+        {
+            c->is_want_write = 1;
+            host_client_update_events(c);
+        }
+        pthread_mutex_unlock(&c->ssl_mutex);
+        if (res <= 0)
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : ECONNRESET;
+        c->rx_len += bytes_read;
 
-    uint8_t password_hash[HOST_PASSWORD_HASH_SIZE], password_salt[HOST_PASSWORD_SALT_SIZE];
-    host_random(password_salt, HOST_PASSWORD_SALT_SIZE);
-    PKCS5_PBKDF2_HMAC_SHA1(password, -1, password_salt, HOST_PASSWORD_SALT_SIZE, 2048, HOST_PASSWORD_HASH_SIZE, password_hash);
+        res = host_client_parse(c);
+        if (res)
+            return res;
+    }
 
-    struct fl_user *u = host_user_get_by_name(c->host, username);
-    if (u != NULL)
+    return 0;
+}
+
+static int host_client_handshake(struct fl_client *c)
+{
+    struct fl_host *h = c->host;
+
+    pthread_mutex_lock(&c->ssl_mutex);
+    int res = SSL_accept(c->ssl);
+    int err = res <= 0 ? SSL_get_error(c->ssl, res) : SSL_ERROR_NONE;
+    if (res <= 0)
     {
-        if (!u->is_use_only)
-            goto host_ccmd_register_error;
-        memcpy(u->password_hash, password_hash, HOST_PASSWORD_HASH_SIZE);
-        memcpy(u->password_salt, password_salt, HOST_PASSWORD_SALT_SIZE);
-        u->is_use_only = cJSON_IsTrue(json_is_use_only);
-        host_call_host_change(c->host, NULL, HOST_CHANGE_USER_CHANGE);
+        c->is_want_write = err == SSL_ERROR_WANT_WRITE;
+        host_client_update_events(c);
     }
-    else
+    pthread_mutex_unlock(&c->ssl_mutex);
+    if (res <= 0)
     {
-        struct fl_user *u = host_user_add(c->host, username, password_hash, password_salt, cJSON_IsTrue(json_is_use_only));
-        if (u == NULL)
-            goto host_ccmd_register_error;
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return 0;
+        ERR_print_errors_fp(stderr);
+        return ECONNABORTED;
     }
 
-    host_printf(H_PRINT_INFO, "Host: client %s:%hu registers <%s>\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), username);
+    c->state = CLIENT_STATE_ESTABLISHED;
+    pthread_mutex_lock(&c->ssl_mutex);
+    c->is_want_write = 0;
+    host_client_update_events(c);
+    pthread_mutex_unlock(&c->ssl_mutex);
+
+    host_user_client_add(h->users[HOST_USER_GUEST], c);
 
-    return host_hcmd_confirm(c, 1);
-host_ccmd_register_error:
-    sleep(1);
-    return host_hcmd_confirm(c, 0);
+    host_call_host_change(c->host, NULL, HOST_CHANGE_CLIENT_CON);
+    host_printf(H_PRINT_INFO, "Host: client %s:%hu connected\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+
+    return host_client_receive(c);
 }
 
-static int host_ccmd_change_password_handler(struct fl_client *c, cJSON *json)
+static void host_client_event(struct fl_client *c, uint32_t events)
 {
-    if (c->user == NULL || c->user->is_use_only)
-        goto host_ccmd_change_password_error;
+    int res = 0;
 
-    cJSON *json_username = cJSON_GetObjectItemCaseSensitive(json, "username");
-    if (!cJSON_IsString(json_username))
-        return ENOMSG;
-    char *username = cJSON_GetStringValue(json_username);
-    struct fl_user *u = host_user_get_by_name(c->host, username);
-    if (u == NULL)
-        goto host_ccmd_change_password_error;
-    if (strcmp(u->username, c->host->users[HOST_USER_GUEST]->username) == 0)
-        goto host_ccmd_change_password_error;
-
-    cJSON *json_old_password = cJSON_GetObjectItemCaseSensitive(json, "old_password");
-    if (!cJSON_IsString(json_old_password))
-        return ENOMSG;
-    char *old_password = cJSON_GetStringValue(json_old_password);
+    if (c->is_closed)
+        return;
+    if (events & (EPOLLERR | EPOLLHUP))
+        res = ECONNRESET;
+    else if (c->state == CLIENT_STATE_HANDSHAKE)
+        res = host_client_handshake(c);
+    else
+    {
+        int is_read_want_write = 0;
+        if (events & EPOLLOUT)
+        {
+            pthread_mutex_lock(&c->ssl_mutex);
+            is_read_want_write = c->is_want_write;
+            res = host_client_flush(c);
+            pthread_mutex_unlock(&c->ssl_mutex);
+        }
+        if (!res && ((events & EPOLLIN) || is_read_want_write))
+            res = host_client_receive(c);
+    }
 
-    uint8_t old_password_hash[HOST_PASSWORD_HASH_SIZE];
-    PKCS5_PBKDF2_HMAC_SHA1(old_password, -1, u->password_salt, HOST_PASSWORD_SALT_SIZE, 2048, HOST_PASSWORD_HASH_SIZE, old_password_hash);
-    if (memcmp(old_password_hash, u->password_hash, HOST_PASSWORD_HASH_SIZE))
-        goto host_ccmd_change_password_error;
+    if (res)
+    {
+        ERR_print_errors_fp(stdout);
+        host_client_disconnected(c);
+    }
+}
 
-    cJSON *json_new_password = cJSON_GetObjectItemCaseSensitive(json, "new_password");
-    if (!cJSON_IsString(json_new_password))
-        return ENOMSG;
-    char *new_password = cJSON_GetStringValue(json_new_password);
+static void host_accept(struct fl_host *h)
+{
+    while (1)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t len = sizeof(struct sockaddr_in);
+        int client_fd = accept4(h->fd, (struct sockaddr *)&client_addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
 
-    uint8_t new_password_hash[HOST_PASSWORD_HASH_SIZE], password_salt[HOST_PASSWORD_SALT_SIZE];
-    host_random(password_salt, HOST_PASSWORD_SALT_SIZE);
-    PKCS5_PBKDF2_HMAC_SHA1(new_password, -1, password_salt, HOST_PASSWORD_SALT_SIZE, 2048, HOST_PASSWORD_HASH_SIZE, new_password_hash);
-    memcpy(u->password_hash, new_password_hash, HOST_PASSWORD_HASH_SIZE);
-    memcpy(u->password_salt, password_salt, HOST_PASSWORD_SALT_SIZE);
+        struct fl_client *c = host_client_create(h, client_fd, client_addr);
+        if (c == NULL)
+        {
+            close(client_fd);
+            continue;
+        }
 
-    host_printf(H_PRINT_INFO, "Host: client %s:%hu changes <%s>'s password\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), username);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev))
+        {
+            perror("epoll_ctl");
+            SSL_free(c->ssl);
+            pthread_mutex_destroy(&c->ssl_mutex);
+            close(client_fd);
+            free(c);
+            continue;
+        }
+        c->events = EPOLLIN;
 
-    return host_hcmd_confirm(c, 1);
-host_ccmd_change_password_error:
-    sleep(1);
-    return host_hcmd_confirm(c, 0);
+        pthread_mutex_lock(&h->clients_mutex);
+        h->clients = realloc(h->clients, (h->n_clients + 1) * sizeof(struct fl_client *));
+        h->clients[h->n_clients] = c;
+        h->n_clients++;
+        pthread_mutex_unlock(&h->clients_mutex);
+    }
 }
 
-static struct fl_client *host_client_create(
+static struct fl_client *host_client_get_by_serial(
     struct fl_host *h,
-    int fd,
-    struct sockaddr_in addr)
+    struct fl_client *c,
+    uint32_t serial)
 {
-    struct fl_client *c = malloc(sizeof(struct fl_client));
-    c->host = h;
-    c->addr = addr;
-    c->fd = fd;
-    pthread_mutex_init(&c->ssl_mutex, NULL);
-
-    return c;
+    for (int i = 0; i < h->n_clients; i++)
+        if (h->clients[i] == c && c->serial == serial)
+            return c;
+    return NULL;
 }
 
-static void host_client_disconnected(struct fl_client *c)
+static void host_tx_done_process(struct fl_host *h)
 {
-    struct fl_host *h = c->host;
-
-    host_user_client_remove(c);
+    uint64_t count;
+    read(h->event_fd, &count, sizeof(count));
 
-    int index;
-    for (index = 0; index < h->n_clients; index++)
-        if (h->clients[index] == c)
-            break;
-    if (index >= h->n_clients)
-        return;
+    pthread_mutex_lock(&h->tx_done_mutex);
+    struct host_tx_done *done = h->tx_done;
+    h->tx_done = NULL;
+    pthread_mutex_unlock(&h->tx_done_mutex);
 
-    for (int i = index; i < h->n_clients - 1; i++)
-        h->clients[i] = h->clients[i + 1];
-    h->n_clients--;
-    h->clients[h->n_clients] = NULL;
+    // 入队为逆序，先翻转
+    struct host_tx_done *list = NULL;
+    while (done != NULL)
+    {
+        struct host_tx_done *next = done->next;
+        done->next = list;
+        list = done;
+        done = next;
+    }
 
-    host_call_host_change(c->host, NULL, HOST_CHANGE_CLIENT_DISCON);
-    pthread_mutex_destroy(&c->ssl_mutex);
-    SSL_free(c->ssl);
-    close(c->fd);
-    free(c);
+    while (list != NULL)
+    {
+        struct host_tx_done *next = list->next;
+        if (list->res)
+        {
+            host_printf(H_PRINT_ERR, "FeLink: %s ERROR, <%08X> : %s\n", list->what, list->dev_id, strerror(list->res));
+        }
+        else
+        {
+            struct fl_client *c = host_client_get_by_serial(h, list->client, list->serial);
+            struct fl_dev_i *d = fl_get_dev_by_id(h->base, list->dev_id);
+            if (c != NULL && d != NULL)
+                host_hcmd_ack(c, d);
+        }
+        free(list);
+        list = next;
+    }
 }
 
-static void *host_receive_thread(void *args)
+static void host_pw_done_process(struct fl_host *h)
 {
-    struct fl_client *c = args;
-    int res;
-
-    c->ssl = SSL_new(c->host->ctx);
-    SSL_set_fd(c->ssl, c->fd);
-    res = SSL_accept(c->ssl);
-    if (res <= 0)
+    pthread_mutex_lock(&h->pw_mutex);
+    struct host_pw_job *job = h->pw_done;
+    h->pw_done = NULL;
+    pthread_mutex_unlock(&h->pw_mutex);
+
+    // 入队为逆序，先翻转
+    struct host_pw_job *list = NULL;
+    while (job != NULL)
     {
-        ERR_print_errors_fp(stderr);
-        SSL_free(c->ssl);
-        close(c->fd);
-        free(c);
-        return NULL;
+        struct host_pw_job *next = job->next;
+        job->next = list;
+        list = job;
+        job = next;
     }
-    res = fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
-    if (res == -1)
+
+    while (list != NULL)
     {
-        perror("ssl fcntl");
-        return NULL;
+        struct host_pw_job *next = list->next;
+        struct fl_client *c = host_client_get_by_serial(h, list->client, list->serial);
+        if (c != NULL)
+        {
+            pthread_mutex_lock(&c->ssl_mutex);
+            c->is_pw_pending = 0;
+            host_client_update_events(c);
+            pthread_mutex_unlock(&c->ssl_mutex);
+
+            int res;
+            if (list->cmd == CCMD_LOGIN)
+                res = host_ccmd_login_done(c, list);
+            else if (list->cmd == CCMD_REGISTER)
+                res = host_ccmd_register_done(c, list);
+            else
+                res = host_ccmd_change_password_done(c, list);
+            // 运算期间积压的帧和已解密的数据不会再触发EPOLLIN
+            if (res || ((c->rx_len > 0 || SSL_pending(c->ssl) > 0) && host_client_receive(c)))
+                host_client_disconnected(c);
+        }
+        host_pw_job_delete(list);
+        list = next;
     }
+}
 
-    struct fl_host *h = c->host;
-    h->clients = realloc(h->clients, (h->n_clients + 1) * sizeof(struct fl_client *));
-    h->clients[h->n_clients] = c;
-    h->n_clients++;
-    host_user_client_add(h->users[HOST_USER_GUEST], c);
-
-    host_call_host_change(c->host, NULL, HOST_CHANGE_CLIENT_CON);
-    host_printf(H_PRINT_INFO, "Host: client %s:%hu connected\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+static int host_pw_workers_start(struct fl_host *h)
+{
+    h->pw_threads = malloc(h->n_pw_workers * sizeof(pthread_t));
+    if (h->pw_threads == NULL)
+        return ENOMEM;
 
-    struct pollfd pfd;
-    pfd.fd = c->fd;
-    pfd.events = POLLIN;
-    uint8_t head[8]; // chksum8 "CMD" len[4]
-    while (1)
+    h->is_pw_stop = 0;
+    h->n_pw_threads = 0;
+    for (int i = 0; i < h->n_pw_workers; i++)
     {
-        res = poll(&pfd, 1, -1);
-        if (res < 0 || pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
-            goto receive_thread_exit;
-        size_t bytes_read;
-        pthread_mutex_lock(&c->ssl_mutex);
-        res = SSL_read_ex(c->ssl, head, 8, &bytes_read);
-        pthread_mutex_unlock(&c->ssl_mutex);
-        if (res <= 0)
-            if (SSL_get_error(c->ssl, res) != SSL_ERROR_WANT_READ)
-                goto receive_thread_exit;
-        if (bytes_read != 8)
-            continue;
+        if (pthread_create(&h->pw_threads[i], NULL, host_pw_worker_thread, h))
+            break;
+        h->n_pw_threads++;
+    }
+    return h->n_pw_threads > 0 ? 0 : EAGAIN;
+}
 
-        if (strncmp((char *)&head[1], "CMD", 3) != 0 || host_chksum8(head, 8) != 0)
+static void host_pw_workers_stop(struct fl_host *h)
+{
+    pthread_mutex_lock(&h->pw_mutex);
+    h->is_pw_stop = 1;
+    pthread_cond_broadcast(&h->pw_cond);
+    pthread_mutex_unlock(&h->pw_mutex);
+    for (int i = 0; i < h->n_pw_threads; i++)
+        pthread_join(h->pw_threads[i], NULL);
+    h->n_pw_threads = 0;
+    free(h->pw_threads);
+    h->pw_threads = NULL;
+
+    struct host_pw_job *lists[2] = {h->pw_queue, h->pw_done};
+    for (int i = 0; i < 2; i++)
+        while (lists[i] != NULL)
         {
-            int exist = SSL_pending(c->ssl);
-            uint8_t temp[exist];
-            SSL_read_ex(c->ssl, temp, exist, &bytes_read);
-            continue;
+            struct host_pw_job *next = lists[i]->next;
+            host_pw_job_delete(lists[i]);
+            lists[i] = next;
         }
-        uint32_t len = host_rd32(&head[4]);
+    h->pw_queue = NULL;
+    h->pw_queue_tail = NULL;
+    h->n_pw_queued = 0;
+    h->pw_done = NULL;
+}
 
-        char json_str[len + 1];
-        json_str[len] = '\0';
-        pthread_mutex_lock(&c->ssl_mutex);
-        res = SSL_read_ex(c->ssl, json_str, len, &bytes_read);
-        pthread_mutex_unlock(&c->ssl_mutex);
-        if (res <= 0)
-            if (SSL_get_error(c->ssl, res) != SSL_ERROR_WANT_READ)
-                goto receive_thread_exit;
-        if (bytes_read < len)
+// 发送到期的延迟确认，返回下一次到期时间(ms)，没有则返回-1
+static int host_confirm_delayed_process(struct fl_host *h)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long timeout = -1;
+
+    // 确认与接收会再次获取clients_mutex，先在锁内取出到期的客户端
+    pthread_mutex_lock(&h->clients_mutex);
+    struct fl_client **due = malloc((h->n_clients + 1) * sizeof(struct fl_client *));
+    int n_due = 0;
+    for (int i = h->n_clients - 1; i >= 0; i--)
+    {
+        struct fl_client *c = h->clients[i];
+        if (!c->is_confirm_delayed)
             continue;
-
-        cJSON *json = cJSON_ParseWithLength(json_str, len);
-        if (json == NULL)
-            goto receive_thread_next;
-
-        host_printf(H_PRINT_CMD, "C (%s:%hu, %s): %s\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), c->user->username, json_str);
-
-        cJSON *json_cmd = cJSON_GetObjectItemCaseSensitive(json, "ccmd");
-        if (!cJSON_IsNumber(json_cmd))
-            goto receive_thread_next;
-        client_cmd cmd = (client_cmd)cJSON_GetNumberValue(json_cmd);
-        switch (cmd)
+        long left = host_timespec_interval_ms(&now, &c->confirm_time);
+        if (left > 0 || due == NULL)
         {
-        case CCMD_INFO:
-            res = host_ccmd_info_handler(c);
-            break;
-        case CCMD_INIT:
-            res = host_ccmd_init_handler(c);
-            break;
-        case CCMD_SCAN:
-            res = host_ccmd_scan_handler(c);
-            break;
-        case CCMD_PAIR:
-            res = host_ccmd_pair_handler(c, json);
-            break;
-        case CCMD_CONNECT:
-            res = host_ccmd_connect_handler(c, json);
-            break;
-        case CCMD_UNPAIR:
-            res = host_ccmd_unpair_handler(c, json);
-            break;
-        case CCMD_DATA:
-            res = host_ccmd_data_handler(c, json);
-            break;
-        case CCMD_SET_TIMEOUT:
-            res = host_ccmd_set_timeout_handler(c, json);
-            break;
-        case CCMD_SET_MAXRET:
-            res = host_ccmd_set_maxret_handler(c, json);
-            break;
-        case CCMD_LOGIN:
-            res = host_ccmd_login_handler(c, json);
-            break;
-        case CCMD_REGISTER:
-            res = host_ccmd_register_handler(c, json);
-            break;
-        case CCMD_CHANGE_PASSWORD:
-            res = host_ccmd_change_password_handler(c, json);
-            break;
-        default:
-            res = 0;
-            break;
+            if (left < 1)
+                left = 1;
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+            continue;
         }
-        if (res)
-            host_printf(H_PRINT_ERR, "Host: client cmd ERROR : %s\n", strerror(res));
+        due[n_due++] = c;
+    }
+    pthread_mutex_unlock(&h->clients_mutex);
 
-    receive_thread_next:
-        cJSON_Delete(json);
+    // 关闭的客户端在本轮结束前不会释放
+    for (int i = 0; i < n_due; i++)
+    {
+        struct fl_client *c = due[i];
+        if (c->is_closed)
+            continue;
+
+        pthread_mutex_lock(&c->ssl_mutex);
+        c->is_confirm_delayed = 0;
+        host_client_update_events(c);
+        pthread_mutex_unlock(&c->ssl_mutex);
+        host_hcmd_confirm(c, 0);
+        // 延迟期间积压的帧和已解密的数据不会再触发EPOLLIN
+        if ((c->rx_len > 0 || SSL_pending(c->ssl) > 0) && host_client_receive(c))
+            host_client_disconnected(c);
     }
+    free(due);
 
-receive_thread_exit:
-    ERR_print_errors_fp(stdout);
-    host_printf(H_PRINT_INFO, "Host: client %s:%hu disconnected\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
-    host_client_disconnected(c);
-    return NULL;
+    return (int)timeout;
 }
 
-static void *host_accept_thread(void *args)
+static void *host_reactor_thread(void *args)
 {
     struct fl_host *h = args;
+    struct epoll_event events[HOST_EPOLL_EVENTS];
+    int timeout = -1;
 
-    int client_fd;
-    struct sockaddr_in client_addr;
-    socklen_t len = sizeof(struct sockaddr_in);
-    while (1)
+    while (!h->is_reactor_stop)
     {
-        client_fd = accept(h->fd, (struct sockaddr *)&client_addr, &len);
-        if (client_fd < 0)
+        int n = epoll_wait(h->epoll_fd, events, HOST_EPOLL_EVENTS, timeout);
+        if (n < 0)
         {
-            perror("accept");
-            continue;
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
         }
-        struct fl_client *c = host_client_create(h, client_fd, client_addr);
-        pthread_create(&c->receive_thread, NULL, host_receive_thread, c);
+
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &h->fd)
+                host_accept(h);
+            else if (ptr == &h->event_fd)
+            {
+                host_tx_done_process(h);
+                host_pw_done_process(h);
+            }
+            else
+                host_client_event(ptr, events[i].events);
+        }
+        timeout = host_confirm_delayed_process(h);
+        host_clients_free_closed(h);
     }
 
     return NULL;
@@ -892,13 +2769,14 @@ static void host_user_dev_add(
 {
     if (u == NULL || d == NULL)
         return;
-    for (int i = 0; i < u->n_available_devs; i++)
-        if (u->available_devs[i] == d)
-            return;
+    if (host_user_dev_is_accessable(u, d))
+        return;
     u->available_devs = realloc(u->available_devs, (u->n_available_devs + 1) * sizeof(struct fl_dev_i *));
     u->available_devs[u->n_available_devs] = d;
     u->n_available_devs++;
+    host_index_insert(&u->available_dev_index, d, host_dev_index_hash);
     host_hcmd_info_broadcast(u);
+    host_journal_mark(u->host, u->username);
     host_call_host_change(u->host, d, HOST_CHANGE_USER_DEV_ADD);
 }
 
@@ -906,17 +2784,19 @@ static void host_user_dev_remove(
     struct fl_user *u,
     struct fl_dev_i *d)
 {
+    if (!host_user_dev_is_accessable(u, d))
+        return;
     int index;
     for (index = 0; index < u->n_available_devs; index++)
         if (u->available_devs[index] == d)
             break;
-    if (index >= u->n_available_devs)
-        return;
     for (int i = index; i < u->n_available_devs - 1; i++)
         u->available_devs[i] = u->available_devs[i + 1];
     u->n_available_devs--;
     u->available_devs[u->n_available_devs] = NULL;
+    host_index_rebuild(&u->available_dev_index, (void *const *)u->available_devs, u->n_available_devs, host_dev_index_hash);
     host_hcmd_info_broadcast(u);
+    host_journal_mark(u->host, u->username);
     host_call_host_change(u->host, d, HOST_CHANGE_USER_DEV_REMOVE);
 }
 
@@ -951,13 +2831,18 @@ void host_dev_change_handler(
         host_user_dev_add(c->user, dev);
         host_printf(H_PRINT_INFO, "Host: client %s:%hu<%s> pairs device <%08X>\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), c->user->username, dev->id);
         break;
-    case DEV_CHANGE_PAIR_START:
     case DEV_CHANGE_ID_CHANGE:
+        // 用户存档中以id记录设备
+        for (int i = 0; i < h->n_users; i++)
+            if (host_user_dev_is_accessable(h->users[i], dev))
+                host_journal_mark(h, h->users[i]->username);
+        // fall through
+    case DEV_CHANGE_PAIR_START:
     case DEV_CHANGE_CONNECT:
     case DEV_CHANGE_CONNECT_TIMEOUT:
         for (int i = 0; i < h->n_users; i++)
             if (host_user_dev_is_accessable(h->users[i], dev))
-                host_hcmd_info_broadcast(h->users[i]);
+                host_hcmd_dev_delta_broadcast(h->users[i], dev);
         break;
     default:
         for (int i = 0; i < base->n_devs; i++)
@@ -968,34 +2853,200 @@ void host_dev_change_handler(
         return;
     }
 
-    host_call_host_change(h, dev, type);
+    // 回调的type为int，设备变化(非负)与host_change_type(负)共用取值空间，原值转发
+    host_call_host_change(h, dev, (host_change_type)type);
     host_printf(H_PRINT_INFO, " <%08X> -> Type: %04hX, State: %d, Name: \'%s\'\n", dev->id, dev->type, dev->state, dev->name);
 }
 
-struct fl_host_i *host_init(struct fl_base_i *base)
+static struct fl_host *host_create(struct fl_base_i *base)
 {
     struct fl_host *h = malloc(sizeof(struct fl_host));
+    if (h == NULL)
+        return NULL;
 
     h->base = base;
     h->users = malloc(8 * sizeof(struct fl_user *));
     h->n_users = 0;
+    memset(&h->user_index, 0, sizeof(struct host_index));
     h->clients = malloc(8 * sizeof(struct fl_client *));
     h->n_clients = 0;
+    h->closed_clients = NULL;
+    h->fd = -1;
+    h->backlog = HOST_DEFAULT_BACKLOG;
+    h->max_frame_size = HOST_DEFAULT_MAX_FRAME_SIZE;
+    h->ctx = NULL;
+    h->ecdsa_cert = NULL;
+    h->ecdsa_key = NULL;
+    pthread_mutex_init(&h->ticket_mutex, NULL);
+    memset(h->ticket_keys, 0, sizeof(h->ticket_keys));
+    h->n_ticket_keys = 0;
+    h->epoll_fd = -1;
+    h->event_fd = -1;
+    h->is_reactor_stop = 0;
+    h->client_serial = 0;
+    pthread_mutex_init(&h->clients_mutex, NULL);
+    pthread_mutex_init(&h->tx_done_mutex, NULL);
+    pthread_mutex_init(&h->info_mutex, NULL);
+    pthread_mutex_init(&h->buf_pool_mutex, NULL);
+    for (int i = 0; i < HOST_BUF_POOL_CLASSES; i++)
+    {
+        h->buf_free[i] = NULL;
+        h->n_buf_free[i] = 0;
+        h->n_buf_in_use[i] = 0;
+        h->buf_high_water[i] = 0;
+    }
+    h->n_buf_oversize = 0;
+    pthread_cond_init(&h->tx_done_cond, NULL);
+    h->tx_done = NULL;
+    h->n_tx_pending = 0;
     h->client_pairing_dev = NULL;
+    h->pw_threads = NULL;
+    h->n_pw_workers = HOST_DEFAULT_PW_WORKERS;
+    h->n_pw_threads = 0;
+    h->pw_queue_max = HOST_DEFAULT_PW_QUEUE_MAX;
+    pthread_mutex_init(&h->pw_mutex, NULL);
+    pthread_cond_init(&h->pw_cond, NULL);
+    h->is_pw_stop = 0;
+    h->pw_queue = NULL;
+    h->pw_queue_tail = NULL;
+    h->n_pw_queued = 0;
+    h->pw_done = NULL;
+    memset(h->pw_rates, 0, sizeof(h->pw_rates));
+    pthread_mutex_init(&h->journal_mutex, NULL);
+    h->journal_users = NULL;
+    h->n_journal_users = 0;
+    h->is_journal_ticket_keys = 0;
     h->host_change_callback = NULL;
     h->host_change_private_arg = NULL;
 
-    uint8_t password_hash[HOST_PASSWORD_HASH_SIZE], password_salt[HOST_PASSWORD_SALT_SIZE];
-    host_random(password_salt, HOST_PASSWORD_SALT_SIZE);
-    PKCS5_PBKDF2_HMAC_SHA1("123456", -1, password_salt, HOST_PASSWORD_SALT_SIZE, 2048, HOST_PASSWORD_HASH_SIZE, password_hash);
-    host_user_add(h, "admin", password_hash, password_salt, 0);
-    memset(password_hash, 0, HOST_PASSWORD_HASH_SIZE);
-    memset(password_salt, 0, HOST_PASSWORD_SALT_SIZE);
-    host_user_add(h, "guest", password_hash, password_salt, 1);
+    return h;
+}
+
+struct fl_host_i *host_init(struct fl_base_i *base)
+{
+    struct fl_host *h = host_create(base);
+    if (h == NULL)
+        return NULL;
+
+    uint8_t password_hash[HOST_PASSWORD_HASH_SIZE], password_salt[HOST_PASSWORD_SALT_SIZE];
+    fl_random(password_salt, HOST_PASSWORD_SALT_SIZE);
+    PKCS5_PBKDF2_HMAC_SHA1("123456", -1, password_salt, HOST_PASSWORD_SALT_SIZE, HOST_PASSWORD_PBKDF2_ITER, HOST_PASSWORD_HASH_SIZE, password_hash);
+    host_user_add(h, "admin", password_hash, password_salt, 0);
+    memset(password_hash, 0, HOST_PASSWORD_HASH_SIZE);
+    memset(password_salt, 0, HOST_PASSWORD_SALT_SIZE);
+    host_user_add(h, "guest", password_hash, password_salt, 1);
+
+    fl_set_devs_change_callback(base, host_dev_change_handler, h);
+
+    return (struct fl_host_i *)h;
+}
+
+// 需持有ticket_mutex，返回是否轮换
+static int host_ticket_key_rotate(struct fl_host *h)
+{
+    time_t now = time(NULL);
+    if (h->n_ticket_keys > 0 && now - h->ticket_keys[0].created < HOST_TLS_TICKET_KEY_LIFETIME && now >= h->ticket_keys[0].created)
+        return 0;
+
+    for (int i = HOST_TLS_TICKET_KEYS - 1; i > 0; i--)
+        h->ticket_keys[i] = h->ticket_keys[i - 1];
+    struct host_ticket_key *k = &h->ticket_keys[0];
+    if (fl_random(k->name, HOST_TLS_TICKET_NAME_SIZE) ||
+        fl_random(k->aes_key, HOST_TLS_TICKET_KEY_SIZE) ||
+        fl_random(k->hmac_key, HOST_TLS_TICKET_KEY_SIZE))
+    {
+        for (int i = 0; i < HOST_TLS_TICKET_KEYS - 1; i++)
+            h->ticket_keys[i] = h->ticket_keys[i + 1];
+        return 0;
+    }
+    k->created = now;
+    if (h->n_ticket_keys < HOST_TLS_TICKET_KEYS)
+        h->n_ticket_keys++;
+    return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int host_ticket_hmac_init(EVP_MAC_CTX *hctx, uint8_t *hmac_key)
+{
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmac_key, HOST_TLS_TICKET_KEY_SIZE);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "sha256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+typedef HMAC_CTX EVP_MAC_CTX;
+
+static int host_ticket_hmac_init(HMAC_CTX *hctx, uint8_t *hmac_key)
+{
+    return HMAC_Init_ex(hctx, hmac_key, HOST_TLS_TICKET_KEY_SIZE, EVP_sha256(), NULL);
+}
+#endif
+
+// 在reactor线程的握手中调用，返回-1出错，0票据无效(完整握手)，1有效，2有效但需换发
+static int host_ticket_key_callback(
+    SSL *ssl,
+    uint8_t *key_name,
+    uint8_t *iv,
+    EVP_CIPHER_CTX *ctx,
+    EVP_MAC_CTX *hctx,
+    int enc)
+{
+    struct fl_host *h = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    int res = -1;
+
+    pthread_mutex_lock(&h->ticket_mutex);
+    if (enc)
+    {
+        int is_rotated = host_ticket_key_rotate(h);
+        struct host_ticket_key *k = &h->ticket_keys[0];
+        if (h->n_ticket_keys > 0 &&
+            fl_random(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 0 &&
+            EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, k->aes_key, iv) == 1 &&
+            host_ticket_hmac_init(hctx, k->hmac_key) == 1)
+        {
+            memcpy(key_name, k->name, HOST_TLS_TICKET_NAME_SIZE);
+            res = 1;
+        }
+        pthread_mutex_unlock(&h->ticket_mutex);
+        if (is_rotated)
+        {
+            host_printf(H_PRINT_INFO, "Host: TLS ticket key rotated\n");
+            host_journal_mark(h, NULL);
+            host_call_host_change(h, NULL, HOST_CHANGE_TLS_TICKET_KEY);
+        }
+        return res;
+    }
 
-    fl_set_devs_change_callback(base, host_dev_change_handler, h);
+    res = 0;
+    for (int i = 0; i < h->n_ticket_keys; i++)
+    {
+        struct host_ticket_key *k = &h->ticket_keys[i];
+        if (memcmp(key_name, k->name, HOST_TLS_TICKET_NAME_SIZE) != 0)
+            continue;
+        if (time(NULL) - k->created >= HOST_TLS_TICKET_KEY_LIFETIME * HOST_TLS_TICKET_KEYS)
+            break;
+        if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, k->aes_key, iv) == 1 &&
+            host_ticket_hmac_init(hctx, k->hmac_key) == 1)
+            res = i == 0 ? 1 : 2;
+        else
+            res = -1;
+        break;
+    }
+    pthread_mutex_unlock(&h->ticket_mutex);
+    return res;
+}
 
-    return (struct fl_host_i *)h;
+static int host_ssl_ctx_use_cert(SSL_CTX *ctx, const char *cert, const char *key)
+{
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stdout);
+        return 1;
+    }
+    return 0;
 }
 
 int host_start(
@@ -1018,28 +3069,31 @@ int host_start(
         return 1;
     }
     h->ctx = ctx;
+    // 非阻塞写遇到WANT_WRITE后缓冲区可能已经realloc
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
 
     // openssl req -nodes -x509 -days 730 -newkey rsa:2048 -keyout cert/privatekey.pem -out cert/certificate.pem
-    res = SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM);
-    if (res != 1)
-    {
-        ERR_print_errors_fp(stdout);
-        goto host_start_error;
-    }
-    res = SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM);
-    if (res != 1)
-    {
-        ERR_print_errors_fp(stdout);
+    if (host_ssl_ctx_use_cert(ctx, cert, key))
         goto host_start_error;
-    }
-    res = SSL_CTX_check_private_key(ctx);
-    if (res != 1)
-    {
-        ERR_print_errors_fp(stdout);
+    // 支持的客户端优先使用ECDSA证书，A7上签名比RSA-2048快得多
+    // openssl req -nodes -x509 -days 730 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -keyout cert/ecdsa-privatekey.pem -out cert/ecdsa-certificate.pem
+    if (h->ecdsa_cert != NULL && host_ssl_ctx_use_cert(ctx, h->ecdsa_cert, h->ecdsa_key))
         goto host_start_error;
-    }
-
-    h->fd = socket(AF_INET, SOCK_STREAM, 0);
+    SSL_CTX_set1_groups_list(ctx, "X25519:P-256");
+
+    // 会话缓存(TLS1.2会话ID)与会话票据，重连的客户端免去完整握手
+    SSL_CTX_set_app_data(ctx, h);
+    SSL_CTX_set_session_id_context(ctx, (const uint8_t *)HOST_TLS_SESSION_ID_CONTEXT, strlen(HOST_TLS_SESSION_ID_CONTEXT));
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, HOST_TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, HOST_TLS_SESSION_TIMEOUT);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, host_ticket_key_callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, host_ticket_key_callback);
+#endif
+
+    h->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (h->fd < 0)
     {
         perror("socket");
@@ -1061,7 +3115,7 @@ int host_start(
         goto host_start_error;
     }
 
-    res = listen(h->fd, 1);
+    res = listen(h->fd, h->backlog);
     if (res)
     {
         perror("listen");
@@ -1069,13 +3123,62 @@ int host_start(
         goto host_start_error;
     }
 
-    pthread_create(&h->accept_thread, NULL, host_accept_thread, h);
+    h->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (h->epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        close(h->fd);
+        goto host_start_error;
+    }
+    h->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (h->event_fd < 0)
+    {
+        perror("eventfd");
+        goto host_start_error_epoll;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &h->fd;
+    res = epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, h->fd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &h->event_fd;
+    res |= epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, h->event_fd, &ev);
+    if (res)
+    {
+        perror("epoll_ctl");
+        goto host_start_error_eventfd;
+    }
+
+    res = host_pw_workers_start(h);
+    if (res)
+    {
+        host_pw_workers_stop(h);
+        goto host_start_error_eventfd;
+    }
+
+    h->is_reactor_stop = 0;
+    res = pthread_create(&h->reactor_thread, NULL, host_reactor_thread, h);
+    if (res)
+    {
+        host_pw_workers_stop(h);
+        goto host_start_error_eventfd;
+    }
 
     host_printf(H_PRINT_INFO, "Host: server start listening on port %hu\n", port);
 
     return 0;
+host_start_error_eventfd:
+    close(h->event_fd);
+    h->event_fd = -1;
+host_start_error_epoll:
+    close(h->epoll_fd);
+    h->epoll_fd = -1;
+    close(h->fd);
 host_start_error:
+    h->fd = -1;
     SSL_CTX_free(ctx);
+    h->ctx = NULL;
     return 1;
 }
 
@@ -1085,30 +3188,126 @@ void host_stop(struct fl_host_i *host)
 
     fl_set_devs_change_callback(h->base, NULL, NULL);
 
-    pthread_cancel(h->accept_thread);
-    pthread_join(h->accept_thread, NULL);
+    if (h->epoll_fd < 0)
+        return;
+
+    uint64_t one = 1;
+    h->is_reactor_stop = 1;
+    write(h->event_fd, &one, sizeof(one));
+    pthread_join(h->reactor_thread, NULL);
     for (int i = h->n_clients - 1; i >= 0; i--)
-    {
-        pthread_cancel(h->clients[i]->receive_thread);
-        pthread_join(h->clients[i]->receive_thread, NULL);
         host_client_disconnected(h->clients[i]);
-    }
+    host_clients_free_closed(h);
+    host_pw_workers_stop(h);
+
+    // 设备的发送完成回调可能晚于停止到达，统一在host_delete中释放
+    close(h->epoll_fd);
+    h->epoll_fd = -1;
 }
 
 void host_delete(struct fl_host_i *host)
 {
     struct fl_host *h = (struct fl_host *)host;
 
+    fl_set_devs_change_callback(h->base, NULL, NULL);
     for (int i = h->n_users - 1; i >= 0; i--)
         host_user_remove(h->users[i]);
 
+    // 等待FeLink调度线程回调完所有未完成的请求
+    pthread_mutex_lock(&h->tx_done_mutex);
+    while (h->n_tx_pending > 0)
+        pthread_cond_wait(&h->tx_done_cond, &h->tx_done_mutex);
+    pthread_mutex_unlock(&h->tx_done_mutex);
+
+    struct host_tx_done *done = h->tx_done;
+    while (done != NULL)
+    {
+        struct host_tx_done *next = done->next;
+        free(done);
+        done = next;
+    }
+
     SSL_CTX_free(h->ctx);
-    close(h->fd);
+    if (h->fd >= 0)
+        close(h->fd);
+    if (h->event_fd >= 0)
+        close(h->event_fd);
+    pthread_mutex_destroy(&h->clients_mutex);
+    pthread_mutex_destroy(&h->tx_done_mutex);
+    pthread_mutex_destroy(&h->info_mutex);
+    pthread_mutex_destroy(&h->pw_mutex);
+    pthread_cond_destroy(&h->pw_cond);
+    pthread_mutex_destroy(&h->ticket_mutex);
+    OPENSSL_cleanse(h->ticket_keys, sizeof(h->ticket_keys));
+    host_journal_clear(h);
+    free(h->journal_users);
+    pthread_mutex_destroy(&h->journal_mutex);
+    free(h->ecdsa_cert);
+    free(h->ecdsa_key);
+    host_buf_pool_free(h);
+    pthread_cond_destroy(&h->tx_done_cond);
     free(h->users);
+    free(h->user_index.slots);
     free(h->clients);
     free(h);
 }
 
+void host_set_backlog(struct fl_host_i *host, int backlog)
+{
+    struct fl_host *h = (struct fl_host *)host;
+
+    h->backlog = backlog > 0 ? backlog : HOST_DEFAULT_BACKLOG;
+}
+
+int host_set_ecdsa_cert(struct fl_host_i *host, const char *cert, const char *key)
+{
+    struct fl_host *h = (struct fl_host *)host;
+
+    char *c = strdup(cert), *k = strdup(key);
+    if (c == NULL || k == NULL)
+    {
+        free(c);
+        free(k);
+        return ENOMEM;
+    }
+    free(h->ecdsa_cert);
+    free(h->ecdsa_key);
+    h->ecdsa_cert = c;
+    h->ecdsa_key = k;
+    return 0;
+}
+
+void host_set_password_workers(struct fl_host_i *host, int n_workers, int queue_max)
+{
+    struct fl_host *h = (struct fl_host *)host;
+
+    h->n_pw_workers = n_workers > 0 ? n_workers : HOST_DEFAULT_PW_WORKERS;
+    h->pw_queue_max = queue_max > 0 ? queue_max : HOST_DEFAULT_PW_QUEUE_MAX;
+}
+
+void host_set_max_frame_size(struct fl_host_i *host, uint32_t max_frame_size)
+{
+    struct fl_host *h = (struct fl_host *)host;
+
+    h->max_frame_size = max_frame_size > 0 ? max_frame_size : HOST_DEFAULT_MAX_FRAME_SIZE;
+}
+
+void host_get_mem_stats(struct fl_host_i *host, struct host_mem_stats *stats)
+{
+    struct fl_host *h = (struct fl_host *)host;
+
+    pthread_mutex_lock(&h->buf_pool_mutex);
+    for (int i = 0; i < HOST_BUF_POOL_CLASSES; i++)
+    {
+        stats->buf_class_size[i] = host_buf_pool_class_size[i];
+        stats->buf_in_use[i] = h->n_buf_in_use[i];
+        stats->buf_high_water[i] = h->buf_high_water[i];
+        stats->buf_free[i] = h->n_buf_free[i];
+    }
+    stats->buf_oversize = h->n_buf_oversize;
+    pthread_mutex_unlock(&h->buf_pool_mutex);
+}
+
 void host_set_host_change_callback(
     struct fl_host_i *host,
     host_change_callback_t callback,
@@ -1120,115 +3319,527 @@ void host_set_host_change_callback(
     h->host_change_private_arg = private_arg;
 }
 
-struct fl_host_i *host_load(
-    struct fl_base_i *base,
-    const uint8_t *sav,
-    size_t count)
+static cJSON *host_user_to_json(struct fl_user *u)
 {
-    char *json_str = (char *)sav;
+    cJSON *json_user = cJSON_CreateObject();
+    cJSON_AddItemToObject(json_user, "username", cJSON_CreateString(u->username));
+    cJSON *json_user_available_devs_id = cJSON_CreateArray();
+    for (int j = 0; j < u->n_available_devs; j++)
+        if (u->available_devs[j]->state >= STATE_PAIRED)
+            cJSON_AddItemToArray(json_user_available_devs_id, cJSON_CreateNumber(u->available_devs[j]->id));
+    cJSON_AddItemToObject(json_user, "available_devs_id", json_user_available_devs_id);
+    cJSON_AddItemToObject(json_user, "is_use_only", cJSON_CreateBool(u->is_use_only));
+    char password_hash_base64[HOST_PASSWORD_HASH_SIZE * 2];
+    EVP_EncodeBlock((uint8_t *)password_hash_base64, u->password_hash, HOST_PASSWORD_HASH_SIZE);
+    cJSON_AddItemToObject(json_user, "password_hash", cJSON_CreateString(password_hash_base64));
+    char password_salt_base64[HOST_PASSWORD_SALT_SIZE * 2];
+    EVP_EncodeBlock((uint8_t *)password_salt_base64, u->password_salt, HOST_PASSWORD_SALT_SIZE);
+    cJSON_AddItemToObject(json_user, "password_salt", cJSON_CreateString(password_salt_base64));
+    return json_user;
+}
 
-    struct fl_host *h = malloc(sizeof(struct fl_host));
+// 新建用户或覆盖同名用户
+static int host_user_from_json(struct fl_host *h, cJSON *json_user)
+{
+    cJSON *json_user_username = cJSON_GetObjectItemCaseSensitive(json_user, "username");
+    cJSON *json_user_available_devs_id = cJSON_GetObjectItemCaseSensitive(json_user, "available_devs_id");
+    cJSON *json_user_is_use_only = cJSON_GetObjectItemCaseSensitive(json_user, "is_use_only");
+    cJSON *json_user_password_hash = cJSON_GetObjectItemCaseSensitive(json_user, "password_hash");
+    cJSON *json_user_password_salt = cJSON_GetObjectItemCaseSensitive(json_user, "password_salt");
+    if (!cJSON_IsString(json_user_username) ||
+        !cJSON_IsArray(json_user_available_devs_id) ||
+        !cJSON_IsBool(json_user_is_use_only) ||
+        !cJSON_IsString(json_user_password_hash) ||
+        !cJSON_IsString(json_user_password_salt))
+        return EINVAL;
+    cJSON *json_user_available_dev_id;
+    cJSON_ArrayForEach(json_user_available_dev_id, json_user_available_devs_id)
+        if (!cJSON_IsNumber(json_user_available_dev_id))
+            return EINVAL;
+
+    char *password_hash_base64 = cJSON_GetStringValue(json_user_password_hash);
+    char *password_salt_base64 = cJSON_GetStringValue(json_user_password_salt);
+    int password_hash_base64_len = strlen(password_hash_base64);
+    int password_salt_base64_len = strlen(password_salt_base64);
+    uint8_t password_hash[password_hash_base64_len + HOST_PASSWORD_HASH_SIZE];
+    uint8_t password_salt[password_salt_base64_len + HOST_PASSWORD_SALT_SIZE];
+    EVP_DecodeBlock(password_hash, (uint8_t *)password_hash_base64, password_hash_base64_len);
+    EVP_DecodeBlock(password_salt, (uint8_t *)password_salt_base64, password_salt_base64_len);
+
+    struct fl_user *u = host_user_get_by_name(h, cJSON_GetStringValue(json_user_username));
+    if (u == NULL)
+    {
+        u = host_user_add(h, cJSON_GetStringValue(json_user_username), password_hash, password_salt, cJSON_IsTrue(json_user_is_use_only));
+        if (u == NULL)
+            return ENOMEM;
+    }
+    else
+    {
+        memcpy(u->password_hash, password_hash, HOST_PASSWORD_HASH_SIZE);
+        memcpy(u->password_salt, password_salt, HOST_PASSWORD_SALT_SIZE);
+        u->is_use_only = cJSON_IsTrue(json_user_is_use_only);
+        while (u->n_available_devs > 0)
+            host_user_dev_remove(u, u->available_devs[u->n_available_devs - 1]);
+        host_user_info_invalidate(u);
+    }
 
-    h->base = base;
-    h->users = malloc(8 * sizeof(struct fl_user *));
-    h->n_users = 0;
-    h->clients = malloc(8 * sizeof(struct fl_client *));
-    h->n_clients = 0;
-    h->client_pairing_dev = NULL;
-    h->host_change_callback = NULL;
-    h->host_change_private_arg = NULL;
+    cJSON_ArrayForEach(json_user_available_dev_id, json_user_available_devs_id)
+        host_user_dev_add(u, fl_get_dev_by_id(h->base, cJSON_GetNumberValue(json_user_available_dev_id)));
+    return 0;
+}
+
+static cJSON *host_ticket_keys_to_json(struct fl_host *h)
+{
+    cJSON *json_ticket_keys = cJSON_CreateArray();
+    pthread_mutex_lock(&h->ticket_mutex);
+    for (int i = 0; i < h->n_ticket_keys; i++)
+    {
+        struct host_ticket_key *k = &h->ticket_keys[i];
+        cJSON *json_ticket_key = cJSON_CreateObject();
+        char name_base64[HOST_TLS_TICKET_NAME_SIZE * 2];
+        EVP_EncodeBlock((uint8_t *)name_base64, k->name, HOST_TLS_TICKET_NAME_SIZE);
+        cJSON_AddItemToObject(json_ticket_key, "name", cJSON_CreateString(name_base64));
+        char aes_key_base64[HOST_TLS_TICKET_KEY_SIZE * 2];
+        EVP_EncodeBlock((uint8_t *)aes_key_base64, k->aes_key, HOST_TLS_TICKET_KEY_SIZE);
+        cJSON_AddItemToObject(json_ticket_key, "aes_key", cJSON_CreateString(aes_key_base64));
+        char hmac_key_base64[HOST_TLS_TICKET_KEY_SIZE * 2];
+        EVP_EncodeBlock((uint8_t *)hmac_key_base64, k->hmac_key, HOST_TLS_TICKET_KEY_SIZE);
+        cJSON_AddItemToObject(json_ticket_key, "hmac_key", cJSON_CreateString(hmac_key_base64));
+        cJSON_AddItemToObject(json_ticket_key, "created", cJSON_CreateNumber(k->created));
+        cJSON_AddItemToArray(json_ticket_keys, json_ticket_key);
+        OPENSSL_cleanse(aes_key_base64, sizeof(aes_key_base64));
+        OPENSSL_cleanse(hmac_key_base64, sizeof(hmac_key_base64));
+    }
+    pthread_mutex_unlock(&h->ticket_mutex);
+    return json_ticket_keys;
+}
+
+// 以存档中的密钥替换当前密钥
+static void host_ticket_keys_from_json(struct fl_host *h, cJSON *json_ticket_keys)
+{
+    pthread_mutex_lock(&h->ticket_mutex);
+    OPENSSL_cleanse(h->ticket_keys, sizeof(h->ticket_keys));
+    h->n_ticket_keys = 0;
+    cJSON *json_ticket_key;
+    cJSON_ArrayForEach(json_ticket_key, json_ticket_keys)
+    {
+        if (h->n_ticket_keys >= HOST_TLS_TICKET_KEYS)
+            break;
+        cJSON *json_name = cJSON_GetObjectItemCaseSensitive(json_ticket_key, "name");
+        cJSON *json_aes_key = cJSON_GetObjectItemCaseSensitive(json_ticket_key, "aes_key");
+        cJSON *json_hmac_key = cJSON_GetObjectItemCaseSensitive(json_ticket_key, "hmac_key");
+        cJSON *json_created = cJSON_GetObjectItemCaseSensitive(json_ticket_key, "created");
+        if (!cJSON_IsString(json_name) ||
+            !cJSON_IsString(json_aes_key) ||
+            !cJSON_IsString(json_hmac_key) ||
+            !cJSON_IsNumber(json_created))
+            continue;
+
+        struct host_ticket_key *k = &h->ticket_keys[h->n_ticket_keys];
+        char *name_base64 = cJSON_GetStringValue(json_name);
+        char *aes_key_base64 = cJSON_GetStringValue(json_aes_key);
+        char *hmac_key_base64 = cJSON_GetStringValue(json_hmac_key);
+        int name_base64_len = strlen(name_base64);
+        int aes_key_base64_len = strlen(aes_key_base64);
+        int hmac_key_base64_len = strlen(hmac_key_base64);
+        uint8_t name[name_base64_len + 3], aes_key[aes_key_base64_len + 3], hmac_key[hmac_key_base64_len + 3];
+        if (EVP_DecodeBlock(name, (uint8_t *)name_base64, name_base64_len) < HOST_TLS_TICKET_NAME_SIZE ||
+            EVP_DecodeBlock(aes_key, (uint8_t *)aes_key_base64, aes_key_base64_len) < HOST_TLS_TICKET_KEY_SIZE ||
+            EVP_DecodeBlock(hmac_key, (uint8_t *)hmac_key_base64, hmac_key_base64_len) < HOST_TLS_TICKET_KEY_SIZE)
+            continue;
+        memcpy(k->name, name, HOST_TLS_TICKET_NAME_SIZE);
+        memcpy(k->aes_key, aes_key, HOST_TLS_TICKET_KEY_SIZE);
+        memcpy(k->hmac_key, hmac_key, HOST_TLS_TICKET_KEY_SIZE);
+        k->created = (time_t)cJSON_GetNumberValue(json_created);
+        h->n_ticket_keys++;
+        OPENSSL_cleanse(aes_key, sizeof(aes_key));
+        OPENSSL_cleanse(hmac_key, sizeof(hmac_key));
+    }
+    pthread_mutex_unlock(&h->ticket_mutex);
+}
+
+/*  .sav v2
+    二进制快照，各字段按4字节对齐，旧版JSON存档仍可读取
+    char[]  HOSV
+    u16     format_version  HOST_SAV_VERSION
+    u16     n_ticket_keys
+    u32     len             4的倍数
+    u32     chksum32        全文按u32累加后为0xFFFFFFFF
+    u32     n_users
+    ticket_keys[]
+    {
+        u8[]    name
+        u8[]    aes_key
+        u8[]    hmac_key
+        u32     created_lo
+        u32     created_hi
+    }
+    users[]
+    {
+        u32     size            本项长度，4的倍数
+        u32     n_devs
+        u8      is_use_only
+        u8[3]   reserved
+        u8[]    password_hash
+        u8[]    password_salt
+        u32[]   devs_id
+        char[]  username        以'\0'结尾
+    }
+*/
+
+#define HOST_SAV_VERSION 2
+#define HOST_SAV_HEAD_SIZE 20
+#define HOST_SAV_TICKET_KEY_SIZE (HOST_TLS_TICKET_NAME_SIZE + 2 * HOST_TLS_TICKET_KEY_SIZE + 8)
+#define HOST_SAV_USER_HEAD_SIZE (12 + HOST_PASSWORD_HASH_SIZE + HOST_PASSWORD_SALT_SIZE)
+
+static size_t host_sav_align4(size_t len)
+{
+    return (len + 3) & ~(size_t)3;
+}
+
+static uint32_t host_chksum32(const uint8_t *bytes, size_t len)
+{
+    uint32_t chksum32 = 0;
+    for (size_t i = 0; i < len; i += 4)
+        chksum32 += host_rd32(&bytes[i]);
+    return ~chksum32;
+}
+
+static int host_load_bin(struct fl_host *h, const uint8_t *sav, size_t count)
+{
+    if (count < HOST_SAV_HEAD_SIZE || host_rd16(&sav[4]) != HOST_SAV_VERSION)
+        return EINVAL;
+    int n_ticket_keys = host_rd16(&sav[6]);
+    uint32_t len = host_rd32(&sav[8]);
+    uint32_t n_users = host_rd32(&sav[16]);
+    if (len > count || len % 4 != 0 || n_users < 2 ||
+        HOST_SAV_HEAD_SIZE + (size_t)n_ticket_keys * HOST_SAV_TICKET_KEY_SIZE > len ||
+        host_chksum32(sav, len) != 0)
+        return EINVAL;
+
+    const uint8_t *ptr = &sav[HOST_SAV_HEAD_SIZE], *end = &sav[len];
+    pthread_mutex_lock(&h->ticket_mutex);
+    for (int i = 0; i < n_ticket_keys; i++, ptr += HOST_SAV_TICKET_KEY_SIZE)
+    {
+        if (h->n_ticket_keys >= HOST_TLS_TICKET_KEYS)
+            continue;
+        struct host_ticket_key *k = &h->ticket_keys[h->n_ticket_keys++];
+        memcpy(k->name, ptr, HOST_TLS_TICKET_NAME_SIZE);
+        memcpy(k->aes_key, &ptr[HOST_TLS_TICKET_NAME_SIZE], HOST_TLS_TICKET_KEY_SIZE);
+        memcpy(k->hmac_key, &ptr[HOST_TLS_TICKET_NAME_SIZE + HOST_TLS_TICKET_KEY_SIZE], HOST_TLS_TICKET_KEY_SIZE);
+        const uint8_t *created = &ptr[HOST_TLS_TICKET_NAME_SIZE + 2 * HOST_TLS_TICKET_KEY_SIZE];
+        k->created = (time_t)((uint64_t)host_rd32(&created[4]) << 32 | host_rd32(created));
+    }
+    pthread_mutex_unlock(&h->ticket_mutex);
+
+    for (uint32_t i = 0; i < n_users; i++)
+    {
+        if (end - ptr < HOST_SAV_USER_HEAD_SIZE)
+            return EINVAL;
+        uint32_t size = host_rd32(ptr);
+        uint32_t n_devs = host_rd32(&ptr[4]);
+        if (size < HOST_SAV_USER_HEAD_SIZE || size > end - ptr || size % 4 != 0 ||
+            (size - HOST_SAV_USER_HEAD_SIZE) / 4 <= n_devs)
+            return EINVAL;
+        const char *username = (const char *)&ptr[HOST_SAV_USER_HEAD_SIZE + n_devs * 4];
+        if (memchr(username, '\0', ptr + size - (const uint8_t *)username) == NULL)
+            return EINVAL;
+
+        struct fl_user *u = host_user_add(h, username, (uint8_t *)&ptr[12], (uint8_t *)&ptr[12 + HOST_PASSWORD_HASH_SIZE], ptr[8]);
+        if (u == NULL)
+            return EINVAL;
+        // 直接批量填入，避免逐个设备扩容与广播
+        struct fl_dev_i **devs = realloc(u->available_devs, (n_devs > 8 ? n_devs : 8) * sizeof(struct fl_dev_i *));
+        if (devs == NULL)
+            return ENOMEM;
+        u->available_devs = devs;
+        const uint8_t *ids = &ptr[HOST_SAV_USER_HEAD_SIZE];
+        for (uint32_t j = 0; j < n_devs; j++)
+        {
+            struct fl_dev_i *d = fl_get_dev_by_id(h->base, host_rd32(&ids[j * 4]));
+            if (d == NULL || host_user_dev_is_accessable(u, d))
+                continue;
+            if (host_index_insert(&u->available_dev_index, d, host_dev_index_hash))
+                return ENOMEM;
+            u->available_devs[u->n_available_devs++] = d;
+        }
+        ptr += size;
+    }
+    return 0;
+}
 
-    cJSON *json = cJSON_ParseWithLength(json_str, count);
+static int host_load_json(struct fl_host *h, const uint8_t *sav, size_t count)
+{
+    cJSON *json = cJSON_ParseWithLength((const char *)sav, count);
     if (json == NULL)
     {
         host_printf(H_PRINT_ERR, "json: %s\n", cJSON_GetErrorPtr());
-        goto host_load_error_0;
+        return EINVAL;
     }
 
     cJSON *json_users = cJSON_GetObjectItemCaseSensitive(json, "users");
     if (!cJSON_IsArray(json_users) || cJSON_GetArraySize(json_users) < 2)
-        goto host_load_error;
+        goto host_load_json_error;
     cJSON *json_user;
     cJSON_ArrayForEach(json_user, json_users)
-    {
-        cJSON *json_user_username = cJSON_GetObjectItemCaseSensitive(json_user, "username");
-        cJSON *json_user_available_devs_id = cJSON_GetObjectItemCaseSensitive(json_user, "available_devs_id");
-        cJSON *json_user_is_use_only = cJSON_GetObjectItemCaseSensitive(json_user, "is_use_only");
-        cJSON *json_user_password_hash = cJSON_GetObjectItemCaseSensitive(json_user, "password_hash");
-        cJSON *json_user_password_salt = cJSON_GetObjectItemCaseSensitive(json_user, "password_salt");
-        if (!cJSON_IsString(json_user_username) ||
-            !cJSON_IsArray(json_user_available_devs_id) ||
-            !cJSON_IsBool(json_user_is_use_only) ||
-            !cJSON_IsString(json_user_password_hash) ||
-            !cJSON_IsString(json_user_password_salt))
-            goto host_load_error;
-
-        char *password_hash_base64 = cJSON_GetStringValue(json_user_password_hash);
-        char *password_salt_base64 = cJSON_GetStringValue(json_user_password_salt);
-        int password_hash_base64_len = strlen(password_hash_base64);
-        int password_salt_base64_len = strlen(password_salt_base64);
-        uint8_t password_hash[password_hash_base64_len];
-        uint8_t password_salt[password_salt_base64_len];
-        EVP_DecodeBlock(password_hash, (uint8_t *)password_hash_base64, password_hash_base64_len);
-        EVP_DecodeBlock(password_salt, (uint8_t *)password_salt_base64, password_salt_base64_len);
-        host_user_add(h, cJSON_GetStringValue(json_user_username), password_hash, password_salt, cJSON_IsTrue(json_user_is_use_only));
-
-        cJSON *json_user_available_dev_id;
-        cJSON_ArrayForEach(json_user_available_dev_id, json_user_available_devs_id)
-        {
-            if (!cJSON_IsNumber(json_user_available_dev_id))
-                goto host_load_error;
-            host_user_dev_add(h->users[h->n_users - 1], fl_get_dev_by_id(base, cJSON_GetNumberValue(json_user_available_dev_id)));
-        }
-    }
+        if (host_user_from_json(h, json_user))
+            goto host_load_json_error;
 
-    fl_set_devs_change_callback(base, host_dev_change_handler, h);
+    // 旧存档没有票据密钥，首次握手时生成
+    host_ticket_keys_from_json(h, cJSON_GetObjectItemCaseSensitive(json, "ticket_keys"));
 
     cJSON_Delete(json);
+    return 0;
+host_load_json_error:
+    cJSON_Delete(json);
+    return EINVAL;
+}
+
+struct fl_host_i *host_load(
+    struct fl_base_i *base,
+    const uint8_t *sav,
+    size_t count)
+{
+    struct fl_host *h = host_create(base);
+    if (h == NULL)
+        return NULL;
+
+    int res;
+    if (count >= 4 && memcmp(sav, "HOSV", 4) == 0)
+        res = host_load_bin(h, sav, count);
+    else
+        res = host_load_json(h, sav, count);
+    if (res)
+        goto host_load_error;
+
+    fl_set_devs_change_callback(base, host_dev_change_handler, h);
+    pthread_mutex_lock(&h->journal_mutex);
+    host_journal_clear(h);
+    pthread_mutex_unlock(&h->journal_mutex);
+
     return (struct fl_host_i *)h;
 host_load_error:
-    cJSON_Delete(json);
-host_load_error_0:
+    for (int i = h->n_users - 1; i >= 0; i--)
+        host_user_remove(h->users[i]);
+    pthread_mutex_destroy(&h->clients_mutex);
+    pthread_mutex_destroy(&h->tx_done_mutex);
+    pthread_mutex_destroy(&h->info_mutex);
+    pthread_mutex_destroy(&h->pw_mutex);
+    pthread_cond_destroy(&h->pw_cond);
+    pthread_mutex_destroy(&h->ticket_mutex);
+    OPENSSL_cleanse(h->ticket_keys, sizeof(h->ticket_keys));
+    host_journal_clear(h);
+    free(h->journal_users);
+    pthread_mutex_destroy(&h->journal_mutex);
+    free(h->ecdsa_cert);
+    free(h->ecdsa_key);
+    host_buf_pool_free(h);
+    pthread_cond_destroy(&h->tx_done_cond);
     free(h->users);
+    free(h->user_index.slots);
     free(h->clients);
     free(h);
     return NULL;
 }
 
+static size_t host_sav_user_n_devs(const struct fl_user *u)
+{
+    size_t n_devs = 0;
+    for (int i = 0; i < u->n_available_devs; i++)
+        if (u->available_devs[i]->state >= STATE_PAIRED)
+            n_devs++;
+    return n_devs;
+}
+
 size_t host_save(
     struct fl_host_i *host,
     uint8_t **sav)
 {
     struct fl_host *h = (struct fl_host *)host;
 
-    cJSON *json = cJSON_CreateObject();
-    cJSON *json_users = cJSON_CreateArray();
+    // 持锁期间的变化要么已写入存档，要么在清空后重新记入日志
+    pthread_mutex_lock(&h->journal_mutex);
+    pthread_mutex_lock(&h->ticket_mutex);
+    size_t len = HOST_SAV_HEAD_SIZE + h->n_ticket_keys * HOST_SAV_TICKET_KEY_SIZE;
+    for (int i = 0; i < h->n_users; i++)
+        len += HOST_SAV_USER_HEAD_SIZE + host_sav_user_n_devs(h->users[i]) * 4 + host_sav_align4(strlen(h->users[i]->username) + 1);
+
+    *sav = calloc(1, len);
+    if (*sav == NULL)
+    {
+        pthread_mutex_unlock(&h->ticket_mutex);
+        pthread_mutex_unlock(&h->journal_mutex);
+        return 0;
+    }
+    uint8_t *ptr = *sav;
+    memcpy(ptr, "HOSV", 4);
+    host_wr16(&ptr[4], HOST_SAV_VERSION);
+    host_wr16(&ptr[6], h->n_ticket_keys);
+    host_wr32(&ptr[8], len);
+    host_wr32(&ptr[16], h->n_users);
+    ptr += HOST_SAV_HEAD_SIZE;
+    for (int i = 0; i < h->n_ticket_keys; i++, ptr += HOST_SAV_TICKET_KEY_SIZE)
+    {
+        struct host_ticket_key *k = &h->ticket_keys[i];
+        memcpy(ptr, k->name, HOST_TLS_TICKET_NAME_SIZE);
+        memcpy(&ptr[HOST_TLS_TICKET_NAME_SIZE], k->aes_key, HOST_TLS_TICKET_KEY_SIZE);
+        memcpy(&ptr[HOST_TLS_TICKET_NAME_SIZE + HOST_TLS_TICKET_KEY_SIZE], k->hmac_key, HOST_TLS_TICKET_KEY_SIZE);
+        uint8_t *created = &ptr[HOST_TLS_TICKET_NAME_SIZE + 2 * HOST_TLS_TICKET_KEY_SIZE];
+        host_wr32(created, (uint64_t)k->created & 0xffffffff);
+        host_wr32(&created[4], (uint64_t)k->created >> 32);
+    }
+    pthread_mutex_unlock(&h->ticket_mutex);
+
     for (int i = 0; i < h->n_users; i++)
     {
         struct fl_user *u = h->users[i];
-        cJSON *json_user = cJSON_CreateObject();
-        cJSON_AddItemToObject(json_user, "username", cJSON_CreateString(u->username));
-        cJSON *json_user_available_devs_id = cJSON_CreateArray();
+        size_t n_devs = host_sav_user_n_devs(u);
+        size_t size = HOST_SAV_USER_HEAD_SIZE + n_devs * 4 + host_sav_align4(strlen(u->username) + 1);
+        host_wr32(ptr, size);
+        host_wr32(&ptr[4], n_devs);
+        ptr[8] = u->is_use_only;
+        memcpy(&ptr[12], u->password_hash, HOST_PASSWORD_HASH_SIZE);
+        memcpy(&ptr[12 + HOST_PASSWORD_HASH_SIZE], u->password_salt, HOST_PASSWORD_SALT_SIZE);
+        uint8_t *ids = &ptr[HOST_SAV_USER_HEAD_SIZE];
         for (int j = 0; j < u->n_available_devs; j++)
             if (u->available_devs[j]->state >= STATE_PAIRED)
-                cJSON_AddItemToArray(json_user_available_devs_id, cJSON_CreateNumber(u->available_devs[j]->id));
-        cJSON_AddItemToObject(json_user, "available_devs_id", json_user_available_devs_id);
-        cJSON_AddItemToObject(json_user, "is_use_only", cJSON_CreateBool(u->is_use_only));
-        char password_hash_base64[HOST_PASSWORD_HASH_SIZE * 2];
-        EVP_EncodeBlock((uint8_t *)password_hash_base64, u->password_hash, HOST_PASSWORD_HASH_SIZE);
-        cJSON_AddItemToObject(json_user, "password_hash", cJSON_CreateString(password_hash_base64));
-        char password_salt_base64[HOST_PASSWORD_SALT_SIZE * 2];
-        EVP_EncodeBlock((uint8_t *)password_salt_base64, u->password_salt, HOST_PASSWORD_SALT_SIZE);
-        cJSON_AddItemToObject(json_user, "password_salt", cJSON_CreateString(password_salt_base64));
-        cJSON_AddItemToArray(json_users, json_user);
-    }
-    cJSON_AddItemToObject(json, "users", json_users);
+            {
+                host_wr32(ids, u->available_devs[j]->id);
+                ids += 4;
+            }
+        strcpy((char *)ids, u->username);
+        ptr += size;
+    }
+    host_journal_clear(h);
+    pthread_mutex_unlock(&h->journal_mutex);
 
-    char *json_str = cJSON_PrintUnformatted(json);
-    int json_str_len = strlen(json_str);
-    *sav = malloc(json_str_len);
-    strcpy((char *)*sav, json_str);
+    host_wr32(&(*sav)[12], host_chksum32(*sav, len));
+    return len;
+}
+
+/*  .jnl
+    由autosave追加写入，按顺序重放，记录均为最终状态，重复重放结果不变
+    records[]
+    {
+        u32     len         含记录头
+        u8      chksum8
+        u8      op          HOST_JOURNAL_*
+        char[]  json        USER为单个用户(字段同旧版JSON host.sav的users[]项)，USER_REMOVE为{"username"}，TICKET_KEYS为{"ticket_keys"}
+    }
+*/
+
+enum
+{
+    HOST_JOURNAL_USER = 0,
+    HOST_JOURNAL_USER_REMOVE = 1,
+    HOST_JOURNAL_TICKET_KEYS = 2,
+};
 
+#define HOST_JOURNAL_HEAD_SIZE 6
+
+static int host_journal_append(uint8_t **jnl, size_t *len, uint8_t op, cJSON *json)
+{
+    char *json_str = cJSON_PrintUnformatted(json);
     cJSON_Delete(json);
-    return json_str_len;
+    if (json_str == NULL)
+        return ENOMEM;
+    size_t json_str_len = strlen(json_str);
+    uint8_t *buf = realloc(*jnl, *len + HOST_JOURNAL_HEAD_SIZE + json_str_len);
+    if (buf == NULL)
+    {
+        cJSON_free(json_str);
+        return ENOMEM;
+    }
+    *jnl = buf;
+
+    uint8_t *rec = &buf[*len];
+    host_wr32(rec, HOST_JOURNAL_HEAD_SIZE + json_str_len);
+    rec[4] = 0;
+    rec[5] = op;
+    memcpy(&rec[HOST_JOURNAL_HEAD_SIZE], json_str, json_str_len);
+    rec[4] = host_chksum8(rec, HOST_JOURNAL_HEAD_SIZE + json_str_len);
+    *len += HOST_JOURNAL_HEAD_SIZE + json_str_len;
+    cJSON_free(json_str);
+    return 0;
+}
+
+size_t host_save_journal(
+    struct fl_host_i *host,
+    uint8_t **jnl)
+{
+    struct fl_host *h = (struct fl_host *)host;
+    size_t len = 0;
+    int res = 0;
+
+    *jnl = NULL;
+    pthread_mutex_lock(&h->journal_mutex);
+    for (int i = 0; i < h->n_journal_users && res == 0; i++)
+    {
+        struct fl_user *u = host_user_get_by_name(h, h->journal_users[i]);
+        if (u != NULL)
+            res = host_journal_append(jnl, &len, HOST_JOURNAL_USER, host_user_to_json(u));
+        else
+        {
+            cJSON *json = cJSON_CreateObject();
+            cJSON_AddItemToObject(json, "username", cJSON_CreateString(h->journal_users[i]));
+            res = host_journal_append(jnl, &len, HOST_JOURNAL_USER_REMOVE, json);
+        }
+    }
+    if (h->is_journal_ticket_keys && res == 0)
+    {
+        cJSON *json = cJSON_CreateObject();
+        cJSON_AddItemToObject(json, "ticket_keys", host_ticket_keys_to_json(h));
+        res = host_journal_append(jnl, &len, HOST_JOURNAL_TICKET_KEYS, json);
+    }
+    // 导出失败时保留记录，下次重试
+    if (res == 0)
+        host_journal_clear(h);
+    pthread_mutex_unlock(&h->journal_mutex);
+
+    if (res)
+    {
+        free(*jnl);
+        *jnl = NULL;
+        return 0;
+    }
+    return len;
+}
+
+size_t host_load_journal(
+    struct fl_host_i *host,
+    const uint8_t *jnl,
+    size_t count)
+{
+    struct fl_host *h = (struct fl_host *)host;
+    const uint8_t *ptr = jnl, *jnl_end = jnl + count;
+
+    // 末尾可能是写入一半的记录，遇到第一条不完整或校验失败的记录即停止
+    while (jnl_end - ptr >= HOST_JOURNAL_HEAD_SIZE)
+    {
+        uint32_t len = host_rd32(ptr);
+        if (len < HOST_JOURNAL_HEAD_SIZE || len > jnl_end - ptr || host_chksum8(ptr, len) != 0)
+            break;
+        cJSON *json = cJSON_ParseWithLength((const char *)&ptr[HOST_JOURNAL_HEAD_SIZE], len - HOST_JOURNAL_HEAD_SIZE);
+        if (json == NULL)
+            break;
+
+        if (ptr[5] == HOST_JOURNAL_USER)
+            host_user_from_json(h, json);
+        else if (ptr[5] == HOST_JOURNAL_USER_REMOVE)
+        {
+            cJSON *json_username = cJSON_GetObjectItemCaseSensitive(json, "username");
+            struct fl_user *u = cJSON_IsString(json_username) ? host_user_get_by_name(h, cJSON_GetStringValue(json_username)) : NULL;
+            if (u != NULL && u != h->users[HOST_USER_ADMIN] && u != h->users[HOST_USER_GUEST])
+                host_user_remove(u);
+        }
+        else if (ptr[5] == HOST_JOURNAL_TICKET_KEYS)
+            host_ticket_keys_from_json(h, cJSON_GetObjectItemCaseSensitive(json, "ticket_keys"));
+        cJSON_Delete(json);
+        ptr += len;
+    }
+
+    pthread_mutex_lock(&h->journal_mutex);
+    host_journal_clear(h);
+    pthread_mutex_unlock(&h->journal_mutex);
+    return ptr - jnl;
 }
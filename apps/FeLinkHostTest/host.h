@@ -12,6 +12,14 @@
 #define HOST_PASSWORD_HASH_SIZE 32
 #define HOST_PASSWORD_SALT_SIZE 32
 
+#define HOST_DEFAULT_BACKLOG 16
+#define HOST_DEFAULT_MAX_FRAME_SIZE (64 * 1024)
+#define HOST_DEFAULT_PW_WORKERS 2 // 口令运算(PBKDF2)的工作线程数
+#define HOST_DEFAULT_PW_QUEUE_MAX 16
+
+#define HOST_BUF_POOL_CLASSES 5
+#define HOST_BUF_POOL_MAX_FREE 32 // 每个尺寸级别最多缓存的空闲帧数
+
 typedef enum
 {
     HOST_CHANGE_USER_ADD = -1,
@@ -21,6 +29,7 @@ typedef enum
     HOST_CHANGE_USER_DEV_REMOVE = -5,
     HOST_CHANGE_CLIENT_CON = -6,
     HOST_CHANGE_CLIENT_DISCON = -7,
+    HOST_CHANGE_TLS_TICKET_KEY = -8,
 } host_change_type;
 
 struct fl_user_i
@@ -51,6 +60,15 @@ struct fl_host_i
     const struct sockaddr_in addr;
 };
 
+struct host_mem_stats
+{
+    size_t buf_class_size[HOST_BUF_POOL_CLASSES];
+    size_t buf_in_use[HOST_BUF_POOL_CLASSES];
+    size_t buf_high_water[HOST_BUF_POOL_CLASSES];
+    size_t buf_free[HOST_BUF_POOL_CLASSES];
+    size_t buf_oversize; // 超出最大尺寸级别直接分配的次数
+};
+
 typedef void (*host_change_callback_t)(struct fl_host_i *host, struct fl_dev_i *dev, int type, void *private_arg);
 
 void host_dev_change_handler(
@@ -67,10 +85,18 @@ int host_start(
     const char *key);
 void host_stop(struct fl_host_i *host);
 void host_delete(struct fl_host_i *host);
+void host_set_backlog(struct fl_host_i *host, int backlog);
+void host_set_max_frame_size(struct fl_host_i *host, uint32_t max_frame_size);
+// 以下需在host_start之前调用
+int host_set_ecdsa_cert(struct fl_host_i *host, const char *cert, const char *key);
+void host_set_password_workers(struct fl_host_i *host, int n_workers, int queue_max);
 void host_set_host_change_callback(
     struct fl_host_i *host,
     host_change_callback_t callback,
     void *private_arg);
+void host_get_mem_stats(
+    struct fl_host_i *host,
+    struct host_mem_stats *stats);
 struct fl_host_i *host_load(
     struct fl_base_i *base,
     const uint8_t *sav,
@@ -78,5 +104,14 @@ struct fl_host_i *host_load(
 size_t host_save(
     struct fl_host_i *host,
     uint8_t **sav);
+// 导出自上次host_save/host_save_journal后变化的用户与票据密钥，无变化返回0
+size_t host_save_journal(
+    struct fl_host_i *host,
+    uint8_t **jnl);
+// 在host_load之后重放，返回完整记录的长度
+size_t host_load_journal(
+    struct fl_host_i *host,
+    const uint8_t *jnl,
+    size_t count);
 
 #endif
@@ -3,6 +3,7 @@
 #include "host.h"
 #include "autosave.h"
 #include "network.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,6 +44,7 @@ void change_handler(struct fl_host_i *host, struct fl_dev_i *dev, int type, void
     case HOST_CHANGE_USER_REMOVE:
     case HOST_CHANGE_USER_DEV_ADD:
     case HOST_CHANGE_USER_DEV_REMOVE:
+    case HOST_CHANGE_TLS_TICKET_KEY:
         autosave_add_change(*felink->autosave, AUTOSAVE_HOST_CHANGE);
         break;
     case DEV_CHANGE_PAIR_START:
@@ -66,16 +68,7 @@ int main(int argc, char *argv[])
         while (network_provisioning())
             ;
 
-    int felink_sav_fd = open(AUTOSAVE_BASE_FILE, O_RDONLY);
-    if (felink_sav_fd > 0)
-    {
-        off_t sav_size = lseek(felink_sav_fd, 0, SEEK_END);
-        lseek(felink_sav_fd, 0, SEEK_SET);
-        uint8_t sav_buf[sav_size];
-        read(felink_sav_fd, sav_buf, sav_size);
-        close(felink_sav_fd);
-        base = fl_load(sav_buf, sav_size);
-    }
+    base = autosave_load_base();
     if (base == NULL)
     {
         perror("FeLink: reload save ERROR, save file open");
@@ -84,20 +77,12 @@ int main(int argc, char *argv[])
             return 1;
     }
 
+    fl_set_stats_callback(base, metrics_fl_stats_callback, NULL);
     con = connection_init(base);
     if (con == NULL)
         return 1;
 
-    int host_sav_fd = open(AUTOSAVE_HOST_FILE, O_RDONLY);
-    if (host_sav_fd > 0)
-    {
-        off_t sav_size = lseek(host_sav_fd, 0, SEEK_END);
-        lseek(host_sav_fd, 0, SEEK_SET);
-        uint8_t sav_buf[sav_size];
-        read(host_sav_fd, sav_buf, sav_size);
-        close(host_sav_fd);
-        host = host_load(base, sav_buf, sav_size);
-    }
+    host = autosave_load_host(base);
     if (host == NULL)
     {
         perror("Host: reload save ERROR, save file open");
@@ -115,6 +100,8 @@ int main(int argc, char *argv[])
     struct felink_collect felink = {&base, &con, &host, &autosave};
     host_set_host_change_callback(host, change_handler, &felink);
 
+    if (access("cert/ecdsa-certificate.pem", R_OK) == 0)
+        host_set_ecdsa_cert(host, "cert/ecdsa-certificate.pem", "cert/ecdsa-privatekey.pem");
     res = host_start(host, 11300, "cert/certificate.pem", "cert/privatekey.pem");
     if (res)
     {
@@ -143,34 +130,17 @@ int main(int argc, char *argv[])
             autosave_stop(autosave);
             connection_stop(con);
             host_stop(host);
-            host_sav_fd = open(AUTOSAVE_HOST_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-            felink_sav_fd = open(AUTOSAVE_BASE_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-            if (host_sav_fd < 0 || felink_sav_fd < 0)
+            res = autosave_snapshot(base, host, AUTOSAVE_BASE_CHANGE | AUTOSAVE_HOST_CHANGE);
+            if (res)
             {
-                perror("FeLink: save ERROR");
+                printf("FeLink: save ERROR: %s\n", strerror(res));
                 printf("Do you want to force quit? [y/N]: ");
                 scanf("%s", cmd_buf);
                 if (cmd_buf[0] == 'y')
                     return 1;
                 else
-                {
-                    close(host_sav_fd);
-                    close(felink_sav_fd);
                     continue;
-                }
             }
-            uint8_t *sav_buf;
-            size_t sav_size;
-
-            sav_size = host_save(host, &sav_buf);
-            write(host_sav_fd, sav_buf, sav_size);
-            free(sav_buf);
-            close(host_sav_fd);
-
-            sav_size = fl_save(base, &sav_buf);
-            write(felink_sav_fd, sav_buf, sav_size);
-            free(sav_buf);
-            close(felink_sav_fd);
 
             host_delete(host);
             fl_delete(base);
@@ -181,6 +151,9 @@ int main(int argc, char *argv[])
         {
             unlink(AUTOSAVE_BASE_FILE);
             unlink(AUTOSAVE_HOST_FILE);
+            unlink(AUTOSAVE_BASE_JOURNAL);
+            unlink(AUTOSAVE_HOST_JOURNAL);
+            unlink(AUTOSAVE_BASE_SALT_TABLE);
 
             autosave_stop(autosave);
             host_set_host_change_callback(host, NULL, NULL);
@@ -194,8 +167,11 @@ int main(int argc, char *argv[])
             host = host_init(base);
             if (base == NULL || con == NULL || host == NULL)
                 return 1;
+            fl_set_stats_callback(base, metrics_fl_stats_callback, NULL);
             autosave = autosave_start(base, host, 30);
             host_set_host_change_callback(host, change_handler, autosave);
+            if (access("cert/ecdsa-certificate.pem", R_OK) == 0)
+                host_set_ecdsa_cert(host, "cert/ecdsa-certificate.pem", "cert/ecdsa-privatekey.pem");
             int res = host_start(host, 11300, "cert/certificate.pem", "cert/privatekey.pem");
             res += connection_start_receive(con);
             if (res || autosave == NULL)
@@ -222,6 +198,44 @@ int main(int argc, char *argv[])
                     printf("%s:%hu ", inet_ntoa(host->users[i]->clients[j]->addr.sin_addr), ntohs(host->users[i]->clients[j]->addr.sin_port));
                 printf("]\n");
             }
+            struct fl_mem_stats fl_stats;
+            struct host_mem_stats host_stats;
+            fl_get_mem_stats(base, &fl_stats);
+            host_get_mem_stats(host, &host_stats);
+            printf("Memory: pools info:\n");
+            for (int i = 0; i < FELINK_MSG_POOL_CLASSES; i++)
+                printf("\tmsg %6zu\t -> In use: %zu, High water: %zu, Free: %zu\n",
+                       fl_stats.msg_class_size[i],
+                       fl_stats.msg_in_use[i],
+                       fl_stats.msg_high_water[i],
+                       fl_stats.msg_free[i]);
+            printf("\tmsg oversize: %zu\n", fl_stats.msg_oversize);
+            printf("\tdev %6zu\t -> In use: %zu, High water: %zu, Chunks: %zu\n",
+                   fl_stats.dev_record_size,
+                   fl_stats.dev_in_use,
+                   fl_stats.dev_high_water,
+                   fl_stats.dev_chunks);
+            for (int i = 0; i < HOST_BUF_POOL_CLASSES; i++)
+                printf("\tbuf %6zu\t -> In use: %zu, High water: %zu, Free: %zu\n",
+                       host_stats.buf_class_size[i],
+                       host_stats.buf_in_use[i],
+                       host_stats.buf_high_water[i],
+                       host_stats.buf_free[i]);
+            printf("\tbuf oversize: %zu\n", host_stats.buf_oversize);
+        }
+        else if (strcmp(cmd_buf, "stats") == 0)
+        {
+            char *text;
+            metrics_dump(&text);
+            if (text != NULL)
+                fputs(text, stdout);
+            free(text);
+        }
+        else if (strcmp(cmd_buf, "log") == 0)
+        {
+            printf("Log mask (HEX, 1: radio, 2: command): ");
+            scanf("%s", cmd_buf);
+            metrics_set_log_mask((int)strtol(cmd_buf, NULL, 16));
         }
         else if (strcmp(cmd_buf, "select") == 0)
         {
@@ -0,0 +1,211 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*  直方图
+    桶按耗时的log2划分，记录时只做一次原子加，导出时再累加成Prometheus要求的累计计数
+    各字段分别原子读取，导出的快照之间可能相差正在进行的几次记录
+*/
+struct metrics_histogram
+{
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+// key为0表示空槽，否则为id | METRICS_DEV_KEY_USED，通过CAS占用后不再释放
+#define METRICS_DEV_KEY_USED (1ULL << 32)
+
+struct metrics_dev
+{
+    uint64_t key;
+    struct metrics_histogram hists[METRICS_N_HISTS];
+};
+
+struct metrics
+{
+    struct metrics_histogram hists[METRICS_N_HISTS];
+    uint64_t counters[METRICS_N_COUNTERS];
+    struct metrics_dev devs[METRICS_MAX_DEVS];
+};
+
+static struct metrics metrics;
+
+int metrics_log_mask = METRICS_LOG_DEFAULT;
+
+static const char *const metrics_hist_names[METRICS_N_HISTS] = {
+    [METRICS_REASSEMBLY] = "felink_rx_reassembly_us",
+    [METRICS_RX_HANDLER] = "felink_rx_handler_us",
+    [METRICS_ENCRYPT] = "felink_encrypt_us",
+    [METRICS_ACK_RTT] = "felink_ack_rtt_us",
+    [METRICS_TLS_WRITE] = "felink_tls_write_us",
+    [METRICS_AUTOSAVE] = "felink_autosave_us",
+};
+
+static const char *const metrics_counter_names[METRICS_N_COUNTERS] = {
+    [METRICS_RX_FRAMES] = "felink_rx_frames_total",
+    [METRICS_RX_ERRORS] = "felink_rx_errors_total",
+    [METRICS_RX_DROPS] = "felink_rx_drops_total",
+    [METRICS_TX_FRAMES] = "felink_tx_frames_total",
+    [METRICS_TX_ERRORS] = "felink_tx_errors_total",
+    [METRICS_TLS_WRITE_BYTES] = "felink_tls_write_bytes_total",
+};
+
+void metrics_set_log_mask(int mask)
+{
+    __atomic_store_n(&metrics_log_mask, mask, __ATOMIC_RELAXED);
+}
+
+#if METRICS_ENABLE
+uint64_t metrics_time_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int metrics_bucket_index(uint64_t us)
+{
+    if (us <= 1)
+        return 0;
+    int i = 64 - __builtin_clzll(us - 1);
+    return i < METRICS_BUCKETS - 1 ? i : METRICS_BUCKETS - 1;
+}
+
+static void metrics_histogram_add(struct metrics_histogram *h, uint64_t us)
+{
+    __atomic_fetch_add(&h->buckets[metrics_bucket_index(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+}
+
+static struct metrics_dev *metrics_dev_get(uint32_t id)
+{
+    uint64_t key = id | METRICS_DEV_KEY_USED;
+    uint32_t index = id * 2654435761u;
+
+    for (int i = 0; i < METRICS_MAX_DEVS; i++)
+    {
+        struct metrics_dev *d = &metrics.devs[(index + i) & (METRICS_MAX_DEVS - 1)];
+        uint64_t old = __atomic_load_n(&d->key, __ATOMIC_ACQUIRE);
+        if (old == 0)
+        {
+            __atomic_compare_exchange_n(&d->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            // 失败时old为抢先占用者的key
+            if (old == 0)
+                return d;
+        }
+        if (old == key)
+            return d;
+    }
+    return NULL;
+}
+
+void metrics_observe(metrics_hist hist, uint64_t us)
+{
+    metrics_histogram_add(&metrics.hists[hist], us);
+}
+
+void metrics_observe_dev(metrics_hist hist, uint32_t id, uint64_t us)
+{
+    metrics_histogram_add(&metrics.hists[hist], us);
+    struct metrics_dev *d = metrics_dev_get(id);
+    if (d != NULL)
+        metrics_histogram_add(&d->hists[hist], us);
+}
+
+void metrics_count(metrics_counter counter, uint64_t n)
+{
+    __atomic_fetch_add(&metrics.counters[counter], n, __ATOMIC_RELAXED);
+}
+#endif
+
+void metrics_fl_stats_callback(
+    struct fl_base_i *base,
+    struct fl_dev_i *dev,
+    fl_stats_type type,
+    uint32_t us,
+    void *private_arg)
+{
+    metrics_hist hist;
+    switch (type)
+    {
+    case FL_STATS_ENCRYPT:
+        hist = METRICS_ENCRYPT;
+        break;
+    case FL_STATS_ACK_RTT:
+        hist = METRICS_ACK_RTT;
+        break;
+    default:
+        return;
+    }
+
+    if (dev != NULL)
+        metrics_observe_dev(hist, dev->id, us);
+    else
+        metrics_observe(hist, us);
+}
+
+// label为空或形如dev="0000ABCD"
+static void metrics_dump_histogram(FILE *f, const char *name, const char *label, const struct metrics_histogram *h)
+{
+    const char *sep = label[0] ? "," : "";
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+    {
+        total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (i < METRICS_BUCKETS - 1)
+            fprintf(f, "%s_bucket{%s%sle=\"%llu\"} %llu\n", name, label, sep, 1ULL << i, (unsigned long long)total);
+        else
+            fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long)total);
+    }
+
+    const char *open = label[0] ? "{" : "";
+    const char *close = label[0] ? "}" : "";
+    fprintf(f, "%s_sum%s%s%s %llu\n", name, open, label, close, (unsigned long long)__atomic_load_n(&h->sum, __ATOMIC_RELAXED));
+    fprintf(f, "%s_count%s%s%s %llu\n", name, open, label, close, (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+size_t metrics_dump(char **text)
+{
+    size_t len = 0;
+    *text = NULL;
+    FILE *f = open_memstream(text, &len);
+    if (f == NULL)
+        return 0;
+
+    for (int i = 0; i < METRICS_N_COUNTERS; i++)
+    {
+        fprintf(f, "# TYPE %s counter\n", metrics_counter_names[i]);
+        fprintf(f, "%s %llu\n", metrics_counter_names[i], (unsigned long long)__atomic_load_n(&metrics.counters[i], __ATOMIC_RELAXED));
+    }
+
+    for (int i = 0; i < METRICS_N_HISTS; i++)
+    {
+        fprintf(f, "# TYPE %s histogram\n", metrics_hist_names[i]);
+        metrics_dump_histogram(f, metrics_hist_names[i], "", &metrics.hists[i]);
+        for (int j = 0; j < METRICS_MAX_DEVS; j++)
+        {
+            const struct metrics_dev *d = &metrics.devs[j];
+            uint64_t key = __atomic_load_n(&d->key, __ATOMIC_ACQUIRE);
+            if (key == 0 || __atomic_load_n(&d->hists[i].count, __ATOMIC_RELAXED) == 0)
+                continue;
+            char label[24];
+            snprintf(label, sizeof(label), "dev=\"%08X\"", (uint32_t)key);
+            metrics_dump_histogram(f, metrics_hist_names[i], label, &d->hists[i]);
+        }
+    }
+
+    if (fclose(f))
+    {
+        free(*text);
+        *text = NULL;
+        return 0;
+    }
+    return len;
+}
@@ -0,0 +1,69 @@
+#ifndef _FELINK_METRICS_
+#define _FELINK_METRICS_
+
+#include "FeLinkBase/felink.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#define METRICS_ENABLE 1 // 置0时埋点编译为空操作
+
+#define METRICS_BUCKETS 24  // 第i个桶上界为2^i微秒，最后一个为+Inf
+#define METRICS_MAX_DEVS 64 // 按设备统计的槽数，必须为2的幂，满后只计入总数
+
+#define METRICS_LOG_RADIO (1 << 0) // 射频帧的十六进制转储
+#define METRICS_LOG_CMD (1 << 1)   // 客户端命令与回复
+#define METRICS_LOG_DEFAULT 0
+
+typedef enum
+{
+    METRICS_REASSEMBLY = 0,
+    METRICS_RX_HANDLER = 1,
+    METRICS_ENCRYPT = 2,
+    METRICS_ACK_RTT = 3,
+    METRICS_TLS_WRITE = 4,
+    METRICS_AUTOSAVE = 5,
+    METRICS_N_HISTS,
+} metrics_hist;
+
+typedef enum
+{
+    METRICS_RX_FRAMES = 0,
+    METRICS_RX_ERRORS = 1,
+    METRICS_RX_DROPS = 2, // 重组超时或被淘汰的槽
+    METRICS_TX_FRAMES = 3,
+    METRICS_TX_ERRORS = 4,
+    METRICS_TLS_WRITE_BYTES = 5,
+    METRICS_N_COUNTERS,
+} metrics_counter;
+
+// 运行时日志开关，与各模块编译期的*_PRINT_DISPLAY同时满足才输出
+extern int metrics_log_mask;
+#define metrics_log_is_on(type) (__atomic_load_n(&metrics_log_mask, __ATOMIC_RELAXED) & (type))
+void metrics_set_log_mask(int mask);
+
+#if METRICS_ENABLE
+uint64_t metrics_time_us(void);
+// 以下均为无锁的原子累加，可在任意线程及持锁时调用
+void metrics_observe(metrics_hist hist, uint64_t us);
+void metrics_observe_dev(metrics_hist hist, uint32_t id, uint64_t us);
+void metrics_count(metrics_counter counter, uint64_t n);
+#else
+#define metrics_time_us() ((uint64_t)0)
+#define metrics_observe(hist, us) ((void)0)
+#define metrics_observe_dev(hist, id, us) ((void)0)
+#define metrics_count(counter, n) ((void)0)
+#endif
+
+// 交给fl_set_stats_callback，private_arg未使用
+void metrics_fl_stats_callback(
+    struct fl_base_i *base,
+    struct fl_dev_i *dev,
+    fl_stats_type type,
+    uint32_t us,
+    void *private_arg);
+// 输出Prometheus文本格式，返回长度，*text需free
+size_t metrics_dump(char **text);
+
+#endif
@@ -70,8 +70,15 @@
 #define RX_DR			0x40
 #define TX_DS			0x20
 #define MAX_RT			0x10
+#define RX_P_NO			0x0E
 #define TX_FULL			0x01
 
+/* FIFO_STATUS 0x17 */
+#define FIFO_TX_FULL		0x20
+#define FIFO_TX_EMPTY		0x10
+
+#define TX_FIFO_DEPTH		3
+
 /* FEATURE 0x1D */
 #define EN_DPL			0x04
 #define EN_ACK_PAY		0x02
@@ -7,6 +7,7 @@
 
 #include <linux/types.h>
 #include <linux/spi/spi.h>
+#include <linux/slab.h>
 
 #include "nrf24_hal.h"
 
@@ -160,6 +161,20 @@ ssize_t nrf24_disable_dynamic_pl(struct spi_device *spi)
 	return nrf24_write_reg(spi, FEATURE, feature & ~EN_DPL);
 }
 
+ssize_t nrf24_setup_ack_pload(struct spi_device *spi, bool enable)
+{
+	ssize_t feature;
+
+	feature = nrf24_read_reg(spi, FEATURE);
+	if (feature < 0)
+		return feature;
+	if (enable)
+		feature |= EN_ACK_PAY;
+	else
+		feature &= ~EN_ACK_PAY;
+	return nrf24_write_reg(spi, FEATURE, feature);
+}
+
 static ssize_t nrf24_setup_dynamic_pl(struct spi_device *spi,
 				      u8 pipe,
 				      bool enable)
@@ -581,16 +596,223 @@ ssize_t nrf24_write_tx_pload_noack(struct spi_device *dev, u8 *buf, u8 length)
 	return nrf24_write_multireg(dev, NRF24_TX_PLOAD_NOACK, buf, length);
 }
 
+//payload of the ACK sent for the next packet received on pipe
+ssize_t nrf24_write_ack_pload(struct spi_device *spi, u8 pipe, u8 *buf, u8 length)
+{
+	u8 buffer[PLOAD_MAX + 1];
+
+	if (!length || length > PLOAD_MAX || pipe > NRF24_PIPE5)
+		return -EINVAL;
+
+	buffer[0] = W_ACK_PAYLOAD | pipe;
+	memcpy(buffer + 1, buf, length);
+
+	return spi_write(spi, buffer, length + 1);
+}
+
 ssize_t nrf24_read_rx_pload(struct spi_device *spi, u8 *buf)
 {
 	return nrf24_read_multireg(spi, NRF24_RX_PLOAD, buf);
 }
 
+/*
+ * clear RX_DR, then fetch STATUS and the width of the top RX payload,
+ * both in one message; returns STATUS as it was before clearing
+ */
+ssize_t nrf24_rx_begin(struct spi_device *spi,
+		       struct nrf24_rx_xfer *xfer,
+		       u8 *rx_status,
+		       u8 *width)
+{
+	struct spi_transfer t[2] = {
+		{
+			.tx_buf = &xfer->tx[0],
+			.rx_buf = &xfer->rx[0],
+			.len = 2,
+			.cs_change = 1,
+		},
+		{
+			.tx_buf = &xfer->tx[2],
+			.rx_buf = &xfer->rx[2],
+			.len = 2,
+		},
+	};
+	ssize_t ret;
+
+	xfer->tx[0] = W_REGISTER + STATUS;
+	xfer->tx[1] = RX_DR;
+	xfer->tx[2] = R_RX_PL_WID;
+	xfer->tx[3] = NOP;
+
+	ret = spi_sync_transfer(spi, t, ARRAY_SIZE(t));
+	if (ret < 0)
+		return ret;
+
+	*rx_status = xfer->rx[2];
+	*width = xfer->rx[3];
+	return xfer->rx[0];
+}
+
+/*
+ * read length bytes of the top RX payload into xfer->rx + 1, then fetch
+ * STATUS and the width of the following payload, both in one message;
+ * returns STATUS carrying the pipe of the following payload
+ */
+ssize_t nrf24_read_rx_pload_next(struct spi_device *spi,
+				 struct nrf24_rx_xfer *xfer,
+				 u8 length,
+				 u8 *width)
+{
+	struct spi_transfer t[2] = {
+		{
+			.tx_buf = &xfer->tx[0],
+			.rx_buf = &xfer->rx[0],
+			.len = length + 1,
+			.cs_change = 1,
+		},
+		{
+			.tx_buf = &xfer->tx[length + 1],
+			.rx_buf = &xfer->rx[length + 1],
+			.len = 2,
+		},
+	};
+	ssize_t ret;
+
+	if (!length || length > PLOAD_MAX)
+		return -EINVAL;
+
+	memset(xfer->tx, NOP, sizeof(xfer->tx));
+	xfer->tx[0] = R_RX_PAYLOAD;
+	xfer->tx[length + 1] = R_RX_PL_WID;
+
+	ret = spi_sync_transfer(spi, t, ARRAY_SIZE(t));
+	if (ret < 0)
+		return ret;
+
+	*width = xfer->rx[length + 2];
+	return xfer->rx[length + 1];
+}
+
+//write order: address width before addresses, EN_DPL before DYNPD
+static const u8 nrf24_cfg_regs[] = {
+	CONFIG,
+	EN_AA,
+	EN_RXADDR,
+	SETUP_AW,
+	SETUP_RETR,
+	RF_CH,
+	RF_SETUP,
+	RX_ADDR_P0,
+	RX_ADDR_P1,
+	RX_ADDR_P2,
+	RX_ADDR_P3,
+	RX_ADDR_P4,
+	RX_ADDR_P5,
+	RX_PW_P0,
+	RX_PW_P1,
+	RX_PW_P2,
+	RX_PW_P3,
+	RX_PW_P4,
+	RX_PW_P5,
+	FEATURE,
+	DYNPD,
+};
+
+#define NRF24_CFG_XFER_MAX	6
+
+/*
+ * transfer all configuration registers in a single message,
+ * when writing only the registers that differ from old are sent
+ */
+static ssize_t nrf24_xfer_regs(struct spi_device *spi,
+			       const struct nrf24_regs *old,
+			       struct nrf24_regs *regs,
+			       bool write)
+{
+	const int n_regs = ARRAY_SIZE(nrf24_cfg_regs);
+	struct spi_transfer *t;
+	u8 *tx;
+	u8 *rx;
+	u8 reg;
+	u8 len;
+	u8 aw;
+	int i;
+	int n = 0;
+	ssize_t ret = -ENOMEM;
+
+	//reads fetch all 5 address bytes, writes send address_width of them
+	aw = write ? clamp(regs->val[SETUP_AW][0] + 2, 3, 5) : 5;
+
+	t = kcalloc(n_regs, sizeof(*t), GFP_KERNEL);
+	tx = kmalloc(2 * n_regs * NRF24_CFG_XFER_MAX, GFP_KERNEL);
+	if (!t || !tx)
+		goto exit_free;
+	rx = tx + n_regs * NRF24_CFG_XFER_MAX;
+
+	for (i = 0; i < n_regs; i++) {
+		reg = nrf24_cfg_regs[i];
+		len = (reg == RX_ADDR_P0 || reg == RX_ADDR_P1) ? aw : 1;
+
+		if (write) {
+			if (!memcmp(old->val[reg], regs->val[reg], len))
+				continue;
+			tx[i * NRF24_CFG_XFER_MAX] = W_REGISTER + reg;
+			memcpy(&tx[i * NRF24_CFG_XFER_MAX + 1], regs->val[reg], len);
+		} else {
+			tx[i * NRF24_CFG_XFER_MAX] = reg;
+			memset(&tx[i * NRF24_CFG_XFER_MAX + 1], NOP, len);
+			t[n].rx_buf = &rx[i * NRF24_CFG_XFER_MAX];
+		}
+		t[n].tx_buf = &tx[i * NRF24_CFG_XFER_MAX];
+		t[n].len = len + 1;
+		t[n].cs_change = 1;
+		n++;
+	}
+
+	ret = 0;
+	if (!n)
+		goto exit_free;
+	t[n - 1].cs_change = 0;
+
+	ret = spi_sync_transfer(spi, t, n);
+	if (ret < 0 || write)
+		goto exit_free;
+
+	for (i = 0; i < n_regs; i++) {
+		reg = nrf24_cfg_regs[i];
+		len = (reg == RX_ADDR_P0 || reg == RX_ADDR_P1) ? aw : 1;
+		memcpy(regs->val[reg], &rx[i * NRF24_CFG_XFER_MAX + 1], len);
+	}
+
+exit_free:
+	kfree(tx);
+	kfree(t);
+	return ret;
+}
+
+ssize_t nrf24_read_regs(struct spi_device *spi, struct nrf24_regs *regs)
+{
+	memset(regs, 0, sizeof(*regs));
+	return nrf24_xfer_regs(spi, NULL, regs, false);
+}
+
+ssize_t nrf24_write_regs(struct spi_device *spi,
+			 const struct nrf24_regs *old,
+			 const struct nrf24_regs *regs)
+{
+	return nrf24_xfer_regs(spi, old, (struct nrf24_regs *)regs, true);
+}
+
 ssize_t nrf24_get_status(struct spi_device *spi)
 {
 	return nrf24_read_reg(spi, STATUS);
 }
 
+ssize_t nrf24_get_fifo_status(struct spi_device *spi)
+{
+	return nrf24_read_reg(spi, FIFO_STATUS);
+}
+
 ssize_t nrf24_get_rx_data_source(struct spi_device *spi)
 {
 	ssize_t status;
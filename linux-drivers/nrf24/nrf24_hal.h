@@ -11,6 +11,19 @@
 #include "nRF24L01.h"
 #include "nrf24_enums.h"
 
+/* DMA-safe buffers for the combined RX transfers */
+struct nrf24_rx_xfer {
+	u8			tx[PLOAD_MAX + 3];
+	u8			rx[PLOAD_MAX + 3];
+};
+
+/* configuration registers by address, RX_ADDR_P0/P1 use up to 5 bytes */
+struct nrf24_regs {
+	u8			val[FEATURE + 1][5];
+};
+
+ssize_t nrf24_read_regs(struct spi_device *spi, struct nrf24_regs *regs);
+ssize_t nrf24_write_regs(struct spi_device *spi, const struct nrf24_regs *old, const struct nrf24_regs *regs);
 ssize_t nrf24_open_pipe(struct spi_device *spi, enum nrf24_pipe_num pipe);
 ssize_t nrf24_close_pipe(struct spi_device *spi, enum nrf24_pipe_num pipe);
 ssize_t nrf24_set_address(struct spi_device *spi, enum nrf24_pipe_num pipe, u8 *addr);
@@ -34,9 +47,13 @@ ssize_t nrf24_set_rf_channel(struct spi_device *spi, u8 channel);
 ssize_t nrf24_get_rf_channel(struct spi_device *spi);
 ssize_t nrf24_write_tx_pload(struct spi_device *dev, u8 *buf, u8 length);
 ssize_t nrf24_write_tx_pload_noack(struct spi_device *dev, u8 *buf, u8 length);
+ssize_t nrf24_write_ack_pload(struct spi_device *spi, u8 pipe, u8 *buf, u8 length);
 ssize_t nrf24_read_rx_pload(struct spi_device *spi, u8 *buf);
+ssize_t nrf24_rx_begin(struct spi_device *spi, struct nrf24_rx_xfer *xfer, u8 *rx_status, u8 *width);
+ssize_t nrf24_read_rx_pload_next(struct spi_device *spi, struct nrf24_rx_xfer *xfer, u8 length, u8 *width);
 ssize_t nrf24_power_up(struct spi_device *spi);
 ssize_t nrf24_get_status(struct spi_device *spi);
+ssize_t nrf24_get_fifo_status(struct spi_device *spi);
 ssize_t nrf24_get_rx_data_source(struct spi_device *spi);
 ssize_t nrf24_get_rx_pload_width(struct spi_device *spi, u8 pipe);
 ssize_t nrf24_soft_reset(struct spi_device *spi);
@@ -53,5 +70,6 @@ ssize_t nrf24_reuse_tx_pl(struct spi_device *spi);
 ssize_t nrf24_get_dynamic_pl(struct spi_device *spi);
 ssize_t nrf24_enable_dynamic_pl(struct spi_device *spi);
 ssize_t nrf24_disable_dynamic_pl(struct spi_device *spi);
+ssize_t nrf24_setup_ack_pload(struct spi_device *spi, bool enable);
 
 #endif
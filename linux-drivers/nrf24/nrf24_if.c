@@ -13,6 +13,7 @@
 #include <linux/err.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/of.h>
 #include <linux/gpio/consumer.h>
 #include <linux/interrupt.h>
@@ -24,8 +25,13 @@
 #include <linux/poll.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/timekeeping.h>
+#include <linux/slab.h>
 
 #include "nrf24_if.h"
+#include "nrf24_ioctl.h"
 #include "nrf24_sysfs.h"
 #include "nrf24_hal.h"
 
@@ -60,6 +66,57 @@ static struct nrf24_pipe *nrf24_pipe_by_id(struct nrf24_device *device, int id)
 	return ERR_PTR(-ENODEV);
 }
 
+static struct nrf24_ring *nrf24_rx_ring(struct nrf24_pipe *p)
+{
+	return p->ring + NRF24_RING_RX_OFFSET;
+}
+
+static struct nrf24_ring *nrf24_tx_ring(struct nrf24_pipe *p)
+{
+	return p->ring + NRF24_RING_TX_OFFSET;
+}
+
+//queue a received payload to the RX ring if mapped, else to the rx kfifo
+static void nrf24_pipe_rx(struct nrf24_pipe *p, u64 address, const u8 *pload, u8 length)
+{
+	struct nrf24_ring *ring;
+	struct nrf24_ring_slot *slot;
+
+	mutex_lock(&p->ring_mutex);
+	if (atomic_read(&p->ring_users) > 0) {
+		ring = nrf24_rx_ring(p);
+		//tail comes from user space, a bogus one just reads as full
+		if (p->rx_ring_head - READ_ONCE(ring->tail) >= NRF24_RING_SLOTS) {
+			WRITE_ONCE(ring->dropped, ring->dropped + 1);
+		} else {
+			slot = &ring->slots[p->rx_ring_head % NRF24_RING_SLOTS];
+			slot->timestamp = ktime_get_ns();
+			slot->address = address;
+			slot->pipe = p->id;
+			slot->len = length;
+			memcpy(slot->data, pload, length);
+			smp_store_release(&ring->head, ++p->rx_ring_head);
+		}
+		mutex_unlock(&p->ring_mutex);
+	} else {
+		mutex_unlock(&p->ring_mutex);
+
+		mutex_lock(&p->rx_fifo_mutex);
+		kfifo_in(&p->rx_fifo, pload, length);
+		mutex_unlock(&p->rx_fifo_mutex);
+	}
+
+	wake_up_interruptible(&p->read_wait_queue);
+}
+
+static bool nrf24_pipe_rx_ready(struct nrf24_pipe *p)
+{
+	if (atomic_read(&p->ring_users) > 0)
+		return p->rx_ring_head != READ_ONCE(nrf24_rx_ring(p)->tail);
+
+	return !kfifo_is_empty(&p->rx_fifo);
+}
+
 static void nrf24_rx_active_timer_cb(struct timer_list *t)
 {
 	struct nrf24_device *device = from_timer(device, t, rx_active_timer);
@@ -74,11 +131,108 @@ static void nrf24_rx_active_timer_cb(struct timer_list *t)
 	}
 }
 
+static void nrf24_tx_complete(struct nrf24_tx_data *tx_data, bool failed)
+{
+	struct nrf24_pipe *p = tx_data->pipe;
+
+	if (failed)
+		p->tx_drop = !tx_data->last;
+	else
+		p->sent += tx_data->size;
+
+	if (tx_data->last) {
+		//signal write function that write operation was finished
+		p->write_done = true;
+		wake_up_interruptible(&p->write_wait_queue);
+	}
+}
+
+//take the next payload only if it can join the burst of head
+static bool nrf24_tx_fifo_get_next(struct nrf24_device *device,
+				   const struct nrf24_tx_data *head,
+				   struct nrf24_tx_data *tx_data)
+{
+	bool ret = false;
+
+	if (device->rx_active)
+		return false;
+
+	mutex_lock(&device->tx_fifo_mutex);
+	if (kfifo_out_peek(&device->tx_fifo, tx_data, sizeof(*tx_data)) == sizeof(*tx_data) &&
+	    !tx_data->ack_pload &&
+	    tx_data->pipe == head->pipe &&
+	    tx_data->address == head->address &&
+	    !tx_data->pipe->tx_drop) {
+		kfifo_skip(&device->tx_fifo);
+		ret = true;
+	}
+	mutex_unlock(&device->tx_fifo_mutex);
+
+	return ret;
+}
+
+static void nrf24_enter_rx_mode(struct nrf24_device *device)
+{
+	struct nrf24_pipe *p;
+
+	//enter Standby-I
+	nrf24_ce_lo(device);
+
+	p = nrf24_pipe_by_id(device, NRF24_PIPE0);
+	if (!IS_ERR(p) &&
+	    (!device->pipe0_address_valid ||
+	     device->pipe0_address != p->cfg.address)) {
+		//restore PIPE0 address as it was corrupted
+		device->pipe0_address_valid = false;
+		if (nrf24_set_address(device->spi,
+				      p->id,
+				      (u8 *)&p->cfg.address) >= 0) {
+			device->pipe0_address = p->cfg.address;
+			device->pipe0_address_valid = true;
+		}
+	}
+
+	//CONFIG is also read-modified-written by NRF24_IOC_SET_CFG
+	mutex_lock(&device->cfg_mutex);
+	nrf24_set_mode(device->spi, NRF24_MODE_RX);
+	mutex_unlock(&device->cfg_mutex);
+	device->tx_mode = false;
+	nrf24_ce_hi(device);
+}
+
+//ACK payloads are only sent in RX mode, and at most TX_FIFO_DEPTH wait there
+static void nrf24_tx_ack_pload(struct nrf24_device *device, struct nrf24_tx_data *tx_data)
+{
+	struct nrf24_pipe *p = tx_data->pipe;
+	ssize_t ret;
+
+	if (device->tx_mode)
+		nrf24_enter_rx_mode(device);
+
+	ret = nrf24_get_fifo_status(device->spi);
+	if (ret < 0)
+		return;
+	if (ret & FIFO_TX_FULL) {
+		dev_dbg(p->dev, "%s: TX FIFO full, ACK payload dropped\n", __func__);
+		return;
+	}
+
+	ret = nrf24_write_ack_pload(device->spi, p->id, tx_data->pload, tx_data->size);
+	if (ret < 0) {
+		dev_dbg(p->dev, "write ACK PLOAD failed (%zd)\n", ret);
+		return;
+	}
+	device->ack_pload_pending = true;
+}
+
 static int nrf24_tx_thread(void *data)
 {
 	struct nrf24_device *device = data;
 	struct nrf24_pipe *p;
-	struct nrf24_tx_data tx_data;
+	struct nrf24_tx_data burst[TX_FIFO_DEPTH];
+	int n_burst;
+	int n_acked;
+	int i;
 	int ret;
 	bool dpl;
 
@@ -96,8 +250,8 @@ static int nrf24_tx_thread(void *data)
 		if (mutex_lock_interruptible(&device->tx_fifo_mutex))
 			continue;
 
-		ret = kfifo_out(&device->tx_fifo, &tx_data, sizeof(tx_data));
-		if (ret != sizeof(tx_data)) {
+		ret = kfifo_out(&device->tx_fifo, &burst[0], sizeof(burst[0]));
+		if (ret != sizeof(burst[0])) {
 			dev_dbg(&device->dev, "get tx_data from fifo failed\n");
 			mutex_unlock(&device->tx_fifo_mutex);
 			continue;
@@ -105,70 +259,155 @@ static int nrf24_tx_thread(void *data)
 
 		mutex_unlock(&device->tx_fifo_mutex);
 
-		p = tx_data.pipe;
+		p = burst[0].pipe;
 		dpl = false;
 
+		if (burst[0].ack_pload) {
+			nrf24_tx_ack_pload(device, &burst[0]);
+			continue;
+		}
+
+		//rest of a failed write
+		if (p->tx_drop) {
+			nrf24_tx_complete(&burst[0], true);
+			goto next;
+		}
+
 		//enter Standby-I mode
 		nrf24_ce_lo(device);
 
-		if (nrf24_set_mode(device->spi, NRF24_MODE_TX) < 0)
-			goto next;
+		//bursts following each other stay in TX mode
+		if (!device->tx_mode) {
+			//unsent ACK payloads would go out with the burst
+			if (device->ack_pload_pending) {
+				if (nrf24_flush_tx_fifo(device->spi) < 0)
+					goto failed;
+				device->ack_pload_pending = false;
+			}
+			mutex_lock(&device->cfg_mutex);
+			ret = nrf24_set_mode(device->spi, NRF24_MODE_TX);
+			mutex_unlock(&device->cfg_mutex);
+			if (ret < 0)
+				goto failed;
+			device->tx_mode = true;
+		}
 
 		//set PIPE0 address in order to receive ACK
-		ret = nrf24_set_address(device->spi,
-					NRF24_PIPE0,
-					(u8 *)&p->cfg.address);
-		if (ret < 0) {
-			dev_dbg(p->dev, "set PIPE0 address failed (%d)\n", ret);
-			goto next;
+		//consecutive payloads to the same address skip this
+		if (!device->pipe0_address_valid ||
+		    device->pipe0_address != burst[0].address) {
+			device->pipe0_address_valid = false;
+			ret = nrf24_set_address(device->spi,
+						NRF24_PIPE0,
+						(u8 *)&burst[0].address);
+			if (ret < 0) {
+				dev_dbg(p->dev, "set PIPE0 address failed (%d)\n", ret);
+				goto failed;
+			}
+			device->pipe0_address = burst[0].address;
+			device->pipe0_address_valid = true;
 		}
 
-		ret = nrf24_set_address(device->spi,
-					NRF24_TX,
-					(u8 *)&p->cfg.address);
-		if (ret < 0) {
-			dev_dbg(p->dev, "set TX address failed (%d)\n", ret);
-			goto next;
+		if (!device->tx_address_valid ||
+		    device->tx_address != burst[0].address) {
+			device->tx_address_valid = false;
+			ret = nrf24_set_address(device->spi,
+						NRF24_TX,
+						(u8 *)&burst[0].address);
+			if (ret < 0) {
+				dev_dbg(p->dev, "set TX address failed (%d)\n", ret);
+				goto failed;
+			}
+			device->tx_address = burst[0].address;
+			device->tx_address_valid = true;
 		}
 
-		//check if dynamic payload length is enabled
-		dpl = nrf24_get_dynamic_pl(device->spi);
-
-		if (p->cfg.plw && dpl) {
-			//disable dynamic payload if pipe
-			//does not use dynamic payload
-			//and dynamic paload is enabled
-			if (nrf24_disable_dynamic_pl(device->spi) < 0)
-				goto next;
+		//disable dynamic payload if pipe
+		//does not use dynamic payload
+		//and dynamic paload is enabled
+		if (p->cfg.plw) {
+			dpl = nrf24_get_dynamic_pl(device->spi) > 0;
+			if (dpl && nrf24_disable_dynamic_pl(device->spi) < 0)
+				goto failed;
 		}
 
+		device->tx_failed = false;
+		device->tx_done = false;
 
-		ret = nrf24_write_tx_pload(device->spi, tx_data.pload, tx_data.size);
-
+		ret = nrf24_write_tx_pload(device->spi, burst[0].pload, burst[0].size);
 		if (ret < 0) {
 			dev_dbg(p->dev,
 				"write TX PLOAD failed (%d)\n",
 				ret);
-			goto next;
+			goto failed;
 		}
+		n_burst = 1;
 
 		//enter TX MODE and start transmission
 		nrf24_ce_hi(device);
 
-		//wait for ACK
-		device->tx_done = false;
-		wait_event_interruptible(device->tx_done_wait_queue,
-					 (device->tx_done ||
-					 kthread_should_stop()));
+		while (n_burst > 0) {
+			//keep the TX FIFO loaded with following payloads
+			//for the same pipe and address
+			while (n_burst < TX_FIFO_DEPTH &&
+			       nrf24_tx_fifo_get_next(device, &burst[0], &burst[n_burst])) {
+				ret = nrf24_write_tx_pload(device->spi,
+							   burst[n_burst].pload,
+							   burst[n_burst].size);
+				if (ret < 0) {
+					dev_dbg(p->dev,
+						"write TX PLOAD failed (%d)\n",
+						ret);
+					nrf24_tx_complete(&burst[n_burst], true);
+					break;
+				}
+				n_burst++;
+			}
 
-		if (kthread_should_stop())
-			return 0;
+			//wait for ACK
+			wait_event_interruptible(device->tx_done_wait_queue,
+						 (device->tx_done ||
+						 kthread_should_stop()));
 
-		p->sent = device->tx_failed ? 0 : tx_data.size;
+			if (kthread_should_stop())
+				return 0;
 
-		//signal write function that write operation was finished
-		p->write_done = true;
-		wake_up_interruptible(&p->write_wait_queue);
+			device->tx_done = false;
+
+			if (device->tx_failed) {
+				//MAX_RT flushed the TX FIFO, rest of the burst never went out
+				for (i = 0; i < n_burst; i++)
+					nrf24_tx_complete(&burst[i], true);
+				break;
+			}
+
+			//TX_DS may be coalesced, so count ACKs from what is left in the FIFO:
+			//empty means all done, not full means at most two are still pending
+			ret = nrf24_get_fifo_status(device->spi);
+			if (ret < 0) {
+				//no IRQ follows once everything went out, fail the rest
+				dev_dbg(p->dev, "get FIFO status failed (%d)\n", ret);
+				nrf24_ce_lo(device);
+				nrf24_flush_tx_fifo(device->spi);
+				for (i = 0; i < n_burst; i++)
+					nrf24_tx_complete(&burst[i], true);
+				break;
+			}
+			if (ret & FIFO_TX_EMPTY)
+				n_acked = n_burst;
+			else if (!(ret & FIFO_TX_FULL))
+				n_acked = max(n_burst - (TX_FIFO_DEPTH - 1), 0);
+			else
+				n_acked = 0;
+
+			for (i = 0; i < n_acked; i++)
+				nrf24_tx_complete(&burst[i], false);
+			n_burst -= n_acked;
+			memmove(&burst[0], &burst[n_acked], n_burst * sizeof(burst[0]));
+		}
+		goto next;
+failed:
+		nrf24_tx_complete(&burst[0], true);
 next:
 		//restore dynamic payload feature
 		if (dpl)
@@ -177,85 +416,76 @@ next:
 		//if all sent enter RX MODE and start receiving
 		if (kfifo_is_empty(&device->tx_fifo) || device->rx_active) {
 			dev_dbg(p->dev, "%s: NRF24_MODE_RX\n", __func__);
-
-			//enter Standby-I
-			nrf24_ce_lo(device);
-
-			p = nrf24_pipe_by_id(device, NRF24_PIPE0);
-			if (!IS_ERR(p)) {
-				//restore PIPE0 address as it was corrupted
-				nrf24_set_address(device->spi,
-						  p->id,
-						  (u8 *)&p->cfg.address);
-			}
-
-			nrf24_set_mode(device->spi, NRF24_MODE_RX);
-			nrf24_ce_hi(device);
+			nrf24_enter_rx_mode(device);
 		}
 	}
 
 	return 0;
 }
 
-static void nrf24_rx_work_handler(struct work_struct *work)
+//drain the RX FIFO, every payload costs one SPI message
+//that also returns the pipe and width of the next one
+static void nrf24_rx_drain(struct nrf24_device *device, u8 status, u8 width)
 {
-	struct nrf24_device *device;
-	ssize_t pipe;
-	ssize_t length;
-	u8 pload[PLOAD_MAX];
+	struct nrf24_rx_xfer *xfer = device->rx_xfer;
 	struct nrf24_pipe *p;
+	u64 address;
+	ssize_t ret;
+	u8 length;
+	int pipe;
 
-	device = container_of(work, struct nrf24_device, rx_work);
-
-	while (!nrf24_is_rx_fifo_empty(device->spi)) {
+	while (true) {
+		pipe = (status & RX_P_NO) >> 1;
+		if (pipe > NRF24_PIPE5)
+			return;
 
-		pipe = nrf24_get_rx_data_source(device->spi);
-		if (pipe < 0 || pipe > NRF24_PIPE5) {
+		if (!width || width > PLOAD_MAX) {
 			dev_dbg(&device->dev,
-				"%s: get pipe failed (err: %zd)\n",
+				"%s: invalid pload width %u, flush\n",
 				__func__,
-				pipe);
+				width);
+			nrf24_flush_rx_fifo(device->spi);
 			return;
 		}
 
-		p = nrf24_pipe_by_id(device, pipe);
-		if (IS_ERR(p))
-			return;
-
-
-		memset(pload, 0, PLOAD_MAX);
-		length = nrf24_read_rx_pload(device->spi, pload);
-		if (length < 0 || length > PLOAD_MAX) {
-			dev_dbg(p->dev,
+		length = width;
+		ret = nrf24_read_rx_pload_next(device->spi, xfer, length, &width);
+		if (ret < 0) {
+			dev_dbg(&device->dev,
 				"%s: could not read pload (err = %zd)\n",
 				__func__,
-				length);
+				ret);
 			return;
 		}
+		status = ret;
 
-		//dev_dbg(p->dev, "rx %zd bytes\n", length);
-		if (mutex_lock_interruptible(&p->rx_fifo_mutex))
-			return;
-		kfifo_in(&p->rx_fifo, pload, length);
-		mutex_unlock(&p->rx_fifo_mutex);
+		p = nrf24_pipe_by_id(device, pipe);
+		if (IS_ERR(p))
+			continue;
 
-		wake_up_interruptible(&p->read_wait_queue);
+		//in TX mode only ACK payloads arrive, on pipe 0 set to the destination
+		address = device->tx_mode ? device->pipe0_address : p->cfg.address;
+
+		//dev_dbg(p->dev, "rx %u bytes\n", length);
+		nrf24_pipe_rx(p, address, &xfer->rx[1], length);
 	}
 }
 
-static void nrf24_isr_work_handler(struct work_struct *work)
+static irqreturn_t nrf24_irq_thread(int irq, void *dev_id)
 {
-	struct nrf24_device *device;
+	struct nrf24_device *device = dev_id;
 	ssize_t status;
+	u8 rx_status;
+	u8 width;
 	u32 usecs;
 
-	device = container_of(work, struct nrf24_device, isr_work);
-
-	status = nrf24_get_status(device->spi);
+	//RX_DR is cleared before draining, payloads arriving meanwhile raise it again
+	status = nrf24_rx_begin(device->spi, device->rx_xfer, &rx_status, &width);
 	if (status < 0)
-		return;
+		return IRQ_NONE;
 
-	if (status & RX_DR) {
+	//ACK payloads come with our own transmissions, no need to back off TX
+	if ((status & RX_DR) && !device->tx_mode) {
 		dev_dbg(&device->dev, "%s: RX_DR\n", __func__);
 		device->rx_active = true;
 		//keep rx active untli next time recevied for 1.5*Toa
@@ -265,9 +495,8 @@ static void nrf24_isr_work_handler(struct work_struct *work)
 		dev_dbg(&device->dev, "rx_active_timer = %u us\n", usecs);
 		mod_timer(&device->rx_active_timer,
 			  jiffies + usecs_to_jiffies(usecs));
-		nrf24_clear_irq(device->spi, RX_DR);
-		schedule_work(&device->rx_work);
 	}
+	nrf24_rx_drain(device, rx_status, width);
 
 	if (status & TX_DS) {
 		dev_dbg(&device->dev, "%s: TX_DS\n", __func__);
@@ -285,18 +514,6 @@ static void nrf24_isr_work_handler(struct work_struct *work)
 		nrf24_clear_irq(device->spi, MAX_RT);
 		wake_up_interruptible(&device->tx_done_wait_queue);
 	}
-}
-
-static irqreturn_t nrf24_isr(int irq, void *dev_id)
-{
-	unsigned long flags;
-	struct nrf24_device *device = dev_id;
-
-	spin_lock_irqsave(&device->lock, flags);
-
-	schedule_work(&device->isr_work);
-
-	spin_unlock_irqrestore(&device->lock, flags);
 
 	return IRQ_HANDLED;
 }
@@ -331,56 +548,574 @@ static ssize_t nrf24_read(struct file *filp,
 	return n ? n : copied;
 }
 
-static ssize_t nrf24_write(struct file *filp,
-			   const char __user *buf,
-			   size_t size,
-			   loff_t *f_pos)
+/*
+ * write_iter so that writev() gathers segments into payloads, a payload
+ * may span several iovecs (e.g. a header byte followed by in-place data)
+ *
+ * blocking writes queue all their payloads before waiting, so that the
+ * TX thread can send them back to back through the TX FIFO
+ */
+static ssize_t nrf24_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+	struct file *filp = iocb->ki_filp;
 	struct nrf24_device *device;
 	struct nrf24_pipe *p;
 	struct nrf24_tx_data data;
 	ssize_t copied = 0;
-	ssize_t left = size;
+	ssize_t left = iov_iter_count(from);
+	ssize_t queued = 0;
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	size_t n;
 
 	p = filp->private_data;
 	data.pipe = p;
+	data.address = p->tx_address_valid ? p->tx_address : p->cfg.address;
+	data.ack_pload = false;
 	device = to_nrf24_device(p->dev->parent);
 
 	while (left > 0) {
 		data.size = p->cfg.plw != 0 ? p->cfg.plw : min_t(size_t, left, PLOAD_MAX);
 
 		memset(data.pload, 0, PLOAD_MAX);
-		if (copy_from_user(data.pload, buf + copied, min_t(size_t, left, data.size)))
-			goto exit_lock;
+		n = min_t(size_t, left, data.size);
+		if (copy_from_iter(data.pload, n, from) != n)
+			break;
 
 		if (mutex_lock_interruptible(&device->tx_fifo_mutex))
-			goto exit_lock;
+			break;
 
-		if (kfifo_in(&device->tx_fifo, &data, sizeof(data)) != sizeof(data))
-			goto exit_kfifo;
+		if (!queued) {
+			p->sent = 0;
+			p->write_done = false;
+		}
+
+		//end the write early if the following payload would not fit
+		data.last = nonblock ||
+			    left <= data.size ||
+			    kfifo_avail(&device->tx_fifo) < 2 * (sizeof(data) + 1);
+
+		if (kfifo_in(&device->tx_fifo, &data, sizeof(data)) != sizeof(data)) {
+			mutex_unlock(&device->tx_fifo_mutex);
+			break;
+		}
 
 		mutex_unlock(&device->tx_fifo_mutex);
 
-		if (filp->f_flags & O_NONBLOCK)
+		queued += data.size;
+		left -= data.size;
+
+		if (nonblock) {
 			copied += data.size;
-		else {
+			queued = 0;
+		} else if (data.last) {
 			wake_up_interruptible(&device->tx_wait_queue);
 
-			p->write_done = false;
 			wait_event_interruptible(p->write_wait_queue, p->write_done);
 			copied += p->sent;
+			if (p->sent != queued)
+				break;
+			queued = 0;
 		}
-		left -= data.size;
 	}
 
+	if (nonblock)
+		wake_up_interruptible(&device->tx_wait_queue);
+	return copied;
+}
+
+//fill tx_data from a TX ring slot, false for slots that can not be sent
+static bool nrf24_tx_ring_slot(struct nrf24_device *device,
+			       struct nrf24_pipe *p,
+			       u32 index,
+			       struct nrf24_tx_data *data)
+{
+	struct nrf24_ring_slot *slot;
+	u8 len;
+
+	slot = &nrf24_tx_ring(p)->slots[index % NRF24_RING_SLOTS];
+
+	len = min_t(u8, READ_ONCE(slot->len), PLOAD_MAX);
+	data->size = p->cfg.plw != 0 ? p->cfg.plw : len;
+	data->address = READ_ONCE(slot->address);
+	if (!data->address)
+		data->address = p->tx_address_valid ? p->tx_address : p->cfg.address;
+	if (!data->size ||
+	    data->address >= BIT_ULL(device->cfg.address_width * BITS_PER_BYTE))
+		return false;
+
+	memset(data->pload, 0, PLOAD_MAX);
+	memcpy(data->pload, slot->data, min(len, data->size));
+	return true;
+}
+
+//move TX ring slots published by user space into the tx kfifo
+//like a write, only the final payload of a kick completes it
+static long nrf24_tx_ring_kick(struct nrf24_device *device, struct nrf24_pipe *p)
+{
+	struct nrf24_ring *ring;
+	struct nrf24_tx_data data, next;
+	long n = 0;
+	u32 head;
+	u32 i;
+	bool full;
+
+	mutex_lock(&p->ring_mutex);
+	if (atomic_read(&p->ring_users) == 0) {
+		mutex_unlock(&p->ring_mutex);
+		return -EINVAL;
+	}
+
+	ring = nrf24_tx_ring(p);
+	head = smp_load_acquire(&ring->head);
+	if (head - p->tx_ring_tail > NRF24_RING_SLOTS) {
+		mutex_unlock(&p->ring_mutex);
+		return -EINVAL;
+	}
+
+	data.pipe = p;
+	data.ack_pload = false;
+
+	mutex_lock(&device->tx_fifo_mutex);
+	for (; p->tx_ring_tail != head; p->tx_ring_tail++, n++) {
+		//skip slots that can not be sent
+		if (!nrf24_tx_ring_slot(device, p, p->tx_ring_tail, &data))
+			continue;
+
+		//end the kick early if the following payload would not fit
+		full = kfifo_avail(&device->tx_fifo) < 2 * (sizeof(data) + 1);
+		data.last = true;
+		for (i = p->tx_ring_tail + 1; !full && i != head; i++) {
+			if (nrf24_tx_ring_slot(device, p, i, &next)) {
+				data.last = false;
+				break;
+			}
+		}
 
-exit_kfifo:
+		if (kfifo_in(&device->tx_fifo, &data, sizeof(data)) != sizeof(data))
+			break;
+		if (full) {
+			p->tx_ring_tail++;
+			n++;
+			break;
+		}
+	}
 	mutex_unlock(&device->tx_fifo_mutex);
-exit_lock:
 
-	if (filp->f_flags & O_NONBLOCK)
+	smp_store_release(&ring->tail, p->tx_ring_tail);
+	mutex_unlock(&p->ring_mutex);
+
+	if (n)
 		wake_up_interruptible(&device->tx_wait_queue);
-	return copied;
+	return n;
+}
+
+static u64 nrf24_regs_address(const struct nrf24_regs *regs, int pipe, u8 aw)
+{
+	u64 address = 0;
+	int i;
+
+	for (i = aw - 1; i >= 0; i--)
+		address = (address << 8) | regs->val[pipe <= NRF24_PIPE1 ? RX_ADDR_P0 + pipe : RX_ADDR_P1][i];
+	//pipes 2-5 share the upper bytes of pipe 1
+	if (pipe > NRF24_PIPE1)
+		address = (address & ~0xFFULL) | regs->val[RX_ADDR_P0 + pipe][0];
+
+	return address;
+}
+
+//EN_ACK_PAY is shared, which pipes use it is only known to the driver
+static u8 nrf24_ack_pload_mask(struct nrf24_device *device)
+{
+	struct nrf24_pipe *p;
+	u8 mask = 0;
+
+	list_for_each_entry(p, &device->pipes, list)
+		if (p->cfg.ack_pload)
+			mask |= BIT(p->id);
+
+	return mask;
+}
+
+static void nrf24_regs_to_cfg(const struct nrf24_regs *regs, u8 ack_pload, struct nrf24_ioc_cfg *cfg)
+{
+	u8 config = regs->val[CONFIG][0];
+	u8 retr = regs->val[SETUP_RETR][0];
+	u8 rf = regs->val[RF_SETUP][0];
+	u8 crc = (config & (EN_CRC | CRCO)) >> 2;
+	int i;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->mask = NRF24_CFG_CRC | NRF24_CFG_RETR_DELAY | NRF24_CFG_RETR_COUNT |
+		    NRF24_CFG_RF_POWER | NRF24_CFG_DATA_RATE |
+		    NRF24_CFG_ADDRESS_WIDTH | NRF24_CFG_CHANNEL;
+	cfg->crc = crc == NRF24_CRC_16BIT ? 16 : crc == NRF24_CRC_8BIT ? 8 : 0;
+	cfg->retr_delay = ((retr >> 4) + 1) * 250;
+	cfg->retr_count = retr & 0x0F;
+	cfg->rf_power = -6 * (NRF24_POWER_0DBM - ((rf & (RF_PWR1 | RF_PWR0)) >> 1));
+	cfg->data_rate = (rf & RF_DR_LO) ? NRF24_DATARATE_256KBPS :
+			 (rf & RF_DR_HI) ? NRF24_DATARATE_2MBPS : NRF24_DATARATE_1MBPS;
+	cfg->address_width = clamp(regs->val[SETUP_AW][0] + 2, 3, 5);
+	cfg->channel = regs->val[RF_CH][0] & 0x7F;
+	cfg->pipe_mask = 0x3F;
+
+	for (i = 0; i <= NRF24_PIPE5; i++) {
+		cfg->pipes[i].address = nrf24_regs_address(regs, i, cfg->address_width);
+		cfg->pipes[i].ack = !!(regs->val[EN_AA][0] & BIT(i));
+		cfg->pipes[i].plw = (regs->val[DYNPD][0] & BIT(i)) ? 0 : regs->val[RX_PW_P0 + i][0];
+		cfg->pipes[i].ack_pload = (regs->val[FEATURE][0] & EN_ACK_PAY) && (ack_pload & BIT(i));
+	}
+}
+
+//same checks and register encoding as the sysfs attributes,
+//ack_pload is the mask of pipes using ACK payloads, updated
+static int nrf24_cfg_to_regs(const struct nrf24_ioc_cfg *cfg, struct nrf24_regs *regs, u8 *ack_pload)
+{
+	u8 aw = clamp(regs->val[SETUP_AW][0] + 2, 3, 5);
+	u8 *reg;
+	int i;
+	int j;
+
+	if (cfg->mask & NRF24_CFG_CRC) {
+		reg = &regs->val[CONFIG][0];
+		*reg &= ~(EN_CRC | CRCO);
+		if (cfg->crc == 8)
+			*reg |= NRF24_CRC_8BIT << 2;
+		else if (cfg->crc == 16)
+			*reg |= NRF24_CRC_16BIT << 2;
+		else if (cfg->crc != 0)
+			return -EINVAL;
+	}
+
+	reg = &regs->val[SETUP_RETR][0];
+	if (cfg->mask & NRF24_CFG_RETR_DELAY) {
+		if (cfg->retr_delay < 250 || cfg->retr_delay > 4000 || cfg->retr_delay % 250)
+			return -EINVAL;
+		*reg = (*reg & 0x0F) | (((cfg->retr_delay / 250) - 1) << 4);
+	}
+	if (cfg->mask & NRF24_CFG_RETR_COUNT) {
+		if (cfg->retr_count > 15)
+			return -EINVAL;
+		*reg = (*reg & 0xF0) | cfg->retr_count;
+	}
+
+	reg = &regs->val[RF_SETUP][0];
+	if (cfg->mask & NRF24_CFG_RF_POWER) {
+		if (cfg->rf_power > 0 || cfg->rf_power < -18 || cfg->rf_power % 6)
+			return -EINVAL;
+		*reg &= ~(RF_PWR1 | RF_PWR0);
+		*reg |= (NRF24_POWER_0DBM + cfg->rf_power / 6) << 1;
+	}
+	if (cfg->mask & NRF24_CFG_DATA_RATE) {
+		*reg &= ~(RF_DR_LO | RF_DR_HI);
+		if (cfg->data_rate == NRF24_DATARATE_256KBPS)
+			*reg |= RF_DR_LO;
+		else if (cfg->data_rate == NRF24_DATARATE_2MBPS)
+			*reg |= RF_DR_HI;
+		else if (cfg->data_rate != NRF24_DATARATE_1MBPS)
+			return -EINVAL;
+	}
+
+	if (cfg->mask & NRF24_CFG_ADDRESS_WIDTH) {
+		if (cfg->address_width < NRF24_AW_3 || cfg->address_width > NRF24_AW_5)
+			return -EINVAL;
+		aw = cfg->address_width;
+		regs->val[SETUP_AW][0] = aw - 2;
+	}
+
+	if (cfg->mask & NRF24_CFG_CHANNEL) {
+		if (cfg->channel & ~0x7F)
+			return -EINVAL;
+		regs->val[RF_CH][0] = cfg->channel;
+	}
+
+	for (i = 0; i <= NRF24_PIPE5; i++) {
+		const struct nrf24_ioc_pipe_cfg *pc = &cfg->pipes[i];
+
+		if (!(cfg->pipe_mask & BIT(i)))
+			continue;
+		if (pc->ack > 1 || pc->plw > PLOAD_MAX || pc->ack_pload > 1)
+			return -EINVAL;
+		if (pc->ack_pload && (!pc->ack || pc->plw))
+			return -EINVAL;
+
+		if (i <= NRF24_PIPE1) {
+			if (pc->address >= BIT_ULL(aw * BITS_PER_BYTE))
+				return -EINVAL;
+			for (j = 0; j < sizeof(regs->val[0]); j++)
+				regs->val[RX_ADDR_P0 + i][j] = pc->address >> (j * BITS_PER_BYTE);
+		} else {
+			regs->val[RX_ADDR_P0 + i][0] = pc->address & 0xFF;
+		}
+
+		if (pc->ack)
+			regs->val[EN_AA][0] |= BIT(i);
+		else
+			regs->val[EN_AA][0] &= ~BIT(i);
+
+		//applied as given, unlike the plw attribute this does not
+		//turn on auto ack for dynamic payload pipes
+		regs->val[RX_PW_P0 + i][0] = pc->plw;
+		if (pc->plw)
+			regs->val[DYNPD][0] &= ~BIT(i);
+		else
+			regs->val[DYNPD][0] |= BIT(i);
+
+		if (pc->ack_pload)
+			*ack_pload |= BIT(i);
+		else
+			*ack_pload &= ~BIT(i);
+	}
+
+	if (regs->val[DYNPD][0])
+		regs->val[FEATURE][0] |= EN_DPL;
+	else
+		regs->val[FEATURE][0] &= ~EN_DPL;
+
+	//ACKs to our own transmissions are received on pipe 0
+	if (*ack_pload && !(regs->val[DYNPD][0] & BIT(NRF24_PIPE0)))
+		return -EINVAL;
+	if (*ack_pload)
+		regs->val[FEATURE][0] |= EN_ACK_PAY;
+	else
+		regs->val[FEATURE][0] &= ~EN_ACK_PAY;
+
+	return 0;
+}
+
+static long nrf24_ioc_get_cfg(struct nrf24_device *device, void __user *argp)
+{
+	struct nrf24_regs *regs;
+	struct nrf24_ioc_cfg cfg;
+	long ret;
+
+	regs = kmalloc(sizeof(*regs), GFP_KERNEL);
+	if (!regs)
+		return -ENOMEM;
+
+	ret = nrf24_read_regs(device->spi, regs);
+	if (ret >= 0) {
+		nrf24_regs_to_cfg(regs, nrf24_ack_pload_mask(device), &cfg);
+		ret = copy_to_user(argp, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+	}
+
+	kfree(regs);
+	return ret;
+}
+
+static long nrf24_ioc_set_cfg(struct nrf24_device *device, void __user *argp)
+{
+	struct nrf24_regs *regs;
+	struct nrf24_ioc_cfg cfg;
+	struct nrf24_pipe *p;
+	long ret;
+	u8 ack_pload;
+	int i;
+
+	if (copy_from_user(&cfg, argp, sizeof(cfg)))
+		return -EFAULT;
+
+	//regs[0]: as read from the chip, regs[1]: to be written
+	regs = kmalloc_array(2, sizeof(*regs), GFP_KERNEL);
+	if (!regs)
+		return -ENOMEM;
+
+	mutex_lock(&device->cfg_mutex);
+
+	ret = nrf24_read_regs(device->spi, &regs[0]);
+	if (ret < 0)
+		goto exit_unlock;
+	regs[1] = regs[0];
+
+	ack_pload = nrf24_ack_pload_mask(device);
+	ret = nrf24_cfg_to_regs(&cfg, &regs[1], &ack_pload);
+	if (ret < 0)
+		goto exit_unlock;
+
+	if (regs[0].val[SETUP_AW][0] != regs[1].val[SETUP_AW][0]) {
+		device->tx_address_valid = false;
+		device->pipe0_address_valid = false;
+	}
+	if (memcmp(regs[0].val[RX_ADDR_P0], regs[1].val[RX_ADDR_P0], sizeof(regs[0].val[RX_ADDR_P0])))
+		device->pipe0_address_valid = false;
+
+	ret = nrf24_write_regs(device->spi, &regs[0], &regs[1]);
+	if (ret < 0)
+		goto exit_unlock;
+
+	//keep the cached copies in line with the chip
+	nrf24_regs_to_cfg(&regs[1], ack_pload, &cfg);
+	device->cfg.crc = cfg.crc == 16 ? NRF24_CRC_16BIT : cfg.crc == 8 ? NRF24_CRC_8BIT : NRF24_CRC_OFF;
+	device->cfg.retr_count = cfg.retr_count;
+	device->cfg.retr_delay = cfg.retr_delay;
+	device->cfg.rf_power = NRF24_POWER_0DBM + cfg.rf_power / 6;
+	device->cfg.data_rate = cfg.data_rate;
+	device->cfg.address_width = cfg.address_width;
+	for (i = 0; i <= NRF24_PIPE5; i++) {
+		p = nrf24_pipe_by_id(device, i);
+		if (IS_ERR(p))
+			continue;
+		p->cfg.address = cfg.pipes[i].address;
+		p->cfg.ack = cfg.pipes[i].ack;
+		p->cfg.plw = cfg.pipes[i].plw;
+		p->cfg.ack_pload = cfg.pipes[i].ack_pload;
+	}
+
+exit_unlock:
+	mutex_unlock(&device->cfg_mutex);
+	kfree(regs);
+	return ret;
+}
+
+static long nrf24_ioc_set_ack_pload(struct nrf24_device *device,
+				    struct nrf24_pipe *p,
+				    void __user *argp)
+{
+	struct nrf24_ioc_ack_pload ack;
+	struct nrf24_tx_data data;
+	int ret;
+
+	if (copy_from_user(&ack, argp, sizeof(ack)))
+		return -EFAULT;
+	if (!p->cfg.ack_pload || !ack.len || ack.len > PLOAD_MAX)
+		return -EINVAL;
+
+	//goes through the TX thread so that it never lands in a burst
+	data.pipe = p;
+	data.address = p->cfg.address;
+	data.size = ack.len;
+	data.last = false;
+	data.ack_pload = true;
+	memset(data.pload, 0, PLOAD_MAX);
+	memcpy(data.pload, ack.data, ack.len);
+
+	ret = mutex_lock_interruptible(&device->tx_fifo_mutex);
+	if (ret)
+		return ret;
+	ret = kfifo_in(&device->tx_fifo, &data, sizeof(data)) == sizeof(data) ? 0 : -EAGAIN;
+	mutex_unlock(&device->tx_fifo_mutex);
+
+	if (!ret)
+		wake_up_interruptible(&device->tx_wait_queue);
+	return ret;
+}
+
+static long nrf24_ioctl(struct file *filp,
+			unsigned int cmd,
+			unsigned long arg)
+{
+	struct nrf24_device *device;
+	struct nrf24_pipe *p;
+	void __user *argp = (void __user *)arg;
+	u64 address;
+
+	p = filp->private_data;
+	device = to_nrf24_device(p->dev->parent);
+
+	switch (cmd) {
+	case NRF24_IOC_SET_TX_ADDR:
+		if (copy_from_user(&address, argp, sizeof(address)))
+			return -EFAULT;
+		if (address >= BIT_ULL(device->cfg.address_width * BITS_PER_BYTE))
+			return -EINVAL;
+		p->tx_address = address;
+		p->tx_address_valid = true;
+		return 0;
+
+	case NRF24_IOC_GET_TX_ADDR:
+		address = p->tx_address_valid ? p->tx_address : p->cfg.address;
+		if (copy_to_user(argp, &address, sizeof(address)))
+			return -EFAULT;
+		return 0;
+
+	case NRF24_IOC_CLR_TX_ADDR:
+		p->tx_address_valid = false;
+		return 0;
+
+	case NRF24_IOC_TX_KICK:
+		return nrf24_tx_ring_kick(device, p);
+
+	case NRF24_IOC_SET_CFG:
+		return nrf24_ioc_set_cfg(device, argp);
+
+	case NRF24_IOC_GET_CFG:
+		return nrf24_ioc_get_cfg(device, argp);
+
+	case NRF24_IOC_SET_ACK_PLOAD:
+		return nrf24_ioc_set_ack_pload(device, p, argp);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static void nrf24_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct nrf24_pipe *p = vma->vm_private_data;
+
+	atomic_inc(&p->ring_users);
+}
+
+static void nrf24_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct nrf24_pipe *p = vma->vm_private_data;
+	bool last;
+
+	mutex_lock(&p->ring_mutex);
+	last = atomic_dec_and_test(&p->ring_users) && p->removed;
+	mutex_unlock(&p->ring_mutex);
+
+	//nrf24_destroy_devices left the pipe to the last unmap
+	if (last) {
+		vfree(p->ring);
+		kfree(p);
+	}
+}
+
+static const struct vm_operations_struct nrf24_ring_vm_ops = {
+	.open = nrf24_ring_vm_open,
+	.close = nrf24_ring_vm_close,
+};
+
+static int nrf24_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct nrf24_pipe *p = filp->private_data;
+	int ret;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_ALIGN(NRF24_RING_MAP_SIZE))
+		return -EINVAL;
+
+	mutex_lock(&p->ring_mutex);
+	if (p->removed) {
+		mutex_unlock(&p->ring_mutex);
+		return -ENODEV;
+	}
+
+	if (!p->ring) {
+		//zeroed
+		p->ring = vmalloc_user(PAGE_ALIGN(NRF24_RING_MAP_SIZE));
+		if (!p->ring) {
+			mutex_unlock(&p->ring_mutex);
+			return -ENOMEM;
+		}
+	}
+
+	//first mapping starts with empty rings
+	if (atomic_read(&p->ring_users) == 0) {
+		memset(p->ring, 0, NRF24_RING_MAP_SIZE);
+		p->rx_ring_head = 0;
+		p->tx_ring_tail = 0;
+	}
+
+	ret = remap_vmalloc_range(vma, p->ring, 0);
+	if (!ret) {
+		vma->vm_ops = &nrf24_ring_vm_ops;
+		vma->vm_private_data = p;
+		atomic_inc(&p->ring_users);
+	}
+	mutex_unlock(&p->ring_mutex);
+
+	return ret;
 }
 
 static int nrf24_open(struct inode *inode, struct file *filp)
@@ -417,7 +1152,7 @@ static __poll_t nrf24_poll(struct file *filp, struct poll_table_struct *wait)
 	device = to_nrf24_device(p->dev->parent);
 
 	poll_wait(filp, &p->read_wait_queue, wait);
-	if (!kfifo_is_empty(&p->rx_fifo))
+	if (nrf24_pipe_rx_ready(p))
 		events |= (EPOLLIN | EPOLLRDNORM);
 
 	if (!kfifo_is_full(&device->tx_fifo))
@@ -435,6 +1170,15 @@ static void nrf24_destroy_devices(struct nrf24_device *device)
 		device_destroy(nrf24_class, pipe->devt);
 		ida_simple_remove(&nrf24_ida_pipe, MINOR(pipe->devt));
 		list_del(&pipe->list);
+
+		//still mapped, freed by the last nrf24_ring_vm_close
+		mutex_lock(&pipe->ring_mutex);
+		pipe->removed = atomic_read(&pipe->ring_users) > 0;
+		mutex_unlock(&pipe->ring_mutex);
+		if (pipe->removed)
+			continue;
+
+		vfree(pipe->ring);
 		kfree(pipe);
 	}
 }
@@ -444,9 +1188,12 @@ static const struct file_operations nrf24_fops = {
 	.open = nrf24_open,
 	.release = nrf24_release,
 	.read = nrf24_read,
-	.write = nrf24_write,
+	.write_iter = nrf24_write_iter,
 	.llseek = no_llseek,
 	.poll = nrf24_poll,
+	.mmap = nrf24_mmap,
+	.unlocked_ioctl = nrf24_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 static struct nrf24_pipe *nrf24_create_pipe(struct nrf24_device *device, int id)
@@ -472,6 +1219,7 @@ static struct nrf24_pipe *nrf24_create_pipe(struct nrf24_device *device, int id)
 
 	INIT_KFIFO(p->rx_fifo);
 	mutex_init(&p->rx_fifo_mutex);
+	mutex_init(&p->ring_mutex);
 	init_waitqueue_head(&p->read_wait_queue);
 	init_waitqueue_head(&p->write_wait_queue);
 
@@ -546,11 +1294,13 @@ static int nrf24_gpio_setup(struct nrf24_device *device)
 
 	nrf24_ce_lo(device);
 
-	ret = request_irq(device->spi->irq,
-			  nrf24_isr,
-			  0,
-			  dev_name(&device->dev),
-			  device);
+	//threaded handler runs at RT priority and talks to the chip directly
+	ret = request_threaded_irq(device->spi->irq,
+				   NULL,
+				   nrf24_irq_thread,
+				   IRQF_ONESHOT,
+				   dev_name(&device->dev),
+				   device);
 	if (ret < 0) {
 		gpiod_put(device->ce);
 		return ret;
@@ -564,6 +1314,7 @@ static void nrf24_dev_release(struct device *dev)
 	struct nrf24_device *device = to_nrf24_device(dev);
 
 	ida_simple_remove(&nrf24_ida_dev, device->id);
+	kfree(device->rx_xfer);
 	kfree(device);
 }
 
@@ -588,6 +1339,13 @@ static struct nrf24_device *nrf24_dev_init(struct spi_device *spi)
 		ida_simple_remove(&nrf24_ida_dev, id);
 		return ERR_PTR(-ENOMEM);
 	}
+
+	device->rx_xfer = kmalloc(sizeof(*device->rx_xfer), GFP_KERNEL);
+	if (!device->rx_xfer) {
+		kfree(device);
+		ida_simple_remove(&nrf24_ida_dev, id);
+		return ERR_PTR(-ENOMEM);
+	}
 	device->spi = spi;
 
 	dev_set_name(&device->dev, "nrf%d", id);
@@ -607,11 +1365,9 @@ static struct nrf24_device *nrf24_dev_init(struct spi_device *spi)
 	init_waitqueue_head(&device->tx_wait_queue);
 	init_waitqueue_head(&device->tx_done_wait_queue);
 
-	INIT_WORK(&device->isr_work, nrf24_isr_work_handler);
-	INIT_WORK(&device->rx_work, nrf24_rx_work_handler);
 	INIT_KFIFO(device->tx_fifo);
-	spin_lock_init(&device->lock);
 	mutex_init(&device->tx_fifo_mutex);
+	mutex_init(&device->cfg_mutex);
 
 	INIT_LIST_HEAD(&device->pipes);
 
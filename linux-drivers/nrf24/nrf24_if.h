@@ -12,11 +12,15 @@
 
 #define FIFO_SIZE			65536
 
+struct nrf24_rx_xfer;
+
 
 struct nrf24_pipe_cfg {
 	u64			address;
 	u8			ack;
 	u8			plw;
+	/* EN_ACK_PAY is on while any pipe has it */
+	u8			ack_pload;
 };
 
 struct nrf24_pipe {
@@ -35,6 +39,21 @@ struct nrf24_pipe {
 
 	u32			sent;
 	bool			write_done;
+	/* a payload of the current write failed, drop the rest of it */
+	bool			tx_drop;
+
+	/* destination of writes, set by NRF24_IOC_SET_TX_ADDR */
+	u64			tx_address;
+	bool			tx_address_valid;
+
+	/* packet mode rings, NRF24_RING_MAP_SIZE of vmalloc_user memory */
+	void			*ring;
+	struct mutex		ring_mutex;
+	atomic_t		ring_users;
+	u32			rx_ring_head;
+	u32			tx_ring_tail;
+	/* destroyed while the rings were mapped, freed on the last unmap */
+	bool			removed;
 };
 
 struct nrf24_device_cfg {
@@ -48,7 +67,12 @@ struct nrf24_device_cfg {
 
 struct nrf24_tx_data {
 	struct nrf24_pipe	*pipe;
+	u64			address;
 	u8			size;
+	/* final payload of a write, completes it */
+	bool			last;
+	/* W_ACK_PAYLOAD for the pipe, not transmitted nor completed */
+	bool			ack_pload;
 	u8			pload[PLOAD_MAX];
 };
 
@@ -62,11 +86,8 @@ struct nrf24_device {
 
 	struct nrf24_device_cfg	cfg;
 
-	/* for irqsave */
-	spinlock_t		lock;
-
-	struct work_struct	isr_work;
-	struct work_struct	rx_work;
+	/* used by the IRQ thread only */
+	struct nrf24_rx_xfer	*rx_xfer;
 
 	/* tx */
 	STRUCT_KFIFO_REC_1(FIFO_SIZE) tx_fifo;
@@ -76,6 +97,22 @@ struct nrf24_device {
 	wait_queue_head_t	tx_done_wait_queue;
 	bool			tx_done;
 	bool			tx_failed;
+	/* PRIM_RX cleared, kept across back-to-back bursts */
+	bool			tx_mode;
+	/* ACK payloads written in RX mode may still sit in the TX FIFO */
+	bool			ack_pload_pending;
+
+	/* addresses currently in TX/PIPE0 registers */
+	u64			tx_address;
+	u64			pipe0_address;
+	bool			tx_address_valid;
+	bool			pipe0_address_valid;
+
+	/*
+	 * serializes NRF24_IOC_SET_CFG, ack_pload changes and the CONFIG
+	 * read-modify-writes of crc and the TX thread's PRIM_RX switching
+	 */
+	struct mutex		cfg_mutex;
 
 	/* rx */
 	struct timer_list	rx_active_timer;
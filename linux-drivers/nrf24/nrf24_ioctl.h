@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+
+/*
+ * ioctl interface of /dev/nrfX.Y, shared with user space
+ *
+ */
+
+#ifndef NRF24_IOCTL_H
+#define NRF24_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define NRF24_IOC_MAGIC			'n'
+
+/*
+ * Destination address of following writes on this pipe, little endian,
+ * address_width bytes. Payloads are tagged with it when queued so the TX
+ * thread only reprograms TX/PIPE0 when the destination changes.
+ * NRF24_IOC_CLR_TX_ADDR falls back to the pipe RX address.
+ */
+#define NRF24_IOC_SET_TX_ADDR		_IOW(NRF24_IOC_MAGIC, 0x01, __u64)
+#define NRF24_IOC_GET_TX_ADDR		_IOR(NRF24_IOC_MAGIC, 0x02, __u64)
+#define NRF24_IOC_CLR_TX_ADDR		_IO(NRF24_IOC_MAGIC, 0x03)
+
+/*
+ * Packet mode. mmap() of NRF24_RING_MAP_SIZE bytes at offset 0 maps an RX
+ * ring followed by a TX ring. While mapped, payloads received on the pipe
+ * go to the RX ring instead of read(), and poll() reports EPOLLIN while it
+ * is not empty. Userspace fills TX slots, advances head and calls
+ * NRF24_IOC_TX_KICK, which queues them and returns how many were taken.
+ *
+ * head and tail run freely, slot = index % NRF24_RING_SLOTS. The producer
+ * owns head and the consumer owns tail; publish them with release stores.
+ */
+#define NRF24_RING_SLOTS		256
+#define NRF24_RING_SIZE			16384
+#define NRF24_RING_RX_OFFSET		0
+#define NRF24_RING_TX_OFFSET		NRF24_RING_SIZE
+#define NRF24_RING_MAP_SIZE		(2 * NRF24_RING_SIZE)
+
+struct nrf24_ring_slot {
+	__u64			timestamp;	/* RX: CLOCK_MONOTONIC ns when drained */
+	__u64			address;	/* TX: destination, 0 for the pipe TX address */
+	__u8			pipe;
+	__u8			len;
+	__u8			reserved[6];
+	__u8			data[32];
+};
+
+struct nrf24_ring {
+	__u32			head;
+	__u32			tail;
+	__u32			dropped;	/* RX: payloads lost to a full ring */
+	__u32			reserved[13];
+	struct nrf24_ring_slot	slots[NRF24_RING_SLOTS];
+};
+
+#define NRF24_IOC_TX_KICK		_IO(NRF24_IOC_MAGIC, 0x04)
+
+/*
+ * Bulk configuration, values as in the sysfs attributes. NRF24_IOC_SET_CFG
+ * applies the fields selected by mask and the pipes selected by pipe_mask
+ * in one SPI message, writing only registers whose value changes, so a
+ * channel hop is a single register write. Nothing is written if any
+ * selected field is invalid. NRF24_IOC_GET_CFG fills every field.
+ */
+#define NRF24_CFG_CRC			(1 << 0)
+#define NRF24_CFG_RETR_DELAY		(1 << 1)
+#define NRF24_CFG_RETR_COUNT		(1 << 2)
+#define NRF24_CFG_RF_POWER		(1 << 3)
+#define NRF24_CFG_DATA_RATE		(1 << 4)
+#define NRF24_CFG_ADDRESS_WIDTH		(1 << 5)
+#define NRF24_CFG_CHANNEL		(1 << 6)
+
+struct nrf24_ioc_pipe_cfg {
+	__u64			address;	/* pipes 2-5 only use the low byte */
+	__u8			ack;
+	__u8			plw;		/* 0 for dynamic payload length */
+	__u8			ack_pload;	/* see NRF24_IOC_SET_ACK_PLOAD */
+	__u8			reserved[5];
+};
+
+struct nrf24_ioc_cfg {
+	__u32			mask;
+	__u16			data_rate;	/* 256, 1024, 2048 kbps */
+	__u16			retr_delay;	/* 250 - 4000 us, multiple of 250 */
+	__u8			crc;		/* 0, 8, 16 bits */
+	__u8			retr_count;	/* 0 - 15 */
+	__s8			rf_power;	/* 0, -6, -12, -18 dBm */
+	__u8			address_width;	/* 3 - 5 bytes */
+	__u8			channel;	/* 0 - 127 */
+	__u8			pipe_mask;	/* bit n selects pipes[n] */
+	__u8			reserved[6];
+	struct nrf24_ioc_pipe_cfg pipes[6];
+};
+
+#define NRF24_IOC_SET_CFG		_IOW(NRF24_IOC_MAGIC, 0x05, struct nrf24_ioc_cfg)
+#define NRF24_IOC_GET_CFG		_IOR(NRF24_IOC_MAGIC, 0x06, struct nrf24_ioc_cfg)
+
+/*
+ * ACK payloads, enabled per pipe by ack_pload (sysfs or NRF24_IOC_SET_CFG).
+ * The pipe needs auto ack and dynamic payload length, and so does pipe 0,
+ * which receives the ACKs of our own transmissions. While any pipe has it:
+ * - payloads carried back in ACKs are received on pipe 0 like any other,
+ *   the peer answers without a transmission of its own. In packet mode
+ *   slot.address is the destination whose ACK carried the payload.
+ * - NRF24_IOC_SET_ACK_PLOAD preloads the payload of the ACK sent for the
+ *   next packet received on this pipe. Up to three may be pending, the rest
+ *   are dropped, and pending ones are flushed when we start transmitting.
+ */
+struct nrf24_ioc_ack_pload {
+	__u8			len;
+	__u8			reserved[7];
+	__u8			data[32];
+};
+
+#define NRF24_IOC_SET_ACK_PLOAD		_IOW(NRF24_IOC_MAGIC, 0x07, struct nrf24_ioc_ack_pload)
+
+#endif /* NRF24_IOCTL_H */
@@ -28,6 +28,17 @@ static struct nrf24_pipe *nrf24_find_pipe_ptr(struct device *dev)
 	return ERR_PTR(-ENODEV);
 }
 
+static bool nrf24_is_ack_pload_used(struct nrf24_device *device)
+{
+	struct nrf24_pipe *pipe;
+
+	list_for_each_entry(pipe, &device->pipes, list)
+		if (pipe->cfg.ack_pload)
+			return true;
+
+	return false;
+}
+
 static ssize_t ack_show(struct device *dev,
 			struct device_attribute *attr,
 			char *buf)
@@ -66,6 +77,9 @@ static ssize_t ack_store(struct device *dev,
 		return ret;
 	if (new < 0 || new > 1)
 		return -EINVAL;
+	//ACK payloads need auto ack
+	if (!new && pipe->cfg.ack_pload)
+		return -EINVAL;
 
 	ret = nrf24_setup_auto_ack(device->spi, pipe->id, new);
 	if (ret < 0)
@@ -116,6 +130,10 @@ static ssize_t plw_store(struct device *dev,
 
 	if (new < 0 || new > PLOAD_MAX)
 		return -EINVAL;
+	//ACK payloads need dynamic payload length here and on pipe 0
+	if (new && (pipe->cfg.ack_pload ||
+		    (pipe->id == NRF24_PIPE0 && nrf24_is_ack_pload_used(device))))
+		return -EINVAL;
 	old = nrf24_get_rx_pload_width(device->spi, pipe->id);
 	if (old < 0)
 		return old;
@@ -183,6 +201,9 @@ static ssize_t address_store(struct device *dev,
 	if (IS_ERR(pipe))
 		return PTR_ERR(pipe);
 
+	if (pipe->id == NRF24_PIPE0)
+		device->pipe0_address_valid = false;
+
 	ret = nrf24_set_address(device->spi, pipe->id, (u8 *)&address);
 	if (ret < 0)
 		return ret;
@@ -192,14 +213,73 @@ static ssize_t address_store(struct device *dev,
 	return count;
 }
 
+static ssize_t ack_pload_show(struct device *dev,
+			      struct device_attribute *attr,
+			      char *buf)
+{
+	struct nrf24_pipe *pipe;
+
+	pipe = nrf24_find_pipe_ptr(dev);
+	if (IS_ERR(pipe))
+		return PTR_ERR(pipe);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", pipe->cfg.ack_pload);
+}
+
+static ssize_t ack_pload_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf,
+			       size_t count)
+{
+	struct nrf24_device *device = to_nrf24_device(dev->parent);
+	int ret;
+	u8 new;
+	u8 old;
+	struct nrf24_pipe *pipe;
+	struct nrf24_pipe *pipe0;
+
+	pipe = nrf24_find_pipe_ptr(dev);
+	if (IS_ERR(pipe))
+		return PTR_ERR(pipe);
+
+	ret = kstrtou8(buf, 10, &new);
+	if (ret < 0)
+		return ret;
+	if (new > 1)
+		return -EINVAL;
+
+	if (new) {
+		if (!pipe->cfg.ack || pipe->cfg.plw)
+			return -EINVAL;
+		//ACKs to our own transmissions are received on pipe 0
+		list_for_each_entry(pipe0, &device->pipes, list)
+			if (pipe0->id == NRF24_PIPE0 && pipe0->cfg.plw)
+				return -EINVAL;
+	}
+
+	mutex_lock(&device->cfg_mutex);
+	old = pipe->cfg.ack_pload;
+	pipe->cfg.ack_pload = new;
+	ret = nrf24_setup_ack_pload(device->spi, nrf24_is_ack_pload_used(device));
+	if (ret < 0)
+		pipe->cfg.ack_pload = old;
+	mutex_unlock(&device->cfg_mutex);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
 static DEVICE_ATTR_RW(ack);
 static DEVICE_ATTR_RW(plw);
 static DEVICE_ATTR_RW(address);
+static DEVICE_ATTR_RW(ack_pload);
 
 struct attribute *nrf24_pipe_attrs[] = {
 	&dev_attr_ack.attr,
 	&dev_attr_plw.attr,
 	&dev_attr_address.attr,
+	&dev_attr_ack_pload.attr,
 	NULL,
 };
 
@@ -246,6 +326,8 @@ static ssize_t tx_address_store(struct device *dev,
 	if (address >= BIT_ULL(len * BITS_PER_BYTE))
 		return -EINVAL;
 
+	device->tx_address_valid = false;
+
 	ret = nrf24_set_address(device->spi, NRF24_TX, (u8 *)&address);
 	if (ret < 0)
 		return ret;
@@ -331,16 +413,16 @@ static ssize_t crc_store(struct device *dev,
 		return -EINVAL;
 	}
 
+	mutex_lock(&device->cfg_mutex);
 	ret = nrf24_get_crc_mode(device->spi);
-	if (ret < 0)
-		return ret;
-
-	if (new != ret) {
+	if (ret >= 0 && new != ret) {
 		ret = nrf24_set_crc_mode(device->spi, new);
-		if (ret < 0)
-			return ret;
-		dev_dbg(dev, "%s: new crc mode = %d\n", __func__, new);
+		if (ret >= 0)
+			dev_dbg(dev, "%s: new crc mode = %d\n", __func__, new);
 	}
+	mutex_unlock(&device->cfg_mutex);
+	if (ret < 0)
+		return ret;
 	return count;
 }
 
@@ -390,9 +472,12 @@ static ssize_t address_width_store(struct device *dev,
 		return ret;
 
 	if (new != ret) {
+		device->tx_address_valid = false;
+		device->pipe0_address_valid = false;
 		ret = nrf24_set_address_width(device->spi, new);
 		if (ret < 0)
 			return ret;
+		device->cfg.address_width = new;
 		dev_dbg(dev, "%s: new address width = %d\n", __func__, new);
 	}
 	return count;
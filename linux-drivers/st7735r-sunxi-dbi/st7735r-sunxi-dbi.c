@@ -32,10 +32,17 @@
 #include <drm/drm_rect.h>
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_fb_helper.h>
+#include <drm/drm_fb_dma_helper.h>
 #include <drm/drm_gem_atomic_helper.h>
 #include <drm/drm_gem_dma_helper.h>
 #include <drm/drm_managed.h>
 
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON) && defined(CONFIG_ARM)
+#include <asm/neon.h>
+#include <asm/simd.h>
+#define SUNXI_DBI_NEON
+#endif
+
 #include "../../../spi/spi-sunxi.h"
 
 #define ST7735R_FRMCTR1		0xb1
@@ -61,7 +68,16 @@ struct sunxi_dbi_dev {
 	struct drm_simple_display_pipe pipe;
 	struct drm_connector connector;
 	struct drm_framebuffer *fb;
-    u16 *vram;
+    /* RGB565 frames, vram[back] is filled while the other one is sent */
+    u16 *vram[2];
+    int back;
+    bool back_ready;
+    struct drm_rect back_rect;
+    /* RGB565 fb sent straight from its GEM buffer instead of vram[back] */
+    struct drm_framebuffer *back_fb;
+    /* area changed since the last vsync, empty when nothing to send */
+    struct drm_rect damage;
+    spinlock_t damage_lock;
 };
 
 struct st7735r_cfg {
@@ -81,6 +97,22 @@ struct st7735r_priv {
 	u32 rotation;
     struct mutex cmdlock;
     struct backlight_device *backlight;
+    /* frame transfer submitted with spi_async, completes on its own */
+    struct spi_message flush_msg;
+    /* one per row when a zero-copy rect does not span whole fb lines */
+    struct spi_transfer *flush_tr;
+    unsigned int n_flush_tr;
+    unsigned int n_flush_pixels;
+    /* CASET/RASET/RAMWR ahead of the pixels, one step per message */
+    struct spi_transfer win_tr;
+    u8 *win_buf;
+    unsigned int flush_step;
+    /* zero-copy fb on the bus, put once the bus is idle again */
+    struct drm_framebuffer *flush_fb;
+    bool flush_busy;
+    wait_queue_head_t flush_wait;
+    /* serializes the vsync handler against pipe disable */
+    struct mutex flush_lock;
 };
 
 int sunxi_dbi_transfer(struct st7735r_priv *priv, const void *data, size_t len)
@@ -153,70 +185,373 @@ err_dbi_transfer:
 	sunxi_dbi_transfer(priv, d, ARRAY_SIZE(d)); \
 })
 
-static void sunxi_dbi_set_frame(struct drm_framebuffer *fb)
+/* called with damage_lock held */
+static void sunxi_dbi_damage_add(struct sunxi_dbi_dev *dbi_dev,
+                                 const struct drm_rect *rect)
+{
+    if (!drm_rect_visible(&dbi_dev->damage)) {
+        dbi_dev->damage = *rect;
+    } else {
+        dbi_dev->damage.x1 = min(dbi_dev->damage.x1, rect->x1);
+        dbi_dev->damage.y1 = min(dbi_dev->damage.y1, rect->y1);
+        dbi_dev->damage.x2 = max(dbi_dev->damage.x2, rect->x2);
+        dbi_dev->damage.y2 = max(dbi_dev->damage.y2, rect->y2);
+    }
+}
+
+static void sunxi_dbi_set_frame(struct drm_framebuffer *fb,
+                                const struct drm_rect *rect)
 {
 	struct st7735r_priv *priv = container_of(fb->dev, 
                                     struct st7735r_priv, dbi_dev.drm);
+    struct sunxi_dbi_dev *dbi_dev = &priv->dbi_dev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dbi_dev->damage_lock, flags);
+    dbi_dev->fb = fb;
+    sunxi_dbi_damage_add(dbi_dev, rect);
+    spin_unlock_irqrestore(&dbi_dev->damage_lock, flags);
+}
 
+/*
+ * DCX and the command/video mode are per-device DBI config, not per
+ * transfer, so the window commands cannot share the pixel message. Each
+ * step is queued with spi_async from the completion of the one before,
+ * and flush_busy covers the whole chain.
+ */
+static const struct {
+    u8 off;
+    u8 len;
+    bool is_cmd;
+} sunxi_dbi_win_steps[] = {
+    { 0, 1, true },     /* CASET */
+    { 1, 4, false },
+    { 5, 1, true },     /* RASET */
+    { 6, 4, false },
+    { 10, 1, true },    /* RAMWR */
+};
 
-    priv->dbi_dev.fb = fb;
+#define SUNXI_DBI_WIN_LEN	11
+#define SUNXI_DBI_FLUSH_PIXELS	ARRAY_SIZE(sunxi_dbi_win_steps)
 
+/* CASET/RASET take inclusive end addresses */
+static void sunxi_dbi_set_window(struct st7735r_priv *priv,
+                                 const struct drm_rect *rect)
+{
+	u16 xs = rect->x1 + priv->cfg->left_offset;
+	u16 xe = rect->x2 - 1 + priv->cfg->left_offset;
+	u16 ys = rect->y1 + priv->cfg->top_offset;
+	u16 ye = rect->y2 - 1 + priv->cfg->top_offset;
+    u8 *buf = priv->win_buf;
+
+    buf[0] = MIPI_DCS_SET_COLUMN_ADDRESS;
+    buf[1] = (xs >> 8) & 0xff;
+    buf[2] = xs & 0xff;
+    buf[3] = (xe >> 8) & 0xff;
+    buf[4] = xe & 0xff;
+    buf[5] = MIPI_DCS_SET_PAGE_ADDRESS;
+    buf[6] = (ys >> 8) & 0xff;
+    buf[7] = ys & 0xff;
+    buf[8] = (ye >> 8) & 0xff;
+    buf[9] = ye & 0xff;
+    buf[10] = MIPI_DCS_WRITE_MEMORY_START;
 }
 
-void sunxi_dbi_vsync_handle(unsigned long data)
+static void sunxi_dbi_flush_complete(void *context);
+
+/* queue step flush_step of the frame, the pixels come last */
+static int sunxi_dbi_flush_submit(struct st7735r_priv *priv)
 {
-    struct spi_device *spi = (struct spi_device*)data;
-    struct drm_device *drm = (struct drm_device*)spi_get_drvdata(spi);
-	struct st7735r_priv *priv = container_of(drm, 
-                                    struct st7735r_priv, dbi_dev.drm);
-	int idx;
-    static u32 count = 0;
+    unsigned int step = priv->flush_step;
+
+    DBI_WRITE(priv->dbi_cfg.dbi_mode);
+    if (step < SUNXI_DBI_FLUSH_PIXELS) {
+        DBI_TR_COMMAND(priv->dbi_cfg.dbi_mode);
+        if (sunxi_dbi_win_steps[step].is_cmd)
+            DBI_DCX_COMMAND(priv->dbi_cfg.dbi_mode);
+        else
+            DBI_DCX_DATA(priv->dbi_cfg.dbi_mode);
+        spi_set_dbi_config(priv->spi, &priv->dbi_cfg);
+
+        priv->win_tr.tx_buf = priv->win_buf + sunxi_dbi_win_steps[step].off;
+        priv->win_tr.len = sunxi_dbi_win_steps[step].len;
+        spi_message_init_with_transfers(&priv->flush_msg, &priv->win_tr, 1);
+    } else {
+        DBI_TR_VIDEO(priv->dbi_cfg.dbi_mode);
+        spi_set_dbi_config(priv->spi, &priv->dbi_cfg);
+
+        spi_message_init_with_transfers(&priv->flush_msg, priv->flush_tr,
+                                        priv->n_flush_pixels);
+    }
+    priv->flush_msg.complete = sunxi_dbi_flush_complete;
+    priv->flush_msg.context = priv;
+
+    return spi_async(priv->spi, &priv->flush_msg);
+}
+
+static void sunxi_dbi_flush_complete(void *context)
+{
+	struct st7735r_priv *priv = context;
+    int ret = priv->flush_msg.status;
+
+    if (!ret && priv->flush_step < SUNXI_DBI_FLUSH_PIXELS) {
+        priv->flush_step++;
+        ret = sunxi_dbi_flush_submit(priv);
+        if (!ret)
+            return;
+    }
+
+	if (ret)
+        dev_err_ratelimited(&priv->spi->dev, "dbi: transfer error %d\n", ret);
 
+    smp_store_release(&priv->flush_busy, false);
+    wake_up(&priv->flush_wait);
+}
+
+/* the controller config must not change under a frame still on the bus */
+static void sunxi_dbi_flush_wait(struct st7735r_priv *priv)
+{
+    wait_event(priv->flush_wait, !smp_load_acquire(&priv->flush_busy));
+}
+
+#ifdef SUNXI_DBI_NEON
+/*
+ * 8 pixels per iteration: vld4 splits B, G, R, X into lanes, then R, G
+ * and B are merged into RGB565 by shift-and-insert. The kernel is built
+ * without NEON code generation, hence inline asm with its own .fpu.
+ */
+static void sunxi_dbi_xrgb8888_to_rgb565_line(u16 *dst, const u32 *src,
+                                              unsigned int n)
+{
+    u32 pix;
+
+    for (; n >= 8; n -= 8, src += 8, dst += 8)
+        asm volatile(
+            ".fpu neon\n"
+            "vld4.8 {d0, d1, d2, d3}, [%0]\n"
+            "vshll.u8 q8, d2, #8\n"
+            "vshll.u8 q9, d1, #8\n"
+            "vshll.u8 q10, d0, #8\n"
+            "vsri.16 q8, q9, #5\n"
+            "vsri.16 q8, q10, #11\n"
+            "vst1.16 {d16, d17}, [%1]\n"
+            :
+            : "r" (src), "r" (dst)
+            : "d0", "d1", "d2", "d3", "d16", "d17", "d18", "d19",
+              "d20", "d21", "memory");
+
+    for (; n; n--) {
+        pix = *src++;
+        *dst++ = ((pix & 0x00f80000) >> 8) |
+                 ((pix & 0x0000fc00) >> 5) |
+                 ((pix & 0x000000f8) >> 3);
+    }
+}
+#endif
+
+/*
+ * rows of clip packed into dst. The controller takes native-endian pixels
+ * in RGB565 video mode, as the memcpy path relies on, so no swab here.
+ */
+static void sunxi_dbi_xrgb8888_to_rgb565(struct iosys_map *dst,
+                                         const struct iosys_map *src,
+                                         const struct drm_framebuffer *fb,
+                                         const struct drm_rect *clip)
+{
+#ifdef SUNXI_DBI_NEON
+    unsigned int width = drm_rect_width(clip);
+    const u8 *sbuf;
+    u16 *dbuf = dst->vaddr;
+    int y;
+
+    if (may_use_simd() && !src->is_iomem) {
+        sbuf = src->vaddr + fb->offsets[0] + clip->y1 * fb->pitches[0] +
+               clip->x1 * sizeof(u32);
+
+        kernel_neon_begin();
+        for (y = clip->y1; y < clip->y2; y++) {
+            sunxi_dbi_xrgb8888_to_rgb565_line(dbuf, (const u32 *)sbuf, width);
+            sbuf += fb->pitches[0];
+            dbuf += width;
+        }
+        kernel_neon_end();
+        return;
+    }
+#endif
+    drm_fb_xrgb8888_to_rgb565(dst, NULL, src, fb, clip, false);
+}
+
+/* native RGB565 in CPU-addressable DMA memory can go to the bus as is */
+static bool sunxi_dbi_can_scanout(const struct drm_framebuffer *fb)
+{
+    struct drm_gem_dma_object *dma_obj;
+
+    if (fb->format->format != DRM_FORMAT_RGB565)
+        return false;
+
+    dma_obj = drm_fb_dma_get_gem_obj(fb, 0);
+    return dma_obj && dma_obj->vaddr && !dma_obj->base.import_attach;
+}
 
+/* take the damage of all updates since the last frame into vram[back] */
+static void sunxi_dbi_prepare_frame(struct st7735r_priv *priv)
+{
+    struct sunxi_dbi_dev *dbi_dev = &priv->dbi_dev;
 	struct iosys_map map[DRM_FORMAT_MAX_PLANES];
 	struct iosys_map vdata[DRM_FORMAT_MAX_PLANES];
-	struct iosys_map vram_map = IOSYS_MAP_INIT_VADDR(priv->dbi_dev.vram);
-	struct drm_rect rect_full = DRM_RECT_INIT(0, 0, 
-                    priv->dbi_cfg.dbi_video_h, priv->dbi_cfg.dbi_video_v); 
-    struct drm_framebuffer *fb = priv->dbi_dev.fb;
+	struct iosys_map vram_map = IOSYS_MAP_INIT_VADDR(dbi_dev->vram[dbi_dev->back]);
+	struct drm_rect rect;
+    struct drm_framebuffer *fb;
+    unsigned long flags;
+	int idx;
+
+    spin_lock_irqsave(&dbi_dev->damage_lock, flags);
+    fb = dbi_dev->fb;
+    rect = dbi_dev->damage;
+    dbi_dev->damage = DRM_RECT_INIT(0, 0, 0, 0);
+    spin_unlock_irqrestore(&dbi_dev->damage_lock, flags);
 
-        // printk("dbi: set frame");
+    /* nothing changed, the panel keeps showing its GRAM */
+    if (!fb || !drm_rect_visible(&rect))
+        return;
 
 	if (!drm_dev_enter(fb->dev, &idx))
 		return;
 
+    /* no CPU access at all, the fb is kept until its transfer is done */
+    if (sunxi_dbi_can_scanout(fb)) {
+        drm_framebuffer_get(fb);
+        dbi_dev->back_fb = fb;
+        dbi_dev->back_rect = rect;
+        dbi_dev->back_ready = true;
+        drm_dev_exit(idx);
+        return;
+    }
+
 	if (drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE))
-		goto err_dbi_vsync;
+		goto err_dbi_prepare;
 
 	if (drm_gem_fb_vmap(fb, map, vdata))
-		goto err_dbi_vsync_gem;
-    drm_fb_memcpy(&vram_map, NULL, vdata, fb, &rect_full);
+		goto err_dbi_prepare_gem;
 
+    /* packed rows of the damaged area only */
+    if (fb->format->format == DRM_FORMAT_XRGB8888)
+        sunxi_dbi_xrgb8888_to_rgb565(&vram_map, vdata, fb, &rect);
+    else
+        drm_fb_memcpy(&vram_map, NULL, vdata, fb, &rect);
 
+    dbi_dev->back_rect = rect;
+    dbi_dev->back_ready = true;
 
+    drm_gem_fb_vunmap(fb, map);
+err_dbi_prepare_gem:
+	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+err_dbi_prepare:
+	drm_dev_exit(idx);
 
-        count++;
-        if(count % 30 == 0)
-            printk("dbi: vsync");
+    /* try again next vsync */
+    if (!dbi_dev->back_ready) {
+        spin_lock_irqsave(&dbi_dev->damage_lock, flags);
+        sunxi_dbi_damage_add(dbi_dev, &rect);
+        spin_unlock_irqrestore(&dbi_dev->damage_lock, flags);
+    }
+}
 
-	// if (!drm_dev_enter(drm, &idx))
-	// 	return;
+/* rows of rect in the GEM buffer, a single transfer when they are contiguous */
+static unsigned int sunxi_dbi_scanout_transfers(struct st7735r_priv *priv,
+                                                struct drm_framebuffer *fb,
+                                                const struct drm_rect *rect)
+{
+    struct drm_gem_dma_object *dma_obj = drm_fb_dma_get_gem_obj(fb, 0);
+    unsigned int pitch = fb->pitches[0];
+    unsigned int len = drm_rect_width(rect) * sizeof(u16);
+    unsigned int height = drm_rect_height(rect);
+    const u8 *buf;
+    unsigned int i;
+
+    buf = dma_obj->vaddr + fb->offsets[0] + rect->y1 * pitch + rect->x1 * sizeof(u16);
+
+    if (len == pitch) {
+        priv->flush_tr[0].tx_buf = buf;
+        priv->flush_tr[0].len = len * height;
+        return 1;
+    }
 
-    DBI_WRITE(priv->dbi_cfg.dbi_mode);
-    DBI_TR_VIDEO(priv->dbi_cfg.dbi_mode);
-    spi_set_dbi_config(priv->spi, &priv->dbi_cfg);
-    sunxi_dbi_transfer(priv, priv->dbi_dev.vram, 
-        priv->dbi_cfg.dbi_video_v * priv->dbi_cfg.dbi_video_h * sizeof(u16));
+    for (i = 0; i < height; i++) {
+        priv->flush_tr[i].tx_buf = buf + i * pitch;
+        priv->flush_tr[i].len = len;
+    }
+    return height;
+}
 
-	// drm_dev_exit(idx);
+/* send vram[back] or back_fb without waiting for it */
+static void sunxi_dbi_flush(struct st7735r_priv *priv)
+{
+    struct sunxi_dbi_dev *dbi_dev = &priv->dbi_dev;
+    struct drm_rect *rect = &dbi_dev->back_rect;
+    int ret;
+
+    /* the bus is idle, the previous zero-copy fb is no longer read */
+    if (priv->flush_fb) {
+        drm_framebuffer_put(priv->flush_fb);
+        priv->flush_fb = NULL;
+    }
 
+    sunxi_dbi_set_window(priv, rect);
+
+    if (dbi_dev->back_fb) {
+        priv->n_flush_pixels = sunxi_dbi_scanout_transfers(priv, dbi_dev->back_fb, rect);
+        priv->flush_fb = dbi_dev->back_fb;
+        dbi_dev->back_fb = NULL;
+    } else {
+        priv->flush_tr[0].tx_buf = dbi_dev->vram[dbi_dev->back];
+        priv->flush_tr[0].len = drm_rect_width(rect) * drm_rect_height(rect) * sizeof(u16);
+        priv->n_flush_pixels = 1;
+        /* vram[back] becomes the front buffer */
+        dbi_dev->back ^= 1;
+    }
 
+    priv->flush_busy = true;
+    priv->flush_step = 0;
+    dbi_dev->back_ready = false;
 
-    drm_gem_fb_vunmap(fb, map);
-err_dbi_vsync_gem:
-	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
-err_dbi_vsync:
-	drm_dev_exit(idx);
+    ret = sunxi_dbi_flush_submit(priv);
+    if (ret) {
+        dev_err_ratelimited(&priv->spi->dev, "dbi: transfer error %d\n", ret);
+        smp_store_release(&priv->flush_busy, false);
+        wake_up(&priv->flush_wait);
+    }
+}
+
+/*
+ * never waits for the bus: while a frame is in flight the next one is
+ * converted into the back buffer, and sent by the first vsync that finds
+ * the bus idle. Damage arriving meanwhile waits for the frame after.
+ */
+void sunxi_dbi_vsync_handle(unsigned long data)
+{
+    struct spi_device *spi = (struct spi_device*)data;
+    struct drm_device *drm = (struct drm_device*)spi_get_drvdata(spi);
+	struct st7735r_priv *priv = container_of(drm, 
+                                    struct st7735r_priv, dbi_dev.drm);
+    static u32 count = 0;
+
+    /* pipe disable in progress */
+    if (!mutex_trylock(&priv->flush_lock))
+        return;
+
+    if (!priv->dbi_dev.back_ready)
+        sunxi_dbi_prepare_frame(priv);
+
+    if (priv->dbi_dev.back_ready && !smp_load_acquire(&priv->flush_busy)) {
+        sunxi_dbi_flush(priv);
+
+        count++;
+        if(count % 30 == 0)
+            printk("dbi: vsync");
+    }
+
+    mutex_unlock(&priv->flush_lock);
 }
 
 static void st7735r_pipe_enable(struct drm_simple_display_pipe *pipe,
@@ -227,10 +562,8 @@ static void st7735r_pipe_enable(struct drm_simple_display_pipe *pipe,
                                     struct st7735r_priv, dbi_dev.drm);
 	int idx;
 	u8 addr_mode;
-	u16 xs = priv->cfg->left_offset;
-	u16 xe = priv->dbi_cfg.dbi_video_h + priv->cfg->left_offset;
-	u16 ys = priv->cfg->top_offset;
-	u16 ye = priv->dbi_cfg.dbi_video_v + priv->cfg->top_offset;
+	struct drm_rect rect_full = DRM_RECT_INIT(0, 0, 
+                    priv->dbi_cfg.dbi_video_h, priv->dbi_cfg.dbi_video_v); 
 
 
         // printk("dbi: pipe enalbe");
@@ -239,6 +572,13 @@ static void st7735r_pipe_enable(struct drm_simple_display_pipe *pipe,
 	if (!drm_dev_enter(pipe->crtc.dev, &idx))
 		return;
 
+    /*
+     * the plane update runs before enable, so a vsync may already have a
+     * window/pixel chain on the bus; keep it off during reset and init
+     */
+    mutex_lock(&priv->flush_lock);
+    sunxi_dbi_flush_wait(priv);
+
     /* hw reset */
 	gpiod_set_value_cansleep(priv->reset, 0);
 	msleep(5);
@@ -302,14 +642,10 @@ static void st7735r_pipe_enable(struct drm_simple_display_pipe *pipe,
 	sunxi_dbi_command(priv, MIPI_DCS_ENTER_NORMAL_MODE);
 
 	msleep(20);
+    mutex_unlock(&priv->flush_lock);
 
-	sunxi_dbi_command(priv, MIPI_DCS_SET_COLUMN_ADDRESS, 
-                (xs >> 8) & 0xff, xs & 0xff, (xe >> 8) & 0xff, xe & 0xff);
-	sunxi_dbi_command(priv, MIPI_DCS_SET_PAGE_ADDRESS, 
-                (ys >> 8) & 0xff, ys & 0xff, (ye >> 8) & 0xff, ye & 0xff);
-	sunxi_dbi_command(priv, MIPI_DCS_WRITE_MEMORY_START);
-
-    sunxi_dbi_set_frame(plane_state->fb);
+    /* GRAM content is undefined after reset, send a full frame */
+    sunxi_dbi_set_frame(plane_state->fb, &rect_full);
     sunxi_dbi_vsync_handle((unsigned long)priv->spi);
 	
     backlight_enable(priv->backlight);
@@ -321,16 +657,35 @@ void st7735r_pipe_disable(struct drm_simple_display_pipe *pipe)
 {
 	struct st7735r_priv *priv = container_of(pipe->crtc.dev, 
                                     struct st7735r_priv, dbi_dev.drm);
+    unsigned long flags;
 
 
         // printk("dbi: pipe disable");
 
+    mutex_lock(&priv->flush_lock);
+    sunxi_dbi_flush_wait(priv);
+
+    /* drop what was not sent yet, enable starts with a full frame */
+    priv->dbi_dev.back_ready = false;
+    if (priv->dbi_dev.back_fb) {
+        drm_framebuffer_put(priv->dbi_dev.back_fb);
+        priv->dbi_dev.back_fb = NULL;
+    }
+    if (priv->flush_fb) {
+        drm_framebuffer_put(priv->flush_fb);
+        priv->flush_fb = NULL;
+    }
+    spin_lock_irqsave(&priv->dbi_dev.damage_lock, flags);
+    priv->dbi_dev.damage = DRM_RECT_INIT(0, 0, 0, 0);
+    spin_unlock_irqrestore(&priv->dbi_dev.damage_lock, flags);
+
     DBI_WRITE(priv->dbi_cfg.dbi_mode);
     DBI_TR_COMMAND(priv->dbi_cfg.dbi_mode);
     spi_set_dbi_config(priv->spi, &priv->dbi_cfg);
 
 	sunxi_dbi_command(priv, MIPI_DCS_SET_DISPLAY_OFF);
 	sunxi_dbi_command(priv, MIPI_DCS_ENTER_SLEEP_MODE);
+    mutex_unlock(&priv->flush_lock);
 
 	backlight_disable(priv->backlight);
 }
@@ -338,8 +693,14 @@ void st7735r_pipe_disable(struct drm_simple_display_pipe *pipe)
 void sunxi_dbi_pipe_update(struct drm_simple_display_pipe *pipe,
 			  struct drm_plane_state *old_state)
 {
-	if (pipe->crtc.state->active)
-        sunxi_dbi_set_frame(pipe->plane.state->fb);
+	struct drm_plane_state *state = pipe->plane.state;
+	struct drm_rect rect;
+
+	if (!pipe->crtc.state->active)
+        return;
+
+    if (drm_atomic_helper_damage_merged(old_state, state, &rect))
+        sunxi_dbi_set_frame(state->fb, &rect);
 }
 
 enum drm_mode_status sunxi_dbi_pipe_mode_valid(struct drm_simple_display_pipe *pipe,
@@ -424,7 +785,7 @@ static const uint64_t drm_formats[] = {
 };
 
 static const struct drm_mode_config_funcs sunxi_dbi_mode_config_funcs = {
-	.fb_create = drm_gem_fb_create,
+	.fb_create = drm_gem_fb_create_with_dirty,
 	.atomic_check = drm_atomic_helper_check,
 	.atomic_commit = drm_atomic_helper_commit,
 };
@@ -441,6 +802,7 @@ static int st7735r_probe(struct spi_device *spi)
 	// struct gpio_desc *dc;
     u32 fps;
 	int ret;
+	int i;
 
 	cfg = device_get_match_data(&spi->dev);
 	if (!cfg)
@@ -456,12 +818,32 @@ static int st7735r_probe(struct spi_device *spi)
 	priv->spi = spi;
 
     mutex_init(&priv->cmdlock);
-
-    dbi_dev->vram = devm_kmalloc(dev, 
-                        cfg->mode.vdisplay * cfg->mode.hdisplay * sizeof(u32), 
-                        GFP_KERNEL);
-	if (!dbi_dev->vram)
-		return -ENOMEM;
+    spin_lock_init(&dbi_dev->damage_lock);
+    mutex_init(&priv->flush_lock);
+    init_waitqueue_head(&priv->flush_wait);
+
+    /* kmalloc memory is DMA-safe, frames go to the bus without a copy */
+    for (i = 0; i < ARRAY_SIZE(dbi_dev->vram); i++) {
+        dbi_dev->vram[i] = devm_kmalloc(dev, 
+                            cfg->mode.vdisplay * cfg->mode.hdisplay * sizeof(u16), 
+                            GFP_KERNEL);
+        if (!dbi_dev->vram[i])
+            return -ENOMEM;
+    }
+    priv->n_flush_tr = max(cfg->mode.vdisplay, cfg->mode.hdisplay);
+    priv->flush_tr = devm_kcalloc(dev, priv->n_flush_tr, 
+                        sizeof(*priv->flush_tr), GFP_KERNEL);
+    if (!priv->flush_tr)
+        return -ENOMEM;
+    for (i = 0; i < priv->n_flush_tr; i++) {
+        priv->flush_tr[i].bits_per_word = 8;
+        priv->flush_tr[i].speed_hz = 500000000;
+    }
+    priv->win_buf = devm_kmalloc(dev, SUNXI_DBI_WIN_LEN, GFP_KERNEL);
+    if (!priv->win_buf)
+        return -ENOMEM;
+    priv->win_tr.bits_per_word = 8;
+    priv->win_tr.speed_hz = 500000000;
 
 	// dbi = &dbi_dev.dbi;
 	drm = &priv->dbi_dev.drm;
@@ -548,7 +930,7 @@ static int st7735r_probe(struct spi_device *spi)
 		return ret;
     }
 
-	// drm_plane_enable_fb_damage_clips(&dbi_dev->pipe.plane);
+	drm_plane_enable_fb_damage_clips(&dbi_dev->pipe.plane);
 
     drm->mode_config.preferred_depth = 16;
 	drm->mode_config.funcs = &sunxi_dbi_mode_config_funcs;